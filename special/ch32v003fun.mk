@@ -231,9 +231,5 @@ build : $(TARGET).bin
 
 webflash:	$(TARGET).bin
 	@echo
-	curl -F size=`stat -L -c %s $(TARGET).bin` -F offset=134217728 -F firmware=@$(TARGET).bin $(WEBLINK)/flash
-	@echo
-	@sleep 3
-	@curl $(WEBLINK)/status
-	@echo
+	curl -sS -X PUT -H "Content-Type: application/octet-stream" --data-binary @$(TARGET).bin $(WEBLINK)/flash/134217728
 	
\ No newline at end of file
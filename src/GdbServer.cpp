@@ -0,0 +1,411 @@
+#include "GdbServer.h"
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static int hexValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static uint32_t parseHex(const char** p) {
+  uint32_t value = 0;
+  int digit;
+  while ((digit = hexValue(**p)) >= 0) {
+    value = (value << 4) | digit;
+    (*p)++;
+  }
+  return value;
+}
+
+static char* putBytes(char* out, const uint8_t* data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    *out++ = hex_digits[data[i] >> 4];
+    *out++ = hex_digits[data[i] & 15];
+  }
+  return out;
+}
+
+// Registers go over the wire in target byte order
+static char* putWord(char* out, uint32_t value) {
+  return putBytes(out, (const uint8_t*)&value, sizeof(value));
+}
+
+static size_t getBytes(const char* in, uint8_t* data, size_t len) {
+  size_t i;
+  for (i = 0; i < len; i++) {
+    int hi = hexValue(in[i * 2]);
+    int lo = hi < 0 ? -1 : hexValue(in[i * 2 + 1]);
+    if (lo < 0) break;
+    data[i] = (hi << 4) | lo;
+  }
+  return i;
+}
+
+static uint32_t getWord(const char* in) {
+  uint32_t value = 0;
+  getBytes(in, (uint8_t*)&value, sizeof(value));
+  return value;
+}
+
+// Binary data in X and vFlashWrite escapes $, #, } and * as } followed by the byte ^ 0x20
+static size_t unescape(char* data, size_t len) {
+  size_t out = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (data[i] == '}' && i + 1 < len) data[out++] = data[++i] ^ 0x20;
+    else data[out++] = data[i];
+  }
+  return out;
+}
+
+GdbServer::GdbServer(GdbTarget* target, void (*send)(const uint8_t* data, size_t len)) : _target(target), _send(send) {}
+
+void GdbServer::begin() {
+  _rx_state = RX_IDLE;
+  _tx_len = 0;
+  _no_ack = false;
+  _running = false;
+  _detached = false;
+  invalidate();
+}
+
+void GdbServer::invalidate() {
+  _regs_valid = false;
+  for (int i = 0; i < GDB_CACHE_LINES; i++) _line_valid[i] = false;
+}
+
+void GdbServer::feed(const uint8_t* data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    char c = data[i];
+    switch (_rx_state) {
+    case RX_IDLE:
+      if (c == '$') {
+        _rx_state = RX_DATA;
+        _rx_len = 0;
+        _rx_sum = 0;
+      } else if (c == 0x03) {
+        // Ctrl-C, the stop reply comes from poll()
+        if (_running) _target->halt();
+      } else if (c == '-' && !_no_ack && _tx_len) {
+        _send((const uint8_t*)_tx, _tx_len);
+      }
+      break;
+    case RX_DATA:
+      if (c == '#') {
+        _rx_state = RX_CHECKSUM1;
+        break;
+      }
+      _rx_sum += c;
+      // Too long packets are counted but not stored, they fail below
+      if (_rx_len < GDB_PACKET_SIZE) _rx[_rx_len] = c;
+      _rx_len++;
+      break;
+    case RX_CHECKSUM1:
+      _rx_check = hexValue(c) << 4;
+      _rx_state = RX_CHECKSUM2;
+      break;
+    case RX_CHECKSUM2:
+      _rx_check |= hexValue(c);
+      _rx_state = RX_IDLE;
+      if (!_no_ack) {
+        bool ok = _rx_check == _rx_sum && _rx_len <= GDB_PACKET_SIZE;
+        _send((const uint8_t*)(ok ? "+" : "-"), 1);
+        if (!ok) break;
+      } else if (_rx_len > GDB_PACKET_SIZE) {
+        replyError(1);
+        break;
+      }
+      _rx[_rx_len] = 0;
+      handlePacket();
+      break;
+    }
+  }
+}
+
+void GdbServer::poll() {
+  if (!_running) return;
+  int signal = _target->stopSignal();
+  // Errors are retried on the next poll, gdb is waiting for a stop reply either way
+  if (signal <= 0) return;
+  _running = false;
+  replyStop(signal);
+}
+
+void GdbServer::reply(const char* data, size_t len) {
+  if (len > GDB_PACKET_SIZE) len = GDB_PACKET_SIZE;
+  memmove(_tx + 1, data, len);
+  uint8_t sum = 0;
+  for (size_t i = 0; i < len; i++) sum += _tx[i + 1];
+  _tx[0] = '$';
+  _tx[len + 1] = '#';
+  _tx[len + 2] = hex_digits[sum >> 4];
+  _tx[len + 3] = hex_digits[sum & 15];
+  _tx_len = len + 4;
+  _send((const uint8_t*)_tx, _tx_len);
+}
+
+void GdbServer::replyError(int code) {
+  char error[4] = {'E', hex_digits[(code >> 4) & 15], hex_digits[code & 15], 0};
+  reply(error);
+}
+
+int GdbServer::fetchRegisters() {
+  if (_regs_valid) return 0;
+  int r = _target->readRegisters(_regs);
+  _regs_valid = !r;
+  return r;
+}
+
+// All registers are expedited, gdb doesn't need a g packet after a step
+void GdbServer::replyStop(int signal) {
+  char* out = _tx + 1;
+  *out++ = 'T';
+  *out++ = hex_digits[(signal >> 4) & 15];
+  *out++ = hex_digits[signal & 15];
+  if (!fetchRegisters()) {
+    for (int i = 0; i < GDB_REG_COUNT; i++) {
+      *out++ = hex_digits[i >> 4];
+      *out++ = hex_digits[i & 15];
+      *out++ = ':';
+      out = putWord(out, _regs[i]);
+      *out++ = ';';
+    }
+  }
+  reply(_tx + 1, out - _tx - 1);
+}
+
+int GdbServer::readMemory(uint32_t address, uint32_t len, uint8_t* data) {
+  if (len > GDB_CACHE_LINE_SIZE || address >= GDB_CACHE_LIMIT || GDB_CACHE_LIMIT - address < len) {
+    return _target->readMemory(address, len, data);
+  }
+  while (len) {
+    uint32_t base = address & ~(uint32_t)(GDB_CACHE_LINE_SIZE - 1);
+    int line = (base / GDB_CACHE_LINE_SIZE) % GDB_CACHE_LINES;
+    if (!_line_valid[line] || _line_address[line] != base) {
+      // The line can run past the end of a memory, then read only what was asked
+      if (_target->readMemory(base, GDB_CACHE_LINE_SIZE, _lines[line])) {
+        _line_valid[line] = false;
+        return _target->readMemory(address, len, data);
+      }
+      _line_valid[line] = true;
+      _line_address[line] = base;
+    }
+    uint32_t chunk = min(len, base + GDB_CACHE_LINE_SIZE - address);
+    memcpy(data, _lines[line] + (address - base), chunk);
+    data += chunk;
+    address += chunk;
+    len -= chunk;
+  }
+  return 0;
+}
+
+void GdbServer::cmdReadMemory(const char* args) {
+  uint8_t data[GDB_PACKET_SIZE / 2];
+  uint32_t address = parseHex(&args);
+  if (*args++ != ',') return replyError(1);
+  uint32_t len = min(parseHex(&args), (uint32_t)sizeof(data));
+  if (readMemory(address, len, data)) return replyError(1);
+  putBytes(_tx + 1, data, len);
+  reply(_tx + 1, len * 2);
+}
+
+void GdbServer::cmdWriteMemory(const char* args, bool binary) {
+  uint32_t address = parseHex(&args);
+  if (*args++ != ',') return replyError(1);
+  uint32_t len = parseHex(&args);
+  if (*args++ != ':') return replyError(1);
+  uint8_t* data = (uint8_t*)args;
+  size_t available = _rx + _rx_len - args;
+  if (binary) available = unescape((char*)data, available);
+  else available = getBytes(args, data, available / 2);
+  if (available < len) return replyError(1);
+  // gdb probes X support with an empty write
+  if (len && _target->writeMemory(address, len, data)) return replyError(1);
+  for (int i = 0; i < GDB_CACHE_LINES; i++) _line_valid[i] = false;
+  reply("OK");
+}
+
+void GdbServer::cmdResume(const char* args, bool step) {
+  if (*args) {
+    uint32_t pc = parseHex(&args);
+    if (_target->writeRegister(GDB_REG_PC, pc)) return replyError(1);
+  }
+  invalidate();
+  if (_target->resume(step)) return replyError(1);
+  _running = true;
+  // A step is done long before we get to look
+  if (step) poll();
+}
+
+// Only hardware breakpoints, gdb writes ebreak itself for software ones in
+// RAM and uses hardware ones in flash because of the memory map
+void GdbServer::cmdBreakpoint(const char* args, bool insert) {
+  if (args[0] != '1' || args[1] != ',') return reply("");
+  args += 2;
+  uint32_t address = parseHex(&args);
+  if (_target->breakpoint(insert, address)) return replyError(1);
+  reply("OK");
+}
+
+void GdbServer::cmdMonitor(const char* args) {
+  char command[32];
+  size_t len = getBytes(args, (uint8_t*)command, sizeof(command) - 1);
+  command[len] = 0;
+  if (strcmp(command, "reset") && strcmp(command, "reset halt")) return reply("");
+  invalidate();
+  if (_target->reset(true)) return replyError(1);
+  reply("OK");
+}
+
+void GdbServer::cmdFlash(const char* args) {
+  if (!strncmp(args, "Erase:", 6)) {
+    args += 6;
+    uint32_t address = parseHex(&args);
+    if (*args++ != ',') return replyError(1);
+    uint32_t len = parseHex(&args);
+    if (_target->flashErase(address, len)) return replyError(1);
+  } else if (!strncmp(args, "Write:", 6)) {
+    args += 6;
+    uint32_t address = parseHex(&args);
+    if (*args++ != ':') return replyError(1);
+    size_t len = unescape((char*)args, _rx + _rx_len - args);
+    if (_target->flashWrite(address, len, (const uint8_t*)args)) return replyError(1);
+  } else if (!strcmp(args, "Done")) {
+    invalidate();
+    if (_target->flashDone()) return replyError(1);
+  } else {
+    return reply("");
+  }
+  reply("OK");
+}
+
+void GdbServer::replyMemoryMap(const char* args) {
+  char xml[512];
+  uint32_t flash_base, flash_size, block_size, ram_base, ram_size;
+  _target->memoryMap(&flash_base, &flash_size, &block_size, &ram_base, &ram_size);
+  // Code runs from the flash alias at 0, map both so breakpoints and load work for either
+  int xml_len = snprintf(xml, sizeof(xml),
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE memory-map PUBLIC \"+//IDN gnu.org//DTD GDB Memory Map V1.0//EN\" \"http://sourceware.org/gdb/gdb-memory-map.dtd\">"
+    "<memory-map>"
+    "<memory type=\"flash\" start=\"0x0\" length=\"0x%" PRIx32 "\"><property name=\"blocksize\">0x%" PRIx32 "</property></memory>"
+    "<memory type=\"flash\" start=\"0x%" PRIx32 "\" length=\"0x%" PRIx32 "\"><property name=\"blocksize\">0x%" PRIx32 "</property></memory>"
+    "<memory type=\"ram\" start=\"0x%" PRIx32 "\" length=\"0x%" PRIx32 "\"/>"
+    "</memory-map>",
+    flash_size, block_size, flash_base, flash_size, block_size, ram_base, ram_size);
+  if (xml_len < 0 || xml_len >= (int)sizeof(xml)) return replyError(1);
+  uint32_t offset = parseHex(&args);
+  if (*args++ != ',') return replyError(1);
+  uint32_t len = min(parseHex(&args), (uint32_t)GDB_PACKET_SIZE - 1);
+  if (offset >= (uint32_t)xml_len) return reply("l");
+  uint32_t chunk = min(len, xml_len - offset);
+  _tx[1] = offset + chunk < (uint32_t)xml_len ? 'm' : 'l';
+  memcpy(_tx + 2, xml + offset, chunk);
+  reply(_tx + 1, chunk + 1);
+}
+
+void GdbServer::handlePacket() {
+  const char* args = _rx + 1;
+  switch (_rx[0]) {
+  case '?':
+    replyStop(5);
+    break;
+  case 'g': {
+    if (fetchRegisters()) return replyError(1);
+    char* out = _tx + 1;
+    for (int i = 0; i < GDB_REG_COUNT; i++) out = putWord(out, _regs[i]);
+    reply(_tx + 1, out - _tx - 1);
+    } break;
+  case 'G':
+    if (fetchRegisters() || _rx_len < 1 + GDB_REG_COUNT * 8) return replyError(1);
+    // Only what changed, the hart may not have all of them
+    for (int i = 0; i < GDB_REG_COUNT; i++) {
+      uint32_t value = getWord(args + i * 8);
+      if (value == _regs[i]) continue;
+      if (_target->writeRegister(i, value)) return replyError(1);
+      _regs[i] = value;
+    }
+    reply("OK");
+    break;
+  case 'p': {
+    uint32_t n = parseHex(&args);
+    if (n >= GDB_REG_COUNT || fetchRegisters()) return replyError(1);
+    putWord(_tx + 1, _regs[n]);
+    reply(_tx + 1, 8);
+    } break;
+  case 'P': {
+    uint32_t n = parseHex(&args);
+    if (n >= GDB_REG_COUNT || *args++ != '=') return replyError(1);
+    uint32_t value = getWord(args);
+    if (_target->writeRegister(n, value)) return replyError(1);
+    if (_regs_valid) _regs[n] = value;
+    reply("OK");
+    } break;
+  case 'm':
+    cmdReadMemory(args);
+    break;
+  case 'M':
+    cmdWriteMemory(args, false);
+    break;
+  case 'X':
+    cmdWriteMemory(args, true);
+    break;
+  case 'c':
+    cmdResume(args, false);
+    break;
+  case 's':
+    cmdResume(args, true);
+    break;
+  case 'Z':
+    cmdBreakpoint(args, true);
+    break;
+  case 'z':
+    cmdBreakpoint(args, false);
+    break;
+  case 'H':
+  case 'T':
+    reply("OK");
+    break;
+  case 'D':
+    reply("OK");
+    _detached = true;
+    break;
+  case 'k':
+    _target->reset(false);
+    _detached = true;
+    break;
+  case 'q':
+    if (!strncmp(args, "Supported", 9)) {
+      char supported[64];
+      snprintf(supported, sizeof(supported), "PacketSize=%x;qXfer:memory-map:read+;QStartNoAckMode+", GDB_PACKET_SIZE);
+      reply(supported);
+    } else if (!strcmp(args, "Attached")) {
+      reply("1");
+    } else if (!strncmp(args, "Xfer:memory-map:read::", 22)) {
+      replyMemoryMap(args + 22);
+    } else if (!strncmp(args, "Rcmd,", 5)) {
+      cmdMonitor(args + 5);
+    } else if (!strncmp(args, "Symbol", 6)) {
+      reply("OK");
+    } else {
+      reply("");
+    }
+    break;
+  case 'Q':
+    if (!strcmp(args, "StartNoAckMode")) {
+      reply("OK");
+      _no_ack = true;
+    } else {
+      reply("");
+    }
+    break;
+  case 'v':
+    if (!strncmp(args, "Flash", 5)) cmdFlash(args + 5);
+    else reply("");
+    break;
+  default:
+    reply("");
+    break;
+  }
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Largest packet in either direction, sent to gdb as PacketSize
+#define GDB_PACKET_SIZE 1024
+// x0-x31 and pc, what gdb expects for riscv:rv32 without a target description
+#define GDB_REG_COUNT 33
+#define GDB_REG_PC 32
+// Small reads while halted are served from a few aligned lines of target
+// memory, gdb reads the stack and instructions a word at a time
+#define GDB_CACHE_LINES 4
+#define GDB_CACHE_LINE_SIZE 64
+// Peripherals start here on all WCH RISC-V parts, never read ahead there
+#define GDB_CACHE_LIMIT 0x40000000
+
+// What the stub needs from the target. Everything returns 0 on success and
+// is only called from GdbServer::feed() and GdbServer::poll().
+class GdbTarget {
+
+  public:
+
+    virtual int halt() = 0;
+
+    // Runs until halted again, or a single instruction when step is set
+    virtual int resume(bool step) = 0;
+
+    // 0 while running, the signal for the stop reply once halted, <0 on error
+    virtual int stopSignal() = 0;
+
+    // GDB_REG_COUNT values, registers the hart doesn't have read as 0
+    virtual int readRegisters(uint32_t* regs) = 0;
+
+    virtual int writeRegister(int n, uint32_t value) = 0;
+
+    virtual int readMemory(uint32_t address, uint32_t len, uint8_t* data) = 0;
+
+    virtual int writeMemory(uint32_t address, uint32_t len, const uint8_t* data) = 0;
+
+    virtual int breakpoint(bool insert, uint32_t address) = 0;
+
+    // vFlashErase/vFlashWrite/vFlashDone, nothing has to hit the target before flashDone()
+    virtual int flashErase(uint32_t address, uint32_t len) = 0;
+
+    virtual int flashWrite(uint32_t address, uint32_t len, const uint8_t* data) = 0;
+
+    virtual int flashDone() = 0;
+
+    virtual int reset(bool halt) = 0;
+
+    virtual void memoryMap(uint32_t* flash_base, uint32_t* flash_size, uint32_t* block_size, uint32_t* ram_base, uint32_t* ram_size) = 0;
+};
+
+// GDB remote serial protocol, transport independent. Bytes from the client
+// go to feed(), replies come out through send. Registers and small memory
+// reads are cached while the target is halted, so a step costs one stop
+// reply with all registers in it and no further round trips.
+class GdbServer {
+
+  public:
+
+    GdbServer(GdbTarget* target, void (*send)(const uint8_t* data, size_t len));
+
+    // Call on connect, the target should already be halted
+    void begin();
+
+    void feed(const uint8_t* data, size_t len);
+
+    // Sends the stop reply once a running target halts
+    void poll();
+
+    // Something else used the link, drop cached registers and memory
+    void invalidate();
+
+    bool running() const { return _running; }
+
+    // Client asked to detach or kill
+    bool detached() const { return _detached; }
+
+  private:
+
+    void handlePacket();
+    void reply(const char* data, size_t len);
+    void reply(const char* data) { reply(data, strlen(data)); }
+    void replyError(int code);
+    void replyStop(int signal);
+    void replyMemoryMap(const char* args);
+    void cmdReadMemory(const char* args);
+    void cmdWriteMemory(const char* args, bool binary);
+    void cmdResume(const char* args, bool step);
+    void cmdBreakpoint(const char* args, bool insert);
+    void cmdMonitor(const char* args);
+    void cmdFlash(const char* args);
+    int fetchRegisters();
+    int readMemory(uint32_t address, uint32_t len, uint8_t* data);
+
+    GdbTarget* _target;
+    void (*_send)(const uint8_t* data, size_t len);
+
+    enum { RX_IDLE, RX_DATA, RX_CHECKSUM1, RX_CHECKSUM2 } _rx_state = RX_IDLE;
+    char _rx[GDB_PACKET_SIZE + 1];
+    size_t _rx_len = 0;
+    uint8_t _rx_sum = 0;
+    uint8_t _rx_check = 0;
+    char _tx[GDB_PACKET_SIZE + 4];
+    size_t _tx_len = 0;
+    bool _no_ack = false;
+    bool _running = false;
+    bool _detached = false;
+
+    uint32_t _regs[GDB_REG_COUNT];
+    bool _regs_valid = false;
+    uint32_t _line_address[GDB_CACHE_LINES];
+    bool _line_valid[GDB_CACHE_LINES] = {false};
+    uint8_t _lines[GDB_CACHE_LINES][GDB_CACHE_LINE_SIZE];
+};
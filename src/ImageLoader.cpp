@@ -0,0 +1,407 @@
+#include "ImageLoader.h"
+
+#define UF2_MAGIC_START0 0x0A324655
+#define UF2_MAGIC_START1 0x9E5D5157
+#define UF2_MAGIC_END    0x0AB16F30
+#define UF2_FLAG_NOT_MAIN_FLASH 0x00000001
+#define UF2_MAX_PAYLOAD  476
+
+static uint32_t get32(const uint8_t* p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t get16(const uint8_t* p) {
+  return p[0] | p[1] << 8;
+}
+
+static int hexDigit(uint8_t c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+bool ImageLoader::begin(uint32_t size) {
+  _image->clear();
+  release();
+  _format = IMAGE_FORMAT_UNKNOWN;
+  _error = NULL;
+  _size = size;
+  _pos = 0;
+  _start = millis();
+  _upload_ms = 0;
+  _stage = STAGE_START;
+  _head_len = 0;
+  _hs_state = HS_TAG;
+  _hs_written = 0;
+  _hs_bits = 0;
+  _hs_bit_count = 0;
+  _hs_out_len = 0;
+  _inflate_us = 0;
+  _accept_us = 0;
+  _stream_size = size;
+  _stream_pos = 0;
+  _feed_pos = 0;
+  _base = 0;
+  _have_base = false;
+  _end = 0;
+  _loaded = 0;
+  _buf_len = 0;
+  _hex_upper = 0;
+  _hex_eof = false;
+  _segment_count = 0;
+  _elf_ready = false;
+  if (size > IMAGE_UPLOAD_MAX) return fail("Upload is too big");
+  return true;
+}
+
+const char* ImageLoader::formatName() const {
+  switch (_format) {
+  case IMAGE_FORMAT_RAW: return "raw";
+  case IMAGE_FORMAT_HEX: return "HEX";
+  case IMAGE_FORMAT_ELF: return "ELF";
+  case IMAGE_FORMAT_UF2: return "UF2";
+  default: return "unknown";
+  }
+}
+
+bool ImageLoader::fail(const char* error) {
+  if (_error == NULL) _error = error;
+  release();
+  return false;
+}
+
+void ImageLoader::release() {
+  free(_hs_window);
+  _hs_window = NULL;
+}
+
+bool ImageLoader::write(uint32_t index, const uint8_t* data, uint32_t len) {
+  if (_error) return false;
+  if (index != _pos || len > _size - _pos) return fail("Upload out of order");
+  _pos += len;
+  if (_pos == _size) _upload_ms = millis() - _start;
+  // Compression magic and header, chunks can be smaller
+  while (len && (_stage == STAGE_START || _stage == STAGE_HEADER)) {
+    uint32_t want = _stage == STAGE_START ? 4 : sizeof(WLHSHeader_t);
+    uint32_t n = min(len, want - _head_len);
+    memcpy(_head + _head_len, data, n);
+    _head_len += n;
+    data += n;
+    len -= n;
+    if (_head_len < want) return true;
+    if (_stage == STAGE_HEADER) {
+      if (!header()) return false;
+    } else if (!memcmp(_head, WLHS_MAGIC, 4)) {
+      _stage = STAGE_HEADER;
+    } else {
+      _stage = STAGE_PLAIN;
+      if (!accept(_head, _head_len)) return false;
+    }
+  }
+  if (len == 0) return true;
+  if (_stage == STAGE_HEATSHRINK) return inflate(data, len);
+  return accept(data, len);
+}
+
+bool ImageLoader::header() {
+  WLHSHeader_t header;
+  memcpy(&header, _head, sizeof(header));
+  if (header.window_bits < WLHS_WINDOW_MIN_BITS || header.window_bits > WLHS_WINDOW_MAX_BITS ||
+      header.lookahead_bits < WLHS_LOOKAHEAD_MIN_BITS || header.lookahead_bits >= header.window_bits) {
+    return fail("Unsupported compression");
+  }
+  if (header.size > IMAGE_UPLOAD_MAX) return fail("Upload is too big");
+  _hs_window = (uint8_t*)malloc(1 << header.window_bits);
+  if (_hs_window == NULL) return fail("Out of memory");
+  _hs_window_bits = header.window_bits;
+  _hs_lookahead_bits = header.lookahead_bits;
+  _stream_size = header.size;
+  _stage = STAGE_HEATSHRINK;
+  return true;
+}
+
+// Time spent passing on the decompressed bytes isn't decompression
+bool ImageLoader::inflate(const uint8_t* data, uint32_t len) {
+  uint32_t start = micros(), accept_us = _accept_us;
+  bool ok = decode(data, len);
+  _inflate_us += micros() - start - (_accept_us - accept_us);
+  return ok;
+}
+
+bool ImageLoader::decode(const uint8_t* data, uint32_t len) {
+  uint32_t mask = (1u << _hs_window_bits) - 1;
+  for (uint32_t i = 0; i < len; i++) {
+    // Padding of the last byte, or trailing bytes
+    if (_hs_written == _stream_size) return true;
+    _hs_bits = _hs_bits << 8 | data[i];
+    _hs_bit_count += 8;
+    for (;;) {
+      uint8_t bits = _hs_state == HS_TAG ? 1 : _hs_state == HS_LITERAL ? 8 : _hs_state == HS_INDEX ? _hs_window_bits : _hs_lookahead_bits;
+      if (_hs_bit_count < bits) break;
+      _hs_bit_count -= bits;
+      uint32_t value = _hs_bits >> _hs_bit_count & ((1u << bits) - 1);
+      switch (_hs_state) {
+      case HS_TAG:
+        _hs_state = value ? HS_LITERAL : HS_INDEX;
+        break;
+      case HS_LITERAL:
+        if (!emit(value)) return false;
+        _hs_state = HS_TAG;
+        break;
+      case HS_INDEX:
+        _hs_index = value;
+        _hs_state = HS_COUNT;
+        break;
+      case HS_COUNT: {
+        uint32_t offset = _hs_index + 1u;
+        if (offset > _hs_written) return fail("Bad compressed data");
+        for (uint32_t n = value + 1; n; n--) {
+          if (!emit(_hs_window[(_hs_written - offset) & mask])) return false;
+        }
+        _hs_state = HS_TAG;
+        break;
+      }
+      }
+    }
+  }
+  return true;
+}
+
+bool ImageLoader::emit(uint8_t c) {
+  if (_hs_written == _stream_size) return fail("Compressed data too long");
+  _hs_window[_hs_written++ & ((1u << _hs_window_bits) - 1)] = c;
+  _hs_out[_hs_out_len++] = c;
+  return _hs_out_len < IMAGE_HS_OUT_SIZE || flush();
+}
+
+bool ImageLoader::flush() {
+  uint32_t start = micros();
+  bool ok = accept(_hs_out, _hs_out_len);
+  _hs_out_len = 0;
+  _accept_us += micros() - start;
+  return ok;
+}
+
+// Image file bytes in order, after decompression
+bool ImageLoader::accept(const uint8_t* data, uint32_t len) {
+  _stream_pos += len;
+  // Magic of ELF and UF2 is 4 bytes, chunks can be smaller
+  if (_format == IMAGE_FORMAT_UNKNOWN) {
+    uint32_t n = min(len, 4 - _buf_len);
+    memcpy(_buf + _buf_len, data, n);
+    _buf_len += n;
+    data += n;
+    len -= n;
+    if (_buf_len < 4 && _stream_pos < _stream_size) return true;
+    if (!detect()) return false;
+  }
+  return feed(data, len);
+}
+
+bool ImageLoader::detect() {
+  uint8_t magic[4];
+  uint32_t n = _buf_len;
+  memcpy(magic, _buf, n);
+  _buf_len = 0;
+  if (n == 4 && !memcmp(magic, "\x7f" "ELF", 4)) _format = IMAGE_FORMAT_ELF;
+  else if (n == 4 && get32(magic) == UF2_MAGIC_START0) _format = IMAGE_FORMAT_UF2;
+  else if (n && magic[0] == ':') _format = IMAGE_FORMAT_HEX;
+  else _format = IMAGE_FORMAT_RAW;
+  if (_format == IMAGE_FORMAT_RAW) {
+    if (!_image->begin(_stream_size)) return fail("Binary is too big");
+  } else {
+    _image->begin(IMAGE_MAX_SIZE);
+  }
+  return feed(magic, n);
+}
+
+bool ImageLoader::feed(const uint8_t* data, uint32_t len) {
+  switch (_format) {
+  case IMAGE_FORMAT_RAW:
+    if (!_image->write(_feed_pos, data, len)) return fail("Out of memory");
+    _feed_pos += len;
+    _loaded += len;
+    return true;
+
+  case IMAGE_FORMAT_HEX:
+    for (uint32_t i = 0; i < len; i++) {
+      uint8_t c = data[i];
+      if (_hex_eof) break;
+      if (c == '\n') {
+        if (!hexLine()) return false;
+        _buf_len = 0;
+      } else if (c != '\r') {
+        if (_buf_len == IMAGE_HEX_LINE_MAX) return fail("HEX line too long");
+        _buf[_buf_len++] = c;
+      }
+    }
+    _feed_pos += len;
+    return true;
+
+  case IMAGE_FORMAT_ELF:
+    // Headers are collected first, then the bytes that came with them are
+    // run through the segments like the rest of the file
+    while (len && !_elf_ready) {
+      uint32_t n = min(len, IMAGE_ELF_HEADER_MAX - _buf_len);
+      memcpy(_buf + _buf_len, data, n);
+      _buf_len += n;
+      _feed_pos += n;
+      data += n;
+      len -= n;
+      if (!elfHeaders()) return false;
+      if (_elf_ready) {
+        if (!elfData(0, _buf, _buf_len)) return false;
+      } else if (_buf_len == IMAGE_ELF_HEADER_MAX) {
+        return fail("ELF program headers not at the start");
+      }
+    }
+    if (len && !elfData(_feed_pos, data, len)) return false;
+    _feed_pos += len;
+    return true;
+
+  case IMAGE_FORMAT_UF2:
+    while (len) {
+      uint32_t n = min(len, IMAGE_UF2_BLOCK_SIZE - _buf_len);
+      memcpy(_buf + _buf_len, data, n);
+      _buf_len += n;
+      _feed_pos += n;
+      data += n;
+      len -= n;
+      if (_buf_len < IMAGE_UF2_BLOCK_SIZE) break;
+      if (!uf2Block()) return false;
+      _buf_len = 0;
+    }
+    return true;
+
+  default:
+    return fail("Unknown format");
+  }
+}
+
+// Addresses in the 0 alias of flash go to flash. The first address sets the
+// base, everything after it has to be within IMAGE_MAX_SIZE above it.
+bool ImageLoader::store(uint32_t address, const uint8_t* data, uint32_t len) {
+  if (len == 0) return true;
+  if (address < 0x01000000) address += 0x08000000;
+  if (!_have_base) {
+    _base = address & ~(uint32_t)(IMAGE_PAGE_SIZE - 1);
+    _have_base = true;
+  }
+  if (address < _base) return fail("Addresses below the first one");
+  if (address - _base > IMAGE_MAX_SIZE || len > IMAGE_MAX_SIZE - (address - _base)) return fail("Image spans too much memory");
+  if (!_image->write(address - _base, data, len)) return fail("Out of memory");
+  _end = max(_end, address - _base + len);
+  _loaded += len;
+  return true;
+}
+
+bool ImageLoader::hexLine() {
+  uint8_t record[IMAGE_HEX_LINE_MAX / 2];
+  if (_buf_len == 0) return true;
+  if (_buf[0] != ':' || _buf_len % 2 == 0 || _buf_len < 11) return fail("Bad HEX record");
+  uint32_t n = (_buf_len - 1) / 2;
+  uint8_t sum = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    int hi = hexDigit(_buf[1 + i * 2]), lo = hexDigit(_buf[2 + i * 2]);
+    if (hi < 0 || lo < 0) return fail("Bad HEX record");
+    record[i] = hi << 4 | lo;
+    sum += record[i];
+  }
+  uint8_t count = record[0];
+  if (n != count + 5u || sum != 0) return fail("HEX checksum mismatch");
+  uint16_t address = record[1] << 8 | record[2];
+  const uint8_t* data = record + 4;
+  switch (record[3]) {
+  case 0x00: return store(_hex_upper + address, data, count);
+  case 0x01: _hex_eof = true; return true;
+  case 0x02: _hex_upper = (uint32_t)(data[0] << 8 | data[1]) << 4; return count == 2 || fail("Bad HEX record");
+  case 0x04: _hex_upper = (uint32_t)(data[0] << 8 | data[1]) << 16; return count == 2 || fail("Bad HEX record");
+  case 0x03:
+  case 0x05: return true; // Start address, the flasher reboots the target anyway
+  default: return fail("Unknown HEX record");
+  }
+}
+
+// True while there isn't enough to tell, _elf_ready once the segments are known
+bool ImageLoader::elfHeaders() {
+  if (_buf_len < 52) return true;
+  if (_buf[4] != 1 || _buf[5] != 1) return fail("Not a 32 bit little endian ELF");
+  uint32_t phoff = get32(_buf + 28);
+  uint16_t phentsize = get16(_buf + 42);
+  uint16_t phnum = get16(_buf + 44);
+  if (phentsize < 32 || phnum == 0) return fail("ELF has no program headers");
+  if (phoff > IMAGE_ELF_HEADER_MAX || phnum * phentsize > IMAGE_ELF_HEADER_MAX - phoff) return fail("ELF program headers not at the start");
+  if (_buf_len < phoff + phnum * phentsize) return true;
+  for (uint16_t i = 0; i < phnum; i++) {
+    const uint8_t* ph = _buf + phoff + i * phentsize;
+    // PT_LOAD with something in the file, .bss has no file size
+    if (get32(ph) != 1 || get32(ph + 16) == 0) continue;
+    if (_segment_count == IMAGE_ELF_MAX_SEGMENTS) return fail("Too many ELF segments");
+    Segment* segment = &_segments[_segment_count++];
+    segment->offset = get32(ph + 4);
+    segment->address = get32(ph + 12); // Physical address, where .data is loaded from
+    segment->size = get32(ph + 16);
+  }
+  if (_segment_count == 0) return fail("ELF has nothing to load");
+  _elf_ready = true;
+  return true;
+}
+
+// Part of every segment that falls into these bytes of the file
+bool ImageLoader::elfData(uint32_t pos, const uint8_t* data, uint32_t len) {
+  for (uint8_t i = 0; i < _segment_count; i++) {
+    const Segment* segment = &_segments[i];
+    uint32_t start = max(pos, segment->offset);
+    uint32_t end = min(pos + len, segment->offset + segment->size);
+    if (start >= end) continue;
+    if (!store(segment->address + (start - segment->offset), data + (start - pos), end - start)) return false;
+  }
+  return true;
+}
+
+bool ImageLoader::uf2Block() {
+  if (get32(_buf) != UF2_MAGIC_START0 || get32(_buf + 4) != UF2_MAGIC_START1 || get32(_buf + 508) != UF2_MAGIC_END) {
+    return fail("Bad UF2 block");
+  }
+  if (get32(_buf + 8) & UF2_FLAG_NOT_MAIN_FLASH) return true;
+  uint32_t size = get32(_buf + 16);
+  if (size > UF2_MAX_PAYLOAD) return fail("Bad UF2 block");
+  return store(get32(_buf + 12), _buf + 32, size);
+}
+
+bool ImageLoader::finish() {
+  if (_error) return false;
+  if (_pos != _size) return fail("Upload cut short");
+  if (_stage == STAGE_START) {
+    _stage = STAGE_PLAIN;
+    if (!accept(_head, _head_len)) return false;
+  }
+  if (_stage == STAGE_HEADER) return fail("Compressed header cut short");
+  if (_stage == STAGE_HEATSHRINK) {
+    if (_hs_out_len && !flush()) return false;
+    release();
+    if (_hs_written != _stream_size) return fail("Compressed data cut short");
+  }
+  if (_format == IMAGE_FORMAT_UNKNOWN && !detect()) return false;
+  switch (_format) {
+  case IMAGE_FORMAT_RAW:
+    return true;
+  case IMAGE_FORMAT_HEX:
+    // Last line without a newline
+    if (!_hex_eof && _buf_len && !hexLine()) return false;
+    if (!_hex_eof) return fail("HEX file has no end record");
+    break;
+  case IMAGE_FORMAT_ELF:
+    if (!_elf_ready) return fail("ELF cut short");
+    break;
+  case IMAGE_FORMAT_UF2:
+    if (_buf_len) return fail("UF2 block cut short");
+    break;
+  default:
+    return fail("Unknown format");
+  }
+  if (!_have_base) return fail("Nothing to program");
+  _image->truncate(_end);
+  return true;
+}
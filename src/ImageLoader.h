@@ -0,0 +1,142 @@
+#pragma once
+
+#include <Arduino.h>
+#include "ImageStore.h"
+#include "WLCompress.h"
+
+// Uploads bigger than an image, Intel HEX and ELF files with debug info
+// are mostly not image bytes
+#define IMAGE_UPLOAD_MAX (4 * 1024 * 1024)
+// ELF header and program headers have to be in this many first bytes
+#define IMAGE_ELF_HEADER_MAX 1024
+#define IMAGE_ELF_MAX_SEGMENTS 16
+#define IMAGE_HEX_LINE_MAX 600
+#define IMAGE_UF2_BLOCK_SIZE 512
+// Decompressed bytes go on in chunks of this
+#define IMAGE_HS_OUT_SIZE 256
+
+typedef enum ImageFormat {
+  IMAGE_FORMAT_UNKNOWN,
+  IMAGE_FORMAT_RAW,
+  IMAGE_FORMAT_HEX,
+  IMAGE_FORMAT_ELF,
+  IMAGE_FORMAT_UF2,
+} ImageFormat_t;
+
+// Fills the image store from an upload as it arrives. The format is told
+// from the first bytes: ELF and UF2 by their magic, Intel HEX by the ':'
+// of its first record, anything else is a raw binary. Files with addresses
+// only write the pages they touch, so gaps cost neither memory nor
+// programming time. Their image starts at the page of the first address
+// and can't span more than IMAGE_MAX_SIZE. Any of them can come
+// compressed, it's decompressed on the way in and never held in full.
+class ImageLoader {
+
+  public:
+
+    ImageLoader(ImageStore* image) : _image(image) {}
+
+    // Expects size bytes of upload, false if that's too much
+    bool begin(uint32_t size);
+
+    // Bytes in upload order, index is where they are in the upload
+    bool write(uint32_t index, const uint8_t* data, uint32_t len);
+
+    // After the last byte, false if the file was cut short or had nothing in it
+    bool finish();
+
+    ImageFormat_t format() const { return _format; }
+
+    const char* formatName() const;
+
+    // True when the file said where it goes, base() is the address of the image store's offset 0
+    bool addressed() const { return _format > IMAGE_FORMAT_RAW; }
+
+    uint32_t base() const { return _base; }
+
+    // Image bytes written, less than the image size when there are gaps
+    uint32_t loaded() const { return _loaded; }
+
+    const char* error() const { return _error; }
+
+    bool compressed() const { return _stage == STAGE_HEATSHRINK; }
+
+    // Bytes after decompression, the same as the upload size otherwise
+    uint32_t streamSize() const { return _stream_size; }
+
+    // From the first to the last byte of the upload, and the part of it spent decompressing
+    uint32_t uploadMs() const { return _upload_ms; }
+
+    uint32_t inflateUs() const { return _inflate_us; }
+
+  private:
+
+    bool fail(const char* error);
+    bool header();
+    bool inflate(const uint8_t* data, uint32_t len);
+    bool decode(const uint8_t* data, uint32_t len);
+    bool emit(uint8_t c);
+    bool flush();
+    void release();
+    bool accept(const uint8_t* data, uint32_t len);
+    bool detect();
+    bool feed(const uint8_t* data, uint32_t len);
+    bool store(uint32_t address, const uint8_t* data, uint32_t len);
+    bool hexLine();
+    bool elfHeaders();
+    bool elfData(uint32_t pos, const uint8_t* data, uint32_t len);
+    bool uf2Block();
+
+    ImageStore* _image;
+    ImageFormat_t _format = IMAGE_FORMAT_UNKNOWN;
+    const char* _error = NULL;
+    uint32_t _size = 0;
+    uint32_t _pos = 0;
+    uint32_t _start = 0;
+    uint32_t _upload_ms = 0;
+
+    // Upload, before decompression
+    enum { STAGE_START, STAGE_HEADER, STAGE_PLAIN, STAGE_HEATSHRINK } _stage = STAGE_START;
+    uint8_t _head[sizeof(WLHSHeader_t)];
+    uint32_t _head_len = 0;
+
+    // heatshrink decoder
+    enum { HS_TAG, HS_LITERAL, HS_INDEX, HS_COUNT } _hs_state = HS_TAG;
+    uint8_t _hs_window_bits = 0;
+    uint8_t _hs_lookahead_bits = 0;
+    uint8_t* _hs_window = NULL;
+    uint32_t _hs_written = 0;
+    uint32_t _hs_bits = 0;
+    uint8_t _hs_bit_count = 0;
+    uint16_t _hs_index = 0;
+    uint8_t _hs_out[IMAGE_HS_OUT_SIZE];
+    uint32_t _hs_out_len = 0;
+    uint32_t _inflate_us = 0;
+    uint32_t _accept_us = 0;
+
+    // Image file, after decompression
+    uint32_t _stream_size = 0;
+    uint32_t _stream_pos = 0;
+    uint32_t _feed_pos = 0; // Bytes handed to feed(), behind _stream_pos while the format isn't known
+    uint32_t _base = 0;
+    bool _have_base = false;
+    uint32_t _end = 0;
+    uint32_t _loaded = 0;
+
+    // Partial record, line or header
+    uint8_t _buf[IMAGE_HEX_LINE_MAX > IMAGE_ELF_HEADER_MAX ? IMAGE_HEX_LINE_MAX : IMAGE_ELF_HEADER_MAX];
+    uint32_t _buf_len = 0;
+
+    // Intel HEX
+    uint32_t _hex_upper = 0;
+    bool _hex_eof = false;
+
+    // ELF, PT_LOAD segments with data
+    struct Segment {
+      uint32_t offset;
+      uint32_t size;
+      uint32_t address;
+    } _segments[IMAGE_ELF_MAX_SEGMENTS];
+    uint8_t _segment_count = 0;
+    bool _elf_ready = false;
+};
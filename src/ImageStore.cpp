@@ -0,0 +1,83 @@
+#include "ImageStore.h"
+#include "esp_heap_caps.h"
+
+bool ImageStore::begin(uint32_t size) {
+  clear();
+  if (size > IMAGE_MAX_SIZE) return false;
+  _size = size;
+  return true;
+}
+
+void ImageStore::clear() {
+  for (uint32_t i = 0; i < IMAGE_MAX_SIZE / IMAGE_PAGE_SIZE; i++) {
+    if (_pages[i] == NULL) continue;
+    heap_caps_free(_pages[i]);
+    _pages[i] = NULL;
+  }
+  _size = 0;
+  _allocated = 0;
+}
+
+void ImageStore::truncate(uint32_t size) {
+  if (size >= _size) return;
+  _size = size;
+  for (uint32_t i = pageCount(); i < IMAGE_MAX_SIZE / IMAGE_PAGE_SIZE; i++) {
+    if (_pages[i] == NULL) continue;
+    heap_caps_free(_pages[i]);
+    _pages[i] = NULL;
+    _allocated--;
+  }
+}
+
+uint8_t* ImageStore::page(uint32_t index, bool allocate) {
+  if (index >= pageCount()) return NULL;
+  if (_pages[index] != NULL || !allocate) return _pages[index];
+  uint8_t* p = NULL;
+  if (_size > IMAGE_INTERNAL_MAX && psramFound()) {
+    p = (uint8_t*)heap_caps_malloc(IMAGE_PAGE_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  }
+  if (p == NULL && heap_caps_get_free_size(MALLOC_CAP_INTERNAL) > IMAGE_HEAP_RESERVE + IMAGE_PAGE_SIZE) {
+    p = (uint8_t*)heap_caps_malloc(IMAGE_PAGE_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  }
+  if (p == NULL) return NULL;
+  memset(p, 0xff, IMAGE_PAGE_SIZE);
+  _pages[index] = p;
+  _allocated++;
+  return p;
+}
+
+uint32_t ImageStore::pageLength(uint32_t index) const {
+  if (index >= pageCount()) return 0;
+  return min((uint32_t)IMAGE_PAGE_SIZE, _size - index * IMAGE_PAGE_SIZE);
+}
+
+bool ImageStore::write(uint32_t offset, const uint8_t* data, uint32_t len) {
+  if (offset + len > _size || offset + len < offset) return false;
+  while (len) {
+    uint8_t* p = page(offset / IMAGE_PAGE_SIZE, true);
+    if (p == NULL) return false;
+    uint32_t in_page = offset % IMAGE_PAGE_SIZE;
+    uint32_t chunk = min(len, (uint32_t)IMAGE_PAGE_SIZE - in_page);
+    memcpy(p + in_page, data, chunk);
+    data += chunk;
+    offset += chunk;
+    len -= chunk;
+  }
+  return true;
+}
+
+uint32_t ImageStore::read(uint32_t offset, uint8_t* data, uint32_t len) const {
+  if (offset >= _size) return 0;
+  len = min(len, _size - offset);
+  uint32_t done = 0;
+  while (done < len) {
+    const uint8_t* p = _pages[offset / IMAGE_PAGE_SIZE];
+    uint32_t in_page = offset % IMAGE_PAGE_SIZE;
+    uint32_t chunk = min(len - done, (uint32_t)IMAGE_PAGE_SIZE - in_page);
+    if (p == NULL) memset(data + done, 0xff, chunk);
+    else memcpy(data + done, p + in_page, chunk);
+    done += chunk;
+    offset += chunk;
+  }
+  return len;
+}
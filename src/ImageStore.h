@@ -0,0 +1,50 @@
+#pragma once
+
+#include <Arduino.h>
+
+#define IMAGE_PAGE_SIZE 1024
+#define IMAGE_MAX_SIZE (256 * 1024)
+// Images up to this size stay in internal RAM even when PSRAM is available
+#define IMAGE_INTERNAL_MAX (16 * 1024)
+// Internal heap left for WiFi and AsyncTCP, pages aren't allocated below it
+#define IMAGE_HEAP_RESERVE (48 * 1024)
+
+// Binary image for the flasher, split into IMAGE_PAGE_SIZE pages that are
+// allocated on first write and freed by clear(). Nothing is held while idle
+// and a large image doesn't need one contiguous block. Pages of large
+// images go to PSRAM on boards that have it.
+class ImageStore {
+
+  public:
+
+    // Drops the previous image, false if size is over IMAGE_MAX_SIZE
+    bool begin(uint32_t size);
+
+    void clear();
+
+    // Shrinks the image, pages past the new end are freed
+    void truncate(uint32_t size);
+
+    // False if out of range or out of memory
+    bool write(uint32_t offset, const uint8_t* data, uint32_t len);
+
+    // Unwritten parts read as 0xff
+    uint32_t read(uint32_t offset, uint8_t* data, uint32_t len) const;
+
+    // NULL if the page was never written and allocate is false, or out of memory
+    uint8_t* page(uint32_t index, bool allocate = false);
+
+    uint32_t pageLength(uint32_t index) const;
+
+    uint32_t pageCount() const { return (_size + IMAGE_PAGE_SIZE - 1) / IMAGE_PAGE_SIZE; }
+
+    uint32_t size() const { return _size; }
+
+    uint32_t allocated() const { return _allocated * IMAGE_PAGE_SIZE; }
+
+  private:
+
+    uint8_t* _pages[IMAGE_MAX_SIZE / IMAGE_PAGE_SIZE] = {NULL};
+    uint32_t _size = 0;
+    uint32_t _allocated = 0;
+};
@@ -149,6 +149,11 @@ void ConfigG::fromJson(JsonObjectConst obj) {
     poll_delay = obj["poll_delay"].as<uint32_t>();
   }
 
+  // Missing in configs saved by older versions
+  if (!obj["progress_interval"].isNull()) {
+    progress_interval = obj["progress_interval"].as<uint32_t>();
+  }
+
 }
 
 void ConfigG::toJson(JsonObject obj) const {
@@ -160,6 +165,7 @@ void ConfigG::toJson(JsonObject obj) const {
   obj["pin3v3"] = pin3v3;
   obj["t1coeff"] = t1coeff;
   obj["poll_delay"] = poll_delay;
+  obj["progress_interval"] = progress_interval;
   obj["sw_version"] = sw_version;
 }
 
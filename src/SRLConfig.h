@@ -13,6 +13,7 @@
 #define SWIO_PIN 10
 #endif
 #define TERMINAL_SEND_DELAY 1000
+#define PROGRESS_EVENT_INTERVAL 250
 #ifndef DEFAULT_T1COEFF
 #define DEFAULT_T1COEFF 7
 #endif
@@ -83,6 +84,7 @@ class ConfigG : public SRLConfig {
     int pin3v3 = -1;
     uint16_t t1coeff = DEFAULT_T1COEFF;
     uint32_t poll_delay = TERMINAL_SEND_DELAY;
+    uint32_t progress_interval = PROGRESS_EVENT_INTERVAL;
     const unsigned int sw_version = SW_VERSION;
 
 };
\ No newline at end of file
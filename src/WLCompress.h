@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+
+// Compressed upload. Goes wherever a HEX or ELF file does (#w, PUT /flash,
+// PUT /personalize, WebSocket and TCP), the loader recognizes it by the
+// magic and decompresses on the way in. Inside can be any image format.
+// The heatshrink stream follows the header: bits MSB first, a 1 bit and
+// 8 bits of literal, or a 0 bit, window_bits of offset - 1 and
+// lookahead_bits of count - 1. All fields little-endian.
+
+#define WLHS_MAGIC "WLHS"
+// The window is allocated for the upload, 4KB at most
+#define WLHS_WINDOW_MAX_BITS 12
+#define WLHS_WINDOW_MIN_BITS 4
+#define WLHS_LOOKAHEAD_MIN_BITS 3
+
+typedef struct __attribute__((packed)) WLHSHeader {
+  char magic[4];
+  uint8_t window_bits;    // heatshrink -w
+  uint8_t lookahead_bits; // heatshrink -l, less than window_bits
+  uint16_t reserved;
+  uint32_t size;          // Decompressed
+} WLHSHeader_t;
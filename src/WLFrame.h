@@ -0,0 +1,65 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Binary framed flasher protocol. Every request starts with a fixed 16 byte
+// little-endian header, payload (if the opcode has one) follows right after
+// it. Replies use the same header with WLF_FRAME_REPLY set in the opcode,
+// status holding one of the text protocol reply codes and length being the
+// size of the reply payload. Requests can be sent back to back, replies come
+// in the same order and carry the sequence id of their request.
+
+#define WLF_FRAME_MAGIC   0xB1
+#define WLF_FRAME_VERSION 1
+#define WLF_FRAME_REPLY   0x80
+
+typedef enum WLFrameOpcode {
+  WLF_OP_NOP        = 0x00, // Echo, no link access
+  WLF_OP_INFO       = 0x01, // Reply payload is the same string as "#i"
+  WLF_OP_HALT       = 0x02, // address = HaltMode() mode
+  WLF_OP_READ_REG   = 0x03, // address = DM register, reply payload = uint32_t value
+  WLF_OP_WRITE_REG  = 0x04, // address = DM register, payload = uint32_t value
+  WLF_OP_READ_MEM   = 0x05, // address, length = bytes to read, reply payload = data
+  WLF_OP_WRITE_MEM  = 0x06, // address, payload = data. Target is halted, not rebooted
+  WLF_OP_FLASH      = 0x07, // address, payload = image. Same as "#w", target is rebooted after
+  WLF_OP_ERASE      = 0x08, // address, length = bytes to erase, 0 for the whole chip
+  // Loops run by the target from its program buffer, word aligned RAM only
+  WLF_OP_FILL       = 0x09, // address, payload = uint32_t bytes, value[, step]
+  WLF_OP_VERIFY     = 0x0A, // address, payload = uint32_t bytes, value[, step], reply payload = mismatch address
+  WLF_OP_COPY       = 0x0B, // address = destination, payload = uint32_t bytes, source
+  WLF_OP_COMPARE    = 0x0C, // address, payload = uint32_t bytes, second address, reply payload = mismatch address
+  WLF_OP_CHECKSUM   = 0x0D, // address, length = bytes, reply payload = CRC-32
+} WLFrameOpcode_t;
+
+typedef enum WLFrameStatus {
+  WLF_STATUS_OK           = 0,
+  WLF_STATUS_BUSY         = 1,
+  WLF_STATUS_LINK_FAILED  = 2,
+  WLF_STATUS_BAD_ARGUMENT = 3,
+  WLF_STATUS_FAILED       = 4,
+  WLF_STATUS_UNIMPLEMENTED= 8,
+  WLF_STATUS_UNKNOWN      = 9,
+} WLFrameStatus_t;
+
+typedef struct __attribute__((packed)) WLFrameHeader {
+  uint8_t magic;
+  uint8_t version;
+  uint8_t opcode;
+  uint8_t status;
+  uint32_t seq;
+  uint32_t address;
+  uint32_t length;
+} WLFrameHeader_t;
+
+// Collects a frame from a byte stream that can be split at any point
+struct WLFrameAssembler {
+  WLFrameHeader_t header;
+  uint8_t* payload = NULL;
+  uint32_t pos = 0;
+  uint32_t skip = 0;
+};
+
+static inline bool frameHasPayload(uint8_t opcode) {
+  return opcode == WLF_OP_WRITE_REG || opcode == WLF_OP_WRITE_MEM || opcode == WLF_OP_FLASH ||
+         opcode == WLF_OP_FILL || opcode == WLF_OP_VERIFY || opcode == WLF_OP_COPY || opcode == WLF_OP_COMPARE;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+// Multi-region image container. Uploaded like any other binary (#w, PUT
+// /flash, framed FLASH), the flasher recognizes it by the magic and writes
+// every region in one link session: app flash, boot area and option bytes
+// without a handshake or link init in between. All fields little-endian,
+// region data follows the table at the offsets given there.
+
+#define WLMF_MAGIC   "WLMF"
+#define WLMF_VERSION 1
+#define WLMF_MAX_REGIONS 8
+
+typedef enum WLManifestErase {
+  WLMF_ERASE_PAGES = 0, // Pages are erased as they are programmed, what #w does
+  WLMF_ERASE_RANGE = 1, // Every sector the region touches is erased before the first write
+  WLMF_ERASE_CHIP  = 2, // Whole chip erase before any region is written
+} WLManifestErase_t;
+
+typedef enum WLManifestVerify {
+  WLMF_VERIFY_DEFAULT = 0, // Whatever #w checks while programming, nothing more
+  WLMF_VERIFY_CRC     = 1, // CRC-32 of the region computed by the target after all regions are written
+} WLManifestVerify_t;
+
+typedef struct __attribute__((packed)) WLManifestHeader {
+  char magic[4];
+  uint8_t version;
+  uint8_t region_count;
+  uint16_t reserved;
+} WLManifestHeader_t;
+
+typedef struct __attribute__((packed)) WLManifestRegion {
+  uint32_t address;
+  uint32_t length;
+  uint32_t data_offset; // From the start of the container
+  uint8_t erase;
+  uint8_t verify;
+  uint16_t reserved;
+} WLManifestRegion_t;
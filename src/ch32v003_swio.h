@@ -17,7 +17,17 @@
 #ifndef _CH32V003_SWIO_H
 #define _CH32V003_SWIO_H
 
+#ifdef SWIO_HOST
+// Host builds (tools/) replace the bit banged PHY with these two and provide
+// IRAM_ATTR, esp_rom_delay_us(), cpu_hal_get_cycle_count() and
+// portDISABLE/ENABLE_INTERRUPTS() themselves.
+struct SWIOState;
+static void SWIOHostWriteReg32( struct SWIOState * state, uint8_t command, uint32_t value );
+static int SWIOHostReadReg32( struct SWIOState * state, uint8_t command, uint32_t * value );
+#else
 #include "soc/gpio_struct.h"
+#include "hal/cpu_hal.h"
+#endif
 // #include "soc/gpio_reg.h"
 // #include "esp_attr.h"
 
@@ -39,6 +49,84 @@
 
 // You should interface to this file via these functions
 
+// Running totals, never reset by ResetInternalProgrammingState().
+struct SWIOStats
+{
+	uint32_t frames_written;
+	uint32_t frames_read;
+	uint32_t read_timeouts;     // ReadBit() timed out
+	uint32_t op_errors;         // WaitForDoneOp() saw cmderr
+	uint32_t flash_busy_polls;  // WaitForFlash() reads of FLASH_STATR
+	uint32_t flash_timeouts;
+	uint32_t write_retries;     // Blocks rewritten after a failed verify
+	uint32_t bytes_written;
+	uint32_t bytes_read;        // Includes verify reads
+};
+
+// Latency histograms, bucket n counts operations that took less than 2^n CPU cycles.
+#define SWIO_HIST_BUCKETS 28
+
+enum SWIOTimedOp
+{
+	SWIO_OP_WRITE_REG,
+	SWIO_OP_READ_REG,
+	SWIO_OP_READ_WORD,
+	SWIO_OP_WRITE_WORD,
+	SWIO_OP_WRITE_BLOCK,
+	SWIO_OP_ERASE,
+	SWIO_OP_WAIT_FLASH,
+	SWIO_OP_INIT,
+	SWIO_OP_COUNT
+};
+
+struct SWIOHistogram
+{
+	uint32_t buckets[SWIO_HIST_BUCKETS];
+	uint32_t count;
+	uint32_t max;
+	uint64_t cycles;
+};
+
+// DM transaction trace, one entry per MCFWriteReg32/MCFReadReg32 call.
+#define SWIO_TRACE_READ  0x01
+#define SWIO_TRACE_ERROR 0x02
+
+struct SWIOTraceEntry
+{
+	uint32_t cycles;   // CPU cycle counter at the end of the transaction
+	uint32_t value;
+	uint8_t reg;
+	uint8_t flags;
+	uint16_t reserved;
+};
+
+struct SWIOTrace
+{
+	struct SWIOTraceEntry * entries;
+	uint32_t size;     // Power of two
+	uint32_t head;     // Total number of entries recorded
+	volatile uint8_t paused;
+};
+
+// Flash layout of a chip family. DetectChip() picks one from the chip ID
+// the first time the flash routines need it after ResetInternalProgrammingState().
+struct SWIOChip
+{
+	const char * name;
+	uint32_t id_address;    // Chip ID word, matched as ( id & id_mask ) == id_value
+	uint32_t id_mask;
+	uint32_t id_value;
+	uint32_t flash_base;
+	uint32_t flash_size;    // Used when the ESIG doesn't give a size
+	uint32_t ram_base;
+	uint32_t ram_size;
+	uint16_t page_size;     // Fast erase and fast program unit
+	uint16_t sector_size;   // Standard erase unit, same as page_size if it isn't used
+	uint8_t load_words;     // Words per CR_BUF_LOAD
+	uint32_t ob_base;       // Option bytes
+	uint16_t ob_size;
+};
+
 struct SWIOState
 {
 	// Set these before calling any functions
@@ -51,8 +139,81 @@ struct SWIOState
 	uint32_t currentstateval;
 	uint32_t flash_unlocked;
 	uint32_t autoincrement;
+
+	// Flash from erased_start to erased_end is known to be blank, set by the
+	// caller after a chip or range erase. Pages written there skip their erase.
+	uint32_t erased_start;
+	uint32_t erased_end;
+
+	// Set by DetectChip()
+	const struct SWIOChip * chip;
+	uint32_t flash_size;
+
+	struct SWIOStats stats;
+
+	// Optional, SWIO_OP_COUNT entries. Operations are timed only when set.
+	struct SWIOHistogram * histograms;
+
+	// Optional, transactions are recorded only when set.
+	struct SWIOTrace * trace;
+
+	// Optional, called as long operations advance.
+	void (*progress)( struct SWIOState * iss, int phase, uint32_t done, uint32_t total );
 };
 
+#define SWIO_PHASE_ERASE   1
+#define SWIO_PHASE_PROGRAM 2
+#define SWIO_PHASE_VERIFY  3
+
+// Word range for ReadRunning()
+struct SWIORange
+{
+	uint32_t address;
+	uint32_t words;
+};
+
+static inline void ReportProgress( struct SWIOState * iss, int phase, uint32_t done, uint32_t total )
+{
+	if( iss->progress ) iss->progress( iss, phase, done, total );
+}
+
+static inline uint32_t TimerStart( struct SWIOState * iss ) IRAM_ATTR;
+static inline void TimerStop( struct SWIOState * iss, int op, uint32_t start ) IRAM_ATTR;
+
+static inline uint32_t TimerStart( struct SWIOState * iss )
+{
+	return iss->histograms ? cpu_hal_get_cycle_count() : 0;
+}
+
+// No allocation and no locks, so it's fine to call with interrupts disabled.
+static inline void TimerStop( struct SWIOState * iss, int op, uint32_t start )
+{
+	if( !iss->histograms ) return;
+	uint32_t cycles = cpu_hal_get_cycle_count() - start;
+	struct SWIOHistogram * h = &iss->histograms[op];
+	int bucket = cycles ? 32 - __builtin_clz( cycles ) : 0;
+	if( bucket >= SWIO_HIST_BUCKETS ) bucket = SWIO_HIST_BUCKETS - 1;
+	h->buckets[bucket]++;
+	h->count++;
+	h->cycles += cycles;
+	if( cycles > h->max ) h->max = cycles;
+}
+
+static inline void RecordTrace( struct SWIOState * iss, uint8_t reg, uint32_t value, uint8_t flags ) IRAM_ATTR;
+
+static inline void RecordTrace( struct SWIOState * iss, uint8_t reg, uint32_t value, uint8_t flags )
+{
+	struct SWIOTrace * t = iss->trace;
+	if( !t || t->paused ) return;
+	struct SWIOTraceEntry * e = &t->entries[t->head & (t->size - 1)];
+	e->cycles = cpu_hal_get_cycle_count();
+	e->value = value;
+	e->reg = reg;
+	e->flags = flags;
+	e->reserved = 0;
+	t->head++;
+}
+
 #if  defined(CONFIG_IDF_TARGET_ESP32)
 #define GPIO_IN GPIO.in
 #define GPIO_SET GPIO.out_w1ts
@@ -78,11 +239,29 @@ static int MCFReadReg32( struct SWIOState * state, uint8_t command, uint32_t * v
 // More advanced functions built on lower level PHY.
 static int ReadWord( struct SWIOState * iss, uint32_t word, uint32_t * ret );
 static int ReadByte( struct SWIOState * iss, uint32_t address_to_read, uint8_t * data );
+static int ReadHalfWord( struct SWIOState * iss, uint32_t address_to_read, uint16_t * data );
+static int ReadBurst( struct SWIOState * iss, uint32_t address_to_read, uint32_t words, uint8_t * data );
 static int WriteByte( struct SWIOState * iss, uint32_t address_to_write, uint8_t data );
+static int WriteHalfWord( struct SWIOState * iss, uint32_t address_to_write, uint16_t data );
 static int WriteWord( struct SWIOState * state, uint32_t word, uint32_t val );
+static int WriteBurst( struct SWIOState * iss, uint32_t address_to_write, uint32_t words, const uint8_t * data );
+static int ReadCPURegister( struct SWIOState * iss, uint32_t regno, uint32_t * value );
+static int WriteCPURegister( struct SWIOState * iss, uint32_t regno, uint32_t value );
+static int ReadCPURegisters( struct SWIOState * iss, uint32_t regno, int count, uint32_t * values );
+static int SamplePC( struct SWIOState * iss, uint32_t * pc );
+static int ReadRunning( struct SWIOState * iss, const struct SWIORange * ranges, int count, uint32_t * data );
+static int FillMemory( struct SWIOState * iss, uint32_t address, uint32_t words, uint32_t value, uint32_t step );
+static int VerifyMemory( struct SWIOState * iss, uint32_t address, uint32_t words, uint32_t value, uint32_t step, uint32_t * mismatch );
+static int CopyMemory( struct SWIOState * iss, uint32_t dst, uint32_t src, uint32_t words );
+static int CompareMemory( struct SWIOState * iss, uint32_t a, uint32_t b, uint32_t words, uint32_t * mismatch );
+static int ChecksumMemory( struct SWIOState * iss, uint32_t address, uint32_t words, uint32_t * crc );
 static int WaitForFlash( struct SWIOState * state );
 static int WaitForDoneOp( struct SWIOState * state );
 static int Write64Block( struct SWIOState * iss, uint32_t address_to_write, uint8_t * data );
+static int WriteFastPage( struct SWIOState * iss, uint32_t address_to_write, uint8_t * data );
+static int WriteFlashPage( struct SWIOState * iss, uint32_t address_to_write, uint8_t * data );
+static int WriteOptionBytes( struct SWIOState * iss, uint32_t address_to_write, uint32_t blob_size, const uint8_t * blob );
+static const struct SWIOChip * DetectChip( struct SWIOState * iss );
 static int ReadBinaryBlob( struct SWIOState * iss, uint32_t address_to_read_from,  uint32_t read_size, uint8_t * data );
 static int WriteBinaryBlob( struct SWIOState * iss, uint32_t address_to_write, uint32_t blob_size, uint8_t * blob );
 static int UnlockFlash( struct SWIOState * iss );
@@ -108,6 +287,32 @@ static int HaltMode( struct SWIOState * iss, int mode );
 #define DMPROGBUF6     0x26
 #define DMPROGBUF7     0x27
 
+// Abstract register numbers, GPRs are SWIO_REG_GPR + n
+#define SWIO_REG_DCSR  0x7b0
+#define SWIO_REG_DPC   0x7b1
+#define SWIO_REG_TSELECT 0x7a0
+#define SWIO_REG_TDATA1  0x7a1
+#define SWIO_REG_TDATA2  0x7a2
+
+#define DCSR_EBREAKM   ( 1 << 15 )  // ebreak in M mode enters debug mode
+#define DCSR_STEP      ( 1 << 2 )
+#define DCSR_CAUSE( dcsr ) ( ( ( dcsr ) >> 6 ) & 7 )
+#define DCSR_CAUSE_HALTREQ 3
+// tdata1 as mcontrol, enter debug mode on execute in M and U mode
+#define MCONTROL_EXEC_BREAK 0x2800104c
+#define SWIO_REG_GPR   0x1000
+#define SWIO_REG_SP    ( SWIO_REG_GPR + 2 )
+
+// System bus access, when the DM has it
+#define DMSBCS         0x38
+#define DMSBADDRESS0   0x39
+#define DMSBDATA0      0x3c
+
+#define SBCS_SBACCESS32     ( 1 << 2 )
+#define SBCS_READ32         ( ( 1 << 20 ) | ( 2 << 17 ) | ( 1 << 16 ) )  // sbreadonaddr, 32 bit, autoincrement
+#define SBCS_READONDATA     ( 1 << 15 )
+#define SBCS_ERRORS         ( ( 1 << 22 ) | ( 7 << 12 ) )  // sbbusyerror, sberror
+
 #define DMCPBR       0x7C
 #define DMCFGR       0x7D
 #define DMSHDWCFGR   0x7E
@@ -137,7 +342,26 @@ static int HaltMode( struct SWIOState * iss, int mode );
 #define CR_STRT_Set                ((uint32_t)0x00000040)
 #define CR_PAGE_ER                 ((uint32_t)0x00020000)
 #define CR_BUF_RST                 ((uint32_t)0x00080000)
+#define CR_PER_Set                 ((uint32_t)0x00000002)
+#define CR_OPTPG_Set               ((uint32_t)0x00000010)
+#define CR_OPTER_Set               ((uint32_t)0x00000020)
+#define CR_OPTWRE_Set              ((uint32_t)0x00000200)
+
+#define SWIO_MAX_PAGE_SIZE 256
+
+// First entry is the default for chips that aren't recognized. RAM is that of
+// the smallest part in the family (CH32V103C6 and CH32V203F6 10KB, CH32V303CB
+// 32KB), bigger parts have more that isn't used.
+static const struct SWIOChip swio_chips[] = {
+	// name        ID address  ID mask     ID value    flash base  flash   RAM base    RAM     page sector load OB base     OB size
+	{ "CH32V003", 0x1FFFF7C4, 0xFFF00000, 0x00300000, 0x08000000, 16384,  0x20000000, 2048,  64,  1024,  1,   0x1FFFF800, 16 },
+	{ "CH32X03x", 0x1FFFF7C4, 0xFFF00000, 0x03500000, 0x08000000, 63488,  0x20000000, 20480, 256, 256,   1,   0x1FFFF800, 16 },
+	{ "CH32V10x", 0x1FFFF7C4, 0xFFF00000, 0x25000000, 0x08000000, 65536,  0x20000000, 10240, 128, 128,   4,   0x1FFFF800, 16 },
+	{ "CH32V20x", 0x1FFFF704, 0xFF000000, 0x20000000, 0x08000000, 491520, 0x20000000, 10240, 256, 4096,  1,   0x1FFFF800, 16 },
+	{ "CH32V30x", 0x1FFFF704, 0xFF000000, 0x30000000, 0x08000000, 491520, 0x20000000, 32768, 256, 4096,  1,   0x1FFFF800, 16 },
+};
 
+#ifndef SWIO_HOST
 static inline void Send1Bit( int t1coeff, int pinmask ) IRAM;
 static inline void Send0Bit( int t1coeff, int pinmask ) IRAM;
 static inline int ReadBit( struct SWIOState * state ) IRAM;
@@ -255,8 +479,14 @@ static inline int ReadBit( struct SWIOState * state )
 	return 2;
 }
 
+#endif // SWIO_HOST
+
 static void MCFWriteReg32( struct SWIOState * state, uint8_t command, uint32_t value )
 {
+	uint32_t start = TimerStart( state );
+#ifdef SWIO_HOST
+	SWIOHostWriteReg32( state, command, value );
+#else
 	int t1coeff = state->t1coeff;
 	int pinmask = state->pinmask;
 
@@ -282,12 +512,28 @@ static void MCFWriteReg32( struct SWIOState * state, uint8_t command, uint32_t v
 			Send0Bit(t1coeff, pinmask);
 	}
 	EnableISR();
+#endif
+	state->stats.frames_written++;
+	RecordTrace( state, command, value, 0 );
 	esp_rom_delay_us(8); // Sometimes 2 is too short.
+	TimerStop( state, SWIO_OP_WRITE_REG, start );
 }
 
 // returns 0 if no error, otherwise error.
 static int MCFReadReg32( struct SWIOState * state, uint8_t command, uint32_t * value )
 {
+	uint32_t start = TimerStart( state );
+#ifdef SWIO_HOST
+	uint32_t rval = 0;
+	if( SWIOHostReadReg32( state, command, &rval ) )
+	{
+		state->stats.read_timeouts++;
+		RecordTrace( state, command, rval, SWIO_TRACE_READ | SWIO_TRACE_ERROR );
+		TimerStop( state, SWIO_OP_READ_REG, start );
+		return -1;
+	}
+	*value = rval;
+#else
 	int t1coeff = state->t1coeff;
 	int pinmask = state->pinmask;
 
@@ -316,15 +562,23 @@ static int MCFReadReg32( struct SWIOState * state, uint8_t command, uint32_t * v
 		if( r == 2 )
 		{
 			EnableISR();
+			state->stats.read_timeouts++;
+			RecordTrace( state, command, rval, SWIO_TRACE_READ | SWIO_TRACE_ERROR );
+			TimerStop( state, SWIO_OP_READ_REG, start );
 			return -1;
 		}
 	}
 	*value = rval;
 	EnableISR();
+#endif
+	state->stats.frames_read++;
+	RecordTrace( state, command, rval, SWIO_TRACE_READ );
 	esp_rom_delay_us(8); // Sometimes 2 is too short.
+	TimerStop( state, SWIO_OP_READ_REG, start );
 	return 0;
 }
 
+#ifndef SWIO_HOST
 static inline void ExecuteTimePairs( struct SWIOState * state, const uint16_t * pairs, int numpairs, int iterations )
 {
 	int t1coeff = state->t1coeff;
@@ -407,11 +661,17 @@ static int DoSongAndDanceToEnterPgmMode( struct SWIOState * state )
 
 	return present;
 }
+#else
+static int DoSongAndDanceToEnterPgmMode( struct SWIOState * state )
+{
+	return 0;
+}
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Higher level functions
 
-static int WaitForFlash( struct SWIOState * iss )
+static int WaitForFlashUntimed( struct SWIOState * iss )
 {
 	struct SWIOState * dev = iss;
 	uint32_t rw, timeout = 0;
@@ -419,6 +679,7 @@ static int WaitForFlash( struct SWIOState * iss )
 	{
 		rw = 0;
 		ReadWord( dev, 0x4002200C, &rw ); // FLASH_STATR => 0x4002200C
+		dev->stats.flash_busy_polls++;
 	} while( (rw & 1) && timeout++ < 500);  // BSY flag.
 
 	WriteWord( dev, 0x4002200C, 0 );
@@ -428,11 +689,22 @@ static int WaitForFlash( struct SWIOState * iss )
 
 
 	if( rw & 1 )
+	{
+		dev->stats.flash_timeouts++;
 		return -5;
+	}
 
 	return 0;
 }
 
+static int WaitForFlash( struct SWIOState * iss )
+{
+	uint32_t start = TimerStart( iss );
+	int r = WaitForFlashUntimed( iss );
+	TimerStop( iss, SWIO_OP_WAIT_FLASH, start );
+	return r;
+}
+
 static int WaitForDoneOp( struct SWIOState * iss )
 {
 	int r;
@@ -448,6 +720,7 @@ static int WaitForDoneOp( struct SWIOState * iss )
 	if( (rrv >> 8 ) & 7 )
 	{
 		MCFWriteReg32( dev, DMABSTRACTCS, 0x00000700 );
+		dev->stats.op_errors++;
 		ret = -33;
 	}
 	return ret;
@@ -461,7 +734,8 @@ static void StaticUpdatePROGBUFRegs( struct SWIOState * dev )
 	MCFWriteReg32( dev, DMCOMMAND, 0x0023100b ); // Copy data to x11
 	MCFWriteReg32( dev, DMDATA0, 0x40022010 ); //FLASH->CTLR
 	MCFWriteReg32( dev, DMCOMMAND, 0x0023100c ); // Copy data to x12
-	MCFWriteReg32( dev, DMDATA0, CR_PAGE_PG|CR_BUF_LOAD);
+	// Parts that load the buffer in groups get a plain store, see WriteFastPage()
+	MCFWriteReg32( dev, DMDATA0, ( dev->chip && dev->chip->load_words != 1 ) ? CR_PAGE_PG : CR_PAGE_PG|CR_BUF_LOAD );
 	MCFWriteReg32( dev, DMCOMMAND, 0x0023100d ); // Copy data to x13
 }
 
@@ -472,13 +746,16 @@ static void ResetInternalProgrammingState( struct SWIOState * iss )
 	iss->currentstateval = 0;
 	iss->flash_unlocked = 0;
 	iss->autoincrement = 0;
+	iss->erased_start = iss->erased_end = 0;
+	iss->chip = 0;
 }
 
 static int ReadWord( struct SWIOState * iss, uint32_t address_to_read, uint32_t * data )
 {
 	struct SWIOState * dev = iss;
+	uint32_t start = TimerStart( iss );
 
-	int autoincrement = 1;
+	uint32_t autoincrement = 1;
 	if( address_to_read == 0x40022010 || address_to_read == 0x4002200C )  // Don't autoincrement when checking flash flag. 
 		autoincrement = 0;
 
@@ -509,7 +786,7 @@ static int ReadWord( struct SWIOState * iss, uint32_t address_to_read, uint32_t
 			// c.ebreak
 			MCFWriteReg32( dev, DMPROGBUF2, 0x9002c180 );
 
-			if( iss->statetag != STTAG( "WRSQ" ) )
+			if( iss->statetag != STTAG( "WRSQ" ) && iss->statetag != STTAG( "RDBU" ) )
 			{
 				StaticUpdatePROGBUFRegs( dev );
 			}
@@ -529,7 +806,9 @@ static int ReadWord( struct SWIOState * iss, uint32_t address_to_read, uint32_t
 	if( iss->autoincrement )
 		iss->currentstateval += 4;
 
-	return MCFReadReg32( dev, DMDATA0, data );
+	int r = MCFReadReg32( dev, DMDATA0, data );
+	TimerStop( iss, SWIO_OP_READ_WORD, start );
+	return r;
 }
 
 static int ReadByte( struct SWIOState * iss, uint32_t address_to_read, uint8_t * data )
@@ -544,7 +823,7 @@ static int ReadByte( struct SWIOState * iss, uint32_t address_to_read, uint8_t *
 	// Different address, so we don't need to re-write all the program regs.
 	// lb x8,0(x9)  // Write to the address.
 	MCFWriteReg32( dev, DMPROGBUF0, 0x00048403 ); // lb x8, 0(x9)
-	MCFWriteReg32( dev, DMPROGBUF1, 0x00100073 ); // c.ebreak
+	MCFWriteReg32( dev, DMPROGBUF1, 0x00100073 ); // ebreak
 
 	MCFWriteReg32( dev, DMDATA0, address_to_read );
 	MCFWriteReg32( dev, DMCOMMAND, 0x00231009 ); // Copy data to x9
@@ -561,6 +840,94 @@ static int ReadByte( struct SWIOState * iss, uint32_t address_to_read, uint8_t *
 	return ret;
 }
 
+static int ReadHalfWord( struct SWIOState * iss, uint32_t address_to_read, uint16_t * data )
+{
+	int ret = 0;
+	struct SWIOState * dev = iss;
+
+	iss->statetag = STTAG( "XXXX" );
+
+	MCFWriteReg32( dev, DMABSTRACTAUTO, 0x00000000 ); // Disable Autoexec.
+
+	MCFWriteReg32( dev, DMPROGBUF0, 0x0004d403 ); // lhu x8, 0(x9)
+	MCFWriteReg32( dev, DMPROGBUF1, 0x00100073 ); // ebreak
+
+	MCFWriteReg32( dev, DMDATA0, address_to_read );
+	MCFWriteReg32( dev, DMCOMMAND, 0x00231009 ); // Copy data to x9
+	MCFWriteReg32( dev, DMCOMMAND, 0x00241000 ); // Only execute.
+	MCFWriteReg32( dev, DMCOMMAND, 0x00221008 ); // Read x8 into DATA0.
+
+	ret |= WaitForDoneOp( dev );
+	iss->currentstateval = -1;
+
+	uint32_t rr;
+	ret |= MCFReadReg32( dev, DMDATA0, &rr );
+	*data = rr;
+	return ret;
+}
+
+// Reads words in pairs, each run of the program buffer leaves two of them in
+// DATA0 and DATA1 and reading DATA1 starts the next run. The address lives in
+// x8 instead of DATA1, so a pair costs two register reads and one run.
+// Autoexec is turned off before the last DATA1 read, so the last run is the
+// one that loaded the last pair. An odd count still loads the word after the
+// end, ReadBinaryBlob only asks for pairs. Consecutive calls continue where
+// the previous one stopped.
+static int ReadBurst( struct SWIOState * iss, uint32_t address_to_read, uint32_t words, uint8_t * data )
+{
+	struct SWIOState * dev = iss;
+	int r = 0;
+	uint32_t i;
+
+	if( iss->statetag != STTAG( "RDBU" ) || address_to_read != iss->currentstateval )
+	{
+		if( iss->statetag != STTAG( "RDBU" ) )
+		{
+			MCFWriteReg32( dev, DMABSTRACTAUTO, 0x00000000 ); // Disable Autoexec.
+
+			// c.lw x9,0(x8)   // First word
+			// c.sw x9,0(x10)  // to DATA0
+			MCFWriteReg32( dev, DMPROGBUF0, 0xc1044004 );
+			// c.lw x9,4(x8)   // Second word
+			// c.sw x9,0(x11)  // to DATA1
+			MCFWriteReg32( dev, DMPROGBUF1, 0xc1844044 );
+			// c.addi x8, 8
+			// c.ebreak
+			MCFWriteReg32( dev, DMPROGBUF2, 0x90020421 );
+
+			if( iss->statetag != STTAG( "RDSQ" ) && iss->statetag != STTAG( "WRSQ" ) )
+			{
+				StaticUpdatePROGBUFRegs( dev );
+			}
+			iss->statetag = STTAG( "RDBU" );
+		}
+		MCFWriteReg32( dev, DMDATA0, address_to_read );
+		MCFWriteReg32( dev, DMCOMMAND, 0x00231008 ); // Copy data to x8
+	}
+	// Otherwise x8 already points at the next pair.
+	// Autoexec on DATA1 only, nothing below writes DATA1
+	MCFWriteReg32( dev, DMABSTRACTAUTO, 2 );
+	MCFWriteReg32( dev, DMCOMMAND, 0x00241000 ); // Only execute, autoexec repeats this
+	r = WaitForDoneOp( dev );
+
+	for( i = 0; i < words && !r; i += 2 )
+	{
+		uint32_t rw;
+		r = MCFReadReg32( dev, DMDATA0, &rw );
+		memcpy( data + i * 4, &rw, 4 );
+		if( i + 1 < words && !r )
+		{
+			if( i + 2 >= words ) MCFWriteReg32( dev, DMABSTRACTAUTO, 0x00000000 ); // Last pair, no run after it
+			r = MCFReadReg32( dev, DMDATA1, &rw );
+			memcpy( data + i * 4 + 4, &rw, 4 );
+		}
+	}
+
+	// Half of the last pair is left in DATA1 for an odd count, start over next time
+	iss->currentstateval = ( words & 1 ) || r ? -1 : address_to_read + words * 4;
+	return r;
+}
+
 static int WriteByte( struct SWIOState * iss, uint32_t address_to_write, uint8_t data )
 {
 	struct SWIOState * dev = iss;
@@ -573,7 +940,7 @@ static int WriteByte( struct SWIOState * iss, uint32_t address_to_write, uint8_t
 	// Different address, so we don't need to re-write all the program regs.
 	// sh x8,0(x9)  // Write to the address.
 	MCFWriteReg32( dev, DMPROGBUF0, 0x00848023 ); // sb x8, 0(x9)
-	MCFWriteReg32( dev, DMPROGBUF1, 0x00100073 ); // c.ebreak
+	MCFWriteReg32( dev, DMPROGBUF1, 0x00100073 ); // ebreak
 
 	MCFWriteReg32( dev, DMDATA0, address_to_write );
 	MCFWriteReg32( dev, DMCOMMAND, 0x00231009 ); // Copy data to x9
@@ -586,13 +953,36 @@ static int WriteByte( struct SWIOState * iss, uint32_t address_to_write, uint8_t
 	return ret;
 }
 
+static int WriteHalfWord( struct SWIOState * iss, uint32_t address_to_write, uint16_t data )
+{
+	struct SWIOState * dev = iss;
+
+	int ret = 0;
+	iss->statetag = STTAG( "XXXX" );
+
+	MCFWriteReg32( dev, DMABSTRACTAUTO, 0x00000000 ); // Disable Autoexec.
+
+	MCFWriteReg32( dev, DMPROGBUF0, 0x00849023 ); // sh x8, 0(x9)
+	MCFWriteReg32( dev, DMPROGBUF1, 0x00100073 ); // ebreak
+
+	MCFWriteReg32( dev, DMDATA0, address_to_write );
+	MCFWriteReg32( dev, DMCOMMAND, 0x00231009 ); // Copy data to x9
+	MCFWriteReg32( dev, DMDATA0, data );
+	MCFWriteReg32( dev, DMCOMMAND, 0x00271008 ); // Copy data to x8, and execute program.
+
+	ret |= WaitForDoneOp( dev );
+	iss->currentstateval = -1;
+	return ret;
+}
+
 static int WriteWord( struct SWIOState * iss, uint32_t address_to_write, uint32_t data )
 {
 	struct SWIOState * dev = iss;
+	uint32_t start = TimerStart( iss );
 
 	int ret = 0;
 
-	int is_flash = 0;
+	uint32_t is_flash = 0;
 	if( ( address_to_write & 0xff000000 ) == 0x08000000 || ( address_to_write & 0x1FFFF800 ) == 0x1FFFF000 )
 	{
 		// Is flash.
@@ -614,7 +1004,7 @@ static int WriteWord( struct SWIOState * iss, uint32_t address_to_write, uint32_
 			// c.sw x9,0(x11)
 			MCFWriteReg32( dev, DMPROGBUF1, 0xc1840491 );
 
-			if( iss->statetag != STTAG( "RDSQ" ) )
+			if( iss->statetag != STTAG( "RDSQ" ) && iss->statetag != STTAG( "RDBU" ) )
 			{
 				StaticUpdatePROGBUFRegs( dev );
 			}
@@ -677,9 +1067,420 @@ static int WriteWord( struct SWIOState * iss, uint32_t address_to_write, uint32_
 
 	iss->currentstateval += 4;
 
+	TimerStop( iss, SWIO_OP_WRITE_WORD, start );
 	return 0;
 }
 
+// RAM only. Streams words through autoexec DATA0 writes without waiting for
+// each one, the program buffer is done long before the next frame ends. A
+// write that lands while it's still busy sets cmderr, which the single
+// WaitForDoneOp() at the end reports.
+static int WriteBurst( struct SWIOState * iss, uint32_t address_to_write, uint32_t words, const uint8_t * data )
+{
+	struct SWIOState * dev = iss;
+	uint32_t start = TimerStart( iss );
+	uint32_t i = 0;
+	uint32_t w;
+
+	if( !words ) return 0;
+
+	if( iss->statetag != STTAG( "WRSQ" ) || iss->lastwriteflags )
+	{
+		// Loads the RAM program and writes the first word, no wait for RAM
+		memcpy( &w, data, 4 );
+		WriteWord( dev, address_to_write, w );
+		i = 1;
+	}
+	else if( address_to_write != iss->currentstateval )
+	{
+		MCFWriteReg32( dev, DMABSTRACTAUTO, 0 ); // Disable Autoexec.
+		MCFWriteReg32( dev, DMDATA1, address_to_write );
+		MCFWriteReg32( dev, DMABSTRACTAUTO, 1 ); // Enable Autoexec.
+	}
+
+	for( ; i < words; i++ )
+	{
+		memcpy( &w, data + i * 4, 4 );
+		MCFWriteReg32( dev, DMDATA0, w );
+	}
+	iss->currentstateval = address_to_write + words * 4;
+
+	int r = WaitForDoneOp( dev );
+	if( r ) iss->currentstateval = -1;
+	TimerStop( iss, SWIO_OP_WRITE_BLOCK, start );
+	return r;
+}
+
+// Hart must be halted. Autoexec is turned off and x8-x13 may be clobbered
+// by the memory functions, so the state is reset for the next one of them.
+static int ReadCPURegister( struct SWIOState * iss, uint32_t regno, uint32_t * value )
+{
+	struct SWIOState * dev = iss;
+	MCFWriteReg32( dev, DMABSTRACTAUTO, 0 ); // Disable Autoexec.
+	MCFWriteReg32( dev, DMCOMMAND, 0x00220000 | regno ); // Copy register to DATA0
+	iss->statetag = STTAG( "XXXX" );
+	int r = WaitForDoneOp( dev );
+	if( r ) return r;
+	return MCFReadReg32( dev, DMDATA0, value );
+}
+
+// Consecutive registers without waiting for each one, an abstract register
+// access is done long before the DATA0 read. cmderr is checked at the end.
+static int ReadCPURegisters( struct SWIOState * iss, uint32_t regno, int count, uint32_t * values )
+{
+	struct SWIOState * dev = iss;
+	int i, r = 0;
+	MCFWriteReg32( dev, DMABSTRACTAUTO, 0 ); // Disable Autoexec.
+	iss->statetag = STTAG( "XXXX" );
+	for( i = 0; i < count && !r; i++ )
+	{
+		MCFWriteReg32( dev, DMCOMMAND, 0x00220000 | ( regno + i ) ); // Copy register to DATA0
+		r = MCFReadReg32( dev, DMDATA0, values + i );
+	}
+	return r ? r : WaitForDoneOp( dev );
+}
+
+static int WriteCPURegister( struct SWIOState * iss, uint32_t regno, uint32_t value )
+{
+	struct SWIOState * dev = iss;
+	MCFWriteReg32( dev, DMABSTRACTAUTO, 0 ); // Disable Autoexec.
+	MCFWriteReg32( dev, DMDATA0, value );
+	MCFWriteReg32( dev, DMCOMMAND, 0x00230000 | regno ); // Copy DATA0 to register
+	iss->statetag = STTAG( "XXXX" );
+	return WaitForDoneOp( dev );
+}
+
+// One profiler sample of a running hart. It's halted for the dpc copy,
+// which only runs once DMSTATUS says it is. DATA0 is the firmware's
+// printf/input mailbox, its value is saved and put back before the hart
+// runs again, so the firmware never sees a PC there. Autoexec is turned
+// off on the first call only.
+static int SamplePC( struct SWIOState * iss, uint32_t * pc )
+{
+	struct SWIOState * dev = iss;
+	uint32_t rrv, data0;
+	int r, tries = 0;
+	if( iss->statetag != STTAG( "SMPL" ) )
+	{
+		MCFWriteReg32( dev, DMABSTRACTAUTO, 0 ); // Disable Autoexec.
+		iss->statetag = STTAG( "SMPL" );
+	}
+	MCFWriteReg32( dev, DMCONTROL, 0x80000001 ); // Request halt
+	do
+	{
+		r = MCFReadReg32( dev, DMSTATUS, &rrv );
+	}
+	while( !r && !( rrv & ( 1 << 9 ) ) && ++tries < 8 ); // allhalted
+	if( !r && !( rrv & ( 1 << 9 ) ) ) r = -5;
+	if( !r ) r = MCFReadReg32( dev, DMDATA0, &data0 );
+	if( !r )
+	{
+		MCFWriteReg32( dev, DMCOMMAND, 0x00220000 | SWIO_REG_DPC ); // Copy dpc to DATA0
+		r = MCFReadReg32( dev, DMDATA0, pc );
+		MCFWriteReg32( dev, DMDATA0, data0 );
+	}
+	MCFWriteReg32( dev, DMCONTROL, 0x40000001 ); // Resume request
+	if( r ) return r;
+	r = MCFReadReg32( dev, DMABSTRACTCS, &rrv );
+	if( r ) return r;
+	if( (rrv >> 8 ) & 7 )
+	{
+		MCFWriteReg32( dev, DMABSTRACTCS, 0x00000700 );
+		dev->stats.op_errors++;
+		return -33;
+	}
+	return 0;
+}
+
+// Reading SBDATA0 starts the next read, that's turned off before the last
+// word of a range so nothing past it is touched.
+static int ReadRunningSystemBus( struct SWIOState * iss, const struct SWIORange * ranges, int count, uint32_t * data )
+{
+	struct SWIOState * dev = iss;
+	uint32_t sbcs, j;
+	int i, r = 0;
+	for( i = 0; i < count && !r; i++ )
+	{
+		uint32_t words = ranges[i].words;
+		if( !words ) continue;
+		sbcs = SBCS_READ32 | ( words > 1 ? SBCS_READONDATA : 0 );
+		if( sbcs != iss->currentstateval ) MCFWriteReg32( dev, DMSBCS, sbcs );
+		MCFWriteReg32( dev, DMSBADDRESS0, ranges[i].address ); // Reads the first word
+		for( j = 0; j < words && !r; j++ )
+		{
+			if( j == words - 1 && words > 1 ) MCFWriteReg32( dev, DMSBCS, sbcs = SBCS_READ32 );
+			r = MCFReadReg32( dev, DMSBDATA0, data++ );
+		}
+		iss->currentstateval = sbcs;
+	}
+	if( r ) return r;
+	r = MCFReadReg32( dev, DMSBCS, &sbcs );
+	if( r ) return r;
+	if( sbcs & SBCS_ERRORS )
+	{
+		MCFWriteReg32( dev, DMSBCS, SBCS_ERRORS | SBCS_READ32 );
+		iss->currentstateval = SBCS_READ32;
+		dev->stats.op_errors++;
+		return -33;
+	}
+	return 0;
+}
+
+// The program buffer loads the next word to x9 after every copy of x9 to
+// DATA0, and with autoexec each DATA0 read does both. Autoexec goes off two
+// words before the end of a range so the last load is its last word.
+// DATA0 is the firmware's printf/input mailbox, it's saved once the hart is
+// halted and put back last. A hart that was halted already stays halted.
+static int ReadRunningHalted( struct SWIOState * iss, const struct SWIORange * ranges, int count, uint32_t * data )
+{
+	struct SWIOState * dev = iss;
+	uint32_t saved[3], rrv, j;
+	int i, r, ret = 0, tries = 0, was_halted;
+
+	r = MCFReadReg32( dev, DMSTATUS, &rrv );
+	if( r ) return r;
+	was_halted = rrv & ( 1 << 9 ); // allhalted
+	if( !was_halted )
+	{
+		MCFWriteReg32( dev, DMCONTROL, 0x80000001 ); // Request halt
+		do
+		{
+			r = MCFReadReg32( dev, DMSTATUS, &rrv );
+		}
+		while( !r && !( rrv & ( 1 << 9 ) ) && ++tries < 8 );
+		if( !r && !( rrv & ( 1 << 9 ) ) ) r = -5;
+		if( r )
+		{
+			MCFWriteReg32( dev, DMCONTROL, 0x40000001 ); // Resume request
+			return r;
+		}
+	}
+	r |= MCFReadReg32( dev, DMDATA0, &saved[2] );
+	MCFWriteReg32( dev, DMCOMMAND, 0x00221008 ); // Save x8
+	r |= MCFReadReg32( dev, DMDATA0, &saved[0] );
+	MCFWriteReg32( dev, DMCOMMAND, 0x00221009 ); // Save x9
+	r |= MCFReadReg32( dev, DMDATA0, &saved[1] );
+	for( i = 0; i < count && !r; i++ )
+	{
+		uint32_t words = ranges[i].words;
+		if( !words ) continue;
+		MCFWriteReg32( dev, DMDATA0, ranges[i].address );
+		MCFWriteReg32( dev, DMCOMMAND, 0x00271008 ); // Address to x8, first word to x9
+		MCFWriteReg32( dev, DMCOMMAND, words > 1 ? 0x00261009 : 0x00221009 ); // x9 to DATA0, next word to x9
+		if( words > 2 ) MCFWriteReg32( dev, DMABSTRACTAUTO, 1 ); // Reading DATA0 repeats that
+		for( j = 0; j < words && !r; j++ )
+		{
+			if( j == words - 2 && words > 2 ) MCFWriteReg32( dev, DMABSTRACTAUTO, 0 );
+			if( j == words - 1 && words > 1 ) MCFWriteReg32( dev, DMCOMMAND, 0x00221009 ); // Last word to DATA0
+			r = MCFReadReg32( dev, DMDATA0, data++ );
+		}
+	}
+	if( r ) MCFWriteReg32( dev, DMABSTRACTAUTO, 0 );
+
+	// Commands are ignored while cmderr is set, clear it before putting x8 and x9 back
+	if( !MCFReadReg32( dev, DMABSTRACTCS, &rrv ) && ( (rrv >> 8 ) & 7 ) )
+	{
+		MCFWriteReg32( dev, DMABSTRACTCS, 0x00000700 );
+		dev->stats.op_errors++;
+		ret = -33;
+	}
+	MCFWriteReg32( dev, DMDATA0, saved[0] );
+	MCFWriteReg32( dev, DMCOMMAND, 0x00231008 ); // Restore x8
+	MCFWriteReg32( dev, DMDATA0, saved[1] );
+	MCFWriteReg32( dev, DMCOMMAND, 0x00231009 ); // Restore x9
+	MCFWriteReg32( dev, DMDATA0, saved[2] );
+	if( !was_halted ) MCFWriteReg32( dev, DMCONTROL, 0x40000001 ); // Resume request
+	return r ? r : ret;
+}
+
+// Word ranges of a running hart, back to back in data. If the DM has system
+// bus access the hart keeps running. Without it, as on the CH32V003, it's
+// halted once for all ranges and only x8 and x9 are used, both are restored
+// before it resumes, a hart that was halted before stays halted. No word
+// outside the ranges is read, so peripheral registers next to them are safe.
+static int ReadRunning( struct SWIOState * iss, const struct SWIORange * ranges, int count, uint32_t * data )
+{
+	struct SWIOState * dev = iss;
+	uint32_t sbcs;
+	int r;
+
+	if( iss->statetag != STTAG( "SBUS" ) && iss->statetag != STTAG( "RDRN" ) )
+	{
+		r = MCFReadReg32( dev, DMSBCS, &sbcs );
+		if( r ) return r;
+		// sbversion 1 with 32 bit access
+		if( ( sbcs >> 29 ) == 1 && ( sbcs & SBCS_SBACCESS32 ) )
+		{
+			MCFWriteReg32( dev, DMSBCS, SBCS_READ32 );
+			iss->currentstateval = SBCS_READ32;
+			iss->statetag = STTAG( "SBUS" );
+		}
+		else
+		{
+			MCFWriteReg32( dev, DMABSTRACTAUTO, 0 ); // Disable Autoexec.
+			// c.lw x9,0(x8)
+			// c.addi x8,4
+			MCFWriteReg32( dev, DMPROGBUF0, 0x04114004 );
+			// c.ebreak
+			MCFWriteReg32( dev, DMPROGBUF1, 0x00019002 );
+			iss->statetag = STTAG( "RDRN" );
+		}
+	}
+	if( iss->statetag == STTAG( "SBUS" ) ) return ReadRunningSystemBus( iss, ranges, count, data );
+	return ReadRunningHalted( iss, ranges, count, data );
+}
+
+// Word loops run from the program buffer on a halted hart. Every run does
+// at most this many words, so no single run keeps the DM busy for long.
+#define SWIO_LOOP_CHUNK 1024
+// A CRC word is 32 rounds of the inner loop
+#define SWIO_CRC_CHUNK  32
+
+// x8 address, x9 value, x13 step, x11 count
+// loop: c.sw x9,0(x8)
+//       c.add x9,x13
+//       c.addi x8,4
+//       c.addi x11,-1
+//       c.bnez x11,loop
+//       c.ebreak
+static const uint32_t swio_loop_fill[] = { 0x94b6c004, 0x15fd0411, 0x9002fde5 };
+// x8 address, x9 value, x13 step, x11 count. Stops with x11 != 0 and x8 at the first mismatch.
+// loop: c.lw x12,0(x8)
+//       bne x12,x9,done
+//       c.add x9,x13
+//       c.addi x8,4
+//       c.addi x11,-1
+//       c.bnez x11,loop
+// done: c.ebreak
+static const uint32_t swio_loop_verify[] = { 0x16634010, 0x94b60096, 0x15fd0411, 0x9002f9f5 };
+// x8 destination, x9 source, x11 count
+// loop: c.lw x12,0(x9)
+//       c.sw x12,0(x8)
+//       c.addi x9,4
+//       c.addi x8,4
+//       c.addi x11,-1
+//       c.bnez x11,loop
+//       c.ebreak
+static const uint32_t swio_loop_copy[] = { 0xc0104090, 0x04110491, 0xf9fd15fd, 0x00019002 };
+// x8 and x9 addresses, x11 count. Stops with x11 != 0 and x8 at the first mismatch.
+// loop: c.lw x12,0(x8)
+//       c.lw x13,0(x9)
+//       bne x12,x13,done
+//       c.addi x8,4
+//       c.addi x9,4
+//       c.addi x11,-1
+//       c.bnez x11,loop
+// done: c.ebreak
+static const uint32_t swio_loop_compare[] = { 0x40944010, 0x00d61663, 0x04910411, 0xf9ed15fd, 0x00019002 };
+// CRC-32 as in zlib, a word at a time LSB first. x8 address, x9 CRC, x10 polynomial, x11 count.
+// outer: c.lw x12,0(x8)
+//        c.xor x9,x12
+//        c.li x12,-32
+// inner: c.mv x13,x9
+//        c.andi x13,1
+//        c.srli x9,1
+//        c.beqz x13,skip
+//        c.xor x9,x10
+// skip:  c.addi x12,1
+//        c.bnez x12,inner
+//        c.addi x8,4
+//        c.addi x11,-1
+//        c.bnez x11,outer
+//        c.ebreak
+static const uint32_t swio_loop_crc[] = { 0x8cb14010, 0x86a65601, 0x80858a85, 0x8ca9c291, 0xfa750605, 0x15fd0411, 0x9002f5e5 };
+
+// Loads a loop and the registers it starts with (pairs of register number and
+// value), then runs it over words in runs of at most chunk words with the
+// count of each run in x11. With stopped set, a run that leaves x11 non zero
+// ended early: the word address in x8 goes to stopped and 1 is returned.
+static int RunProgbufLoop( struct SWIOState * iss, const uint32_t * code, int code_words, const uint32_t * regs, int reg_count,
+                           uint32_t words, uint32_t chunk, uint32_t * stopped )
+{
+	struct SWIOState * dev = iss;
+	uint32_t left;
+	int i, r;
+
+	MCFWriteReg32( dev, DMABSTRACTAUTO, 0 ); // Disable Autoexec.
+	for( i = 0; i < code_words; i++ )
+		MCFWriteReg32( dev, DMPROGBUF0 + i, code[i] );
+	for( i = 0; i < reg_count; i++ )
+	{
+		MCFWriteReg32( dev, DMDATA0, regs[i * 2 + 1] );
+		MCFWriteReg32( dev, DMCOMMAND, 0x00230000 | regs[i * 2] ); // Copy data to register
+	}
+	// The program buffer and x8-x13 don't hold what the memory functions expect anymore
+	iss->statetag = STTAG( "XXXX" );
+
+	while( words )
+	{
+		uint32_t n = words < chunk ? words : chunk;
+		MCFWriteReg32( dev, DMDATA0, n );
+		MCFWriteReg32( dev, DMCOMMAND, 0x0027100b ); // Count to x11 and run
+		r = WaitForDoneOp( dev );
+		if( r ) return r;
+		words -= n;
+		if( !stopped ) continue;
+		MCFWriteReg32( dev, DMCOMMAND, 0x0022100b ); // x11 to DATA0
+		r = MCFReadReg32( dev, DMDATA0, &left );
+		if( r ) return r;
+		if( left )
+		{
+			MCFWriteReg32( dev, DMCOMMAND, 0x00221008 ); // x8 to DATA0
+			r = MCFReadReg32( dev, DMDATA0, stopped );
+			if( !r ) r = WaitForDoneOp( dev );
+			return r ? r : 1;
+		}
+	}
+	return 0;
+}
+
+// Word aligned address, writes go to RAM or peripherals, not flash. Word i
+// gets value + i * step, so step 4 and value = address is an address test.
+static int FillMemory( struct SWIOState * iss, uint32_t address, uint32_t words, uint32_t value, uint32_t step )
+{
+	uint32_t regs[] = { SWIO_REG_GPR + 8, address, SWIO_REG_GPR + 9, value, SWIO_REG_GPR + 13, step };
+	if( address & 3 ) return -1;
+	return RunProgbufLoop( iss, swio_loop_fill, 3, regs, 3, words, SWIO_LOOP_CHUNK, 0 );
+}
+
+// Checks what FillMemory() wrote. Returns 1 with the address of the first differing word in mismatch.
+static int VerifyMemory( struct SWIOState * iss, uint32_t address, uint32_t words, uint32_t value, uint32_t step, uint32_t * mismatch )
+{
+	uint32_t regs[] = { SWIO_REG_GPR + 8, address, SWIO_REG_GPR + 9, value, SWIO_REG_GPR + 13, step };
+	if( address & 3 ) return -1;
+	return RunProgbufLoop( iss, swio_loop_verify, 4, regs, 3, words, SWIO_LOOP_CHUNK, mismatch );
+}
+
+// Forward copy, like memcpy() the ranges shouldn't overlap with dst above src
+static int CopyMemory( struct SWIOState * iss, uint32_t dst, uint32_t src, uint32_t words )
+{
+	uint32_t regs[] = { SWIO_REG_GPR + 8, dst, SWIO_REG_GPR + 9, src };
+	if( ( dst | src ) & 3 ) return -1;
+	return RunProgbufLoop( iss, swio_loop_copy, 4, regs, 2, words, SWIO_LOOP_CHUNK, 0 );
+}
+
+// Returns 1 with the address of the first differing word of a in mismatch
+static int CompareMemory( struct SWIOState * iss, uint32_t a, uint32_t b, uint32_t words, uint32_t * mismatch )
+{
+	uint32_t regs[] = { SWIO_REG_GPR + 8, a, SWIO_REG_GPR + 9, b };
+	if( ( a | b ) & 3 ) return -1;
+	return RunProgbufLoop( iss, swio_loop_compare, 5, regs, 2, words, SWIO_LOOP_CHUNK, mismatch );
+}
+
+// Same value as the zlib crc32() of the bytes
+static int ChecksumMemory( struct SWIOState * iss, uint32_t address, uint32_t words, uint32_t * crc )
+{
+	uint32_t regs[] = { SWIO_REG_GPR + 8, address, SWIO_REG_GPR + 9, 0xffffffff, SWIO_REG_GPR + 10, 0xedb88320 };
+	uint32_t reg;
+	int r;
+	if( address & 3 ) return -1;
+	r = RunProgbufLoop( iss, swio_loop_crc, 7, regs, 3, words, SWIO_CRC_CHUNK, 0 );
+	if( !r ) r = ReadCPURegister( iss, SWIO_REG_GPR + 9, &reg );
+	// Left as it was on a failure
+	if( !r ) *crc = ~reg;
+	return r;
+}
+
 static int UnlockFlash( struct SWIOState * iss )
 {
 	struct SWIOState * dev = iss;
@@ -706,7 +1507,43 @@ static int UnlockFlash( struct SWIOState * iss )
 	return 0;
 }
 
-static int EraseFlash( struct SWIOState * iss, uint32_t address, uint32_t length, int type )
+static const struct SWIOChip * DetectChip( struct SWIOState * iss )
+{
+	if( iss->chip ) return iss->chip;
+
+	const struct SWIOChip * chip = &swio_chips[0];
+	uint32_t id_address = 0;
+	uint32_t id = 0;
+	unsigned i;
+	for( i = 0; i < sizeof( swio_chips ) / sizeof( swio_chips[0] ); i++ )
+	{
+		// Entries sharing an ID address are next to each other
+		if( swio_chips[i].id_address != id_address )
+		{
+			id_address = swio_chips[i].id_address;
+			if( ReadWord( iss, id_address, &id ) ) id = 0;
+		}
+		if( id && ( id & swio_chips[i].id_mask ) == swio_chips[i].id_value )
+		{
+			chip = &swio_chips[i];
+			break;
+		}
+	}
+
+	// Flash size in KB is in the ESIG
+	uint32_t flash_kb;
+	iss->flash_size = chip->flash_size;
+	if( !ReadWord( iss, 0x1FFFF7E0, &flash_kb ) && ( flash_kb & 0xffff ) != 0 && ( flash_kb & 0xffff ) != 0xffff )
+		iss->flash_size = ( flash_kb & 0xffff ) * 1024;
+
+	iss->chip = chip;
+	// Makes WriteWord() reload x13 for this chip
+	if( chip->load_words != 1 )
+		iss->statetag = STTAG( "XXXX" );
+	return chip;
+}
+
+static int EraseFlashUntimed( struct SWIOState * iss, uint32_t address, uint32_t length, int type )
 {
 	struct SWIOState * dev = iss;
 
@@ -728,36 +1565,62 @@ static int EraseFlash( struct SWIOState * iss, uint32_t address, uint32_t length
 		WriteWord( dev, 0x40022010, CR_STRT_Set|FLASH_CTLR_MER );
 		if( WaitForFlash( dev ) ) return -13;
 		WriteWord( dev, 0x40022010, 0 ); //  FLASH->CTLR = 0x40022010
+		ReportProgress( dev, SWIO_PHASE_ERASE, 1, 1 );
 	}
 	else
 	{
 		// 16.4.7, Step 3: Check the BSY bit of the FLASH_STATR register to confirm that there are no other programming operations in progress.
 		// skip (we make sure at the end)
 
-		int chunk_to_erase = address;
+		const struct SWIOChip * chip = DetectChip( iss );
+		uint32_t chunk_to_erase = address;
 
 		while( chunk_to_erase < address + length )
 		{
+			// A whole sector takes one standard erase instead of one fast erase per page
+			int sector = chip->sector_size > chip->page_size && ( chunk_to_erase % chip->sector_size ) == 0 &&
+				address + length - chunk_to_erase >= chip->sector_size;
+			uint32_t op = sector ? CR_PER_Set : CR_PAGE_ER;
+
 			if( WaitForFlash( dev ) ) return -14;
 
 			// Step 4:  set PAGE_ER of FLASH_CTLR(0x40022010)
-			WriteWord( dev, 0x40022010, CR_PAGE_ER ); // Actually FTER //  FLASH->CTLR = 0x40022010
+			WriteWord( dev, 0x40022010, op ); // Actually FTER //  FLASH->CTLR = 0x40022010
 
 			// Step 5: Write the first address of the fast erase page to the FLASH_ADDR register.
 			WriteWord( dev, 0x40022014, chunk_to_erase  ); // FLASH->ADDR = 0x40022014
 
-			// Step 6: Set the STAT bit of FLASH_CTLR register to '1' to initiate a fast page erase (64 bytes) action.
-			WriteWord( dev, 0x40022010, CR_STRT_Set|CR_PAGE_ER );  // FLASH->CTLR = 0x40022010
+			// Step 6: Set the STAT bit of FLASH_CTLR register to '1' to initiate a fast page erase action.
+			WriteWord( dev, 0x40022010, CR_STRT_Set|op );  // FLASH->CTLR = 0x40022010
 			if( WaitForFlash( dev ) ) return -15;
 
 			WriteWord( dev, 0x40022010, 0 ); //  FLASH->CTLR = 0x40022010 (Disable any pending ops)
-			chunk_to_erase+=64;
+			chunk_to_erase += sector ? chip->sector_size : chip->page_size;
+			ReportProgress( dev, SWIO_PHASE_ERASE, chunk_to_erase - address, length );
 		}
 	}
 	return 0;
 }
 
-static int Write64Block( struct SWIOState * iss, uint32_t address_to_write, uint8_t * blob )
+static int EraseFlash( struct SWIOState * iss, uint32_t address, uint32_t length, int type )
+{
+	uint32_t start = TimerStart( iss );
+	int r = EraseFlashUntimed( iss, address, length, type );
+	TimerStop( iss, SWIO_OP_ERASE, start );
+	return r;
+}
+
+// True when the page is still blank from the caller's erase. Pages are
+// written going up, so everything below the end of this one is used up.
+static int TakeErasedPage( struct SWIOState * iss, uint32_t address, uint32_t size )
+{
+	if( iss->erased_start >= iss->erased_end ) return 0;
+	int erased = address >= iss->erased_start && address + size <= iss->erased_end;
+	if( address + size > iss->erased_start ) iss->erased_start = address + size;
+	return erased;
+}
+
+static int Write64BlockUntimed( struct SWIOState * iss, uint32_t address_to_write, uint8_t * blob )
 {
 	struct SWIOState * dev = iss;
 
@@ -782,7 +1645,8 @@ static int Write64Block( struct SWIOState * iss, uint32_t address_to_write, uint
 		}
 
 		is_flash = 1;
-		rw = EraseFlash( dev, address_to_write, blob_size, 0 );
+		if( !TakeErasedPage( dev, address_to_write, blob_size ) )
+			rw = EraseFlash( dev, address_to_write, blob_size, 0 );
 		if( rw ) return rw;
 		// 16.4.6 Main memory fast programming, Step 5
 		//if( WaitForFlash( dev ) ) return -11;
@@ -790,6 +1654,10 @@ static int Write64Block( struct SWIOState * iss, uint32_t address_to_write, uint
 		//if( WaitForFlash( dev ) ) return -11;
 
 	}
+	else
+	{
+		return WriteBurst( dev, address_to_write, blob_size / 4, blob );
+	}
 
 	/* General Note:
 		Most flash operations take about 3ms to complete :(
@@ -822,22 +1690,130 @@ static int Write64Block( struct SWIOState * iss, uint32_t address_to_write, uint
 			WriteWord( dev, 0x40022010, CR_PAGE_PG|CR_STRT_Set );  // R32_FLASH_CTLR
 			if( (rw = WaitForFlash( dev ) ) ) return rw;
 		}
-		else
+	}
+
+	return 0;
+}
+
+static int Write64Block( struct SWIOState * iss, uint32_t address_to_write, uint8_t * blob )
+{
+	uint32_t start = TimerStart( iss );
+	int r = Write64BlockUntimed( iss, address_to_write, blob );
+	TimerStop( iss, SWIO_OP_WRITE_BLOCK, start );
+	return r;
+}
+
+// Fast page programming for parts with 128 and 256 byte pages. Same sequence
+// as Write64Block(), but the buffer is reset and loaded for the whole page.
+static int WriteFastPageUntimed( struct SWIOState * iss, uint32_t address_to_write, uint8_t * blob )
+{
+	struct SWIOState * dev = iss;
+	const struct SWIOChip * chip = DetectChip( iss );
+	int rw;
+	uint32_t j;
+
+	if( !iss->flash_unlocked )
+	{
+		if( ( rw = UnlockFlash( dev ) ) )
+			return rw;
+	}
+
+	if( !TakeErasedPage( dev, address_to_write, chip->page_size ) )
+	{
+		rw = EraseFlash( dev, address_to_write, chip->page_size, 0 );
+		if( rw ) return rw;
+	}
+
+	WriteWord( dev, 0x40022010, CR_PAGE_PG );  // R32_FLASH_CTLR
+	WriteWord( dev, 0x40022010, CR_BUF_RST | CR_PAGE_PG );
+	if( ( rw = WaitForFlash( dev ) ) ) return rw;
+
+	for( j = 0; j < chip->page_size / 4; j++ )
+	{
+		uint32_t data;
+		memcpy( &data, blob + j * 4, 4 );
+		WriteWord( dev, address_to_write + j * 4, data );
+		// The CH32V10x takes the buffer 4 words at a time
+		if( chip->load_words > 1 && ( j + 1 ) % chip->load_words == 0 )
 		{
-			int index = (wp-address_to_write);
-			uint32_t data = 0xffffffff;
-			if( index + 3 < blob_size )
-				data = ((uint32_t*)blob)[index/4];
-			else if( (int32_t)(blob_size - index) > 0 )
-				memcpy( &data, &blob[index], blob_size - index );
-			WriteWord( dev, wp, data );
-			wp += 4;
+			WriteWord( dev, 0x40022010, CR_PAGE_PG | CR_BUF_LOAD );
+			if( ( rw = WaitForFlash( dev ) ) ) return rw;
 		}
 	}
 
+	WriteWord( dev, 0x40022014, address_to_write );  // R32_FLASH_ADDR
+	WriteWord( dev, 0x40022010, CR_PAGE_PG|CR_STRT_Set );
+	if( ( rw = WaitForFlash( dev ) ) ) return rw;
 	return 0;
 }
 
+static int WriteFastPage( struct SWIOState * iss, uint32_t address_to_write, uint8_t * blob )
+{
+	uint32_t start = TimerStart( iss );
+	int r = WriteFastPageUntimed( iss, address_to_write, blob );
+	TimerStop( iss, SWIO_OP_WRITE_BLOCK, start );
+	return r;
+}
+
+// One page of flash at a page aligned address, with the routine that fits the chip
+static int WriteFlashPage( struct SWIOState * iss, uint32_t address_to_write, uint8_t * blob )
+{
+	if( DetectChip( iss )->page_size == 64 )
+		return Write64Block( iss, address_to_write, blob );
+	return WriteFastPage( iss, address_to_write, blob );
+}
+
+// Option bytes are erased and programmed as one block, the ones around the
+// blob are read first and written back. Each is a data byte and its
+// complement, only the data byte is written, the controller adds the other.
+static int WriteOptionBytes( struct SWIOState * iss, uint32_t address_to_write, uint32_t blob_size, const uint8_t * blob )
+{
+	struct SWIOState * dev = iss;
+	const struct SWIOChip * chip = DetectChip( iss );
+	uint8_t ob[32];
+	uint32_t rw;
+	uint32_t i;
+	int r;
+
+	if( address_to_write < chip->ob_base || address_to_write + blob_size > chip->ob_base + chip->ob_size || chip->ob_size > sizeof( ob ) )
+		return -1;
+	if( ( r = ReadBinaryBlob( dev, chip->ob_base, chip->ob_size, ob ) ) ) return r;
+	memcpy( ob + address_to_write - chip->ob_base, blob, blob_size );
+
+	if( !iss->flash_unlocked )
+	{
+		if( ( r = UnlockFlash( dev ) ) )
+			return r;
+	}
+
+	// OBWRE is cleared by every write of 0 to FLASH_CTLR, unlock it again if needed
+	ReadWord( dev, R32_FLASH_CTLR, &rw );
+	if( !( rw & CR_OPTWRE_Set ) )
+	{
+		WriteWord( dev, R32_FLASH_OBKEYR, FLASH_KEY1 );
+		WriteWord( dev, R32_FLASH_OBKEYR, FLASH_KEY2 );
+		ReadWord( dev, R32_FLASH_CTLR, &rw );
+		if( !( rw & CR_OPTWRE_Set ) ) return -9;
+	}
+
+	if( WaitForFlash( dev ) ) return -14;
+	WriteWord( dev, R32_FLASH_CTLR, CR_OPTWRE_Set | CR_OPTER_Set );
+	WriteWord( dev, R32_FLASH_CTLR, CR_OPTWRE_Set | CR_OPTER_Set | CR_STRT_Set );
+	if( WaitForFlash( dev ) ) return -15;
+	ReportProgress( dev, SWIO_PHASE_ERASE, 1, 1 );
+
+	WriteWord( dev, R32_FLASH_CTLR, CR_OPTWRE_Set | CR_OPTPG_Set );
+	for( i = 0; i < chip->ob_size && !r; i += 2 )
+	{
+		r = WriteHalfWord( dev, chip->ob_base + i, ob[i] );
+		if( !r ) r = WaitForFlash( dev );
+		ReportProgress( dev, SWIO_PHASE_PROGRAM, i + 2, chip->ob_size );
+	}
+	WriteWord( dev, R32_FLASH_CTLR, 0 );
+	if( !r ) dev->stats.bytes_written += blob_size;
+	return r;
+}
+
 int ReadBinaryBlob( struct SWIOState * iss, uint32_t address_to_read_from, uint32_t read_size, uint8_t * blob )
 {
 	struct SWIOState * dev = iss;
@@ -848,64 +1824,48 @@ int ReadBinaryBlob( struct SWIOState * iss, uint32_t address_to_read_from, uint3
 	while( rpos < rend )
 	{
 		int r;
-		int remain = rend - rpos;
+		uint32_t remain = rend - rpos;
 
-		if( ( rpos & 3 ) == 0 && remain >= 4 )
+		if( ( rpos & 3 ) == 0 && remain >= 8 )
+		{
+			uint32_t words = remain / 8 * 2;
+			r = ReadBurst( dev, rpos, words, blob );
+			if( r ) return r;
+			blob += words * 4;
+			rpos += words * 4;
+		}
+		else if( ( rpos & 3 ) == 0 && remain >= 4 )
 		{
 			uint32_t rw;
 			r = ReadWord( dev, rpos, &rw );
-			//printf( "RW: %d %08x %08x\n", r, rpos, rw );
 			if( r ) return r;
-			int rem = remain;
-			if( rem > 4 ) rem = 4;
-			memcpy( blob, &rw, rem);
+			memcpy( blob, &rw, 4 );
 			blob += 4;
 			rpos += 4;
 		}
+		else if( ( rpos & 1 ) == 0 && remain >= 2 )
+		{
+			// Unaligned head and tail, halfwords where possible
+			uint16_t rh;
+			r = ReadHalfWord( dev, rpos, &rh );
+			if( r ) return r;
+			memcpy( blob, &rh, 2 );
+			blob += 2;
+			rpos += 2;
+		}
 		else
 		{
-			for ( ; remain > 0; remain--) {
-				uint8_t rw;
-				r = ReadByte( dev, rpos, &rw );
-				if( r ) return r;
-				memcpy( blob, &rw, 1 );
-				blob += 1;
-				rpos += 1;
-			}
-			// if( ( rpos & 1 ) )
-			// {
-			// 	uint8_t rw;
-			// 	r = ReadByte( dev, rpos, &rw );
-			// 	if( r ) return r;
-			// 	memcpy( blob, &rw, 1 );
-			// 	blob += 1;
-			// 	rpos += 1;
-			// 	remain -= 1;
-			// }
-			// if( ( rpos & 2 ) && remain >= 2 )
-			// {
-			// 	uint16_t rw;
-			// 	r = ReadHalfWord( dev, rpos, &rw );
-			// 	if( r ) return r;
-			// 	memcpy( blob, &rw, 2 );
-			// 	blob += 2;
-			// 	rpos += 2;
-			// 	remain -= 2;
-			// }
-			// if( remain >= 1 )
-			// {
-			// 	uint8_t rw;
-			// 	r = ReadByte( dev, rpos, &rw );
-			// 	if( r ) return r;
-			// 	memcpy( blob, &rw, 1 );
-			// 	blob += 1;
-			// 	rpos += 1;
-			// 	remain -= 1;
-			// }
+			uint8_t rb;
+			r = ReadByte( dev, rpos, &rb );
+			if( r ) return r;
+			*blob = rb;
+			blob += 1;
+			rpos += 1;
 		}
 	}
 	int r = WaitForDoneOp( dev );
 	// if( r ) fprintf( stderr, "Fault on DefaultReadBinaryBlob\n" );
+	if( !r ) dev->stats.bytes_read += read_size;
 	return r;
 }
 
@@ -925,18 +1885,23 @@ static int WriteBinaryBlob( struct SWIOState * iss, uint32_t address_to_write, u
 	if( is_flash )
 		address_to_write |= 0x08000000;
 
-	if( is_flash && ( address_to_write & 0x3f ) == 0 && ( blob_size & 0x3f ) == 0 )
+	// Flash goes in pages of the chip, RAM in 64 byte blocks
+	int psize = is_flash ? DetectChip( iss )->page_size : 64;
+
+	if( is_flash && ( address_to_write % psize ) == 0 && ( blob_size % psize ) == 0 )
 	{
-		int i;
-		for( i = 0; i < blob_size; i+= 64 )
+		uint32_t i;
+		for( i = 0; i < blob_size; i+= psize )
 		{
-			int r = Write64Block( dev, address_to_write + i, blob + i );
+			int r = WriteFlashPage( dev, address_to_write + i, blob + i );
 			if( r )
 			{
 				// fprintf( stderr, "Error writing block at memory %08x / Error: %d\n", address_to_write, r );
 				return r;
 			}
+			ReportProgress( dev, SWIO_PHASE_PROGRAM, i + psize, blob_size );
 		}
+		dev->stats.bytes_written += blob_size;
 		return 0;
 	}
 
@@ -947,36 +1912,39 @@ static int WriteBinaryBlob( struct SWIOState * iss, uint32_t address_to_write, u
 	}
 
 
-	uint8_t tempblock[64];
-	uint8_t tempblock2[64];
+	uint8_t tempblock[SWIO_MAX_PAGE_SIZE];
+	uint8_t tempblock2[SWIO_MAX_PAGE_SIZE];
 	// uint8_t *tempblock = (uint8_t*)malloc(64);
-	int sblock =  address_to_write >> 6;
-	int eblock = ( address_to_write + blob_size + 0x3f) >> 6;
+	int sblock =  address_to_write / psize;
+	int eblock = ( address_to_write + blob_size + psize - 1 ) / psize;
 	int b;
 	int rsofar = 0;
 
 	for( b = sblock; b < eblock; b++ )
 	{
-		int offset_in_block = address_to_write - (b * 64);
+		int offset_in_block = address_to_write - (b * psize);
 		if( offset_in_block < 0 ) offset_in_block = 0;
-		int end_o_plus_one_in_block = ( address_to_write + blob_size ) - (b*64);
-		if( end_o_plus_one_in_block > 64 ) end_o_plus_one_in_block = 64;
-		int	base = b * 64;
+		int end_o_plus_one_in_block = ( address_to_write + blob_size ) - (b*psize);
+		if( end_o_plus_one_in_block > psize ) end_o_plus_one_in_block = psize;
+		int	base = b * psize;
 
-		if( offset_in_block == 0 && end_o_plus_one_in_block == 64 )
+		if( offset_in_block == 0 && end_o_plus_one_in_block == psize )
 		{
 			int r;
 			for(int i=0; i<20; i++) {
-				r = Write64Block( dev, base, blob + rsofar );
-				ReadBinaryBlob( dev, base, 64, tempblock );
-				if (!memcmp(blob+rsofar, tempblock, 64)) break;
+				r = is_flash ? WriteFlashPage( dev, base, blob + rsofar ) : Write64Block( dev, base, blob + rsofar );
+				ReportProgress( dev, SWIO_PHASE_PROGRAM, rsofar + psize, blob_size );
+				ReadBinaryBlob( dev, base, psize, tempblock );
+				ReportProgress( dev, SWIO_PHASE_VERIFY, rsofar + psize, blob_size );
+				if (!memcmp(blob+rsofar, tempblock, psize)) break;
+				dev->stats.write_retries++;
 				if (i == 9) 
 				{
 					Serial.println(rsofar);
 					return -99;
 				}
 			}
-			rsofar += 64;
+			rsofar += psize;
 			if( r )
 			{
 				// fprintf( stderr, "Error writing block at memory %08x (error = %d)\n", base, r );
@@ -988,7 +1956,7 @@ static int WriteBinaryBlob( struct SWIOState * iss, uint32_t address_to_write, u
 			//Ok, we have to do something wacky.
 			if( is_flash )
 			{
-				ReadBinaryBlob( dev, base, 64, tempblock );
+				ReadBinaryBlob( dev, base, psize, tempblock );
 
 				// Permute tempblock
 				int tocopy = end_o_plus_one_in_block - offset_in_block;
@@ -997,25 +1965,33 @@ static int WriteBinaryBlob( struct SWIOState * iss, uint32_t address_to_write, u
 				// int r = Write64Block( dev, base, tempblock );
 				int r;
 				for(int i=0; i<20; i++) {
-					r = Write64Block( dev, base, tempblock );
-					ReadBinaryBlob( dev, base, 64, tempblock2 );
-					if (!memcmp(tempblock, tempblock2, 64)) break;
+					r = WriteFlashPage( dev, base, tempblock );
+					ReportProgress( dev, SWIO_PHASE_PROGRAM, rsofar + tocopy, blob_size );
+					ReadBinaryBlob( dev, base, psize, tempblock2 );
+					ReportProgress( dev, SWIO_PHASE_VERIFY, rsofar + tocopy, blob_size );
+					if (!memcmp(tempblock, tempblock2, psize)) break;
+					dev->stats.write_retries++;
 					if (i == 9) return -99;
 				}
 				if( r ) return r;
 				if( WaitForFlash( dev ) ) goto timedout;
+				rsofar += tocopy;
 			}
 			else
 			{
 				// Accessing RAM.  Be careful to only do the needed operations.
 				int j;
-				for( j = 0; j < 16; j++ )
+				for( j = 0; j < psize / 4; j++ )
 				{
-					uint32_t taddy = j*4;
+					int taddy = j*4;
 					if( offset_in_block <= taddy && end_o_plus_one_in_block >= taddy + 4 )
 					{
-						WriteWord( dev, taddy + base, *(uint32_t*)(blob + rsofar) );
-						rsofar += 4;
+						// All whole words left in the block at once
+						int words = ( end_o_plus_one_in_block - taddy ) / 4;
+						int r = WriteBurst( dev, taddy + base, words, blob + rsofar );
+						if( r ) return r;
+						rsofar += words * 4;
+						j += words - 1;
 					}
 					// else if( ( offset_in_block & 1 ) || ( end_o_plus_one_in_block & 1 ) )
 					else
@@ -1055,6 +2031,7 @@ static int WriteBinaryBlob( struct SWIOState * iss, uint32_t address_to_write, u
 	// FlushLLCommands( dev );
 
 	// if(MCF.DelayUS) MCF.DelayUS( dev, 100 ); // Why do we need this? (We seem to need this on the WCH programmers?)
+	dev->stats.bytes_written += blob_size;
 	return 0;
 timedout:
 	// fprintf( stderr, "Timed out\n" );
@@ -1,5 +1,6 @@
 #include <Arduino.h>
 #include <stdio.h>
+#include <atomic>
 // #include <ESPAsyncTCP.h>
 #include <ESPAsyncWebServer.h>
 #ifdef ARDUINO_OTA
@@ -15,16 +16,46 @@
 #include "SRLConfig.h"
 #include "LittleFS_helpers.h"
 #include "ch32v003_swio.h"
+#include "WLFrame.h"
+#include "WLManifest.h"
+#include "ImageStore.h"
+#include "ImageLoader.h"
+#include "GdbServer.h"
 #include "driver/gpio.h"
+#include "esp_rom_crc.h"
+#include "lwip/tcpip.h"
+#include "lwip/priv/tcp_priv.h"
 
 #define DEVICE_NAME "WebLink"
 #define MDNS_NAME "weblink"
 
 #define WCH_MAX_TIMEOUT 30
 #define TERMINAL_BUFFER_SIZE 1024
-#define MAX_BINARY_SIZE 16384
 #define DEFAULT_FLASH_OFFSET 0x08000000
+#define DEFAULT_RUN_ADDRESS 0x20000000
 #define FLASHER_OP_TIMEOUT 10000
+#ifndef TERMINAL_TCP_PORT
+#define TERMINAL_TCP_PORT 23
+#endif
+#ifndef FLASHER_TCP_PORT
+#define FLASHER_TCP_PORT 2323
+#endif
+#ifndef GDB_TCP_PORT
+#define GDB_TCP_PORT 3333
+#endif
+#define GDB_RX_BUFFER_SIZE 2048
+#define GDB_POLL_INTERVAL 20
+#define GDB_HW_BREAKPOINTS 4
+#define TCP_MAX_CLIENTS 2
+#define TCP_TERMINAL_BUFFER_SIZE 256
+#define TCP_OUT_SIZE 4096
+// Frame replies go out whole, the largest carries FRAME_MAX_LENGTH bytes
+#define TCP_FLASHER_OUT_SIZE (FRAME_MAX_LENGTH + 512)
+// Terminal and flasher clients, one gdb
+#define TCP_OUT_SLOTS (TCP_MAX_CLIENTS * 2 + 1)
+#define FRAME_QUEUE_SIZE 16
+#define FRAME_QUEUE_MAX_BYTES 32768
+#define FRAME_MAX_LENGTH 16384
 
 #define HALT_MODE_HALT_AND_RESET    0
 #define HALT_MODE_REBOOT            1
@@ -66,7 +97,11 @@ ConfigG config;
 AsyncWebServer server(80);
 AsyncWebSocket terminal_ws("/terminal");
 AsyncWebSocket flash_ws("/wsflash");
+AsyncWebSocket watch_ws("/watch");
 AsyncEventSource link_events = AsyncEventSource("/events");
+AsyncServer terminal_tcp(TERMINAL_TCP_PORT);
+AsyncServer flash_tcp(FLASHER_TCP_PORT);
+AsyncServer gdb_tcp(GDB_TCP_PORT);
 DNSServer dns_server;
 PersWiFiManagerAsync persWM(server, dns_server);
 
@@ -77,17 +112,39 @@ bool AP_active = false;
 
 struct Terminal {
   bool connected = false;
+  volatile bool paused = false;
+  // Held by the polling task while it may use the link, see terminalPause()
+  SemaphoreHandle_t lock = NULL;
   char buf[TERMINAL_BUFFER_SIZE];
   char incomming_buf[64];
   uint8_t incomming_pos = 0;
   uint32_t last_send_time = 0;
 } terminal;
 
+typedef enum TelnetState {
+  TELNET_DATA,
+  TELNET_IAC,
+  TELNET_OPTION, // WILL, WONT, DO or DONT, the option byte follows
+  TELNET_SB,
+  TELNET_SB_IAC,
+} TelnetState_t;
+
+struct TerminalTCP {
+  AsyncClient* clients[TCP_MAX_CLIENTS] = {NULL};
+  TelnetState_t telnet[TCP_MAX_CLIENTS];
+  char out_buf[TCP_TERMINAL_BUFFER_SIZE];
+  uint16_t out_len = 0;
+  char in_buf[TCP_TERMINAL_BUFFER_SIZE];
+  volatile uint16_t in_head = 0;
+  volatile uint16_t in_tail = 0;
+} terminal_tcp_state;
+
 struct Flasher {
   bool active = false;
   bool will_flash = false;
   bool will_unbrick = false;
   bool will_read = false;
+  bool run = false; // Load into SRAM and start there instead of flashing
   uint32_t offset = 0;
   uint32_t size = 0;
   char message[64];
@@ -103,24 +160,394 @@ struct FlasherWS {
   bool active = false;
   WLFlasherCommand_t current_command = WLF_NONE;
   AsyncWebSocketClient* client;
+  AsyncClient* tcp_client = NULL;
+  uint32_t tcp_upload_pos = 0;
   uint32_t watchdog = 0;
 } flasher_ws;
 
+// #l is parsed on async_tcp and run by handleMemoryLoop() in loop()
+struct MemoryLoopJob {
+  volatile bool pending = false;
+  uint8_t op;
+  uint32_t args[4];
+} memory_loop;
+
+struct FrameJob {
+  WLFrameHeader_t header;
+  uint8_t* payload = NULL;
+  uint32_t ws_client = 0;
+  AsyncClient* tcp_client = NULL;
+};
+
+struct FrameQueue {
+  FrameJob jobs[FRAME_QUEUE_SIZE];
+  volatile uint8_t head = 0;
+  volatile uint8_t tail = 0;
+  std::atomic<uint32_t> pending_bytes{0};  // Added on async_tcp, released by loop()
+  bool link_ready = false;
+  bool auto_halted = false;
+  WLFrameAssembler ws_assemblers[TCP_MAX_CLIENTS];
+  uint32_t ws_assembler_ids[TCP_MAX_CLIENTS] = {0};
+} frame_queue;
+
+typedef enum WLProgressPhase {
+  WLP_IDLE,
+  WLP_ERASE = SWIO_PHASE_ERASE,
+  WLP_PROGRAM = SWIO_PHASE_PROGRAM,
+  WLP_VERIFY = SWIO_PHASE_VERIFY,
+  WLP_UPLOAD,
+  WLP_DONE,
+  WLP_FAILED,
+} WLProgressPhase_t;
+
+struct Metrics {
+  uint32_t terminal_bytes_in = 0;
+  uint32_t terminal_bytes_out = 0;
+  uint32_t terminal_overflows = 0;
+  uint32_t flash_jobs_ok = 0;
+  uint32_t flash_jobs_failed = 0;
+  uint32_t flasher_timeouts = 0;
+} metrics;
+
+struct SWIOHistogram link_histograms[SWIO_OP_COUNT];
+// Set by /histograms?reset, cleared by handleHistograms() in loop()
+volatile bool histograms_reset = false;
+const char* swio_op_names[SWIO_OP_COUNT] = {"reg_write", "reg_read", "word_read", "word_write", "block_write", "erase", "wait_flash", "init"};
+
+// Totals at the start of the current flash job, used for the per-job breakdown
+struct JobTiming {
+  uint32_t count[SWIO_OP_COUNT];
+  uint64_t cycles[SWIO_OP_COUNT];
+  uint32_t start_time;
+  // Compressed upload before the job, upload_bytes is 0 otherwise
+  uint32_t upload_bytes;
+  uint32_t image_bytes;
+  uint32_t upload_ms;
+  uint32_t inflate_ms;
+  char json[512] = "{}";
+} job_timing;
+
+// Fixed workload sizes, so results from different units can be compared
+#define BENCH_REG_OPS 2000
+#define BENCH_READ_BYTES 4096
+#define BENCH_RAM_BYTES 1024
+#define BENCH_PAGE_WRITES 8
+
+typedef enum WLBenchTest {
+  WLB_REG_WRITE,
+  WLB_REG_READ,
+  WLB_WORD_READ,
+  WLB_RAM_WRITE,
+  WLB_PAGE_PROGRAM,
+  WLB_FLASH_IMAGE,
+  WLB_TEST_COUNT
+} WLBenchTest_t;
+
+const char* bench_test_names[WLB_TEST_COUNT] = {"reg_write", "reg_read", "word_read", "ram_write", "page_program", "flash_image"};
+
+struct BenchResult {
+  uint32_t ops;
+  uint32_t bytes;
+  uint32_t us;
+  uint32_t errors;
+};
+
+struct Bench {
+  volatile bool pending = false;
+  bool flash = false;
+  BenchResult results[WLB_TEST_COUNT];
+  char json[900] = "{}";
+} bench;
+
+// Fixed rate sampling from loop(), for the PC sampler and the watch list
+struct Pacer {
+  uint32_t period = 0;
+  uint32_t next_us = 0;
+};
+
+// PC sampler. Every distinct PC takes a slot, what doesn't fit is counted as dropped.
+#define PROFILE_TABLE_SIZE 512
+#define PROFILE_DEFAULT_RATE 1000
+// A sample is 8 frames, about 230us on the wire
+#define PROFILE_MAX_RATE 4000
+#define PROFILE_DEFAULT_MS 1000
+#define PROFILE_MAX_MS 30000
+// Faster rates than loop() comes around, so each pass samples for this long
+#define PROFILE_SLICE_US 20000
+
+struct ProfileEntry {
+  uint32_t pc;
+  uint32_t count;
+};
+
+struct Profile {
+  volatile bool pending = false;
+  bool running = false;
+  uint32_t rate = PROFILE_DEFAULT_RATE;
+  uint32_t ms = PROFILE_DEFAULT_MS;
+  Pacer pacer;
+  uint32_t start = 0;
+  uint64_t busy_us = 0;
+  int status = 0;
+  uint32_t samples = 0;
+  uint32_t missed = 0;
+  uint32_t errors = 0;
+  uint32_t dropped = 0;
+  uint32_t sample_us = 0;
+  // Sorted by count once the run is done, the first used entries are the result
+  uint32_t used = 0;
+  ProfileEntry table[PROFILE_TABLE_SIZE];
+  char json[200] = "{}";
+} profile;
+
+// Snapshots of SRAM and core registers on LittleFS
+#define SNAPSHOT_DIR "/snapshots"
+#define SNAPSHOT_NAME_MAX 24
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_MAX_GPRS 31
+// mstatus, mtvec, mscratch, mepc, mcause, mtval, intsyscr and dpc. Not every
+// core has all of them, the ones that fail to read are left out.
+const uint16_t snapshot_csrs[] = {0x300, 0x305, 0x340, 0x341, 0x342, 0x343, 0x804, SWIO_REG_DPC};
+#define SNAPSHOT_CSR_COUNT (sizeof(snapshot_csrs) / sizeof(snapshot_csrs[0]))
+
+typedef enum WLSnapshotOp {
+  WLS_NONE,
+  WLS_SAVE,
+  WLS_RESTORE
+} WLSnapshotOp_t;
+
+// File layout, SRAM follows
+struct SnapshotHeader {
+  char magic[4];      // "WLSS"
+  uint8_t version;
+  uint8_t gpr_count;  // x1 onwards
+  uint8_t csr_count;
+  uint8_t reserved;
+  char chip[12];
+  uint32_t ram_base;
+  uint32_t ram_size;
+  uint32_t csr_valid; // Bit per entry of snapshot_csrs
+  uint32_t gprs[SNAPSHOT_MAX_GPRS];
+  uint32_t csrs[SNAPSHOT_CSR_COUNT];
+};
+
+struct Snapshot {
+  volatile uint8_t op = WLS_NONE;
+  char name[SNAPSHOT_NAME_MAX + 1];
+  char reply[80] = "";
+} snapshot;
+
+// Base image on LittleFS that's flashed with a few bytes patched per unit
+#define PERSONALIZE_IMAGE "/personalize.bin"
+#define PERSONALIZE_COUNTER "/personalize.cnt"
+#define PERSONALIZE_VERSION 1
+#define PERSONALIZE_MAX_PATCHES 8
+// All value patches together, supplied with every flash request
+#define PERSONALIZE_VALUE_MAX 32
+// R32_ESIG_UNIID1-3, 96 bits on every WCH RISC-V part
+#define ESIG_UNIID 0x1FFFF7E8
+#define ESIG_UNIID_SIZE 12
+
+typedef enum WLPersonalizeOp {
+  WLU_NONE,
+  WLU_STORE,
+  WLU_FLASH,
+  WLU_FLASHING
+} WLPersonalizeOp_t;
+
+typedef enum WLPatchSource {
+  WLPS_COUNTER, // Unit counter, little endian, up to 4 bytes
+  WLPS_UID,     // Chip UID from the ESIG, up to 12 bytes
+  WLPS_VALUE,   // Next bytes of the value given with the flash request
+  WLPS_COUNT
+} WLPatchSource_t;
+
+const char* patch_source_names[] = {"counter", "uid", "value"};
+const uint8_t patch_source_max[] = {4, ESIG_UNIID_SIZE, PERSONALIZE_VALUE_MAX};
+
+struct PatchEntry {
+  uint32_t offset;    // From the start of the image
+  uint8_t length;
+  uint8_t source;
+  uint16_t reserved;
+};
+
+// File layout, the image follows
+struct PersonalizeHeader {
+  char magic[4];      // "WLPI"
+  uint8_t version;
+  uint8_t patch_count;
+  uint16_t reserved;
+  uint32_t offset;    // Where the image is flashed
+  uint32_t size;
+  uint32_t crc;       // Of the base image, zlib's crc32
+  PatchEntry patches[PERSONALIZE_MAX_PATCHES];
+};
+
+struct Personalize {
+  volatile uint8_t op = WLU_NONE;
+  PersonalizeHeader header;  // Of an upload until it's stored
+  uint8_t value[PERSONALIZE_VALUE_MAX];
+  uint8_t value_len = 0;
+  uint32_t unit = 0;
+  uint32_t start = 0;
+  char reply[96] = "";
+} personalize;
+
+// Watch list, RAM variables sampled while the target runs
+#define WATCH_MAX_VARS 16
+// Words read per sample, all ranges together
+#define WATCH_MAX_WORDS 64
+// Small gaps in SRAM are read along, a new range costs more frames than a few words
+#define WATCH_MAX_GAP_WORDS 3
+#define WATCH_DEFAULT_RATE 100
+// Samples are taken from loop(), it doesn't come around much more often
+#define WATCH_MAX_RATE 500
+#define WATCH_BUFFER_SIZE 16384
+#define WATCH_SEND_INTERVAL 50
+#define WATCH_MESSAGE_SIZE 1024
+
+struct WatchVar {
+  uint32_t address;
+  uint8_t size;
+  uint16_t offset;  // Into the words read for a sample
+};
+
+struct Watch {
+  volatile bool start = false;
+  volatile bool stop = false;
+  bool running = false;
+  bool sysbus = false;
+  int status = 0;
+  uint32_t rate = WATCH_DEFAULT_RATE;
+  uint8_t count = 0;
+  WatchVar vars[WATCH_MAX_VARS];
+  // Set up by onWatch(), taken over by handleWatch()
+  uint8_t new_count = 0;
+  uint32_t new_rate = WATCH_DEFAULT_RATE;
+  WatchVar new_vars[WATCH_MAX_VARS];
+  uint8_t range_count = 0;
+  SWIORange ranges[WATCH_MAX_VARS];
+  uint32_t words = 0;
+  // Records are a uint32_t timestamp in us since the start and the values of all variables
+  uint16_t record_size = 4;
+  uint32_t capacity = 0;
+  uint32_t generation = 0;
+  uint32_t start_us = 0;
+  Pacer pacer;
+  uint32_t last_send = 0;
+  uint32_t samples = 0;
+  uint32_t missed = 0;
+  uint32_t errors = 0;
+  volatile uint32_t head = 0;  // Records written
+  uint32_t sent = 0;           // Records streamed on /watch
+  uint8_t buf[WATCH_BUFFER_SIZE];
+} watch;
+
+struct GdbConnection {
+  AsyncClient* client = NULL;
+  volatile bool attach = false;
+  volatile bool detach = false;
+  bool attached = false;
+  uint8_t rx[GDB_RX_BUFFER_SIZE];
+  volatile uint16_t rx_head = 0;
+  volatile uint16_t rx_tail = 0;
+  uint32_t link_frames = 0;
+  uint32_t last_poll = 0;
+} gdb;
+
+// Reads are streamed in chunks, the HTTP response takes them from a ring buffer
+#define DUMP_CHUNK_SIZE 1024
+#define DUMP_BUFFER_SIZE 4096
+
+typedef enum WLDumpState {
+  WLD_IDLE,
+  WLD_STREAMING,
+  WLD_DONE,
+  WLD_FAILED,
+} WLDumpState_t;
+
+struct Dump {
+  volatile uint8_t state = WLD_IDLE;
+  bool http = false;
+  uint32_t id = 0;
+  uint32_t ws_client = 0;
+  uint32_t offset = 0;
+  uint32_t size = 0;
+  volatile uint32_t read = 0;  // Bytes read from the target
+  volatile uint32_t sent = 0;  // Bytes taken by the HTTP response
+  volatile bool cancelled = false;
+  uint8_t buf[DUMP_BUFFER_SIZE];
+} dump;
+
+#define TRACE_DEFAULT_ENTRIES 2048
+struct SWIOTrace link_trace;
+
+// /trace?start from async_tcp, the buffer is swapped in by loop() between SWIO transactions
+struct TraceStart {
+  struct SWIOTraceEntry* entries = NULL;  // New buffer, NULL to keep the current one
+  uint32_t size = 0;
+  volatile bool pending = false;
+  uint32_t downloads = 0;  // Running /trace.bin responses, they read the buffer
+} trace_start;
+
+const char* progress_phase_names[] = {"idle", "erase", "program", "verify", "upload", "done", "failed"};
+
+// Latest flasher progress, published on /events at most every config.progress_interval
+struct Progress {
+  volatile uint8_t phase = WLP_IDLE;
+  volatile uint32_t done = 0;
+  volatile uint32_t total = 0;
+  volatile bool dirty = false;
+  uint32_t last_id = 0;
+  uint32_t last_send_time = 0;
+  char json[80] = "";
+} progress;
+
 TaskHandle_t PollTask;
+TaskHandle_t LoopTask;
 
 struct SWIOState link_state;
-uint8_t binary_buf[16384];
+ImageStore image;
+ImageLoader loader(&image);
 bool upload_post_error;
 
+// Lets a job that's flashed in parts report progress of the whole
+struct ProgressSpan {
+  uint32_t base = 0;
+  uint32_t total = 0;
+} link_progress_span;
+
 int initLink();
-int writeBinary(uint32_t offset, uint32_t size);
+int writeImagePages(uint32_t offset);
+bool uploadFinish();
+int writeBinary(uint32_t offset, uint32_t size, uint8_t* data = NULL);
+int runBinary(uint32_t address);
 int unbrick();
 int chipInfo(char* buf);
+bool personalizeParse(const char* manifest, uint32_t size, PersonalizeHeader* header);
+bool personalizeFits(PersonalizeHeader* header, uint32_t size);
+int memoryLoop(uint8_t op, uint32_t address, uint32_t bytes, uint32_t arg, uint32_t step, uint32_t* result);
 void pollTerminal(void *pvParameter);
 void handleFlasher();
+void handleFrameQueue();
+int frameQueueCount();
+size_t frameFeed(WLFrameAssembler* assembler, const uint8_t* data, size_t len, uint32_t ws_client, AsyncClient* tcp_client);
+void frameDropClient(uint32_t ws_client, AsyncClient* tcp_client);
+bool tcpWrite(AsyncClient* client, const uint8_t* data, size_t len);
+size_t tcpSpace(AsyncClient* client);
+void tcpClose(AsyncClient* client);
 void parseMessage(char* message);
 void uartSetup();
 void terminalDisconnect();
+bool terminalPause();
+void terminalResume();
+void flasherReply(const char* format, ...);
+void flasherReplyBinary(const uint8_t* data, size_t len);
+void dumpBegin(bool http, uint32_t offset, uint32_t size);
+int tcpTerminalCount();
+void tcpTerminalSend(const char* data, size_t len);
+void tcpTerminalFlush();
 
 
 ////////////////////////////////
@@ -149,6 +576,47 @@ void onUpload(AsyncWebServerRequest *request, String filename, size_t index, uin
   // Handle upload
 }
 
+////////////////////////////////
+///   Progress events        ///
+////////////////////////////////
+bool progressPublish(bool force = false) {
+  if (!progress.dirty) return false;
+  if (!force && millis() - progress.last_send_time < config.progress_interval) return false;
+  progress.dirty = false;
+  progress.last_send_time = millis();
+  char json[sizeof(progress.json)];
+  snprintf(json, sizeof(json), "{\"phase\":\"%s\",\"done\":%" PRIu32 ",\"total\":%" PRIu32 "}",
+           progress_phase_names[progress.phase], progress.done, progress.total);
+  // Ids share the millis() space with other events, but have to be unique for resume
+  uint32_t id = max(millis(), progress.last_id + 1);
+  strcpy(progress.json, json);
+  progress.last_id = id;
+  link_events.send(json, "progress", id);
+  return true;
+}
+
+// Intermediate states are coalesced, final ones are always sent
+bool progressUpdate(uint8_t phase, uint32_t done, uint32_t total) {
+  progress.phase = phase;
+  progress.done = done;
+  progress.total = total;
+  progress.dirty = true;
+  return progressPublish(phase == WLP_DONE || phase == WLP_FAILED);
+}
+
+void onLinkProgress(struct SWIOState* iss, int phase, uint32_t done, uint32_t total) {
+  if (link_progress_span.total) progressUpdate(phase, link_progress_span.base + done, link_progress_span.total);
+  else progressUpdate(phase, done, total);
+}
+
+// Clients reconnecting with Last-Event-ID get the state they missed
+void progressResume(AsyncEventSourceClient *client) {
+  if (!progress.last_id) return;
+  if (client->lastId() ? client->lastId() < progress.last_id : progress.phase != WLP_DONE && progress.phase != WLP_FAILED) {
+    client->send(progress.json, "progress", progress.last_id);
+  }
+}
+
 void onFlashRequest(AsyncWebServerRequest *request) {
   // the request handler is triggered after the upload has finished... 
   // create the response, add header, and send response
@@ -169,26 +637,59 @@ void resetFlasher() {
   flasher.will_flash = false;
   flasher.will_unbrick = false;
   flasher.will_read = false;
+  flasher.run = false;
   flasher.offset = 0;
   flasher.size = 0;
   flasher.retries = 0;
   flasher.current_retry = 0;
   flasher_ws.current_command = WLF_NONE;
+  terminalResume();
+}
+
+// Why a text command can't have the link right now, NULL if it can. Commands
+// run on async_tcp, anything else on the link would be driven at the same time.
+const char* commandBusy() {
+  // The debugger holds the hart halted, a command could reboot or resume it under gdb
+  if (gdb.attached) return "Debugger attached";
+  // Samples are read from loop(), a halt would also stop the target under the watch
+  if (watch.running || watch.start) return "Watch running";
+  if (flasher.active || flasher_ws.active || frameQueueCount()) return "Flasher busy";
+  return NULL;
 }
 
-void activateFlasher(bool ws = false) {
-  terminalDisconnect();
+// False when the polling task didn't let go of the link, reply #1;Flasher busy
+bool activateFlasher(bool ws = false) {
+  if (!terminalPause()) return false;
   flasher.active = true;
   flasher_ws.active = ws;
   flasher.watchdog = millis();
+  return true;
+}
+
+// Holds the response back until the job in loop() is done, then sends reply.
+// The job fills reply before busy() turns false.
+void replyWhenDone(AsyncWebServerRequest *request, const char* type, bool (*busy)(), const char* reply) {
+  AsyncWebServerResponse *response = request->beginChunkedResponse(type, [busy, reply](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+    if (busy() || flasher.active) return RESPONSE_TRY_AGAIN;
+    size_t len = strlen(reply);
+    if (index >= len) return 0;
+    len = min(len - index, maxLen);
+    memcpy(buffer, reply + index, len);
+    return len;
+  });
+  response->addHeader("Connection", "close");
+  request->send(response);
 }
 
 int resetCH() {
   Serial.println("Resetting the board");
+  if (!terminalPause()) return 1;
   if(initLink() < 1) {
+    terminalResume();
     return 1;
   } else {
     HaltMode(&link_state, 1);
+    terminalResume();
     delay(10);
     return 0;
   }
@@ -222,22 +723,33 @@ void onFlashUpload(AsyncWebServerRequest *request, String filename, size_t index
       } else {
         flasher.offset = request->getParam("offset", true)->value().toInt();
       }
-      if (MAX_BINARY_SIZE < binary_size) {
+      if (binary_size < 0 || IMAGE_UPLOAD_MAX < binary_size) {
         upload_post_error = true;
         flasher.error = WLF_UPLOAD_ERROR;
-        Serial.println("Binary is bigger then ch32v003 flash size.");
+        Serial.println("Binary is bigger then max image size.");
         return request->send(400, "text/plain", "Binary is too big.");
       } else {
         flasher.size = binary_size;
       }
       flasher.active = true;
+      loader.begin(binary_size);
       Serial.printf("Starting binary upload. size = %d\n\r", binary_size);
     }
+    if (upload_post_error) return;
     if(len){
-      memcpy(binary_buf+index, data, len);
+      if (!loader.write(index, data, len)) {
+        upload_post_error = true;
+        flasher.error = WLF_UPLOAD_ERROR;
+        flasher.status = WLF_FAILED;
+        strcpy(flasher.message, loader.error());
+        Serial.println(flasher.message);
+        progressUpdate(WLP_FAILED, index, flasher.size);
+        link_events.send(flasher.message, "flasher", millis());
+        resetFlasher();
+        return;
+      }
       sprintf(flasher.message, "%d/%" PRIu32 "", (int)(index+len), flasher.size);
-      Serial.println(flasher.message);
-      link_events.send(flasher.message, "flasher", millis());
+      if (progressUpdate(WLP_UPLOAD, index+len, flasher.size)) link_events.send(flasher.message, "flasher", millis());
     }
     
     if (final) { // if the final flag is set then this is the last frame of data
@@ -248,8 +760,18 @@ void onFlashUpload(AsyncWebServerRequest *request, String filename, size_t index
         resetFlasher();
         sprintf(flasher.message, "Size mismatch, expected:%" PRIu32 ", actual:%d", flasher.size, (int)(index+len));
         Serial.println(flasher.message);
+        progressUpdate(WLP_FAILED, index+len, flasher.size);
         link_events.send(flasher.message, "flasher", millis());
         return request->send(400, "text/plain", "Size mismatch");
+      } else if (!uploadFinish()) {
+        upload_post_error = true;
+        flasher.error = WLF_UPLOAD_ERROR;
+        flasher.status = WLF_FAILED;
+        strcpy(flasher.message, loader.error());
+        progressUpdate(WLP_FAILED, index+len, flasher.size);
+        link_events.send(flasher.message, "flasher", millis());
+        resetFlasher();
+        return request->send(400, "text/plain", flasher.message);
       } else {
         upload_post_error = false;
         flasher.will_flash = true;
@@ -284,81 +806,1288 @@ void onStatus(AsyncWebServerRequest *request) {
   }
 }
 
-void onTerminalEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)
-{
-  // Handle WebSocket event
-  switch (type) {
-  case WS_EVT_CONNECT:
-    // client connected
-    Serial.printf("ws[%s][%u] connect\n\r", server->url(), client->id());
-    if (!flasher.active || !flasher_ws.active) {
-      client->printf("Hello Client %u" PRIu32 " :)", client->id());
-      if (config.uart == false){
-        if (initLink() > 0) {
-          terminal.connected = true;
-        } else {
-          terminal.connected = false;
-          client->printf("Failed to connect to ch32v003");
-          client->close();
+// Raw upload state of PUT /flash/<offset>, freed together with the request
+struct FlashPut {
+  int code;
+  const char* message;
+  uint32_t crc;
+};
+
+void onFlashPutBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+  if (!index) {
+    FlashPut* put = (FlashPut*)malloc(sizeof(FlashPut));
+    if (put == NULL) return;
+    put->code = 0;
+    put->message = NULL;
+    put->crc = 0;
+    request->_tempObject = put;
+    // POST /run?address= loads into SRAM instead, PUT /personalize/<offset> stores a base image
+    bool run = request->url() == "/run";
+    bool store = request->url().startsWith("/personalize/");
+    const char* offset_str = run ? NULL : request->url().c_str() + (store ? strlen("/personalize/") : strlen("/flash/"));
+    PersonalizeHeader header;
+    if (run && request->hasParam("address")) offset_str = request->getParam("address")->value().c_str();
+    char* end = (char*)"";
+    uint32_t offset = offset_str ? strtoul(offset_str, &end, 0) : DEFAULT_RUN_ADDRESS;
+    if ((offset_str && *offset_str == 0) || *end != 0) {
+      put->code = 400;
+      put->message = "#3;Bad offset";
+    } else if (run && (offset & 0xff000000) != DEFAULT_RUN_ADDRESS) {
+      put->code = 400;
+      put->message = "#3;Address is not in SRAM";
+    } else if (total > (store ? IMAGE_MAX_SIZE : IMAGE_UPLOAD_MAX)) {
+      put->code = 413;
+      put->message = "#3;Binary is too big";
+    } else if (store && !personalizeParse(request->hasParam("patches") ? request->getParam("patches")->value().c_str() : "", IMAGE_MAX_SIZE, &header)) {
+      put->code = 400;
+      put->message = "#3;Bad patch manifest";
+    } else if (flasher.active || frameQueueCount()) {
+      put->code = 409;
+      put->message = "#1;Flasher busy";
+    }
+    if (!put->code && !activateFlasher()) {
+      put->code = 409;
+      put->message = "#1;Flasher busy";
+    }
+    if (put->code) return;
+    if (store) {
+      header.offset = offset;
+      personalize.header = header;
+    }
+    loader.begin(total);
+    flasher.status = WLF_UPLOADING;
+    flasher.offset = offset;
+    flasher.size = total;
+    flasher.run = run;
+    flasher.retries = request->hasParam("retries") ? request->getParam("retries")->value().toInt() : 0;
+    request->onDisconnect([]() {
+      // Upload was cut short, don't wait for the watchdog
+      if (flasher.active && !flasher_ws.active && flasher.status == WLF_UPLOADING) resetFlasher();
+    });
+    Serial.printf("Starting raw binary upload. size = %u\n\r", (unsigned)total);
+  }
+  FlashPut* put = (FlashPut*)request->_tempObject;
+  if (put == NULL || put->code) return;
+  bool store = request->url().startsWith("/personalize/");
+  if (!loader.write(index, data, len)) {
+    put->code = 507;
+    put->message = loader.format() == IMAGE_FORMAT_RAW && !loader.compressed() ? "#4;Out of memory" : "#4;Bad image file";
+    flasher.status = WLF_FAILED;
+    progressUpdate(WLP_FAILED, index, total);
+    resetFlasher();
+    return;
+  }
+  put->crc = esp_rom_crc32_le(put->crc, data, len);
+  flasher.watchdog = millis();
+  progressUpdate(WLP_UPLOAD, index + len, total);
+  if (index + len < total) return;
+  if (request->hasHeader("X-Content-CRC32") && strtoul(request->getHeader("X-Content-CRC32")->value().c_str(), NULL, 16) != put->crc) {
+    put->code = 400;
+    put->message = "#4;CRC mismatch";
+    flasher.status = WLF_FAILED;
+    progressUpdate(WLP_FAILED, total, total);
+    resetFlasher();
+    return;
+  }
+  if (!uploadFinish()) {
+    put->code = 400;
+    put->message = "#4;Bad image file";
+  } else if (store && !personalizeFits(&personalize.header, image.size())) {
+    put->code = 400;
+    put->message = "#3;Base image has to be a raw binary the patches fit in";
+  }
+  if (put->code) {
+    flasher.status = WLF_FAILED;
+    progressUpdate(WLP_FAILED, total, total);
+    resetFlasher();
+    return;
+  }
+  flasher.status = WLF_UPDATING;
+  if (store) {
+    personalize.op = WLU_STORE;
+    return;
+  }
+  flasher.will_flash = true;
+  link_events.send("Will flash", "flasher", millis());
+}
+
+char flash_put_reply[sizeof(flasher.message) + sizeof(job_timing.json) + 8];
+
+bool flashPutBusy() {
+  if (flasher.active) return true;
+  snprintf(flash_put_reply, sizeof(flash_put_reply), "#%d;%s\n%s\n", flasher.status == WLF_SUCCESS ? 0 : 4,
+           flasher.status == WLF_SUCCESS || flasher.status == WLF_FAILED ? flasher.message : "Flasher timeout", job_timing.json);
+  return false;
+}
+
+// Replies once the flasher is done, so a single request covers upload and flashing
+void onFlashPut(AsyncWebServerRequest *request) {
+  FlashPut* put = (FlashPut*)request->_tempObject;
+  if (put == NULL) {
+    return request->send(411, "text/plain", "#3;Content-Length required\n");
+  }
+  if (put->code) {
+    return request->send(put->code, "text/plain", String(put->message) + "\n");
+  }
+  replyWhenDone(request, "text/plain", flashPutBusy, flash_put_reply);
+}
+
+void printMetric(Print &out, const char* name, const char* type, const char* help, uint32_t value) {
+  out.printf("# HELP weblink_%s %s\n# TYPE weblink_%s %s\nweblink_%s %" PRIu32 "\n", name, help, name, type, name, value);
+}
+
+// Prometheus text format
+void onMetrics(AsyncWebServerRequest *request) {
+  AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+  const struct SWIOStats* stats = &link_state.stats;
+  printMetric(*response, "swio_frames_written_total", "counter", "SWIO register write frames", stats->frames_written);
+  printMetric(*response, "swio_frames_read_total", "counter", "SWIO register read frames", stats->frames_read);
+  printMetric(*response, "swio_read_timeouts_total", "counter", "SWIO reads that timed out waiting for the target", stats->read_timeouts);
+  printMetric(*response, "swio_op_errors_total", "counter", "Debug module abstract command errors", stats->op_errors);
+  printMetric(*response, "flash_busy_polls_total", "counter", "Reads of FLASH_STATR while waiting for the flash", stats->flash_busy_polls);
+  printMetric(*response, "flash_busy_timeouts_total", "counter", "Flash operations that stayed busy", stats->flash_timeouts);
+  printMetric(*response, "flash_write_retries_total", "counter", "Flash blocks rewritten after failed verify", stats->write_retries);
+  printMetric(*response, "link_bytes_written_total", "counter", "Bytes written to target memory", stats->bytes_written);
+  printMetric(*response, "link_bytes_read_total", "counter", "Bytes read from target memory, including verify", stats->bytes_read);
+  printMetric(*response, "flash_jobs_ok_total", "counter", "Successful flash jobs", metrics.flash_jobs_ok);
+  printMetric(*response, "flash_jobs_failed_total", "counter", "Failed flash jobs", metrics.flash_jobs_failed);
+  printMetric(*response, "flasher_timeouts_total", "counter", "Flasher jobs reset by the watchdog", metrics.flasher_timeouts);
+  printMetric(*response, "flasher_active", "gauge", "1 while a flasher job is running", flasher.active || frameQueueCount());
+  printMetric(*response, "frame_queue_length", "gauge", "Queued binary frames", frameQueueCount());
+  printMetric(*response, "terminal_bytes_in_total", "counter", "Bytes sent to the target terminal", metrics.terminal_bytes_in);
+  printMetric(*response, "terminal_bytes_out_total", "counter", "Bytes received from the target terminal", metrics.terminal_bytes_out);
+  printMetric(*response, "terminal_overflows_total", "counter", "Terminal buffer overflows and dropped input", metrics.terminal_overflows);
+  response->print("# HELP weblink_clients Connected clients\n# TYPE weblink_clients gauge\n");
+  response->printf("weblink_clients{endpoint=\"terminal\"} %u\n", (unsigned)terminal_ws.count());
+  response->printf("weblink_clients{endpoint=\"wsflash\"} %u\n", (unsigned)flash_ws.count());
+  response->printf("weblink_clients{endpoint=\"watch\"} %u\n", (unsigned)watch_ws.count());
+  response->printf("weblink_clients{endpoint=\"events\"} %u\n", (unsigned)link_events.count());
+  response->printf("weblink_clients{endpoint=\"terminal_tcp\"} %d\n", tcpTerminalCount());
+  // AsyncTCP doesn't expose its event queue, this is the closest thing we can see
+  printMetric(*response, "events_packets_waiting", "gauge", "Average packets queued per /events client", link_events.avgPacketsWaiting());
+  printMetric(*response, "heap_free_bytes", "gauge", "Free heap", ESP.getFreeHeap());
+  printMetric(*response, "heap_min_free_bytes", "gauge", "Lowest free heap since boot", ESP.getMinFreeHeap());
+  printMetric(*response, "heap_max_alloc_bytes", "gauge", "Largest allocatable heap block", ESP.getMaxAllocHeap());
+  response->print("# HELP weblink_task_stack_free_bytes Stack high-water mark\n# TYPE weblink_task_stack_free_bytes gauge\n");
+  response->printf("weblink_task_stack_free_bytes{task=\"loop\"} %u\n", (unsigned)uxTaskGetStackHighWaterMark(LoopTask));
+  response->printf("weblink_task_stack_free_bytes{task=\"poll\"} %u\n", (unsigned)uxTaskGetStackHighWaterMark(PollTask));
+  response->printf("weblink_task_stack_free_bytes{task=\"async_tcp\"} %u\n", (unsigned)uxTaskGetStackHighWaterMark(NULL));
+  printMetric(*response, "uptime_seconds", "counter", "Seconds since boot", millis() / 1000);
+  request->send(response);
+}
+
+////////////////////////////////
+///   Latency histograms     ///
+////////////////////////////////
+void jobTimingStart() {
+  for (int i = 0; i < SWIO_OP_COUNT; i++) {
+    job_timing.count[i] = link_histograms[i].count;
+    job_timing.cycles[i] = link_histograms[i].cycles;
+  }
+  job_timing.start_time = millis();
+}
+
+// Where the time of the last job went, [count, microseconds] per operation type
+void jobTimingFinish() {
+  uint32_t mhz = ESP.getCpuFreqMHz();
+  int pos = snprintf(job_timing.json, sizeof(job_timing.json), "{\"total_ms\":%" PRIu32, millis() - job_timing.start_time);
+  for (int i = 0; i < SWIO_OP_COUNT && pos < (int)sizeof(job_timing.json); i++) {
+    uint32_t count = link_histograms[i].count - job_timing.count[i];
+    uint64_t cycles = link_histograms[i].cycles - job_timing.cycles[i];
+    pos += snprintf(job_timing.json + pos, sizeof(job_timing.json) - pos, ",\"%s\":[%" PRIu32 ",%" PRIu32 "]",
+                    swio_op_names[i], count, (uint32_t)(cycles / mhz));
+  }
+  // Time saved is the upload of the uncompressed file at the rate the compressed one came in
+  if (job_timing.upload_bytes && pos < (int)sizeof(job_timing.json)) {
+    int32_t saved = (uint64_t)job_timing.image_bytes * job_timing.upload_ms / job_timing.upload_bytes - job_timing.upload_ms - job_timing.inflate_ms;
+    pos += snprintf(job_timing.json + pos, sizeof(job_timing.json) - pos,
+                    ",\"upload\":{\"bytes\":%" PRIu32 ",\"image_bytes\":%" PRIu32 ",\"ms\":%" PRIu32 ",\"inflate_ms\":%" PRIu32 ",\"saved_ms\":%" PRId32 "}",
+                    job_timing.upload_bytes, job_timing.image_bytes, job_timing.upload_ms, job_timing.inflate_ms, saved);
+    job_timing.upload_bytes = 0;
+  }
+  if (pos < (int)sizeof(job_timing.json) - 1) strcat(job_timing.json, "}");
+  Serial.printf("Job timing: %s\n\r", job_timing.json);
+  link_events.send(job_timing.json, "timing", millis());
+}
+
+void onHistograms(AsyncWebServerRequest *request) {
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  response->printf("{\"cpu_mhz\":%" PRIu32 ",\"t1coeff\":%d,\"ops\":{", ESP.getCpuFreqMHz(), link_state.t1coeff);
+  for (int i = 0; i < SWIO_OP_COUNT; i++) {
+    const struct SWIOHistogram* h = &link_histograms[i];
+    response->printf("%s\"%s\":{\"count\":%" PRIu32 ",\"cycles\":%llu,\"max\":%" PRIu32 ",\"buckets\":[",
+                     i ? "," : "", swio_op_names[i], h->count, (unsigned long long)h->cycles, h->max);
+    for (int b = 0; b < SWIO_HIST_BUCKETS; b++) response->printf(b ? ",%" PRIu32 : "%" PRIu32, h->buckets[b]);
+    response->print("]}");
+  }
+  response->printf("},\"last_job\":%s}", job_timing.json);
+  request->send(response);
+  if (request->hasParam("reset")) histograms_reset = true;
+}
+
+// Cleared where the jobs run, not under them from async_tcp. Terminal polls
+// are counted from their own task without a lock, so those are approximate.
+void handleHistograms() {
+  if (!histograms_reset) return;
+  memset(link_histograms, 0, sizeof(link_histograms));
+  histograms_reset = false;
+}
+
+////////////////////////////////
+///   DM transaction trace   ///
+////////////////////////////////
+// File layout of /trace.bin, entries follow oldest first
+struct __attribute__((packed)) TraceFileHeader {
+  char magic[4];
+  uint8_t version;
+  uint8_t entry_size;
+  uint16_t t1coeff;
+  uint32_t cpu_mhz;
+  uint32_t count;
+  uint32_t dropped;
+};
+
+uint32_t traceCount() {
+  return link_trace.head < link_trace.size ? link_trace.head : link_trace.size;
+}
+
+void onTrace(AsyncWebServerRequest *request) {
+  if ((request->hasParam("start") || request->hasParam("stop")) && trace_start.pending) {
+    request->send(409, "text/plain", "#1;Trace is starting");
+    return;
+  }
+  if (request->hasParam("start")) {
+    if (trace_start.downloads) {
+      request->send(409, "text/plain", "#1;Trace is being downloaded");
+      return;
+    }
+    uint32_t entries = TRACE_DEFAULT_ENTRIES;
+    String value = request->getParam("start")->value();
+    if (value.length()) entries = strtoul(value.c_str(), NULL, 0);
+    if (entries < 16 || entries & (entries - 1)) {
+      request->send(400, "text/plain", "#3;Size has to be a power of two");
+      return;
+    }
+    link_state.trace = NULL;
+    trace_start.entries = NULL;
+    if (entries != link_trace.size) {
+      trace_start.entries = (struct SWIOTraceEntry*)malloc(entries * sizeof(struct SWIOTraceEntry));
+      if (!trace_start.entries) {
+        request->send(507, "text/plain", "#4;Not enough memory");
+        return;
+      }
+    }
+    trace_start.size = entries;
+    trace_start.pending = true;
+  } else if (request->hasParam("stop")) {
+    // Buffer is kept for /trace.bin
+    link_state.trace = NULL;
+  }
+  char buf[96];
+  sprintf(buf, "{\"enabled\":%s,\"size\":%" PRIu32 ",\"recorded\":%" PRIu32 "}",
+          link_state.trace || trace_start.pending ? "true" : "false",
+          trace_start.pending ? trace_start.size : link_trace.size, trace_start.pending ? 0 : link_trace.head);
+  request->send(200, "application/json", buf);
+}
+
+// Jobs in loop() use link_state.trace, the old buffer can only go away here
+void handleTrace() {
+  if (!trace_start.pending) return;
+  if (trace_start.entries) {
+    free(link_trace.entries);
+    link_trace.entries = trace_start.entries;
+    link_trace.size = trace_start.size;
+    trace_start.entries = NULL;
+  }
+  link_trace.head = 0;
+  link_state.trace = &link_trace;
+  trace_start.pending = false;
+  Serial.printf("Link trace started, %" PRIu32 " entries\n\r", link_trace.size);
+}
+
+void onTraceDownload(AsyncWebServerRequest *request) {
+  if (!link_trace.entries) {
+    request->send(404, "text/plain", "#3;No trace recorded");
+    return;
+  }
+  // Freeze the ring while it's being sent, recording resumes when the client is done
+  bool enabled = link_state.trace != NULL;
+  link_state.trace = NULL;
+  trace_start.downloads++;
+  request->onDisconnect([enabled]() {
+    trace_start.downloads--;
+    if (enabled) link_state.trace = &link_trace;
+  });
+  uint32_t count = traceCount();
+  uint32_t first = link_trace.head - count;
+  struct TraceFileHeader header = {{'W', 'L', 'T', 'R'}, 1, sizeof(struct SWIOTraceEntry), (uint16_t)link_state.t1coeff,
+                                   ESP.getCpuFreqMHz(), count, link_trace.head - count};
+  size_t total = sizeof(header) + count * sizeof(struct SWIOTraceEntry);
+  AsyncWebServerResponse *response = request->beginResponse("application/octet-stream", total,
+    [header, first](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      size_t len = 0;
+      while (len < maxLen) {
+        if (index < sizeof(header)) {
+          size_t n = min(maxLen - len, sizeof(header) - index);
+          memcpy(buffer + len, (const uint8_t*)&header + index, n);
+          len += n;
+          index += n;
+          continue;
         }
-      } else {
-        terminal.connected = true;
-        Serial.println("Using UART for terminal");
+        size_t offset = index - sizeof(header);
+        uint32_t entry = offset / sizeof(struct SWIOTraceEntry);
+        if (entry >= header.count) break;
+        size_t skip = offset % sizeof(struct SWIOTraceEntry);
+        size_t n = min(maxLen - len, sizeof(struct SWIOTraceEntry) - skip);
+        const uint8_t* src = (const uint8_t*)&link_trace.entries[(first + entry) & (link_trace.size - 1)];
+        memcpy(buffer + len, src + skip, n);
+        len += n;
+        index += n;
       }
+      return len;
+    });
+  response->addHeader("Content-Disposition", "attachment; filename=\"trace.bin\"");
+  request->send(response);
+}
+
+////////////////////////////////
+///   Link benchmark         ///
+////////////////////////////////
+// GET /bench returns the last results, ?run starts a new run and replies when it's done
+void onBench(AsyncWebServerRequest *request) {
+  if (!request->hasParam("run")) {
+    request->send(200, "application/json", bench.json);
+    return;
+  }
+  if (flasher.active || frameQueueCount() || !activateFlasher()) {
+    request->send(409, "text/plain", "#1;Flasher busy");
+    return;
+  }
+  bench.flash = request->hasParam("flash");
+  bench.pending = true;
+  replyWhenDone(request, "application/json", []() { return bench.pending; }, bench.json);
+}
+
+////////////////////////////////
+///   PC sampler             ///
+////////////////////////////////
+// GET /profile?run&rate=&ms= samples the running target and replies with a summary when it's done,
+// GET /profile returns the histogram of the last run as JSON, ?format=folded as "pc count" lines
+void onProfile(AsyncWebServerRequest *request) {
+  if (!request->hasParam("run")) {
+    if (profile.pending) {
+      request->send(409, "text/plain", "#1;Profile running");
+      return;
+    }
+    bool folded = request->hasParam("format") && request->getParam("format")->value() == "folded";
+    AsyncResponseStream *response = request->beginResponseStream(folded ? "text/plain" : "application/json");
+    if (!folded) {
+      response->printf("{\"status\":%d,\"rate\":%" PRIu32 ",\"ms\":%" PRIu32 ",\"samples\":%" PRIu32 ",\"missed\":%" PRIu32
+                       ",\"errors\":%" PRIu32 ",\"dropped\":%" PRIu32 ",\"sample_us\":%" PRIu32 ",\"pcs\":{",
+                       profile.status, profile.rate, profile.ms, profile.samples, profile.missed, profile.errors,
+                       profile.dropped, profile.sample_us);
+    }
+    for (uint32_t i = 0; i < profile.used; i++) {
+      const ProfileEntry* e = &profile.table[i];
+      if (folded) response->printf("0x%08" PRIx32 " %" PRIu32 "\n", e->pc, e->count);
+      else response->printf("%s\"0x%08" PRIx32 "\":%" PRIu32, i ? "," : "", e->pc, e->count);
+    }
+    if (!folded) response->print("}}");
+    request->send(response);
+    return;
+  }
+  if (flasher.active || frameQueueCount()) {
+    request->send(409, "text/plain", "#1;Flasher busy");
+    return;
+  }
+  uint32_t rate = PROFILE_DEFAULT_RATE, ms = PROFILE_DEFAULT_MS;
+  if (request->hasParam("rate")) rate = request->getParam("rate")->value().toInt();
+  if (request->hasParam("ms")) ms = request->getParam("ms")->value().toInt();
+  if (rate < 1 || rate > PROFILE_MAX_RATE || ms < 1 || ms > PROFILE_MAX_MS) {
+    request->send(400, "text/plain", "#2;Bad rate or duration");
+    return;
+  }
+  if (!activateFlasher()) {
+    request->send(409, "text/plain", "#1;Flasher busy");
+    return;
+  }
+  profile.rate = rate;
+  profile.ms = ms;
+  profile.pending = true;
+  replyWhenDone(request, "application/json", []() { return profile.pending; }, profile.json);
+}
+
+////////////////////////////////
+///   Snapshots              ///
+////////////////////////////////
+bool snapshotPath(char* path, size_t len, const String& name) {
+  if (name.length() < 1 || name.length() > SNAPSHOT_NAME_MAX) return false;
+  for (size_t i = 0; i < name.length(); i++) {
+    char c = name[i];
+    if (!isalnum(c) && c != '_' && c != '-') return false;
+  }
+  snprintf(path, len, SNAPSHOT_DIR "/%s.bin", name.c_str());
+  return true;
+}
+
+// GET /snapshot?save=name and ?restore=name reply when done, ?delete=name removes one,
+// /snapshot alone lists them
+void onSnapshot(AsyncWebServerRequest *request) {
+  char path[sizeof(SNAPSHOT_DIR) + SNAPSHOT_NAME_MAX + 8];
+  uint8_t op = request->hasParam("save") ? WLS_SAVE : request->hasParam("restore") ? WLS_RESTORE : WLS_NONE;
+  if (request->hasParam("delete")) {
+    if (!snapshotPath(path, sizeof(path), request->getParam("delete")->value())) {
+      request->send(400, "text/plain", "#3;Bad snapshot name");
+    } else if (!LittleFS.remove(path)) {
+      request->send(404, "text/plain", "#4;No such snapshot");
     } else {
-      client->text("Can't use terminal flasher is active");
-      client->close();
+      request->send(200, "text/plain", "#0;Snapshot deleted");
     }
-    break;
-  case WS_EVT_DISCONNECT:
-    // client disconnected
-    Serial.printf("ws[%s][%" PRIu32 "] disconnect\n\r", server->url(), client->id());
-    terminalDisconnect();
-    break;
-  case WS_EVT_ERROR:
-    // error was received from the other end
-    Serial.printf("ws[%s][%" PRIu32 "] error(%u): %s\n\r", server->url(), client->id(), *((uint16_t *)arg), (char *)data);
-    break;
-  case WS_EVT_PONG:
-    // pong message was received (in response to a ping request maybe)
-    Serial.printf("ws[%s][%" PRIu32 "] pong[%u]: %s\n\r", server->url(), client->id(), len, (len) ? (char *)data : "");
-    break;
-  case WS_EVT_DATA:
-    // data packet
-    AwsFrameInfo *info = (AwsFrameInfo *)arg;
-    if (info->final && info->index == 0 && info->len == len) {
-      // the whole message is in a single frame and we got all of it's data
-      Serial.printf("ws[%s][%" PRIu32 "] %s-message[%llu]: ", server->url(), client->id(), (info->opcode == WS_TEXT) ? "text" : "binary", info->len);
-      if (info->opcode == WS_TEXT && data[0] == 35) {
-        Serial.printf("%s. Sendind to terminal\n\r", (char *)data);
-        if (terminal.incomming_buf[terminal.incomming_pos] == 0) {
-          strncpy(terminal.incomming_buf, (char *)data+1, min(int(len-1), (int)sizeof(terminal.incomming_buf)));
-        }
-      } else  if (info->opcode == WS_TEXT) {
-        Serial.printf("%s\n\r", (char *)data);
-      } else {
-        for (size_t i = 0; i < info->len; i++) {
-          Serial.printf("%02x ", data[i]);
-        }
-        Serial.print("\n\r");
+    return;
+  }
+  if (op == WLS_NONE) {
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    response->print("[");
+    File dir = LittleFS.open(SNAPSHOT_DIR);
+    bool first = true;
+    if (dir && dir.isDirectory()) {
+      for (File file = dir.openNextFile(); file; file = dir.openNextFile()) {
+        String name = file.name();
+        if (!name.endsWith(".bin")) continue;
+        name = name.substring(name.lastIndexOf('/') + 1, name.length() - 4);
+        response->printf("%s{\"name\":\"%s\",\"size\":%u}", first ? "" : ",", name.c_str(), (unsigned)file.size());
+        first = false;
       }
     }
-    break;
+    response->print("]");
+    request->send(response);
+    return;
+  }
+  String name = request->getParam(op == WLS_SAVE ? "save" : "restore")->value();
+  if (!snapshotPath(path, sizeof(path), name)) {
+    request->send(400, "text/plain", "#3;Bad snapshot name");
+    return;
+  }
+  if (flasher.active || frameQueueCount() || !activateFlasher()) {
+    request->send(409, "text/plain", "#1;Flasher busy");
+    return;
   }
+  strcpy(snapshot.name, name.c_str());
+  snapshot.op = op;
+  replyWhenDone(request, "text/plain", []() { return snapshot.op != WLS_NONE; }, snapshot.reply);
 }
 
-void onFlasherEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)
-{
-  // Handle WebSocket event
-  switch (type) {
-  case WS_EVT_CONNECT:
-    // client connected
-    Serial.printf("ws[%s][%u] flasher connect\n\r", server->url(), client->id());
-    client->printf("Welcome to WebLink flasher. Your id is %" PRIu32 "", client->id());
+////////////////////////////////
+///   Personalization        ///
+////////////////////////////////
+// Manifest is a comma separated list of offset:length:source, offsets from
+// the start of the image. Value patches take the bytes of the flash
+// request's value in manifest order.
+bool personalizeParse(const char* manifest, uint32_t size, PersonalizeHeader* header) {
+  uint32_t value_len = 0;
+  memset(header, 0, sizeof(PersonalizeHeader));
+  memcpy(header->magic, "WLPI", 4);
+  header->version = PERSONALIZE_VERSION;
+  header->size = size;
+  const char* p = manifest;
+  while (*p) {
+    if (header->patch_count == PERSONALIZE_MAX_PATCHES) return false;
+    PatchEntry* patch = &header->patches[header->patch_count++];
+    char* end;
+    patch->offset = strtoul(p, &end, 0);
+    if (*end != ':') return false;
+    uint32_t length = strtoul(end + 1, &end, 0);
+    if (*end != ':') return false;
+    p = end + 1;
+    size_t name_len = strcspn(p, ",");
+    patch->source = WLPS_COUNT;
+    for (uint8_t i = 0; i < WLPS_COUNT; i++) {
+      if (strlen(patch_source_names[i]) == name_len && !strncmp(p, patch_source_names[i], name_len)) patch->source = i;
+    }
+    if (patch->source == WLPS_COUNT || length == 0 || length > patch_source_max[patch->source]) return false;
+    if (patch->offset >= size || length > size - patch->offset) return false;
+    patch->length = length;
+    if (patch->source == WLPS_VALUE) value_len += length;
+    p += name_len;
+    if (*p == ',') p++;
+  }
+  return value_len <= PERSONALIZE_VALUE_MAX;
+}
+
+// The manifest is checked against the largest image while the upload is
+// still compressed, this is the check against the real size. A stored base
+// image is patched at fixed offsets, so it has to be raw.
+bool personalizeFits(PersonalizeHeader* header, uint32_t size) {
+  if (loader.format() != IMAGE_FORMAT_RAW) return false;
+  for (uint8_t i = 0; i < header->patch_count; i++) {
+    const PatchEntry* patch = &header->patches[i];
+    if (patch->offset >= size || patch->length > size - patch->offset) return false;
+  }
+  header->size = size;
+  return true;
+}
+
+// Hex string to bytes, -1 if it isn't one or doesn't fit
+int parseHex(const char* hex, uint8_t* out, size_t max) {
+  size_t len = strlen(hex);
+  if (len % 2 || len / 2 > max) return -1;
+  for (size_t i = 0; i < len; i += 2) {
+    char byte[3] = {hex[i], hex[i + 1], 0};
+    char* end;
+    out[i / 2] = strtoul(byte, &end, 16);
+    if (*end != 0 || !isxdigit(hex[i])) return -1;
+  }
+  return len / 2;
+}
+
+uint32_t personalizeCounter() {
+  uint32_t counter = 0;
+  File file = LittleFS.open(PERSONALIZE_COUNTER, FILE_READ);
+  if (file) {
+    if (file.read((uint8_t*)&counter, sizeof(counter)) != sizeof(counter)) counter = 0;
+    file.close();
+  }
+  return counter;
+}
+
+bool personalizeSetCounter(uint32_t counter) {
+  File file = LittleFS.open(PERSONALIZE_COUNTER, FILE_WRITE, true);
+  if (!file) return false;
+  bool ok = file.write((const uint8_t*)&counter, sizeof(counter)) == sizeof(counter);
+  file.close();
+  return ok;
+}
+
+// Replies once the job is done
+void personalizeReply(AsyncWebServerRequest *request) {
+  replyWhenDone(request, "text/plain", []() { return personalize.op != WLU_NONE; }, personalize.reply);
+}
+
+// PUT /personalize/<offset>?patches= replies once the image is stored
+void onPersonalizePut(AsyncWebServerRequest *request) {
+  FlashPut* put = (FlashPut*)request->_tempObject;
+  if (put == NULL) {
+    return request->send(411, "text/plain", "#3;Content-Length required\n");
+  }
+  if (put->code) {
+    return request->send(put->code, "text/plain", String(put->message) + "\n");
+  }
+  personalizeReply(request);
+}
+
+// GET /personalize?flash[&value=hex] flashes the next unit, ?counter=N sets
+// the unit counter, ?delete removes the image, /personalize alone describes it
+void onPersonalize(AsyncWebServerRequest *request) {
+  if (flasher.active || frameQueueCount()) {
+    request->send(409, "text/plain", "#1;Flasher busy");
+    return;
+  }
+  if (request->hasParam("delete")) {
+    LittleFS.remove(PERSONALIZE_COUNTER);
+    if (!LittleFS.remove(PERSONALIZE_IMAGE)) request->send(404, "text/plain", "#4;No image");
+    else request->send(200, "text/plain", "#0;Image deleted");
+    return;
+  }
+  if (request->hasParam("counter")) {
+    if (!personalizeSetCounter(strtoul(request->getParam("counter")->value().c_str(), NULL, 0))) request->send(500, "text/plain", "#4;Counter not saved");
+    else request->send(200, "text/plain", "#0;Counter set");
+    return;
+  }
+  if (request->hasParam("flash")) {
+    int len = request->hasParam("value") ? parseHex(request->getParam("value")->value().c_str(), personalize.value, sizeof(personalize.value)) : 0;
+    if (len < 0) {
+      request->send(400, "text/plain", "#3;Bad value");
+      return;
+    }
+    personalize.value_len = len;
+    flasher.retries = request->hasParam("retries") ? request->getParam("retries")->value().toInt() : 0;
+    if (!activateFlasher()) {
+      request->send(409, "text/plain", "#1;Flasher busy");
+      return;
+    }
+    personalize.op = WLU_FLASH;
+    personalizeReply(request);
+    return;
+  }
+  PersonalizeHeader header;
+  File file = LittleFS.open(PERSONALIZE_IMAGE, FILE_READ);
+  bool ok = file && file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) && !memcmp(header.magic, "WLPI", 4);
+  if (file) file.close();
+  if (!ok) {
+    request->send(404, "text/plain", "#4;No image");
+    return;
+  }
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  response->printf("{\"offset\":%" PRIu32 ",\"size\":%" PRIu32 ",\"crc\":\"%08" PRIx32 "\",\"counter\":%" PRIu32 ",\"patches\":[",
+                   header.offset, header.size, header.crc, personalizeCounter());
+  for (uint8_t i = 0; i < header.patch_count && i < PERSONALIZE_MAX_PATCHES; i++) {
+    const PatchEntry* patch = &header.patches[i];
+    response->printf("%s{\"offset\":%" PRIu32 ",\"length\":%u,\"source\":\"%s\"}", i ? "," : "", patch->offset, patch->length,
+                     patch->source < WLPS_COUNT ? patch_source_names[patch->source] : "?");
+  }
+  response->print("]}");
+  request->send(response);
+}
+
+////////////////////////////////
+///   Watch list             ///
+////////////////////////////////
+// GET /watch?vars=0x20000010:4,0x20000020:2&rate=200 starts sampling, ?stop stops it,
+// /watch alone returns the state. Records stream on the /watch WebSocket.
+void onWatch(AsyncWebServerRequest *request) {
+  if (request->hasParam("stop")) {
+    watch.stop = true;
+    request->send(200, "text/plain", "#0;Stopped");
+    return;
+  }
+  if (request->hasParam("vars")) {
+    if (watch.start) {
+      request->send(409, "text/plain", "#1;Watch starting");
+      return;
+    }
+    String list = request->getParam("vars")->value();
+    uint32_t rate = request->hasParam("rate") ? request->getParam("rate")->value().toInt() : WATCH_DEFAULT_RATE;
+    const char* p = list.c_str();
+    uint8_t count = 0;
+    bool ok = rate >= 1 && rate <= WATCH_MAX_RATE;
+    while (ok && *p) {
+      char* end;
+      WatchVar* v = &watch.new_vars[count];
+      v->address = strtoul(p, &end, 0);
+      v->size = 4;
+      if (*end == ':') v->size = strtoul(end + 1, &end, 0);
+      // Naturally aligned, so a variable never spans two words
+      ok = end != p && count < WATCH_MAX_VARS && (v->size == 1 || v->size == 2 || v->size == 4) &&
+           !(v->address & (v->size - 1)) && (*end == ',' || *end == 0);
+      p = *end ? end + 1 : end;
+      count++;
+    }
+    if (!ok || !count) {
+      request->send(400, "text/plain", "#3;Bad watch list");
+      return;
+    }
+    watch.new_count = count;
+    watch.new_rate = rate;
+    watch.start = true;
+    request->send(200, "text/plain", "#0;Watching");
+    return;
+  }
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  response->printf("{\"running\":%s,\"status\":%d,\"mode\":\"%s\",\"rate\":%" PRIu32 ",\"samples\":%" PRIu32 ",\"missed\":%" PRIu32
+                   ",\"errors\":%" PRIu32 ",\"ranges\":%u,\"words\":%" PRIu32 ",\"record_size\":%u,\"records\":%" PRIu32 ",\"vars\":[",
+                   watch.running ? "true" : "false", watch.status, watch.sysbus ? "sysbus" : "halt", watch.rate, watch.samples,
+                   watch.missed, watch.errors, watch.range_count, watch.words, watch.record_size, min((uint32_t)watch.head, watch.capacity));
+  for (uint8_t i = 0; i < watch.count; i++) {
+    response->printf("%s{\"address\":\"0x%08" PRIx32 "\",\"size\":%u}", i ? "," : "", watch.vars[i].address, watch.vars[i].size);
+  }
+  response->print("]}");
+  request->send(response);
+}
+
+uint32_t watchValue(const uint8_t* record, uint8_t var) {
+  uint32_t value = 0;
+  uint16_t offset = 4;
+  for (uint8_t i = 0; i < var; i++) offset += watch.vars[i].size;
+  memcpy(&value, record + offset, watch.vars[var].size);
+  return value;
+}
+
+// GET /watch.csv, what's still in the ring buffer with a header of variable addresses
+void onWatchCSV(AsyncWebServerRequest *request) {
+  uint32_t head = watch.head;
+  uint32_t next = head > watch.capacity ? head - watch.capacity : 0;
+  uint32_t generation = watch.generation;
+  AsyncWebServerResponse *response = request->beginChunkedResponse("text/csv", [next, head, generation](uint8_t *buffer, size_t maxLen, size_t index) mutable -> size_t {
+    char line[WATCH_MAX_VARS * 11 + 16];
+    size_t used = 0;
+    if (generation != watch.generation) return 0;
+    if (index == 0) {
+      int len = snprintf(line, sizeof(line), "us");
+      for (uint8_t i = 0; i < watch.count; i++) len += snprintf(line + len, sizeof(line) - len, ",0x%08" PRIx32, watch.vars[i].address);
+      line[len++] = '\n';
+      if ((size_t)len > maxLen) return 0;
+      memcpy(buffer, line, len);
+      used = len;
+    }
+    // Records overwritten since the download started are skipped
+    if (watch.head - next > watch.capacity) next = watch.head - watch.capacity;
+    while (next < head) {
+      const uint8_t* record = watch.buf + (next % watch.capacity) * watch.record_size;
+      uint32_t us;
+      memcpy(&us, record, 4);
+      int len = snprintf(line, sizeof(line), "%" PRIu32, us);
+      for (uint8_t i = 0; i < watch.count; i++) len += snprintf(line + len, sizeof(line) - len, ",%" PRIu32, watchValue(record, i));
+      line[len++] = '\n';
+      if (used + len > maxLen) break;
+      memcpy(buffer + used, line, len);
+      used += len;
+      next++;
+    }
+    return used;
+  });
+  request->send(response);
+}
+
+////////////////////////////////
+///   Memory dump            ///
+////////////////////////////////
+// Called with the flasher active, the read starts from handleFlasher()
+void dumpBegin(bool http, uint32_t offset, uint32_t size) {
+  dump.http = http;
+  dump.id++;
+  dump.ws_client = !http && flasher_ws.client != NULL ? flasher_ws.client->id() : 0;
+  dump.offset = offset;
+  dump.size = size;
+  dump.read = 0;
+  dump.sent = 0;
+  dump.cancelled = false;
+  dump.state = WLD_STREAMING;
+  flasher.offset = offset;
+  flasher.size = size;
+  flasher.will_read = true;
+}
+
+void dumpEnd(WLDumpState_t state) {
+  if (!gdb.attached) HaltMode(&link_state, HALT_MODE_RESUME);
+  if (state == WLD_DONE) {
+    Serial.printf("Read %" PRIu32 " bytes from 0x%08" PRIx32 "\n\r", dump.size, dump.offset);
+  } else {
+    Serial.printf("Read failed at 0x%08" PRIx32 "%s\n\r", dump.offset + dump.read, dump.cancelled ? ", cancelled" : "");
+  }
+  if (!dump.http && flasher_ws.active) flasherReply(state == WLD_DONE ? "#0;Download complete" : "#4;Failed to read memory");
+  dump.state = state;
+  resetFlasher();
+}
+
+// Clients get the next chunk once their send queue has room
+bool dumpClientReady() {
+  if (dump.http) return dump.read - dump.sent <= DUMP_BUFFER_SIZE - DUMP_CHUNK_SIZE;
+  if (flasher_ws.tcp_client != NULL) return tcpSpace(flasher_ws.tcp_client) >= DUMP_CHUNK_SIZE;
+  AsyncWebSocketClient* client = flash_ws.client(dump.ws_client);
+  if (client == NULL) dump.cancelled = true;
+  return client != NULL && !client->queueIsFull();
+}
+
+// Chunks end on DUMP_CHUNK_SIZE boundaries of the target address, so only
+// the first one can be unaligned and a chunk never wraps around the ring
+bool dumpChunk() {
+  uint32_t address = dump.offset + dump.read;
+  uint32_t len = min(dump.size - dump.read, (uint32_t)(DUMP_CHUNK_SIZE - address % DUMP_CHUNK_SIZE));
+  uint8_t* chunk = dump.buf + (dump.http ? address % DUMP_BUFFER_SIZE : 0);
+  flasher.watchdog = millis();
+  if (ReadBinaryBlob(&link_state, address, len, chunk)) return false;
+  if (!dump.http) {
+    if (flasher_ws.tcp_client != NULL) {
+      if (!tcpWrite(flasher_ws.tcp_client, chunk, len)) dump.cancelled = true;
+    } else {
+      AsyncWebSocketClient* client = flash_ws.client(dump.ws_client);
+      if (client != NULL) client->binary(chunk, len);
+    }
+  }
+  dump.read += len;
+  return true;
+}
+
+void handleDump() {
+  if (dump.state != WLD_STREAMING || flasher.will_read) return;
+  if (!flasher.active || dump.cancelled) {
+    dumpEnd(WLD_FAILED);
+    return;
+  }
+  for (int i = 0; i < DUMP_BUFFER_SIZE / DUMP_CHUNK_SIZE && dump.read < dump.size && dumpClientReady(); i++) {
+    if (!dumpChunk()) {
+      dumpEnd(WLD_FAILED);
+      return;
+    }
+  }
+  // The HTTP response is done once it has taken everything from the buffer
+  if (dump.read >= dump.size && (!dump.http || dump.sent >= dump.read)) dumpEnd(WLD_DONE);
+}
+
+void onRead(AsyncWebServerRequest *request) {
+  if (!request->hasParam("offset") || !request->hasParam("size")) {
+    request->send(400, "text/plain", "#3;Offset or size missing");
+    return;
+  }
+  char* end;
+  uint32_t offset = strtoul(request->getParam("offset")->value().c_str(), &end, 0);
+  bool bad = *end != 0;
+  uint32_t size = strtoul(request->getParam("size")->value().c_str(), &end, 0);
+  if (bad || *end != 0 || size == 0 || offset + size < offset) {
+    request->send(400, "text/plain", "#3;Bad offset or size");
+    return;
+  }
+  if (flasher.active || frameQueueCount() || !activateFlasher()) {
+    request->send(409, "text/plain", "#1;Flasher busy");
+    return;
+  }
+  flasher.status = WLF_UPDATING;
+  dumpBegin(true, offset, size);
+  uint32_t id = dump.id;
+  request->onDisconnect([id]() {
+    if (dump.id == id) dump.cancelled = true;
+  });
+  // A failed read ends the body early
+  AsyncWebServerResponse *response = request->beginChunkedResponse("application/octet-stream", [](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+    uint32_t avail = dump.read - dump.sent;
+    if (avail == 0) return dump.state == WLD_STREAMING ? RESPONSE_TRY_AGAIN : 0;
+    uint32_t pos = (dump.offset + dump.sent) % DUMP_BUFFER_SIZE;
+    size_t len = min((size_t)avail, min(maxLen, (size_t)(DUMP_BUFFER_SIZE - pos)));
+    memcpy(buffer, dump.buf + pos, len);
+    dump.sent += len;
+    return len;
+  });
+  response->addHeader("Connection", "close");
+  request->send(response);
+}
+
+void onTerminalEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)
+{
+  // Handle WebSocket event
+  switch (type) {
+  case WS_EVT_CONNECT:
+    // client connected
+    Serial.printf("ws[%s][%u] connect\n\r", server->url(), client->id());
+    client->printf("Hello Client %u" PRIu32 " :)", client->id());
+    if (config.uart == false){
+      if (commandBusy()) {
+        // The flasher, gdb or the watch owns the link, polling will start as soon as it's done
+        terminal.connected = true;
+      } else if (initLink() > 0) {
+        terminal.connected = true;
+      } else {
+        terminal.connected = false;
+        client->printf("Failed to connect to ch32v003");
+        client->close();
+      }
+    } else {
+      terminal.connected = true;
+      Serial.println("Using UART for terminal");
+    }
+    break;
+  case WS_EVT_DISCONNECT:
+    // client disconnected
+    Serial.printf("ws[%s][%" PRIu32 "] disconnect\n\r", server->url(), client->id());
+    if (tcpTerminalCount() == 0) terminalDisconnect();
+    break;
+  case WS_EVT_ERROR:
+    // error was received from the other end
+    Serial.printf("ws[%s][%" PRIu32 "] error(%u): %s\n\r", server->url(), client->id(), *((uint16_t *)arg), (char *)data);
+    break;
+  case WS_EVT_PONG:
+    // pong message was received (in response to a ping request maybe)
+    Serial.printf("ws[%s][%" PRIu32 "] pong[%u]: %s\n\r", server->url(), client->id(), len, (len) ? (char *)data : "");
+    break;
+  case WS_EVT_DATA:
+    // data packet
+    AwsFrameInfo *info = (AwsFrameInfo *)arg;
+    if (info->final && info->index == 0 && info->len == len) {
+      // the whole message is in a single frame and we got all of it's data
+      Serial.printf("ws[%s][%" PRIu32 "] %s-message[%llu]: ", server->url(), client->id(), (info->opcode == WS_TEXT) ? "text" : "binary", info->len);
+      if (info->opcode == WS_TEXT && data[0] == 35) {
+        Serial.printf("%s. Sendind to terminal\n\r", (char *)data);
+        if (terminal.incomming_buf[terminal.incomming_pos] == 0) {
+          strncpy(terminal.incomming_buf, (char *)data+1, min(int(len-1), (int)sizeof(terminal.incomming_buf)));
+        } else {
+          metrics.terminal_overflows++;
+        }
+      } else  if (info->opcode == WS_TEXT) {
+        Serial.printf("%s\n\r", (char *)data);
+      } else {
+        for (size_t i = 0; i < info->len; i++) {
+          Serial.printf("%02x ", data[i]);
+        }
+        Serial.print("\n\r");
+      }
+    }
+    break;
+  }
+}
+
+// Parses and runs a "#command;argument" flasher command, replies go to the
+// client set in flasher_ws by the caller.
+void flasherCommand(char* buffer) {
+  char* token;
+  uint32_t datareg, value;
+  if (!activateFlasher(true)) {
+    flasherReply("#1;Flasher busy");
+    return;
+  }
+  if (initLink() < 1) {
+    flasherReply("#2;Failed to init link");
+    resetFlasher();
+    return;
+  }
+  switch (buffer[1])
+  {
+  case '3':
+  case '5':
+  case 't':
+  case 'f':
+  case 'U':
+    flasherReply("#8;Unimplemented");
+    resetFlasher();
+    break;
+  case 'b': //reBoot
+    flasher_ws.current_command = WLF_RESET;
+    HaltMode(&link_state, HALT_MODE_REBOOT);
+    flasherReply("#0;Reboted");
+    resetFlasher();
+    break;
+  case 'B': //reBoot into Bootloader
+    flasher_ws.current_command = WLF_RESET;
+    HaltMode(&link_state, HALT_MODE_GO_TO_BOOTLOADER);
+    flasherReply("#0;Reboted to bootloader");
+    resetFlasher();
+    break;
+  case 'e': //rEsume
+    flasher_ws.current_command = WLF_RESET;
+    HaltMode(&link_state, HALT_MODE_RESUME);
+    flasherReply("#0;Resumed");
+    resetFlasher();
+    break;
+  case 'a': //Reboot into Halt
+    flasher_ws.current_command = WLF_HALT;
+    HaltMode(&link_state, HALT_MODE_HALT_AND_RESET);
+    flasherReply("#0;Reboted to halt");
+    resetFlasher();
+    break;
+  case 'A': // Halt without reboot
+    flasher_ws.current_command = WLF_HALT;
+    HaltMode(&link_state, HALT_MODE_HALT_BUT_NO_RESET);
+    flasherReply("#0;Halted");
+    resetFlasher();
+    break;
+  case 'd': // disable NRST pin (turn it into a GPIO)
+    // HaltMode(&link_state, HALT_MODE_HALT_AND_RESET);
+    // ConfigureNRSTAsGPIO(&link_state, 0);
+    // flasherReply("#0;NRST disabled");
+    // resetFlasher();
+    // break;
+  case 'D':
+    // HaltMode(&link_state, HALT_MODE_HALT_AND_RESET);
+    // ConfigureNRSTAsGPIO(&link_state, 1);
+    // flasherReply("#0;NRST enabled");
+    // resetFlasher();
+    // break;
+  case 'p':
+    // HaltMode(&link_state, HALT_MODE_HALT_AND_RESET);
+    // ConfigureReadProtection(&link_state, 0);
+    // flasherReply("#0;Read protection off");
+    // resetFlasher();
+    // break;
+  case 'P':
+    // HaltMode(&link_state, HALT_MODE_HALT_AND_RESET);
+    // flasherReply("#0;Read protection on");
+    // ConfigureReadProtection(&link_state, 1);
+    flasherReply("#8;Unimplemented");
+    resetFlasher();
+  case 's':
+    flasher_ws.current_command = WLF_DEBUG;
+    token = strtok(buffer, ";");
+    token = strtok(NULL, ";");
+    if (token == NULL) {
+      flasherReply("#3;Register missing");
+      resetFlasher();
+      break;
+    }
+    datareg = atoi(token);
+    token = strtok(NULL, ";");
+    if (token == NULL) {
+      flasherReply("#3;Value missing");
+      resetFlasher();
+      break;
+    }
+    value = atoi(token);
+    MCFWriteReg32(&link_state, datareg, value);
+    flasherReply("#0;Register written");
+    resetFlasher();
+    break;
+  case 'm': {
+    flasher_ws.current_command = WLF_DEBUG;
+    token = strtok(buffer, ";");
+    token = strtok(NULL, ";");
+    if (token == NULL) {
+      flasherReply("#3;Register missing");
+      resetFlasher();
+      break;
+    }
+    datareg = atoi(token);
+    int ret = MCFReadReg32(&link_state, datareg, &value);
+    flasherReply("#0;%" PRIu32 ";%" PRIu32 ";%d", datareg, value, ret);
+    resetFlasher();
+    } break;
+  case 'w':
+    token = strtok(buffer, ";");
+    token = strtok(NULL, ";");
+    if (token == NULL) {
+      flasherReply("#3;Offset missing");
+      resetFlasher();
+      break;
+    }
+    flasher.offset = atoi(token);
+    token = strtok(NULL, ";");
+    if (token == NULL) {
+      flasherReply("#3;Size missing");
+      resetFlasher();
+      break;
+    }
+    flasher.size = atoi(token);
+    if (!loader.begin(flasher.size)) {
+      flasherReply("#3;Binary is too big");
+      resetFlasher();
+      break;
+    }
+    token = strtok(NULL, ";");
+    if (token != NULL) {
+      flasher.retries = atoi(token);
+      token = strtok(NULL, ";");
+      if (token != NULL) strncpy(flasher.name, token, 64);
+    }
+    flasher.status = WLF_UPLOADING;
+    flasher_ws.current_command = WLF_FLASH;
+    flasherReply("#0;Ready for upload");
+    break;
+  case 'x': // Same as #w, but the binary is loaded into SRAM and run from there
+    token = strtok(buffer, ";");
+    token = strtok(NULL, ";");
+    if (token == NULL) {
+      flasherReply("#3;Address missing");
+      resetFlasher();
+      break;
+    }
+    flasher.offset = strtoul(token, NULL, 0);
+    token = strtok(NULL, ";");
+    if (token == NULL) {
+      flasherReply("#3;Size missing");
+      resetFlasher();
+      break;
+    }
+    flasher.size = strtoul(token, NULL, 0);
+    if ((flasher.offset & 0xff000000) != DEFAULT_RUN_ADDRESS || !loader.begin(flasher.size)) {
+      flasherReply("#3;Binary doesn't fit in SRAM");
+      resetFlasher();
+      break;
+    }
+    flasher.run = true;
+    flasher.status = WLF_UPLOADING;
+    flasher_ws.current_command = WLF_FLASH;
+    flasherReply("#0;Ready for upload");
+    break;
+  case 'l': { // Memory loop run by the target: #l;op;address;bytes[;argument[;step]]
+    static const char* ops[] = {"fill", "verify", "copy", "compare", "crc"};
+    static const uint8_t opcodes[] = {WLF_OP_FILL, WLF_OP_VERIFY, WLF_OP_COPY, WLF_OP_COMPARE, WLF_OP_CHECKSUM};
+    uint32_t args[4] = {0, 0, 0, 0};
+    int op = -1, count = 0;
+    flasher_ws.current_command = WLF_DEBUG;
+    token = strtok(buffer, ";");
+    token = strtok(NULL, ";");
+    for (int i = 0; token != NULL && i < 5; i++) {
+      if (!strcmp(token, ops[i])) op = i;
+    }
+    while (op >= 0 && count < 4 && (token = strtok(NULL, ";")) != NULL) args[count++] = strtoul(token, NULL, 0);
+    if (op < 0 || count < (opcodes[op] == WLF_OP_CHECKSUM ? 2 : 3)) {
+      flasherReply("#3;Usage: #l;fill|verify|copy|compare|crc;address;bytes[;argument[;step]]");
+      resetFlasher();
+      break;
+    }
+    // A loop over a big range takes a while, the reply comes from loop()
+    memory_loop.op = opcodes[op];
+    memcpy(memory_loop.args, args, sizeof(args));
+    memory_loop.pending = true;
+    } break;
+  case 'r':
+    flasher_ws.current_command = WLF_READ;
+    token = strtok(buffer, ";");
+    token = strtok(NULL, ";");
+    if (token == NULL) {
+      flasherReply("#3;Offset missing");
+      resetFlasher();
+      break;
+    }
+    flasher.offset = strtoul(token, NULL, 10);
+    token = strtok(NULL, ";");
+    if (token == NULL) {
+      flasherReply("#3;Size missing");
+      resetFlasher();
+      break;
+    }
+    flasher.size = strtoul(token, NULL, 10);
+    if (flasher.size == 0 || flasher.offset + flasher.size < flasher.offset) {
+      flasherReply("#3;Memory value request out of range");
+      resetFlasher();
+      break;
+    }
+    // Disconnecting doesn't reset the flasher, handleDump() notices the client is gone
+    flasher.status = WLF_UPDATING;
+    flasher_ws.current_command = WLF_READ;
+    flasherReply("#0;Ready for download");
+    dumpBegin(false, flasher.offset, flasher.size);
+    break;
+  case 'u':
+    flasher_ws.current_command = WLF_UNBRICK;
+  case 'E':
+    flasher_ws.current_command = WLF_ERASE;
+    flasher.will_unbrick = true;
+    break;
+  case 'i':
+    flasher_ws.current_command = WLF_INFO;
+    if (chipInfo(buffer)) {
+      Serial.println("Failed to read info");
+      flasherReply("#4;Failed to read info");
+    } else {
+      Serial.println(buffer);
+      flasherReply("%s", buffer);
+    }
+    resetFlasher();
+    break;
+
+  default:
+    resetFlasher();
+    flasherReply("#9;Unknown command");
+    break;
+  }
+}
+
+////////////////////////////////
+///   Framed protocol        ///
+////////////////////////////////
+int frameQueueCount() {
+  return (frame_queue.head + FRAME_QUEUE_SIZE - frame_queue.tail) % FRAME_QUEUE_SIZE;
+}
+
+// Sends a reply to the client that made the request. Payload, if any, has to
+// be placed in buf right after the space reserved for the header.
+void frameSend(uint32_t ws_client, AsyncClient* tcp_client, const WLFrameHeader_t* request, uint8_t status, uint8_t* buf, uint32_t len) {
+  WLFrameHeader_t header;
+  uint8_t* reply = buf ? buf : (uint8_t*)&header;
+  WLFrameHeader_t* reply_header = (WLFrameHeader_t*)reply;
+  *reply_header = *request;
+  reply_header->magic = WLF_FRAME_MAGIC;
+  reply_header->version = WLF_FRAME_VERSION;
+  reply_header->opcode |= WLF_FRAME_REPLY;
+  reply_header->status = status;
+  reply_header->length = buf ? len : 0;
+  size_t total = sizeof(WLFrameHeader_t) + reply_header->length;
+  if (tcp_client != NULL) {
+    tcpWrite(tcp_client, reply, total);
+  } else if (ws_client) {
+    AsyncWebSocketClient* client = flash_ws.client(ws_client);
+    if (client != NULL) client->binary(reply, total);
+  }
+}
+
+void frameReply(const FrameJob* job, uint8_t status, uint8_t* buf = NULL, uint32_t len = 0) {
+  frameSend(job->ws_client, job->tcp_client, &job->header, status, buf, len);
+}
+
+WLFrameAssembler* frameAssemblerFor(uint32_t ws_client) {
+  int slot = 0;
+  for (int i = 0; i < TCP_MAX_CLIENTS; i++) {
+    if (frame_queue.ws_assembler_ids[i] == ws_client) return &frame_queue.ws_assemblers[i];
+    if (frame_queue.ws_assembler_ids[i] == 0) slot = i;
+  }
+  // Out of slots means one of the owners is gone without a disconnect event
+  WLFrameAssembler* assembler = &frame_queue.ws_assemblers[slot];
+  free(assembler->payload);
+  *assembler = WLFrameAssembler();
+  frame_queue.ws_assembler_ids[slot] = ws_client;
+  return assembler;
+}
+
+void frameEnqueue(WLFrameAssembler* assembler, uint32_t ws_client, AsyncClient* tcp_client) {
+  FrameJob* job = &frame_queue.jobs[frame_queue.head];
+  job->header = assembler->header;
+  job->payload = assembler->payload;
+  job->ws_client = ws_client;
+  job->tcp_client = tcp_client;
+  assembler->payload = NULL;
+  frame_queue.head = (frame_queue.head + 1) % FRAME_QUEUE_SIZE;
+}
+
+// Consumes bytes up to the end of the current frame and queues it once it's
+// complete. Frames that can't be accepted are answered right away.
+size_t frameFeed(WLFrameAssembler* assembler, const uint8_t* data, size_t len, uint32_t ws_client, AsyncClient* tcp_client) {
+  size_t used = 0;
+  WLFrameHeader_t* header = &assembler->header;
+  if (assembler->skip) {
+    used = min(len, (size_t)assembler->skip);
+    assembler->skip -= used;
+    return used;
+  }
+  if (assembler->pos < sizeof(WLFrameHeader_t)) {
+    used = min(len, sizeof(WLFrameHeader_t) - assembler->pos);
+    memcpy((uint8_t*)header + assembler->pos, data, used);
+    assembler->pos += used;
+    if (assembler->pos < sizeof(WLFrameHeader_t)) return used;
+    if (header->magic != WLF_FRAME_MAGIC || header->version != WLF_FRAME_VERSION) {
+      // Can't tell where the next frame starts, drop the rest of this data
+      frameSend(ws_client, tcp_client, header, WLF_STATUS_BAD_ARGUMENT, NULL, 0);
+      assembler->pos = 0;
+      return len;
+    }
+    uint8_t status = WLF_STATUS_OK;
+    uint32_t payload_len = frameHasPayload(header->opcode) ? header->length : 0;
+    if (header->length > FRAME_MAX_LENGTH) {
+      status = WLF_STATUS_BAD_ARGUMENT;
+    } else if (frameQueueCount() == FRAME_QUEUE_SIZE - 1 || frame_queue.pending_bytes + payload_len > FRAME_QUEUE_MAX_BYTES) {
+      status = WLF_STATUS_BUSY;
+    } else if (payload_len) {
+      assembler->payload = (uint8_t*)malloc(payload_len);
+      if (assembler->payload == NULL) status = WLF_STATUS_BUSY;
+    }
+    if (status != WLF_STATUS_OK) {
+      frameSend(ws_client, tcp_client, header, status, NULL, 0);
+      assembler->pos = 0;
+      assembler->skip = payload_len;
+      return used;
+    }
+    frame_queue.pending_bytes += payload_len;
+    data += used;
+    len -= used;
+  }
+  uint32_t payload_pos = assembler->pos - sizeof(WLFrameHeader_t);
+  uint32_t payload_len = frameHasPayload(header->opcode) ? header->length : 0;
+  size_t chunk = min(len, (size_t)(payload_len - payload_pos));
+  if (chunk) memcpy(assembler->payload + payload_pos, data, chunk);
+  assembler->pos += chunk;
+  used += chunk;
+  if (payload_pos + chunk == payload_len) {
+    frameEnqueue(assembler, ws_client, tcp_client);
+    assembler->pos = 0;
+  }
+  return used;
+}
+
+// Replies can't be delivered to a client that is gone, the jobs still run
+void frameDropClient(uint32_t ws_client, AsyncClient* tcp_client) {
+  for (int i = 0; i < FRAME_QUEUE_SIZE; i++) {
+    if (ws_client && frame_queue.jobs[i].ws_client == ws_client) frame_queue.jobs[i].ws_client = 0;
+    if (tcp_client && frame_queue.jobs[i].tcp_client == tcp_client) frame_queue.jobs[i].tcp_client = NULL;
+  }
+  if (!ws_client) return;
+  for (int i = 0; i < TCP_MAX_CLIENTS; i++) {
+    if (frame_queue.ws_assembler_ids[i] == ws_client) {
+      free(frame_queue.ws_assemblers[i].payload);
+      frame_queue.ws_assemblers[i] = WLFrameAssembler();
+      frame_queue.ws_assembler_ids[i] = 0;
+    }
+  }
+}
+
+void onFlasherEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)
+{
+  // Handle WebSocket event
+  switch (type) {
+  case WS_EVT_CONNECT:
+    // client connected
+    Serial.printf("ws[%s][%u] flasher connect\n\r", server->url(), client->id());
+    client->printf("Welcome to WebLink flasher. Your id is %" PRIu32 "", client->id());
     break;
   case WS_EVT_DISCONNECT:
     // client disconnected
     Serial.printf("ws[%s][%" PRIu32 "] flasher disconnect\n\r", server->url(), client->id());
+    frameDropClient(client->id(), NULL);
     break;
   case WS_EVT_ERROR:
     // error was received from the other end
@@ -371,252 +2100,792 @@ void onFlasherEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEve
   case WS_EVT_DATA:
     // data packet
     AwsFrameInfo *info = (AwsFrameInfo *)arg;
+    // Binary messages outside of a "#w" upload carry framed requests
+    if (info->message_opcode == WS_BINARY && !(flasher_ws.active && flasher.status == WLF_UPLOADING && client == flasher_ws.client)) {
+      WLFrameAssembler* assembler = frameAssemblerFor(client->id());
+      size_t used = 0;
+      while (used < len) {
+        used += frameFeed(assembler, data + used, len - used, client->id(), NULL);
+      }
+      break;
+    }
     if (info->final && info->index == 0 && info->len == len) {
       // the whole message is in a single frame and we got all of it's data
       Serial.printf("ws[%s][%" PRIu32 "] %s-message[%llu]: ", server->url(), client->id(), (info->opcode == WS_TEXT) ? "text" : "binary", info->len);
       if (info->opcode == WS_TEXT) {
         Serial.printf("%s\n\r", (char *)data);
-        char buffer[74];
-        char* token;
-        uint32_t datareg, value;
+        char buffer[96];
         strncpy(buffer, (char *)data, 64);
         // Serial.println(buffer);
         if (buffer[0] == '#') {
           Serial.printf("[ws] Got a command: %s\n\r", buffer);
-          if (flasher.active || flasher_ws.active) {
-            client->printf("#1;Flasher busy");
+          const char* busy = commandBusy();
+          if (busy) {
+            client->printf("#1;%s", busy);
             break;
           }
-          if (initLink() < 1) {
-            client->text("#2;Failed to init link");
-            break;
-          };
           flasher_ws.client = client;
-          activateFlasher(true);
-          switch (buffer[1])
-          {
-          case '3':
-          case '5':
-          case 't':
-          case 'f':
-          case 'U':
-            client->printf("#8;Unimplemented");
-            resetFlasher();
-            break;
-          case 'b': //reBoot
-            flasher_ws.current_command = WLF_RESET;
-            HaltMode(&link_state, HALT_MODE_REBOOT);
-            client->text("#0;Reboted");
-            resetFlasher();
-            break;
-          case 'B': //reBoot into Bootloader
-            flasher_ws.current_command = WLF_RESET;
-            HaltMode(&link_state, HALT_MODE_GO_TO_BOOTLOADER);
-            client->text("#0;Reboted to bootloader");
-            resetFlasher();
-            break;
-          case 'e': //rEsume
-            flasher_ws.current_command = WLF_RESET;
-            HaltMode(&link_state, HALT_MODE_RESUME);
-            client->text("#0;Resumed");
-            resetFlasher();
-            break;
-          case 'a': //Reboot into Halt
-            flasher_ws.current_command = WLF_HALT;
-            HaltMode(&link_state, HALT_MODE_HALT_AND_RESET);
-            client->text("#0;Reboted to halt");
-            resetFlasher();
-            break;
-          case 'A': // Halt without reboot
-            flasher_ws.current_command = WLF_HALT;
-            HaltMode(&link_state, HALT_MODE_HALT_BUT_NO_RESET);
-            client->text("#0;Halted");
-            resetFlasher();
-            break;
-          case 'd': // disable NRST pin (turn it into a GPIO)
-            // HaltMode(&link_state, HALT_MODE_HALT_AND_RESET);
-            // ConfigureNRSTAsGPIO(&link_state, 0);
-            // client->text("#0;NRST disabled");
-            // resetFlasher();
-            // break;
-          case 'D':
-            // HaltMode(&link_state, HALT_MODE_HALT_AND_RESET);
-            // ConfigureNRSTAsGPIO(&link_state, 1);
-            // client->text("#0;NRST enabled");
-            // resetFlasher();
-            // break;
-          case 'p':
-            // HaltMode(&link_state, HALT_MODE_HALT_AND_RESET);
-            // ConfigureReadProtection(&link_state, 0);
-            // client->text("#0;Read protection off");
-            // resetFlasher();
-            // break;
-          case 'P':
-            // HaltMode(&link_state, HALT_MODE_HALT_AND_RESET);
-            // client->text("#0;Read protection on");
-            // ConfigureReadProtection(&link_state, 1);
-            client->text("#8;Unimplemented");
-            resetFlasher();
-          case 's':
-            flasher_ws.current_command = WLF_DEBUG;
-            token = strtok(buffer, ";");
-            token = strtok(NULL, ";");
-            if (token == NULL) {
-              client->text("#3;Register missing");
-              resetFlasher();
-              break;
-            }
-            datareg = atoi(token);
-            token = strtok(NULL, ";");
-            if (token == NULL) {
-              client->text("#3;Value missing");
-              resetFlasher();
-              break;
-            }
-            value = atoi(token);
-            MCFWriteReg32(&link_state, datareg, value);
-            client->text("#0;Register written");
-            resetFlasher();
-            break;
-          case 'm': {
-            flasher_ws.current_command = WLF_DEBUG;
-            token = strtok(buffer, ";");
-            token = strtok(NULL, ";");
-            if (token == NULL) {
-              client->text("#3;Register missing");
-              resetFlasher();
-              break;
-            }
-            datareg = atoi(token);
-            int ret = MCFReadReg32(&link_state, datareg, &value);
-            client->printf("#0;%" PRIu32 ";%" PRIu32 ";%d", datareg, value, ret);
-            resetFlasher();
-            } break;
-          case 'w':
-            token = strtok(buffer, ";");
-            token = strtok(NULL, ";");
-            if (token == NULL) {
-              client->printf("#3;Offset missing");
-              resetFlasher();
-              break;
-            }
-            flasher.offset = atoi(token);
-            token = strtok(NULL, ";");
-            if (token == NULL) {
-              client->printf("#3;Size missing");
-              resetFlasher();
-              break;
-            }
-            flasher.size = atoi(token);
-            if (flasher.size > MAX_BINARY_SIZE) {
-              client->printf("#3;Binary is too big");
-              resetFlasher();
-              break;
-            }
-            token = strtok(NULL, ";");
-            if (token != NULL) {
-              flasher.retries = atoi(token);
-              token = strtok(NULL, ";");
-              if (token != NULL) strncpy(flasher.name, token, 64);
-            }
-            flasher.status = WLF_UPLOADING;
-            flasher_ws.current_command = WLF_FLASH;
-            client->printf("#0;Ready for upload");
-            break;
-          case 'r':
-            flasher_ws.current_command = WLF_READ;
-            token = strtok(buffer, ";");
-            token = strtok(NULL, ";");
-            if (token == NULL) {
-              client->printf("#3;Offset missing");
-              resetFlasher();
-              break;
-            }
-            flasher.offset = atoi(token);
-            token = strtok(NULL, ";");
-            if (token == NULL) {
-              client->printf("#3;Size missing");
-              resetFlasher();
-              break;
-            }
-            flasher.size = atoi(token);
-            if(flasher.offset > 0xffffffff || flasher.size > 0xffffffff ) {
-            // if (flasher.size > MAX_BINARY_SIZE) {
-              client->printf("#3;Memory value request out of range");
-              resetFlasher();
-              break;
-            }
-            flasher.status = WLF_UPLOADING;
-            flasher_ws.current_command = WLF_READ;
-            client->printf("#0;Ready for download");
-            flasher.will_read = true;
-            break;
-          case 'u':
-            flasher_ws.current_command = WLF_UNBRICK;
-          case 'E':
-            flasher_ws.current_command = WLF_ERASE;
-            flasher.will_unbrick = true;
-            break;
-          case 'i':
-            flasher_ws.current_command = WLF_INFO;
-            if (chipInfo(buffer)) {
-              Serial.println("Failed to read info");
-              client->printf("#4;Failed to read info");
-            } else {
-              Serial.println(buffer);
-              client->text(buffer);
-            }
-            resetFlasher();
-            break;
-
-          default:
-            resetFlasher();
-            client->printf("#9;Unknown command");
-            break;
-          }
+          flasher_ws.tcp_client = NULL;
+          flasherCommand(buffer);
         }
       } else  if (info->opcode == WS_BINARY && flasher_ws.active && flasher.status == WLF_UPLOADING && client == flasher_ws.client) {
         Serial.println("Got binary in one message");
         flasher.watchdog = millis();
-        if (len == flasher.size) {
-          memcpy(binary_buf, data, len);
-          printf(flasher.message, "%d/%" PRIu32 "", (int)(len), flasher.size);
-          Serial.println(flasher.message);
-          flasher.will_flash = true;
-          flasher.status == WLF_UPDATING;
-          client->printf("#0;Will flash");
-        } else {
+        // uploadFinish() changes the size to the image's
+        if (len != flasher.size) {
           resetFlasher();
           flasher.error = WLF_UPLOAD_ERROR;
           flasher.status = WLF_FAILED;
           client->printf("#4;Binary size mismatch");
+        } else if (!loader.write(0, data, len) || !uploadFinish()) {
+          resetFlasher();
+          flasher.error = WLF_UPLOAD_ERROR;
+          flasher.status = WLF_FAILED;
+          client->printf("#4;%s", loader.error());
+        } else {
+          sprintf(flasher.message, "%d/%" PRIu32 "", (int)(len), (uint32_t)len);
+          Serial.println(flasher.message);
+          progressUpdate(WLP_UPLOAD, len, len);
+          flasher.will_flash = true;
+          flasher.status == WLF_UPDATING;
+          client->printf("#0;Will flash");
         }
       }
     } else if (info->opcode == WS_BINARY && flasher_ws.active && flasher.status == WLF_UPLOADING && client == flasher_ws.client) {
       Serial.print("Got partial binary ");
       Serial.printf("index=%llu; len=%u; \n\r", info->index, len);
       flasher.watchdog = millis();
-      memcpy(binary_buf+info->index, data, len);
+      bool last = info->index + len == info->len;
+      if (info->len != flasher.size || !loader.write(info->index, data, len) || (last && !uploadFinish())) {
+        resetFlasher();
+        flasher.error = WLF_UPLOAD_ERROR;
+        flasher.status = WLF_FAILED;
+        if (info->len != flasher.size) client->printf("#4;Binary size mismatch");
+        else client->printf("#4;%s", loader.error());
+        return;
+      }
       sprintf(flasher.message, "%" PRIu64 "/%" PRIu32 "", (info->index+len), info->len);
-      Serial.println(flasher.message);
-      if (info->index + len == info->len) {
+      progressUpdate(WLP_UPLOAD, info->index + len, info->len);
+      if (last) {
         Serial.println("Final");
-        if (info->len == flasher.size) {
-          flasher.will_flash = true;
-          flasher.status == WLF_UPDATING;
-          client->printf("#0;Will flash");
-        } else {
+        flasher.will_flash = true;
+        flasher.status == WLF_UPDATING;
+        client->printf("#0;Will flash");
+      }
+    } else {
+      Serial.println("Got something");
+    }
+    break;
+  }
+}
+
+////////////////////////////////
+///   Raw TCP functions      ///
+////////////////////////////////
+struct FlasherTCPConnection {
+  char line[96];
+  uint8_t pos = 0;
+  WLFrameAssembler frame;
+};
+
+// Bytes queued for one TCP client. Any task can queue them, only the
+// async_tcp task touches the AsyncClient: it drains the ring from the ack
+// and poll callbacks. lwIP polls every 500ms, so tcpWrite() asks the tcpip
+// thread for a poll right away.
+struct TCPOut {
+  AsyncClient* client = NULL;
+  struct tcp_pcb* pcb = NULL;
+  uint8_t* buf = NULL;
+  uint32_t size = 0;
+  uint32_t head = 0; // Both count up, head - tail bytes are queued
+  uint32_t tail = 0;
+  bool kicked = false;
+  bool closing = false;
+} tcp_out[TCP_OUT_SLOTS];
+portMUX_TYPE tcp_out_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Call with tcp_out_mux held
+TCPOut* tcpOutFor(AsyncClient* client) {
+  if (client == NULL) return NULL;
+  for (int i = 0; i < TCP_OUT_SLOTS; i++) {
+    if (tcp_out[i].client == client) return &tcp_out[i];
+  }
+  return NULL;
+}
+
+// Runs on the tcpip thread, the pcb is only valid if it's still active
+void tcpKick(void* arg) {
+  for (struct tcp_pcb* pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next) {
+    if (pcb == arg) {
+      if (pcb->poll != NULL) pcb->poll(pcb->callback_arg, pcb);
+      return;
+    }
+  }
+}
+
+// async_tcp task only. The ring is read outside the lock, writers only
+// touch bytes past head and the buffer is freed on this task.
+void tcpDrain(AsyncClient* client) {
+  for (;;) {
+    portENTER_CRITICAL(&tcp_out_mux);
+    TCPOut* out = tcpOutFor(client);
+    const uint8_t* data = NULL;
+    size_t len = 0;
+    bool close = false;
+    if (out != NULL) {
+      out->kicked = false;
+      len = min(out->head - out->tail, out->size - out->tail % out->size);
+      data = out->buf + out->tail % out->size;
+      close = out->closing && len == 0;
+    }
+    portEXIT_CRITICAL(&tcp_out_mux);
+    if (close) {
+      client->close();
+      return;
+    }
+    size_t space = len ? client->space() : 0;
+    if (space == 0) return;
+    size_t sent = client->add((const char*)data, min(len, space));
+    client->send();
+    if (sent == 0) return;
+    portENTER_CRITICAL(&tcp_out_mux);
+    out->tail += sent;
+    portEXIT_CRITICAL(&tcp_out_mux);
+  }
+}
+
+void tcpKickLocked(TCPOut* out, struct tcp_pcb** kick) {
+  if (out->kicked) return;
+  out->kicked = true;
+  *kick = out->pcb;
+}
+
+// A failed kick leaves the bytes to the next ack or poll
+void tcpKickSend(struct tcp_pcb* kick) {
+  if (kick != NULL) tcpip_try_callback(tcpKick, kick);
+}
+
+// async_tcp task, when the client connects. False if all slots are taken.
+bool tcpOpen(AsyncClient* client, uint32_t size) {
+  uint8_t* buf = (uint8_t*)malloc(size);
+  if (buf == NULL) return false;
+  TCPOut* out = NULL;
+  portENTER_CRITICAL(&tcp_out_mux);
+  for (int i = 0; i < TCP_OUT_SLOTS && out == NULL; i++) {
+    if (tcp_out[i].client == NULL) out = &tcp_out[i];
+  }
+  if (out != NULL) {
+    *out = TCPOut();
+    out->client = client;
+    out->pcb = client->pcb();
+    out->buf = buf;
+    out->size = size;
+  }
+  portEXIT_CRITICAL(&tcp_out_mux);
+  if (out == NULL) {
+    free(buf);
+    return false;
+  }
+  client->onAck([](void* arg, AsyncClient* client, size_t len, uint32_t time) { tcpDrain(client); }, NULL);
+  client->onPoll([](void* arg, AsyncClient* client) { tcpDrain(client); }, NULL);
+  return true;
+}
+
+// async_tcp task, from the disconnect handler before the client is deleted
+void tcpRelease(AsyncClient* client) {
+  uint8_t* buf = NULL;
+  portENTER_CRITICAL(&tcp_out_mux);
+  TCPOut* out = tcpOutFor(client);
+  if (out != NULL) {
+    buf = out->buf;
+    *out = TCPOut();
+  }
+  portEXIT_CRITICAL(&tcp_out_mux);
+  free(buf);
+}
+
+// Any task. Queues all of it or nothing, false if it doesn't fit or the
+// client is gone. Never waits for the client.
+bool tcpWrite(AsyncClient* client, const uint8_t* data, size_t len) {
+  struct tcp_pcb* kick = NULL;
+  bool ok = false;
+  portENTER_CRITICAL(&tcp_out_mux);
+  TCPOut* out = tcpOutFor(client);
+  if (out != NULL && !out->closing && len <= out->size - (out->head - out->tail)) {
+    uint32_t pos = out->head % out->size;
+    size_t first = min(len, (size_t)(out->size - pos));
+    memcpy(out->buf + pos, data, first);
+    memcpy(out->buf, data + first, len - first);
+    out->head += len;
+    tcpKickLocked(out, &kick);
+    ok = true;
+  }
+  portEXIT_CRITICAL(&tcp_out_mux);
+  tcpKickSend(kick);
+  return ok;
+}
+
+// Bytes tcpWrite() takes right now. A client that is gone takes anything
+// and drops it, so nobody waits for it.
+size_t tcpSpace(AsyncClient* client) {
+  size_t space = SIZE_MAX;
+  portENTER_CRITICAL(&tcp_out_mux);
+  TCPOut* out = tcpOutFor(client);
+  if (out != NULL && !out->closing) space = out->size - (out->head - out->tail);
+  portEXIT_CRITICAL(&tcp_out_mux);
+  return space;
+}
+
+// Any task. Closes once everything queued before is out.
+void tcpClose(AsyncClient* client) {
+  struct tcp_pcb* kick = NULL;
+  portENTER_CRITICAL(&tcp_out_mux);
+  TCPOut* out = tcpOutFor(client);
+  if (out != NULL) {
+    out->closing = true;
+    tcpKickLocked(out, &kick);
+  }
+  portEXIT_CRITICAL(&tcp_out_mux);
+  tcpKickSend(kick);
+}
+
+void flasherReply(const char* format, ...) {
+  char reply[128];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(reply, sizeof(reply) - 1, format, args);
+  va_end(args);
+  if (len < 0) return;
+  if (len > (int)sizeof(reply) - 2) len = sizeof(reply) - 2;
+  if (flasher_ws.tcp_client != NULL) {
+    reply[len++] = '\n';
+    tcpWrite(flasher_ws.tcp_client, (const uint8_t*)reply, len);
+  } else if (flasher_ws.client != NULL) {
+    flasher_ws.client->text(reply, len);
+  }
+}
+
+void flasherReplyBinary(const uint8_t* data, size_t len) {
+  if (flasher_ws.tcp_client != NULL) {
+    tcpWrite(flasher_ws.tcp_client, data, len);
+  } else if (flasher_ws.client != NULL) {
+    flasher_ws.client->binary(data, len);
+  }
+}
+
+int tcpTerminalCount() {
+  int count = 0;
+  for (int i = 0; i < TCP_MAX_CLIENTS; i++) {
+    if (terminal_tcp_state.clients[i] != NULL) count++;
+  }
+  return count;
+}
+
+void tcpTerminalFlush() {
+  if (terminal_tcp_state.out_len == 0) return;
+  for (int i = 0; i < TCP_MAX_CLIENTS; i++) {
+    AsyncClient* client = terminal_tcp_state.clients[i];
+    // A client that doesn't keep up misses output, like WebSocket ones
+    if (client != NULL && !tcpWrite(client, (const uint8_t*)terminal_tcp_state.out_buf, terminal_tcp_state.out_len)) metrics.terminal_overflows++;
+  }
+  terminal_tcp_state.out_len = 0;
+}
+
+// Terminal output is collected while the target keeps printing and flushed
+// once it goes quiet, so raw clients get data without waiting for poll_delay.
+void tcpTerminalSend(const char* data, size_t len) {
+  if (tcpTerminalCount() == 0) return;
+  while (len) {
+    size_t chunk = min(len, (size_t)(TCP_TERMINAL_BUFFER_SIZE - terminal_tcp_state.out_len));
+    memcpy(terminal_tcp_state.out_buf + terminal_tcp_state.out_len, data, chunk);
+    terminal_tcp_state.out_len += chunk;
+    data += chunk;
+    len -= chunk;
+    if (terminal_tcp_state.out_len == TCP_TERMINAL_BUFFER_SIZE) tcpTerminalFlush();
+  }
+}
+
+void tcpTerminalCloseAll() {
+  for (int i = 0; i < TCP_MAX_CLIENTS; i++) {
+    if (terminal_tcp_state.clients[i] != NULL) tcpClose(terminal_tcp_state.clients[i]);
+  }
+}
+
+// Moves received bytes into the terminal input buffer once it's free again
+void tcpTerminalFeed() {
+  if (terminal_tcp_state.in_head == terminal_tcp_state.in_tail) return;
+  if (terminal.incomming_buf[terminal.incomming_pos] != 0) return;
+  size_t len = 0;
+  while (terminal_tcp_state.in_tail != terminal_tcp_state.in_head && len < sizeof(terminal.incomming_buf) - 1) {
+    terminal.incomming_buf[len++] = terminal_tcp_state.in_buf[terminal_tcp_state.in_tail];
+    terminal_tcp_state.in_tail = (terminal_tcp_state.in_tail + 1) % TCP_TERMINAL_BUFFER_SIZE;
+  }
+  terminal.incomming_pos = 0;
+  terminal.incomming_buf[len] = 0;
+}
+
+// Drops telnet commands and option negotiation, true for bytes that go to
+// the target. IAC IAC is a literal 0xff.
+bool telnetFilter(TelnetState_t* state, uint8_t c) {
+  switch (*state) {
+  case TELNET_DATA:
+    if (c != 0xff) return true;
+    *state = TELNET_IAC;
+    return false;
+  case TELNET_IAC:
+    *state = TELNET_DATA;
+    if (c == 0xff) return true;
+    if (c >= 251) *state = TELNET_OPTION; // WILL, WONT, DO, DONT
+    else if (c == 250) *state = TELNET_SB;
+    return false; // NOP, GA and the other 2 byte commands
+  case TELNET_OPTION:
+    *state = TELNET_DATA;
+    return false;
+  case TELNET_SB:
+    if (c == 0xff) *state = TELNET_SB_IAC;
+    return false;
+  case TELNET_SB_IAC:
+    *state = c == 240 ? TELNET_DATA : TELNET_SB; // SE ends it, IAC IAC is data inside
+    return false;
+  }
+  return false;
+}
+
+void onTerminalTCPClient(void* arg, AsyncClient* client) {
+  int slot = -1;
+  for (int i = 0; i < TCP_MAX_CLIENTS; i++) {
+    if (terminal_tcp_state.clients[i] == NULL) {
+      slot = i;
+      break;
+    }
+  }
+  Serial.printf("tcp[%d] terminal connect from %s\n\r", TERMINAL_TCP_PORT, client->remoteIP().toString().c_str());
+  client->onDisconnect([](void* arg, AsyncClient* client) {
+    Serial.printf("tcp[%d] terminal disconnect\n\r", TERMINAL_TCP_PORT);
+    for (int i = 0; i < TCP_MAX_CLIENTS; i++) {
+      if (terminal_tcp_state.clients[i] == client) terminal_tcp_state.clients[i] = NULL;
+    }
+    if (tcpTerminalCount() == 0 && terminal_ws.count() == 0) terminal.connected = false;
+    tcpRelease(client);
+    delete client;
+  }, NULL);
+  if (slot < 0 || !tcpOpen(client, TCP_OUT_SIZE)) {
+    client->write("Too many clients\r\n");
+    client->close();
+    return;
+  }
+  client->setNoDelay(true);
+  terminal_tcp_state.telnet[slot] = TELNET_DATA;
+  client->onData([](void* arg, AsyncClient* client, void* data, size_t len) {
+    TelnetState_t* telnet = (TelnetState_t*)arg;
+    uint8_t* bytes = (uint8_t*)data;
+    for (size_t i = 0; i < len; i++) {
+      if (!telnetFilter(telnet, bytes[i]) || bytes[i] == 0) continue;
+      uint16_t next = (terminal_tcp_state.in_head + 1) % TCP_TERMINAL_BUFFER_SIZE;
+      if (next == terminal_tcp_state.in_tail) {
+        metrics.terminal_overflows++;
+        break;
+      }
+      terminal_tcp_state.in_buf[terminal_tcp_state.in_head] = bytes[i];
+      terminal_tcp_state.in_head = next;
+    }
+  }, &terminal_tcp_state.telnet[slot]);
+  // The flasher, gdb or the watch owns the link, polling will start as soon as it's done
+  if (config.uart == false && !commandBusy() && !terminal.connected) {
+    if (initLink() < 1) {
+      client->write("Failed to connect to ch32v003\r\n");
+      client->close();
+      return;
+    }
+  }
+  terminal_tcp_state.clients[slot] = client;
+  terminal.connected = true;
+}
+
+void onFlasherTCPClient(void* arg, AsyncClient* client) {
+  Serial.printf("tcp[%d] flasher connect from %s\n\r", FLASHER_TCP_PORT, client->remoteIP().toString().c_str());
+  client->setNoDelay(true);
+  FlasherTCPConnection* connection = new FlasherTCPConnection;
+  client->onDisconnect([](void* arg, AsyncClient* client) {
+    Serial.printf("tcp[%d] flasher disconnect\n\r", FLASHER_TCP_PORT);
+    if (flasher_ws.tcp_client == client) {
+      flasher_ws.tcp_client = NULL;
+      if (flasher.status == WLF_UPLOADING) resetFlasher();
+    }
+    frameDropClient(0, client);
+    free(((FlasherTCPConnection*)arg)->frame.payload);
+    delete (FlasherTCPConnection*)arg;
+    tcpRelease(client);
+    delete client;
+  }, connection);
+  if (!tcpOpen(client, TCP_FLASHER_OUT_SIZE)) {
+    client->write("Too many clients\n");
+    client->close();
+    return;
+  }
+  client->onData([](void* arg, AsyncClient* client, void* data, size_t len) {
+    FlasherTCPConnection* connection = (FlasherTCPConnection*)arg;
+    uint8_t* bytes = (uint8_t*)data;
+    while (len) {
+      // After "#w" the next flasher.size bytes are the binary itself
+      if (flasher_ws.tcp_client == client && flasher_ws.active && flasher.status == WLF_UPLOADING && flasher_ws.current_command == WLF_FLASH && flasher_ws.tcp_upload_pos < flasher.size) {
+        size_t chunk = min(len, (size_t)(flasher.size - flasher_ws.tcp_upload_pos));
+        bool last = flasher_ws.tcp_upload_pos + chunk == flasher.size;
+        if (!loader.write(flasher_ws.tcp_upload_pos, bytes, chunk) || (last && !uploadFinish())) {
+          flasherReply("#4;%s", loader.error());
+          progressUpdate(WLP_FAILED, flasher_ws.tcp_upload_pos, flasher.size);
           resetFlasher();
-          flasher.error = WLF_UPLOAD_ERROR;
-          flasher.status = WLF_FAILED;
-          client->printf("#4;Binary size mismatch");
+          return;
+        }
+        flasher_ws.tcp_upload_pos += chunk;
+        bytes += chunk;
+        len -= chunk;
+        flasher.watchdog = millis();
+        progressUpdate(WLP_UPLOAD, flasher_ws.tcp_upload_pos, last ? flasher_ws.tcp_upload_pos : flasher.size);
+        if (last) {
+          flasher.will_flash = true;
+          flasher.status = WLF_UPDATING;
+          flasherReply("#0;Will flash");
         }
+        continue;
+      }
+      // Binary frames can be mixed with text commands, but not inside a line
+      if (connection->frame.pos || connection->frame.skip || (connection->pos == 0 && *bytes == WLF_FRAME_MAGIC)) {
+        size_t used = frameFeed(&connection->frame, bytes, len, 0, client);
+        bytes += used;
+        len -= used;
+        continue;
+      }
+      char c = *bytes++;
+      len--;
+      if (c == '\n' || c == '\r') {
+        if (connection->pos == 0) continue;
+        connection->line[connection->pos] = 0;
+        connection->pos = 0;
+        if (connection->line[0] != '#') continue;
+        Serial.printf("[tcp] Got a command: %s\n\r", connection->line);
+        const char* busy = commandBusy();
+        if (busy) {
+          char reply[32];
+          int n = snprintf(reply, sizeof(reply), "#1;%s\n", busy);
+          tcpWrite(client, (const uint8_t*)reply, n);
+          continue;
+        }
+        flasher_ws.client = NULL;
+        flasher_ws.tcp_client = client;
+        flasher_ws.tcp_upload_pos = 0;
+        flasherCommand(connection->line);
+      } else if (connection->pos < sizeof(connection->line) - 1) {
+        connection->line[connection->pos++] = c;
+      }
+    }
+  }, connection);
+  tcpWrite(client, (const uint8_t*)"Welcome to WebLink flasher\n", 27);
+}
+
+////////////////////////////////
+///   GDB server             ///
+////////////////////////////////
+// The program buffer used for memory access runs on x8-x13, they're saved
+// before the first memory access while halted and put back before resuming.
+class LinkGdbTarget : public GdbTarget {
+
+  public:
+
+    bool loading = false;
+
+    void begin() {
+      scratch_saved = false;
+      breakpoint_used = 0;
+      loading = false;
+    }
+
+    // Leaves the target running without our breakpoints
+    void end() {
+      for (int i = 0; i < GDB_HW_BREAKPOINTS; i++) {
+        if (breakpoint_used & (1 << i)) breakpoint(false, breakpoints[i]);
+      }
+      restoreScratch();
+      HaltMode(&link_state, HALT_MODE_RESUME);
+    }
+
+    int halt() override {
+      HaltMode(&link_state, HALT_MODE_HALT_BUT_NO_RESET);
+      return 0;
+    }
+
+    int resume(bool step) override {
+      uint32_t dcsr;
+      int r = restoreScratch();
+      if (!r) r = ReadCPURegister(&link_state, SWIO_REG_DCSR, &dcsr);
+      // ebreak has to halt for gdb's software breakpoints
+      dcsr = (dcsr | DCSR_EBREAKM) & ~DCSR_STEP;
+      if (step) dcsr |= DCSR_STEP;
+      if (!r) r = WriteCPURegister(&link_state, SWIO_REG_DCSR, dcsr);
+      if (r) return r;
+      HaltMode(&link_state, HALT_MODE_RESUME);
+      return 0;
+    }
+
+    int stopSignal() override {
+      uint32_t status, dcsr;
+      if (MCFReadReg32(&link_state, DMSTATUS, &status)) return -1;
+      if (!(status & (1 << 9))) return 0; // allhalted
+      if (ReadCPURegister(&link_state, SWIO_REG_DCSR, &dcsr)) return -1;
+      return DCSR_CAUSE(dcsr) == DCSR_CAUSE_HALTREQ ? 2 : 5; // SIGINT, SIGTRAP
+    }
+
+    int readRegisters(uint32_t* regs) override {
+      int r = saveScratch();
+      if (r) return r;
+      // RV32E only has x0-x15
+      int gprs = strcmp(DetectChip(&link_state)->name, "CH32V003") ? 32 : 16;
+      memset(regs, 0, GDB_REG_COUNT * sizeof(uint32_t));
+      r = ReadCPURegisters(&link_state, SWIO_REG_GPR, gprs, regs);
+      if (!r) r = ReadCPURegister(&link_state, SWIO_REG_DPC, regs + GDB_REG_PC);
+      memcpy(regs + 8, scratch, sizeof(scratch));
+      return r;
+    }
+
+    int writeRegister(int n, uint32_t value) override {
+      if (n == GDB_REG_PC) return WriteCPURegister(&link_state, SWIO_REG_DPC, value);
+      if (scratch_saved && n >= 8 && n < 8 + SCRATCH_REGS) {
+        scratch[n - 8] = value;
+        return 0;
+      }
+      return WriteCPURegister(&link_state, SWIO_REG_GPR + n, value);
+    }
+
+    int readMemory(uint32_t address, uint32_t len, uint8_t* data) override {
+      int r = saveScratch();
+      return r ? r : ReadBinaryBlob(&link_state, address, len, data);
+    }
+
+    int writeMemory(uint32_t address, uint32_t len, const uint8_t* data) override {
+      int r = saveScratch();
+      return r ? r : WriteBinaryBlob(&link_state, address, len, (uint8_t*)data);
+    }
+
+    int breakpoint(bool insert, uint32_t address) override {
+      for (int i = 0; i < GDB_HW_BREAKPOINTS; i++) {
+        bool used = breakpoint_used & (1 << i);
+        if (insert ? used : !used || breakpoints[i] != address) continue;
+        uint32_t selected;
+        int r = WriteCPURegister(&link_state, SWIO_REG_TSELECT, i);
+        // tselect reads back something else when there's no trigger i
+        if (!r) r = ReadCPURegister(&link_state, SWIO_REG_TSELECT, &selected);
+        if (!r && selected != (uint32_t)i) r = -1;
+        if (!r) r = WriteCPURegister(&link_state, SWIO_REG_TDATA1, 0);
+        if (!r && insert) r = WriteCPURegister(&link_state, SWIO_REG_TDATA2, address);
+        if (!r && insert) r = WriteCPURegister(&link_state, SWIO_REG_TDATA1, MCONTROL_EXEC_BREAK);
+        if (r) return r;
+        breakpoints[i] = address;
+        if (insert) breakpoint_used |= 1 << i;
+        else breakpoint_used &= ~(1 << i);
+        return 0;
+      }
+      return -1;
+    }
+
+    // gdb erases everything first, the image store then covers all erased blocks
+    int flashErase(uint32_t address, uint32_t len) override {
+      address = flashAddress(address);
+      if (!loading) {
+        if (flasher.active || frameQueueCount() || !activateFlasher()) return -1;
+        flasher.status = WLF_UPLOADING;
+        flasher.offset = address;
+        flasher.size = 0;
+        loading = true;
+      }
+      if (address < flasher.offset || image.size()) return -1;
+      flasher.size = max(flasher.size, address + len - flasher.offset);
+      return 0;
+    }
+
+    int flashWrite(uint32_t address, uint32_t len, const uint8_t* data) override {
+      address = flashAddress(address);
+      if (!loading || address < flasher.offset) return -1;
+      if (!image.size() && !image.begin(flasher.size)) return -1;
+      flasher.watchdog = millis();
+      progressUpdate(WLP_UPLOAD, address + len - flasher.offset, flasher.size);
+      return image.write(address - flasher.offset, data, len) ? 0 : -1;
+    }
+
+    // Goes through the flasher's page writer, the target stays halted
+    int flashDone() override {
+      if (!loading) return 0;
+      loading = false;
+      int r = saveScratch();
+      // Erased but never written blocks are programmed as 0xff
+      for (uint32_t i = 0; i < image.pageCount() && !r; i++) {
+        if (image.page(i, true) == NULL) r = -1;
+      }
+      flasher.status = WLF_UPDATING;
+      jobTimingStart();
+      if (!r) r = writeImagePages(flasher.offset);
+      jobTimingFinish();
+      flasher.status = r ? WLF_FAILED : WLF_SUCCESS;
+      if (r) sprintf(flasher.message, "Flashing failed: %d", r);
+      else strcpy(flasher.message, "Flashed successfully");
+      progressUpdate(r ? WLP_FAILED : WLP_DONE, flasher.size, flasher.size);
+      if (r) metrics.flash_jobs_failed++;
+      else metrics.flash_jobs_ok++;
+      Serial.printf("[gdb] %s\n\r", flasher.message);
+      link_events.send(flasher.message, "flasher", millis());
+      resetFlasher();
+      return r;
+    }
+
+    int reset(bool halt) override {
+      scratch_saved = false;
+      HaltMode(&link_state, halt ? HALT_MODE_HALT_AND_RESET : HALT_MODE_REBOOT);
+      return 0;
+    }
+
+    void memoryMap(uint32_t* flash_base, uint32_t* flash_size, uint32_t* block_size, uint32_t* ram_base, uint32_t* ram_size) override {
+      saveScratch();
+      const struct SWIOChip* chip = DetectChip(&link_state);
+      *flash_base = chip->flash_base;
+      *flash_size = link_state.flash_size;
+      *block_size = chip->page_size;
+      *ram_base = chip->ram_base;
+      *ram_size = chip->ram_size;
+    }
+
+  private:
+
+    static const int SCRATCH_REGS = 6;
+
+    int saveScratch() {
+      if (scratch_saved) return 0;
+      int r = ReadCPURegisters(&link_state, SWIO_REG_GPR + 8, SCRATCH_REGS, scratch);
+      scratch_saved = !r;
+      return r;
+    }
+
+    int restoreScratch() {
+      int r = 0;
+      for (int i = 0; i < SCRATCH_REGS && scratch_saved && !r; i++) {
+        r = WriteCPURegister(&link_state, SWIO_REG_GPR + 8 + i, scratch[i]);
       }
-    } else {
-      Serial.println("Got something");
+      if (!r) scratch_saved = false;
+      return r;
     }
-    break;
+
+    // Code runs from the flash alias at 0
+    uint32_t flashAddress(uint32_t address) {
+      const struct SWIOChip* chip = DetectChip(&link_state);
+      return address < chip->flash_base ? address + chip->flash_base : address;
+    }
+
+    uint32_t scratch[SCRATCH_REGS];
+    bool scratch_saved = false;
+    uint32_t breakpoints[GDB_HW_BREAKPOINTS];
+    uint8_t breakpoint_used = 0;
+} gdb_target;
+
+void gdbSend(const uint8_t* data, size_t len) {
+  tcpWrite(gdb.client, data, len);
+}
+
+GdbServer gdb_server(&gdb_target, gdbSend);
+
+void gdbDetach() {
+  gdb.attached = false;
+  if (gdb_target.loading) resetFlasher();
+  gdb_target.end();
+  terminalResume();
+  Serial.println("[gdb] Detached");
+}
+
+// Link access happens here, the TCP callbacks only queue bytes
+void handleGdb() {
+  if (gdb.detach) {
+    gdb.detach = false;
+    if (gdb.attached) gdbDetach();
+  }
+  if (!gdb.attach && !gdb.attached) return;
+  if (frameQueueCount() || (flasher.active && !gdb_target.loading)) return;
+  if (gdb.attach) {
+    if (!terminalPause()) return;
+    gdb.attach = false;
+    if (initLink() < 1) {
+      Serial.println("[gdb] Link init failed");
+      tcpClose(gdb.client);
+      terminalResume();
+      return;
+    }
+    HaltMode(&link_state, HALT_MODE_HALT_BUT_NO_RESET);
+    gdb.attached = true;
+    gdb_target.begin();
+    gdb_server.begin();
+    Serial.println("[gdb] Attached, target halted");
+  }
+  const struct SWIOStats* stats = &link_state.stats;
+  // Someone else used the link in between, what we know about the target may be stale
+  if (stats->frames_written + stats->frames_read != gdb.link_frames) gdb_server.invalidate();
+  // Every reply has to fit, gdb waits for it anyway
+  if (tcpSpace(gdb.client) < GDB_PACKET_SIZE + 4) return;
+  uint8_t buf[256];
+  size_t len = 0;
+  while (gdb.rx_tail != gdb.rx_head && len < sizeof(buf)) {
+    buf[len++] = gdb.rx[gdb.rx_tail];
+    gdb.rx_tail = (gdb.rx_tail + 1) % GDB_RX_BUFFER_SIZE;
+  }
+  if (len) gdb_server.feed(buf, len);
+  if (gdb_server.running() && millis() - gdb.last_poll >= GDB_POLL_INTERVAL) {
+    gdb.last_poll = millis();
+    gdb_server.poll();
   }
+  gdb.link_frames = stats->frames_written + stats->frames_read;
+  if (gdb_server.detached()) {
+    gdbDetach();
+    tcpClose(gdb.client);
+  }
+}
+
+void onGdbTCPClient(void* arg, AsyncClient* client) {
+  Serial.printf("tcp[%d] gdb connect from %s\n\r", GDB_TCP_PORT, client->remoteIP().toString().c_str());
+  client->onDisconnect([](void* arg, AsyncClient* client) {
+    Serial.printf("tcp[%d] gdb disconnect\n\r", GDB_TCP_PORT);
+    if (gdb.client == client) {
+      gdb.client = NULL;
+      gdb.detach = true;
+    }
+    tcpRelease(client);
+    delete client;
+  }, NULL);
+  if (gdb.client != NULL || !tcpOpen(client, TCP_OUT_SIZE)) {
+    client->close();
+    return;
+  }
+  client->setNoDelay(true);
+  client->onData([](void* arg, AsyncClient* client, void* data, size_t len) {
+    uint8_t* bytes = (uint8_t*)data;
+    for (size_t i = 0; i < len; i++) {
+      uint16_t next = (gdb.rx_head + 1) % GDB_RX_BUFFER_SIZE;
+      // gdb retransmits when a packet gets lost
+      if (next == gdb.rx_tail) break;
+      gdb.rx[gdb.rx_head] = bytes[i];
+      gdb.rx_head = next;
+    }
+  }, NULL);
+  gdb.rx_head = 0;
+  gdb.rx_tail = 0;
+  gdb.client = client;
+  gdb.attach = true;
+}
+
+void tcpServerSetup() {
+  terminal_tcp.setNoDelay(true);
+  terminal_tcp.onClient(onTerminalTCPClient, NULL);
+  terminal_tcp.begin();
+  flash_tcp.setNoDelay(true);
+  flash_tcp.onClient(onFlasherTCPClient, NULL);
+  flash_tcp.begin();
+  gdb_tcp.setNoDelay(true);
+  gdb_tcp.onClient(onGdbTCPClient, NULL);
+  gdb_tcp.begin();
 }
 
 String wifiTemplate(const String& var)
@@ -652,6 +2921,7 @@ void webServerSetup() {
   flash_ws.onEvent(onFlasherEvent);
   server.addHandler(&terminal_ws);
   server.addHandler(&flash_ws);
+  server.addHandler(&watch_ws);
   server.addHandler(&link_events);
   server.addHandler(&settings_handler);
 
@@ -702,12 +2972,32 @@ void webServerSetup() {
     // send event with message "hello!", id current millis
     // and set reconnect delay to 1 second
     client->send("hello!", NULL, millis(), 1000);
+    progressResume(client);
   });
 
   server.on("/flash", HTTP_POST, onFlashRequest, onFlashUpload);
+  server.on("/flash/*", HTTP_PUT, onFlashPut, NULL, onFlashPutBody);
+  server.on("/run", HTTP_POST, onFlashPut, NULL, onFlashPutBody);
+  server.on("/personalize/*", HTTP_PUT, onPersonalizePut, NULL, onFlashPutBody);
+  server.on("/personalize", HTTP_GET, onPersonalize);
 
   server.on("/status", HTTP_GET, onStatus);
 
+  server.on("/metrics", HTTP_GET, onMetrics);
+
+  server.on("/histograms", HTTP_GET, onHistograms);
+
+  server.on("/bench", HTTP_GET, onBench);
+  server.on("/profile", HTTP_GET, onProfile);
+  server.on("/snapshot", HTTP_GET, onSnapshot);
+  server.on("/watch", HTTP_GET, onWatch);
+  server.on("/watch.csv", HTTP_GET, onWatchCSV);
+
+  server.on("/read", HTTP_GET, onRead);
+
+  server.on("/trace", HTTP_GET, onTrace);
+  server.on("/trace.bin", HTTP_GET, onTraceDownload);
+
   server.on("/", HTTP_ANY, [](AsyncWebServerRequest *request) { 
     // request->send(LittleFS, "/www/index.html");
     request->send(LittleFS, "/www/index.html", String(), false, wifiTemplate);
@@ -784,6 +3074,7 @@ void wifiConfigChange() {
 ///   Link functions         ///
 ////////////////////////////////
 int initLink() {
+  uint32_t timer_start = TimerStart(&link_state);
   strcpy(terminal.buf, "#");
   ResetInternalProgrammingState(&link_state);
   pinMode(config.swio_pin, OUTPUT_OPEN_DRAIN);
@@ -837,31 +3128,242 @@ int initLink() {
 	}
 
 	link_state.statetag = STTAG( "STRT" );
+  TimerStop(&link_state, SWIO_OP_INIT, timer_start);
   return _status;
 }
 
-int writeBinary(uint32_t offset, uint32_t size) {
-  if (size > MAX_BINARY_SIZE) {
+// Files with addresses say where they go, the offset given with the upload
+// is ignored. The size becomes the size of the image, compressed uploads
+// are smaller than that.
+bool uploadFinish() {
+  if (!loader.finish()) {
+    Serial.printf("Upload failed: %s\n\r", loader.error());
+    return false;
+  }
+  uint32_t upload_bytes = flasher.size;
+  if (loader.addressed()) flasher.offset = loader.base();
+  flasher.size = image.size();
+  job_timing.upload_bytes = 0;
+  if (loader.compressed()) {
+    job_timing.upload_bytes = upload_bytes;
+    job_timing.image_bytes = loader.streamSize();
+    job_timing.upload_ms = loader.uploadMs();
+    job_timing.inflate_ms = loader.inflateUs() / 1000;
+    Serial.printf("Compressed upload, %" PRIu32 " of %" PRIu32 " bytes (%" PRIu32 "%%) in %" PRIu32 "ms, %" PRIu32 "ms decompressing\n\r",
+                  upload_bytes, job_timing.image_bytes, upload_bytes * 100 / max(job_timing.image_bytes, (uint32_t)1),
+                  job_timing.upload_ms, job_timing.inflate_ms);
+  }
+  Serial.printf("%s image, %" PRIu32 " bytes at 0x%08" PRIx32 ", %" PRIu32 " loaded\n\r", loader.formatName(), image.size(), flasher.offset, loader.loaded());
+  return true;
+}
+
+// Writes the image store one page at a time, progress still covers the whole
+// image. Pages that were never written are gaps in a HEX, ELF or UF2 file
+// and are left alone on the target, neither erased nor programmed.
+int writeImagePages(uint32_t offset) {
+  int r = 0;
+  for (uint32_t i = 0; i < image.pageCount() && !r; i++) {
+    uint8_t* page = image.page(i);
+    if (page == NULL) continue;
+    link_progress_span.base = i * IMAGE_PAGE_SIZE;
+    link_progress_span.total = image.size();
+    r = WriteBinaryBlob(&link_state, offset + i * IMAGE_PAGE_SIZE, image.pageLength(i), page);
+  }
+  link_progress_span.total = 0;
+  return r;
+}
+
+// Container bytes come from data when given, from the image store otherwise
+uint32_t manifestRead(const uint8_t* data, uint32_t size, uint32_t offset, uint8_t* buf, uint32_t len) {
+  if (offset >= size) return 0;
+  len = min(len, size - offset);
+  if (data) memcpy(buf, data + offset, len);
+  else image.read(offset, buf, len);
+  return len;
+}
+
+bool isManifest(const uint8_t* data, uint32_t size) {
+  WLManifestHeader_t header;
+  return manifestRead(data, size, 0, (uint8_t*)&header, sizeof(header)) == sizeof(header) && !memcmp(header.magic, WLMF_MAGIC, 4);
+}
+
+bool manifestOptionBytes(const WLManifestRegion_t* region) {
+  return (region->address & 0x1FFFF800) == 0x1FFFF800;
+}
+
+// Option bytes go last, they can write protect what the other regions need
+uint64_t manifestOrder(const WLManifestRegion_t* region) {
+  return (uint64_t)manifestOptionBytes(region) << 32 | region->address;
+}
+
+// CRC-32 of the region as written, by the target when it's word aligned
+int manifestVerify(const WLManifestRegion_t* region, const uint8_t* data, uint32_t size, uint8_t* buf) {
+  uint32_t expected = 0, actual = 0;
+  for (uint32_t pos = 0; pos < region->length; pos += IMAGE_PAGE_SIZE) {
+    uint32_t n = manifestRead(data, size, region->data_offset + pos, buf, min(region->length - pos, (uint32_t)IMAGE_PAGE_SIZE));
+    expected = esp_rom_crc32_le(expected, buf, n);
+  }
+  if (!((region->address | region->length) & 3)) {
+    int r = ChecksumMemory(&link_state, region->address, region->length / 4, &actual);
+    if (r) return r;
+  } else {
+    for (uint32_t pos = 0; pos < region->length; pos += IMAGE_PAGE_SIZE) {
+      uint32_t n = min(region->length - pos, (uint32_t)IMAGE_PAGE_SIZE);
+      if (ReadBinaryBlob(&link_state, region->address + pos, n, buf)) return -3;
+      actual = esp_rom_crc32_le(actual, buf, n);
+    }
+  }
+  if (actual != expected) {
+    Serial.printf("Region 0x%08" PRIx32 " CRC %08" PRIx32 ", expected %08" PRIx32 "\n\r", region->address, actual, expected);
+    return -12;
+  }
+  return 0;
+}
+
+// Writes every region of a WLMF container in one link session: the regions
+// by address, each after its range erase, with the option bytes last, then
+// the CRC checks and a single reboot. Pages of a chip or range erase aren't
+// erased again when they are programmed.
+int writeManifest(const uint8_t* data, uint32_t size) {
+  WLManifestHeader_t header;
+  WLManifestRegion_t regions[WLMF_MAX_REGIONS];
+  manifestRead(data, size, 0, (uint8_t*)&header, sizeof(header));
+  uint32_t table = header.region_count * sizeof(WLManifestRegion_t);
+  if (header.version != WLMF_VERSION || header.region_count == 0 || header.region_count > WLMF_MAX_REGIONS ||
+      manifestRead(data, size, sizeof(header), (uint8_t*)regions, table) != table) {
+    return -10;
+  }
+  uint32_t total = 0;
+  bool chip_erase = false;
+  for (uint8_t i = 0; i < header.region_count; i++) {
+    WLManifestRegion_t* region = &regions[i];
+    if (region->length == 0 || region->data_offset > size || region->length > size - region->data_offset ||
+        region->erase > WLMF_ERASE_CHIP || region->verify > WLMF_VERIFY_CRC) {
+      return -10;
+    }
+    chip_erase |= region->erase == WLMF_ERASE_CHIP;
+    total += region->length;
+    // Insertion sort, a handful of regions at most
+    for (uint8_t j = i; j > 0 && manifestOrder(&regions[j]) < manifestOrder(&regions[j - 1]); j--) {
+      WLManifestRegion_t swap = regions[j];
+      regions[j] = regions[j - 1];
+      regions[j - 1] = swap;
+    }
+  }
+  uint8_t* buf = (uint8_t*)malloc(IMAGE_PAGE_SIZE);
+  if (buf == NULL) return -4;
+  terminalPause();
+  if (initLink() < 1) {
+    free(buf);
+    terminalResume();
+    return -2;
+  }
+  HaltMode(&link_state, HALT_MODE_HALT_AND_RESET);
+  int r = 0;
+  const struct SWIOChip* chip = DetectChip(&link_state);
+  for (uint8_t i = 0; i < header.region_count; i++) {
+    if (manifestOptionBytes(&regions[i]) &&
+        (regions[i].address < chip->ob_base || regions[i].address + regions[i].length > chip->ob_base + chip->ob_size)) {
+      r = -10;
+    }
+  }
+  if (chip_erase && !r) {
+    r = EraseFlash(&link_state, 0, 0, 1);
+    link_state.erased_start = 0x08000000;
+    link_state.erased_end = 0x08000000 + link_state.flash_size;
+  }
+  // Chunks end on image page boundaries of the target address, so only the
+  // first and last page of an unaligned region need a read-modify-write
+  uint32_t done = 0;
+  uint32_t erased = 0;
+  for (uint8_t i = 0; i < header.region_count && !r; i++) {
+    const WLManifestRegion_t* region = &regions[i];
+    Serial.printf("Region 0x%08" PRIx32 ", %" PRIu32 " bytes\n\r", region->address, region->length);
+    link_progress_span.base = done;
+    link_progress_span.total = total;
+    if (manifestOptionBytes(region)) {
+      // Always erased and programmed as a block, whatever the erase policy
+      manifestRead(data, size, region->data_offset, buf, region->length);
+      r = WriteOptionBytes(&link_state, region->address, region->length, buf);
+      done += region->length;
+      continue;
+    }
+    if (region->erase == WLMF_ERASE_RANGE && !chip_erase) {
+      // A page shared with the region before was erased and written by it already
+      uint32_t start = max((region->address | 0x08000000) & ~(uint32_t)(chip->page_size - 1), erased);
+      uint32_t end = ((region->address | 0x08000000) + region->length + chip->page_size - 1) & ~(uint32_t)(chip->page_size - 1);
+      if (start < end) {
+        r = EraseFlash(&link_state, start, end - start, 0);
+        link_state.erased_start = start;
+        link_state.erased_end = end;
+        erased = end;
+      }
+    }
+    for (uint32_t pos = 0; pos < region->length && !r; ) {
+      uint32_t n = min(region->length - pos, IMAGE_PAGE_SIZE - (region->address + pos) % IMAGE_PAGE_SIZE);
+      manifestRead(data, size, region->data_offset + pos, buf, n);
+      link_progress_span.base = done;
+      r = WriteBinaryBlob(&link_state, region->address + pos, n, buf);
+      pos += n;
+      done += n;
+    }
+  }
+  link_progress_span.total = 0;
+  link_state.erased_start = link_state.erased_end = 0;
+  for (uint8_t i = 0; i < header.region_count && !r; i++) {
+    if (regions[i].verify == WLMF_VERIFY_CRC) r = manifestVerify(&regions[i], data, size, buf);
+  }
+  free(buf);
+  HaltMode(&link_state, HALT_MODE_REBOOT);
+  if (!r) terminalResume();
+  delay(10);
+  return r;
+}
+
+int writeBinary(uint32_t offset, uint32_t size, uint8_t* data) {
+  if (size > IMAGE_MAX_SIZE || (data == NULL && size != image.size())) {
     return -1;
   }
-  // for(int i=0; i<10; i++) {
-  //   Serial.print(binary_buf[i], HEX);
-  // }
-  // Serial.println("");
-  if(initLink() < 1) return -2;
+  // A container carries its own addresses, offset doesn't matter
+  if (isManifest(data, size)) return writeManifest(data, size);
+  terminalPause();
+  if(initLink() < 1) {
+    terminalResume();
+    return -2;
+  }
   // delay(10);
   int is_flash = ( offset & 0xff000000 ) == 0x08000000 || ( offset & 0x1FFFF800 ) == 0x1FFFF000;
   HaltMode(&link_state, is_flash?0:5);
   // delay(10);
-  int flash_result = WriteBinaryBlob(&link_state, offset, size, binary_buf);
+  int flash_result = data ? WriteBinaryBlob(&link_state, offset, size, data) : writeImagePages(offset);
   delay(10);
   if (is_flash) {
     HaltMode(&link_state, 1);
+    // Start polling right away so the first output of the new firmware isn't lost
+    if (!flash_result) terminalResume();
     delay(10);
   }
   return flash_result;
 }
 
+// Loads the image into SRAM and starts it from its first byte with the stack
+// at the top of SRAM. Flash isn't touched, so there's no erase/program time.
+int runBinary(uint32_t address) {
+  terminalPause();
+  if(initLink() < 1) return -2;
+  HaltMode(&link_state, HALT_MODE_HALT_BUT_NO_RESET);
+  const struct SWIOChip* chip = DetectChip(&link_state);
+  uint32_t ram_end = chip->ram_base + chip->ram_size;
+  int r = address < chip->ram_base || address + image.size() > ram_end ? -3 : writeImagePages(address);
+  if (!r) r = WriteCPURegister(&link_state, SWIO_REG_SP, ram_end);
+  if (!r) r = WriteCPURegister(&link_state, SWIO_REG_DPC, address);
+  // A failed run doesn't leave the hart halted either
+  HaltMode(&link_state, HALT_MODE_RESUME);
+  if (r) return r;
+  terminalResume();
+  return 0;
+}
+
 int unbrick() {
   struct SWIOState * dev = &link_state;
 
@@ -937,18 +3439,28 @@ void pollTerminal(void *pvParameter) {
   Serial.printf("Terminal polling is running on core %d\n\r", (int)xPortGetCoreID());
   uint32_t send_word = 0;
   while(true) {  
+    // Taken before checking for pause, see terminalPause()
+    xSemaphoreTake(terminal.lock, portMAX_DELAY);
     if (terminal.connected) {
+      tcpTerminalFeed();
       if (config.uart == true) {
         if (Uart.available() > 0) {
-          terminal_ws.binaryAll(String("#"+Uart.readString()));
+          String uart_data = Uart.readString();
+          metrics.terminal_bytes_out += uart_data.length();
+          terminal_ws.binaryAll(String("#"+uart_data));
+          tcpTerminalSend(uart_data.c_str(), uart_data.length());
+          tcpTerminalFlush();
         }
         if (terminal.incomming_buf[terminal.incomming_pos] != 0) {
           Uart.print(terminal.incomming_buf);
+          metrics.terminal_bytes_in += strlen(terminal.incomming_buf);
           terminal.incomming_pos = 0;
           terminal.incomming_buf[0] = 0;
           link_events.send("+", "terminal", millis());
         }
-      } else {
+      } else if (!terminal.paused) {
+        // Terminal polls would push everything else out of the trace
+        link_trace.paused = true;
         if (send_word == 0 && terminal.incomming_buf[terminal.incomming_pos] != 0) {
           int i;
           for (i=0; i<3; i++) {
@@ -956,6 +3468,7 @@ void pollTerminal(void *pvParameter) {
             send_word |= terminal.incomming_buf[terminal.incomming_pos+i] << (i*8+8);
           }
           send_word |= i+4;
+          metrics.terminal_bytes_in += i;
           if (terminal.incomming_buf[terminal.incomming_pos+i+1] != 0) {
             terminal.incomming_pos += i+1;
           } else {
@@ -975,50 +3488,108 @@ void pollTerminal(void *pvParameter) {
         if(r != 0) {
           Serial.printf("Terminal dead.  code %d\n\r", r );
           terminal_ws.closeAll();
+          tcpTerminalCloseAll();
           terminal.connected = false;
           send_word = 0;
         }
         if( rr & 0x80 ) {
           int num_printf_chars = (rr & 0xf)-4;
           if (strlen(terminal.buf) + num_printf_chars > TERMINAL_BUFFER_SIZE-1) {
+            metrics.terminal_overflows++;
             terminal_ws.binaryAll(terminal.buf);
             terminal.last_send_time = millis();
             strcpy(terminal.buf, "#");
           }
           if(num_printf_chars > 0 && num_printf_chars <= 7) {
+            char chunk[8];
             int firstrem = num_printf_chars;
             if( firstrem > 3 ) firstrem = 3;
-            strncat(terminal.buf, ((const char*)&rr)+1, firstrem);
+            memcpy(chunk, ((const char*)&rr)+1, firstrem);
             if( num_printf_chars > 3 ) {
               uint32_t r2;
               r = MCFReadReg32( &link_state, DMDATA1, &r2 );
-              strncat(terminal.buf, (const char*)&r2, num_printf_chars - 3);
+              memcpy(chunk+3, &r2, num_printf_chars - 3);
             }
+            chunk[num_printf_chars] = 0;
+            metrics.terminal_bytes_out += num_printf_chars;
+            strncat(terminal.buf, chunk, num_printf_chars);
+            tcpTerminalSend(chunk, num_printf_chars);
           }
           MCFWriteReg32( &link_state, DMDATA0, send_word ); // Write that we acknowledge the data.
             send_word = 0;
+        } else {
+          tcpTerminalFlush();
         }
+        link_trace.paused = false;
       }
     }
+    xSemaphoreGive(terminal.lock);
     delay(1);
   }
 }
 
+// Fill, verify, copy, compare or CRC of target memory with one of the
+// WLF_OP_* loop opcodes, run by the target itself from the program buffer.
+// Needs a halted target and leaves it halted. Verify and compare put the
+// address of the first mismatch in result, 0xffffffff if there was none,
+// checksum puts the CRC-32 there.
+int memoryLoop(uint8_t op, uint32_t address, uint32_t bytes, uint32_t arg, uint32_t step, uint32_t* result) {
+  uint32_t words = bytes / 4;
+  int r;
+  *result = 0xffffffff;
+  if (bytes == 0 || (bytes | address) & 3 || address + bytes < address) return -1;
+  switch (op) {
+  case WLF_OP_FILL:
+    return FillMemory(&link_state, address, words, arg, step);
+  case WLF_OP_VERIFY:
+    r = VerifyMemory(&link_state, address, words, arg, step, result);
+    break;
+  case WLF_OP_COPY:
+    if (arg & 3 || arg + bytes < arg) return -1;
+    return CopyMemory(&link_state, address, arg, words);
+  case WLF_OP_COMPARE:
+    if (arg & 3 || arg + bytes < arg) return -1;
+    r = CompareMemory(&link_state, address, arg, words, result);
+    break;
+  case WLF_OP_CHECKSUM:
+    return ChecksumMemory(&link_state, address, words, result);
+  default:
+    return -1;
+  }
+  // A mismatch is a result, not an error
+  return r == 1 ? 0 : r;
+}
+
+void handleMemoryLoop() {
+  if (!memory_loop.pending) return;
+  uint32_t result;
+  flasher.watchdog = millis();
+  HaltMode(&link_state, HALT_MODE_HALT_BUT_NO_RESET);
+  int r = memoryLoop(memory_loop.op, memory_loop.args[0], memory_loop.args[1], memory_loop.args[2], memory_loop.args[3], &result);
+  if (r == -1) flasherReply("#3;Address and size must be word aligned");
+  else if (r) flasherReply("#4;Failed: %d", r);
+  else flasherReply("#0;0x%08" PRIx32, result);
+  memory_loop.pending = false;
+  resetFlasher();
+}
+
 int chipInfo(char* buf) {
 	uint32_t reg;
+  const struct SWIOChip* chip;
   
 	HaltMode(&link_state, HALT_MODE_HALT_BUT_NO_RESET);
+	chip = DetectChip(&link_state);
 	
-	if(ReadWord(&link_state, 0x1FFFF800, &reg ) ) goto fail;	
+	if(ReadWord(&link_state, chip->ob_base, &reg ) ) goto fail;	
 	// printf( "USER/RDPR  : %04x/%04x\n", reg>>16, reg&0xFFFF );
 	sprintf(buf, "%04x;%04x;", reg>>16, reg&0xFFFF );
-	if(ReadWord(&link_state, 0x1FFFF804, &reg ) ) goto fail;	
+	if(ReadWord(&link_state, chip->ob_base + 4, &reg ) ) goto fail;	
 	// printf( "DATA1/DATA0: %04x/%04x\n", reg>>16, reg&0xFFFF );
 	sprintf(buf+10, "%04x;%04x;", reg>>16, reg&0xFFFF );
-	if(ReadWord(&link_state, 0x1FFFF808, &reg ) ) goto fail;	
+	if(ReadWord(&link_state, chip->ob_base + 8, &reg ) ) goto fail;	
 	// printf( "WRPR1/WRPR0: %04x/%04x\n", reg>>16, reg&0xFFFF );
 	sprintf(buf+20, "%04x;%04x;", reg>>16, reg&0xFFFF );
-	if(ReadWord(&link_state, 0x1FFFF80c, &reg ) ) goto fail;	
+	if(ReadWord(&link_state, chip->ob_base + 12, &reg ) ) goto fail;	
 	// printf( "WRPR3/WRPR2: %04x/%04x\n", reg>>16, reg&0xFFFF );
 	sprintf(buf+30, "%04x;%04x;", reg>>16, reg&0xFFFF );
 	if(ReadWord(&link_state, 0x1FFFF7E8, &reg ) ) goto fail;	
@@ -1030,9 +3601,8 @@ int chipInfo(char* buf) {
 	if(ReadWord(&link_state, 0x1FFFF7F0, &reg ) ) goto fail;	
 	// printf( "R32_ESIG_UNIID3: %08x\n", reg );
 	sprintf(buf+58, "%08x;", reg );
-  if(ReadWord(&link_state, 0x1FFFF7E0, &reg ) ) goto fail;
 	// printf( "Flash Size: %d kB\n", (reg&0xffff) );
-	sprintf(buf+67, "%dkB", (reg&0xffff) );
+	sprintf(buf+67, "%" PRIu32 "kB;%s", link_state.flash_size / 1024, chip->name );
   HaltMode(&link_state, HALT_MODE_RESUME);
 	return 0;
 fail:
@@ -1042,35 +3612,46 @@ fail:
 
 void handleFlasher() {
   if (flasher.will_flash || flasher.will_unbrick) {
+    // Tried again on the next pass while the polling task holds the link
+    if (!terminalPause()) return;
     flasher.will_flash = !flasher.will_unbrick;
     flasher.will_unbrick = !flasher.will_flash;
-    terminalDisconnect();
-    delay(100);
   }
   if (flasher.will_flash) {
     flasher.will_flash = false;
     int flash_result;
+    jobTimingStart();
     for (flasher.current_retry = 0; flasher.current_retry <= flasher.retries; flasher.current_retry++) {
       flasher.watchdog = millis();
-      flash_result = writeBinary(flasher.offset, flasher.size);
+      flash_result = flasher.run ? runBinary(flasher.offset) : writeBinary(flasher.offset, flasher.size);
       if (!flash_result) break;
     }
     if (flash_result) {
       if (flash_result == -2) {
         strcpy(flasher.message, "Link init failed");  
+      } else if (flash_result == -3) {
+        strcpy(flasher.message, "Binary doesn't fit in SRAM");
       } else {
-        sprintf(flasher.message, "Flashing failed: %d", flash_result);
+        sprintf(flasher.message, "%s failed: %d", flasher.run ? "Loading" : "Flashing", flash_result);
       }
       flasher.error = WLF_UPDATER_ERROR;
       flasher.status = WLF_FAILED;
+    } else if (flasher.run) {
+      sprintf(flasher.message, "Running from 0x%08" PRIx32, flasher.offset);
+      flasher.status = WLF_SUCCESS;
     } else {
       sprintf(flasher.message, "Flashed successfully");
       flasher.status = WLF_SUCCESS;
     }
+    progressUpdate(flash_result ? WLP_FAILED : WLP_DONE, flasher.size, flasher.size);
+    if (flash_result) metrics.flash_jobs_failed++;
+    else metrics.flash_jobs_ok++;
+    jobTimingFinish();
+    if (flash_result && link_state.trace) Serial.printf("Link trace has %" PRIu32 " entries, see /trace.bin\n\r", traceCount());
     Serial.println(flasher.message);
     link_events.send(flasher.message, "flasher", millis());
     // if (flasher_ws.active) flasher_ws.client->text(flasher.message);
-    if (flasher_ws.active) flasher_ws.client->printf("#%d;%s", flash_result?4:0, flasher.message);
+    if (flasher_ws.active) flasherReply("#%d;%s", flash_result?4:0, flasher.message);
     resetFlasher();
   } else if (flasher.will_unbrick) {
     flasher.will_unbrick = false;
@@ -1088,29 +3669,763 @@ void handleFlasher() {
       if (r) sprintf(flasher.message, "Unbrick failed: %d", r);
       else strcpy(flasher.message, "Success! Unbrick completed.");
     }
+    progressUpdate(r ? WLP_FAILED : WLP_DONE, progress.total, progress.total);
     link_events.send(flasher.message, "flasher", millis());
     Serial.println(flasher.message);
-    if (flasher_ws.active) flasher_ws.client->printf("#%d;%s", r?4:0, flasher.message);
+    if (flasher_ws.active) flasherReply("#%d;%s", r?4:0, flasher.message);
     resetFlasher();
   } else if (flasher.will_read) {
+    if (!terminalPause()) return;
     flasher.will_read = false;
     flasher.watchdog = millis();
-    HaltMode(&link_state, HALT_MODE_HALT_BUT_NO_RESET);
-    int read_result = ReadBinaryBlob(&link_state, flasher.offset, flasher.size, binary_buf);
-    if (read_result) {
-      Serial.println("Failed to read flash");
-      if (flasher_ws.active) {
-        flasher_ws.client->text("#4;Failed to read flash");
+    // The debugger holds the hart halted, resuming it after the read would pull it from under gdb
+    if (gdb.attached) dumpEnd(WLD_FAILED);
+    // #r has set up the link already
+    else if (dump.http && initLink() < 1) dumpEnd(WLD_FAILED);
+    else HaltMode(&link_state, HALT_MODE_HALT_BUT_NO_RESET);
+  }
+}
+
+// Framed requests keep the link initialized and the target halted between
+// jobs, so pipelined requests don't pay for it every time.
+void frameHalt() {
+  if (frame_queue.auto_halted) return;
+  HaltMode(&link_state, HALT_MODE_HALT_BUT_NO_RESET);
+  frame_queue.auto_halted = true;
+}
+
+void handleFrameQueue() {
+  if (flasher.active || frameQueueCount() == 0) return;
+  FrameJob* job = &frame_queue.jobs[frame_queue.tail];
+  WLFrameHeader_t* header = &job->header;
+  const size_t reply_offset = sizeof(WLFrameHeader_t);
+  uint8_t reply[sizeof(WLFrameHeader_t) + 96];
+  int r = 0;
+  // Replies go out whole, wait until a TCP client has room for this one
+  if (tcpSpace(job->tcp_client) < reply_offset + (header->opcode == WLF_OP_READ_MEM ? header->length : sizeof(reply))) return;
+  // The debugger holds the hart halted, a frame could reboot it or write under gdb.
+  // The watch list expects a running target, a HALT frame would stop it.
+  if (gdb.attached || watch.running) {
+    frameReply(job, WLF_STATUS_BUSY);
+    goto done;
+  }
+  // Tried again on the next pass while the polling task holds the link
+  if (!terminalPause()) return;
+  flasher.watchdog = millis();
+  if (!frame_queue.link_ready && header->opcode != WLF_OP_NOP) {
+    if (initLink() < 1) {
+      frameReply(job, WLF_STATUS_LINK_FAILED);
+      goto done;
+    }
+    frame_queue.link_ready = true;
+  }
+  switch (header->opcode) {
+  case WLF_OP_NOP:
+    frameReply(job, WLF_STATUS_OK);
+    break;
+  case WLF_OP_INFO:
+    r = chipInfo((char*)reply + reply_offset);
+    // chipInfo() resumes the target
+    frame_queue.auto_halted = false;
+    if (r) frameReply(job, WLF_STATUS_FAILED);
+    else frameReply(job, WLF_STATUS_OK, reply, strlen((char*)reply + reply_offset));
+    break;
+  case WLF_OP_HALT:
+    if (header->address > HALT_MODE_HALT_BUT_NO_RESET || header->address == 4) {
+      frameReply(job, WLF_STATUS_BAD_ARGUMENT);
+      break;
+    }
+    HaltMode(&link_state, header->address);
+    // Explicit halt mode is left as is when the queue drains
+    frame_queue.auto_halted = false;
+    frameReply(job, WLF_STATUS_OK);
+    break;
+  case WLF_OP_READ_REG: {
+    uint32_t value = 0;
+    r = MCFReadReg32(&link_state, header->address, &value);
+    memcpy(reply + reply_offset, &value, sizeof(value));
+    if (r) frameReply(job, WLF_STATUS_FAILED);
+    else frameReply(job, WLF_STATUS_OK, reply, sizeof(value));
+    } break;
+  case WLF_OP_WRITE_REG:
+    if (header->length != sizeof(uint32_t)) {
+      frameReply(job, WLF_STATUS_BAD_ARGUMENT);
+      break;
+    }
+    MCFWriteReg32(&link_state, header->address, *(uint32_t*)job->payload);
+    frameReply(job, WLF_STATUS_OK);
+    break;
+  case WLF_OP_READ_MEM: {
+    uint8_t* buf = (uint8_t*)malloc(reply_offset + header->length);
+    if (buf == NULL) {
+      frameReply(job, WLF_STATUS_BUSY);
+      break;
+    }
+    frameHalt();
+    r = ReadBinaryBlob(&link_state, header->address, header->length, buf + reply_offset);
+    if (r) frameReply(job, WLF_STATUS_FAILED);
+    else frameReply(job, WLF_STATUS_OK, buf, header->length);
+    free(buf);
+    } break;
+  case WLF_OP_WRITE_MEM:
+    frameHalt();
+    r = WriteBinaryBlob(&link_state, header->address, header->length, job->payload);
+    frameReply(job, r ? WLF_STATUS_FAILED : WLF_STATUS_OK);
+    break;
+  case WLF_OP_FLASH:
+    jobTimingStart();
+    r = writeBinary(header->address, header->length, job->payload);
+    // writeBinary() does its own init and reboots the target
+    frame_queue.auto_halted = false;
+    sprintf(flasher.message, r ? "Flashing failed: %d" : "Flashed successfully", r);
+    progressUpdate(r ? WLP_FAILED : WLP_DONE, header->length, header->length);
+    if (r) metrics.flash_jobs_failed++;
+    else metrics.flash_jobs_ok++;
+    jobTimingFinish();
+    link_events.send(flasher.message, "flasher", millis());
+    frameReply(job, r == -2 ? WLF_STATUS_LINK_FAILED : r ? WLF_STATUS_FAILED : WLF_STATUS_OK);
+    break;
+  case WLF_OP_ERASE:
+    frameHalt();
+    r = EraseFlash(&link_state, header->address, header->length, header->length ? 0 : 1);
+    progressUpdate(r ? WLP_FAILED : WLP_DONE, progress.done, progress.total);
+    frameReply(job, r ? WLF_STATUS_FAILED : WLF_STATUS_OK);
+    break;
+  case WLF_OP_FILL:
+  case WLF_OP_VERIFY:
+  case WLF_OP_COPY:
+  case WLF_OP_COMPARE:
+  case WLF_OP_CHECKSUM: {
+    // Payload is bytes, then the argument and step, checksum takes bytes from length
+    uint32_t args[3] = {header->length, 0, 0};
+    uint32_t result;
+    if (header->opcode != WLF_OP_CHECKSUM) {
+      if (header->length < 8 || header->length > sizeof(args) || header->length & 3) {
+        frameReply(job, WLF_STATUS_BAD_ARGUMENT);
+        break;
       }
-    } else {
-      if (flasher_ws.active) {
-        flasher_ws.client->binary(binary_buf, flasher.size);
-        flasher_ws.client->text("#0;Download complete");
+      memcpy(args, job->payload, header->length);
+    }
+    frameHalt();
+    r = memoryLoop(header->opcode, header->address, args[0], args[1], args[2], &result);
+    memcpy(reply + reply_offset, &result, sizeof(result));
+    if (r == -1) frameReply(job, WLF_STATUS_BAD_ARGUMENT);
+    else if (r) frameReply(job, WLF_STATUS_FAILED);
+    else if (header->opcode == WLF_OP_FILL || header->opcode == WLF_OP_COPY) frameReply(job, WLF_STATUS_OK);
+    else frameReply(job, WLF_STATUS_OK, reply, sizeof(result));
+    } break;
+  default:
+    frameReply(job, WLF_STATUS_UNKNOWN);
+    break;
+  }
+done:
+  if (job->payload != NULL) {
+    frame_queue.pending_bytes -= header->length;
+    free(job->payload);
+    job->payload = NULL;
+  }
+  frame_queue.tail = (frame_queue.tail + 1) % FRAME_QUEUE_SIZE;
+  if (frameQueueCount() == 0) {
+    if (frame_queue.auto_halted) HaltMode(&link_state, HALT_MODE_RESUME);
+    frame_queue.auto_halted = false;
+    frame_queue.link_ready = false;
+    terminalResume();
+  }
+}
+
+uint32_t benchFinish(BenchResult* result, uint32_t start) {
+  result->us += micros() - start;
+  return result->errors;
+}
+
+// Every test leaves the target as it found it, flash tests write back what was there
+int benchRun() {
+  BenchResult* results = bench.results;
+  uint32_t start, value;
+  int r;
+
+  HaltMode(&link_state, HALT_MODE_HALT_BUT_NO_RESET);
+  // Plain DM register access, DATA0 is harmless while autoexec is off
+  MCFWriteReg32(&link_state, DMABSTRACTAUTO, 0x00000000);
+  link_state.statetag = STTAG( "XXXX" );
+  start = micros();
+  for (uint32_t i = 0; i < BENCH_REG_OPS; i++) MCFWriteReg32(&link_state, DMDATA0, i);
+  results[WLB_REG_WRITE].ops = BENCH_REG_OPS;
+  results[WLB_REG_WRITE].bytes = BENCH_REG_OPS * 4;
+  benchFinish(&results[WLB_REG_WRITE], start);
+  start = micros();
+  for (uint32_t i = 0; i < BENCH_REG_OPS; i++) {
+    r = MCFReadReg32(&link_state, DMDATA0, &value);
+    if (r || value != BENCH_REG_OPS - 1) results[WLB_REG_READ].errors++;
+  }
+  results[WLB_REG_READ].ops = BENCH_REG_OPS;
+  results[WLB_REG_READ].bytes = BENCH_REG_OPS * 4;
+  // A dead link fails every read, no point in going on
+  if (benchFinish(&results[WLB_REG_READ], start) == BENCH_REG_OPS) return -2;
+
+  // Autoincrement ReadWord() over the start of flash
+  start = micros();
+  for (uint32_t i = 0; i < BENCH_READ_BYTES; i += 4) {
+    if (ReadWord(&link_state, 0x08000000 + i, &value)) results[WLB_WORD_READ].errors++;
+  }
+  results[WLB_WORD_READ].ops = BENCH_READ_BYTES / 4;
+  results[WLB_WORD_READ].bytes = BENCH_READ_BYTES;
+  benchFinish(&results[WLB_WORD_READ], start);
+
+  // RAM, saved and restored around a pattern write
+  image.begin(3 * BENCH_RAM_BYTES);
+  uint8_t* saved = image.page(0, true);
+  uint8_t* pattern = image.page(1, true);
+  uint8_t* check = image.page(2, true);
+  if (saved == NULL || pattern == NULL || check == NULL) return -4;
+  if (ReadBinaryBlob(&link_state, 0x20000000, BENCH_RAM_BYTES, saved)) return -3;
+  for (uint32_t i = 0; i < BENCH_RAM_BYTES; i++) pattern[i] = i * 7 + 0x5a;
+  start = micros();
+  r = WriteBinaryBlob(&link_state, 0x20000000, BENCH_RAM_BYTES, pattern);
+  results[WLB_RAM_WRITE].ops = BENCH_RAM_BYTES / 4;
+  results[WLB_RAM_WRITE].bytes = BENCH_RAM_BYTES;
+  benchFinish(&results[WLB_RAM_WRITE], start);
+  if (r || ReadBinaryBlob(&link_state, 0x20000000, BENCH_RAM_BYTES, check)) {
+    results[WLB_RAM_WRITE].errors++;
+  } else {
+    for (uint32_t i = 0; i < BENCH_RAM_BYTES; i += 4) {
+      if (memcmp(pattern + i, check + i, 4)) results[WLB_RAM_WRITE].errors++;
+    }
+  }
+  WriteBinaryBlob(&link_state, 0x20000000, BENCH_RAM_BYTES, saved);
+  if (!bench.flash) return 0;
+
+  uint32_t page_size = DetectChip(&link_state)->page_size;
+  uint32_t flash_size = min(link_state.flash_size, (uint32_t)IMAGE_MAX_SIZE);
+  if (flash_size < 1024) return -3;
+  // Whole image has to be read back before anything is erased
+  image.begin(flash_size);
+  for (uint32_t i = 0; i < image.pageCount(); i++) {
+    uint8_t* page = image.page(i, true);
+    if (page == NULL) return -4;
+    if (ReadBinaryBlob(&link_state, 0x08000000 + i * IMAGE_PAGE_SIZE, image.pageLength(i), page)) return -3;
+  }
+
+  // Erase + program + verify of the last page, rewritten with its own content
+  uint32_t last = image.pageCount() - 1;
+  uint8_t* page = image.page(last) + image.pageLength(last) - page_size;
+  for (int i = 0; i < BENCH_PAGE_WRITES; i++) {
+    start = micros();
+    if (WriteFlashPage(&link_state, 0x08000000 + flash_size - page_size, page)) results[WLB_PAGE_PROGRAM].errors++;
+    benchFinish(&results[WLB_PAGE_PROGRAM], start);
+  }
+  results[WLB_PAGE_PROGRAM].ops = BENCH_PAGE_WRITES;
+  results[WLB_PAGE_PROGRAM].bytes = BENCH_PAGE_WRITES * page_size;
+
+  start = micros();
+  if (writeImagePages(0x08000000)) results[WLB_FLASH_IMAGE].errors++;
+  results[WLB_FLASH_IMAGE].ops = flash_size / page_size;
+  results[WLB_FLASH_IMAGE].bytes = flash_size;
+  benchFinish(&results[WLB_FLASH_IMAGE], start);
+  return 0;
+}
+
+void handleBench() {
+  if (!bench.pending) return;
+  flasher.watchdog = millis();
+  terminalPause();
+  memset(bench.results, 0, sizeof(bench.results));
+  // Benchmark writes aren't flasher jobs, keep them off /events
+  link_state.progress = NULL;
+  uint32_t start = millis();
+  // The debugger holds the hart halted, resuming or rebooting it would pull it from under gdb
+  int r = gdb.attached ? -5 : initLink() < 1 ? -2 : benchRun();
+  link_state.progress = onLinkProgress;
+  if (!gdb.attached) HaltMode(&link_state, bench.flash ? HALT_MODE_REBOOT : HALT_MODE_RESUME);
+
+  int pos = snprintf(bench.json, sizeof(bench.json), "{\"status\":%d,\"cpu_mhz\":%" PRIu32 ",\"t1coeff\":%d,\"total_ms\":%" PRIu32 ",\"tests\":{",
+                     r, ESP.getCpuFreqMHz(), link_state.t1coeff, millis() - start);
+  bool first = true;
+  for (int i = 0; i < WLB_TEST_COUNT && pos < (int)sizeof(bench.json); i++) {
+    const BenchResult* result = &bench.results[i];
+    if (!result->ops) continue;
+    uint32_t us = max(result->us, (uint32_t)1);
+    pos += snprintf(bench.json + pos, sizeof(bench.json) - pos,
+                    "%s\"%s\":{\"ops\":%" PRIu32 ",\"bytes\":%" PRIu32 ",\"us\":%" PRIu32 ",\"ops_s\":%" PRIu32 ",\"bits_s\":%" PRIu32 ",\"errors\":%" PRIu32 "}",
+                    first ? "" : ",", bench_test_names[i], result->ops, result->bytes, result->us,
+                    (uint32_t)((uint64_t)result->ops * 1000000 / us), (uint32_t)((uint64_t)result->bytes * 8000000 / us), result->errors);
+    first = false;
+  }
+  if (pos < (int)sizeof(bench.json) - 2) strcat(bench.json, "}}");
+  Serial.printf("Bench: %s\n\r", bench.json);
+  bench.pending = false;
+  resetFlasher();
+}
+
+void pacerStart(Pacer* pacer, uint32_t rate) {
+  pacer->period = 1000000 / rate;
+  pacer->next_us = micros();
+}
+
+// Whether the next sample is due, waits for it if that's at most max_us away
+bool pacerWait(Pacer* pacer, uint32_t max_us) {
+  if ((int32_t)(pacer->next_us - micros()) > (int32_t)max_us) return false;
+  while ((int32_t)(micros() - pacer->next_us) < 0) {}
+  return true;
+}
+
+// Schedules the next sample, returns the number of samples missed
+uint32_t pacerNext(Pacer* pacer) {
+  pacer->next_us += pacer->period;
+  // Fell behind, skip ahead instead of sampling in a burst
+  if ((int32_t)(micros() - pacer->next_us) <= (int32_t)pacer->period) return 0;
+  uint32_t late = (micros() - pacer->next_us) / pacer->period;
+  pacer->next_us += late * pacer->period;
+  return late;
+}
+
+void profileAdd(uint32_t pc) {
+  // Instructions are at least 2 byte aligned
+  uint32_t slot = ((pc >> 1) * 2654435761u) % PROFILE_TABLE_SIZE;
+  for (uint32_t i = 0; i < PROFILE_TABLE_SIZE; i++) {
+    ProfileEntry* e = &profile.table[(slot + i) % PROFILE_TABLE_SIZE];
+    if (e->count && e->pc != pc) continue;
+    e->pc = pc;
+    e->count++;
+    return;
+  }
+  profile.dropped++;
+}
+
+int profileCompare(const void* a, const void* b) {
+  uint32_t ca = ((const ProfileEntry*)a)->count, cb = ((const ProfileEntry*)b)->count;
+  return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+int profileBegin() {
+  uint32_t reg;
+  memset(profile.table, 0, sizeof(profile.table));
+  profile.samples = profile.missed = profile.errors = profile.dropped = profile.sample_us = 0;
+  profile.busy_us = 0;
+  // The debugger holds the hart halted, sampling would let it run
+  if (gdb.attached) return -5;
+  if (initLink() < 1) return -2;
+  if (MCFReadReg32(&link_state, DMSTATUS, &reg)) return -2;
+  // Sampling resumes the hart, don't let a halted target run
+  if (reg & (1 << 9)) return -5;
+  profile.start = millis();
+  pacerStart(&profile.pacer, profile.rate);
+  profile.running = true;
+  return 0;
+}
+
+void profileEnd(int status) {
+  profile.running = false;
+  profile.status = status;
+  if (profile.samples) profile.sample_us = profile.busy_us / (profile.samples + profile.errors);
+  qsort(profile.table, PROFILE_TABLE_SIZE, sizeof(ProfileEntry), profileCompare);
+  profile.used = 0;
+  while (profile.used < PROFILE_TABLE_SIZE && profile.table[profile.used].count) profile.used++;
+  // SamplePC() leaves the autoexec state behind, nothing else expects it
+  ResetInternalProgrammingState(&link_state);
+
+  snprintf(profile.json, sizeof(profile.json), "{\"status\":%d,\"rate\":%" PRIu32 ",\"ms\":%" PRIu32 ",\"samples\":%" PRIu32
+           ",\"missed\":%" PRIu32 ",\"errors\":%" PRIu32 ",\"dropped\":%" PRIu32 ",\"sample_us\":%" PRIu32 ",\"pcs\":%" PRIu32 "}",
+           profile.status, profile.rate, profile.ms, profile.samples, profile.missed, profile.errors, profile.dropped,
+           profile.sample_us, profile.used);
+  Serial.printf("Profile: %s\n\r", profile.json);
+  profile.pending = false;
+  resetFlasher();
+}
+
+// Samples for up to PROFILE_SLICE_US per pass, the rest of loop() runs in between
+void handleProfile() {
+  if (!profile.pending) return;
+  flasher.watchdog = millis();
+  if (!profile.running) {
+    terminalPause();
+    int r = profileBegin();
+    if (r) profileEnd(r);
+    return;
+  }
+  uint32_t slice = micros();
+  while (micros() - slice < PROFILE_SLICE_US && pacerWait(&profile.pacer, PROFILE_SLICE_US - (micros() - slice))) {
+    if (millis() - profile.start >= profile.ms) break;
+    uint32_t t = micros();
+    uint32_t pc;
+    if (SamplePC(&link_state, &pc)) {
+      // Nothing answers anymore, no point in going on
+      if (++profile.errors > 10 && !profile.samples) {
+        profileEnd(-3);
+        return;
       }
+    } else {
+      profileAdd(pc);
+      profile.samples++;
     }
+    profile.busy_us += micros() - t;
+    profile.missed += pacerNext(&profile.pacer);
+  }
+  if (millis() - profile.start >= profile.ms) profileEnd(0);
+}
+
+// Registers are read before anything touches memory, the memory routines
+// use x8-x13. RAM goes through the image store on its way to the file.
+int snapshotSave(const char* path) {
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "WLSS", 4);
+  header.version = SNAPSHOT_VERSION;
+  header.csr_count = SNAPSHOT_CSR_COUNT;
+  HaltMode(&link_state, HALT_MODE_HALT_BUT_NO_RESET);
+  if (ReadCPURegisters(&link_state, SWIO_REG_GPR + 1, 15, header.gprs)) return -3;
+  for (uint32_t i = 0; i < SNAPSHOT_CSR_COUNT; i++) {
+    if (!ReadCPURegister(&link_state, snapshot_csrs[i], &header.csrs[i])) header.csr_valid |= 1 << i;
+  }
+  const struct SWIOChip* chip = DetectChip(&link_state);
+  // Only the CH32V003 is RV32E, x16 and up are untouched by DetectChip()
+  header.gpr_count = strcmp(chip->name, "CH32V003") ? 31 : 15;
+  if (header.gpr_count > 15 && ReadCPURegisters(&link_state, SWIO_REG_GPR + 16, 16, header.gprs + 15)) return -3;
+  strncpy(header.chip, chip->name, sizeof(header.chip));
+  header.ram_base = chip->ram_base;
+  header.ram_size = chip->ram_size;
+  if (!image.begin(header.ram_size)) return -4;
+  for (uint32_t i = 0; i < image.pageCount(); i++) {
+    uint8_t* page = image.page(i, true);
+    if (page == NULL) return -4;
+    if (ReadBinaryBlob(&link_state, header.ram_base + i * IMAGE_PAGE_SIZE, image.pageLength(i), page)) return -3;
+  }
+  HaltMode(&link_state, HALT_MODE_RESUME);
+
+  File file = LittleFS.open(path, FILE_WRITE, true);
+  if (!file) return -6;
+  bool ok = file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header);
+  for (uint32_t i = 0; i < image.pageCount() && ok; i++) {
+    ok = file.write(image.page(i), image.pageLength(i)) == image.pageLength(i);
+  }
+  file.close();
+  if (!ok) {
+    LittleFS.remove(path);
+    return -6;
+  }
+  return 0;
+}
+
+// The file is read before the halt, the hart only stops for the RAM write
+// and the registers. Registers go last, writing RAM uses x8-x13.
+int snapshotRestore(const char* path) {
+  SnapshotHeader header;
+  File file = LittleFS.open(path, FILE_READ);
+  if (!file) return -7;
+  bool ok = file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) && !memcmp(header.magic, "WLSS", 4) &&
+            header.version == SNAPSHOT_VERSION && header.gpr_count <= SNAPSHOT_MAX_GPRS && header.csr_count == SNAPSHOT_CSR_COUNT &&
+            image.begin(header.ram_size);
+  for (uint32_t i = 0; i < image.pageCount() && ok; i++) {
+    uint8_t* page = image.page(i, true);
+    ok = page != NULL && file.read(page, image.pageLength(i)) == image.pageLength(i);
+  }
+  file.close();
+  if (!ok) return -7;
+
+  HaltMode(&link_state, HALT_MODE_HALT_BUT_NO_RESET);
+  const struct SWIOChip* chip = DetectChip(&link_state);
+  if (strncmp(header.chip, chip->name, sizeof(header.chip)) || header.ram_base != chip->ram_base || header.ram_size != chip->ram_size) {
     HaltMode(&link_state, HALT_MODE_RESUME);
+    return -8;
+  }
+  int r = writeImagePages(header.ram_base);
+  for (uint32_t i = 0; i < SNAPSHOT_CSR_COUNT && !r; i++) {
+    if (header.csr_valid & (1 << i)) r = WriteCPURegister(&link_state, snapshot_csrs[i], header.csrs[i]);
+  }
+  for (uint32_t i = 0; i < header.gpr_count && !r; i++) r = WriteCPURegister(&link_state, SWIO_REG_GPR + 1 + i, header.gprs[i]);
+  if (r) return -3;
+  HaltMode(&link_state, HALT_MODE_RESUME);
+  return 0;
+}
+
+void handleSnapshot() {
+  if (snapshot.op == WLS_NONE) return;
+  char path[sizeof(SNAPSHOT_DIR) + SNAPSHOT_NAME_MAX + 8];
+  snprintf(path, sizeof(path), SNAPSHOT_DIR "/%s.bin", snapshot.name);
+  flasher.watchdog = millis();
+  terminalPause();
+  // Not a flasher job, keep it off /events
+  link_state.progress = NULL;
+  uint32_t start = millis();
+  // The debugger holds the hart halted, saving or restoring would let it run
+  int r = gdb.attached ? -5 : initLink() < 1 ? -2 : snapshot.op == WLS_SAVE ? snapshotSave(path) : snapshotRestore(path);
+  // A failed save leaves the target as it was, a failed restore leaves it halted
+  if (r && !gdb.attached && snapshot.op == WLS_SAVE) HaltMode(&link_state, HALT_MODE_RESUME);
+  link_state.progress = onLinkProgress;
+  const char* what = snapshot.op == WLS_SAVE ? "saved" : "restored";
+  if (r) snprintf(snapshot.reply, sizeof(snapshot.reply), "#4;Snapshot %s not %s (%d)", snapshot.name, what, r);
+  else snprintf(snapshot.reply, sizeof(snapshot.reply), "#0;Snapshot %s %s in %" PRIu32 "ms", snapshot.name, what, millis() - start);
+  Serial.println(snapshot.reply);
+  snapshot.op = WLS_NONE;
+  resetFlasher();
+}
+
+int personalizeStore() {
+  PersonalizeHeader* header = &personalize.header;
+  // Of the image, the upload may have been compressed
+  header->crc = 0;
+  for (uint32_t i = 0; i < image.pageCount(); i++) {
+    if (image.page(i) == NULL) return -6;
+    header->crc = esp_rom_crc32_le(header->crc, image.page(i), image.pageLength(i));
+  }
+  File file = LittleFS.open(PERSONALIZE_IMAGE, FILE_WRITE, true);
+  if (!file) return -6;
+  bool ok = file.write((const uint8_t*)header, sizeof(PersonalizeHeader)) == sizeof(PersonalizeHeader);
+  for (uint32_t i = 0; i < image.pageCount() && ok; i++) {
+    ok = image.page(i) != NULL && file.write(image.page(i), image.pageLength(i)) == image.pageLength(i);
+  }
+  file.close();
+  if (!ok) {
+    LittleFS.remove(PERSONALIZE_IMAGE);
+    return -6;
+  }
+  return 0;
+}
+
+// Loads the base image into the image store and patches it there, the
+// flasher then programs it like any other upload. Only the pages the
+// patches fall into differ from the base image.
+int personalizeLoad() {
+  PersonalizeHeader header;
+  File file = LittleFS.open(PERSONALIZE_IMAGE, FILE_READ);
+  if (!file) return -7;
+  bool ok = file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) && !memcmp(header.magic, "WLPI", 4) &&
+            header.version == PERSONALIZE_VERSION && header.patch_count <= PERSONALIZE_MAX_PATCHES && image.begin(header.size);
+  uint32_t crc = 0;
+  for (uint32_t i = 0; i < image.pageCount() && ok; i++) {
+    uint8_t* page = image.page(i, true);
+    ok = page != NULL && file.read(page, image.pageLength(i)) == image.pageLength(i);
+    if (ok) crc = esp_rom_crc32_le(crc, page, image.pageLength(i));
+  }
+  file.close();
+  if (!ok || crc != header.crc) return -7;
+
+  uint8_t uid[ESIG_UNIID_SIZE];
+  bool have_uid = false;
+  uint32_t counter = personalizeCounter();
+  uint32_t value_pos = 0;
+  for (uint8_t i = 0; i < header.patch_count; i++) {
+    const PatchEntry* patch = &header.patches[i];
+    const uint8_t* bytes;
+    switch (patch->source) {
+    case WLPS_COUNTER:
+      bytes = (const uint8_t*)&counter;
+      break;
+    case WLPS_UID:
+      if (!have_uid) {
+        if (initLink() < 1) return -2;
+        HaltMode(&link_state, HALT_MODE_HALT_BUT_NO_RESET);
+        for (int w = 0; w < ESIG_UNIID_SIZE / 4; w++) {
+          uint32_t reg;
+          if (ReadWord(&link_state, ESIG_UNIID + w * 4, &reg)) return -3;
+          memcpy(uid + w * 4, &reg, 4);
+        }
+        have_uid = true;
+      }
+      bytes = uid;
+      break;
+    case WLPS_VALUE:
+      if (value_pos + patch->length > personalize.value_len) return -10;
+      bytes = personalize.value + value_pos;
+      value_pos += patch->length;
+      break;
+    default:
+      return -7;
+    }
+    if (!image.write(patch->offset, bytes, patch->length)) return -7;
+  }
+  if (value_pos != personalize.value_len) return -10;
+  personalize.unit = counter;
+  flasher.offset = header.offset;
+  flasher.size = header.size;
+  return 0;
+}
+
+// Storing and loading happen here, programming is left to handleFlasher()
+void handlePersonalize() {
+  uint8_t op = personalize.op;
+  if (op == WLU_NONE) return;
+  if (op == WLU_FLASHING) {
+    if (flasher.active) return;
+    if (flasher.status == WLF_SUCCESS) {
+      personalizeSetCounter(personalize.unit + 1);
+      snprintf(personalize.reply, sizeof(personalize.reply), "#0;Unit %" PRIu32 " flashed in %" PRIu32 "ms\n", personalize.unit, millis() - personalize.start);
+    } else {
+      snprintf(personalize.reply, sizeof(personalize.reply), "#4;Unit %" PRIu32 ": %s\n", personalize.unit, flasher.message);
+    }
+    Serial.print(personalize.reply);
+    personalize.op = WLU_NONE;
+    return;
+  }
+  flasher.watchdog = millis();
+  if (op == WLU_STORE) {
+    int r = personalizeStore();
+    if (r) snprintf(personalize.reply, sizeof(personalize.reply), "#4;Image not stored (%d)\n", r);
+    else snprintf(personalize.reply, sizeof(personalize.reply), "#0;Stored %" PRIu32 " bytes for 0x%08" PRIx32 " with %u patches\n",
+                  personalize.header.size, personalize.header.offset, personalize.header.patch_count);
+    Serial.print(personalize.reply);
+    personalize.op = WLU_NONE;
+    resetFlasher();
+    return;
+  }
+  terminalPause();
+  personalize.start = millis();
+  // The debugger holds the hart halted, flashing would reboot it from under gdb
+  int r = gdb.attached ? -5 : personalizeLoad();
+  if (r) {
+    const char* why = r == -5 ? "Debugger attached" : r == -7 ? "No image or image is corrupt" : r == -10 ? "Value doesn't match the manifest" : "Failed to read UID";
+    snprintf(personalize.reply, sizeof(personalize.reply), "#%d;%s (%d)\n", r == -10 ? 3 : r == -2 ? 2 : 4, why, r);
+    Serial.print(personalize.reply);
+    personalize.op = WLU_NONE;
     resetFlasher();
+    return;
+  }
+  flasher.status = WLF_UPDATING;
+  flasher.will_flash = true;
+  personalize.op = WLU_FLASHING;
+  link_events.send("Will flash", "flasher", millis());
+}
+
+int watchCompare(const void* a, const void* b) {
+  uint32_t aa = ((const WatchVar*)a)->address, ab = ((const WatchVar*)b)->address;
+  return aa < ab ? -1 : aa > ab ? 1 : 0;
+}
+
+// Variables sorted by address and merged into word ranges: neighbours share
+// a range, in SRAM so do variables a few words apart. Peripheral registers
+// in between are never read.
+int watchRanges() {
+  WatchVar sorted[WATCH_MAX_VARS];
+  memcpy(sorted, watch.vars, sizeof(WatchVar) * watch.count);
+  qsort(sorted, watch.count, sizeof(WatchVar), watchCompare);
+  watch.range_count = 0;
+  watch.words = 0;
+  for (uint8_t i = 0; i < watch.count; i++) {
+    uint32_t first = sorted[i].address & ~3u;
+    SWIORange* last = watch.range_count ? &watch.ranges[watch.range_count - 1] : NULL;
+    uint32_t gap = WATCH_MAX_GAP_WORDS * 4;
+    if (first < 0x20000000 || first >= 0x40000000) gap = 0;
+    if (last != NULL && first <= last->address + last->words * 4 + gap) {
+      uint32_t words = (first - last->address) / 4 + 1;
+      if (words > last->words) {
+        watch.words += words - last->words;
+        last->words = words;
+      }
+    } else {
+      watch.ranges[watch.range_count].address = first;
+      watch.ranges[watch.range_count].words = 1;
+      watch.range_count++;
+      watch.words++;
+    }
+    if (watch.words > WATCH_MAX_WORDS) return -3;
+  }
+  // Where every variable ends up in the words of a sample
+  for (uint8_t i = 0; i < watch.count; i++) {
+    uint32_t first = watch.vars[i].address & ~3u, offset = 0;
+    for (uint8_t r = 0; r < watch.range_count; r++) {
+      const SWIORange* range = &watch.ranges[r];
+      if (first >= range->address && first < range->address + range->words * 4) {
+        watch.vars[i].offset = offset + (watch.vars[i].address - range->address);
+        break;
+      }
+      offset += range->words * 4;
+    }
+  }
+  return 0;
+}
+
+void watchEnd(int status) {
+  watch.running = false;
+  watch.status = status;
+  Serial.printf("Watch stopped: %d, %" PRIu32 " samples, %" PRIu32 " missed, %" PRIu32 " errors\n\r",
+                status, watch.samples, watch.missed, watch.errors);
+  ResetInternalProgrammingState(&link_state);
+  terminalResume();
+}
+
+int watchBegin() {
+  uint32_t reg;
+  watch.count = watch.new_count;
+  watch.rate = watch.new_rate;
+  memcpy(watch.vars, watch.new_vars, sizeof(watch.vars));
+  watch.record_size = 4;
+  for (uint8_t i = 0; i < watch.count; i++) watch.record_size += watch.vars[i].size;
+  watch.capacity = WATCH_BUFFER_SIZE / watch.record_size;
+  watch.generation++;
+  watch.head = watch.sent = 0;
+  watch.samples = watch.missed = watch.errors = 0;
+  watch.sysbus = false;
+  if (watchRanges()) return -3;
+  if (initLink() < 1) return -2;
+  if (MCFReadReg32(&link_state, DMSTATUS, &reg)) return -2;
+  // Without system bus access sampling resumes the hart, don't let a halted target run
+  if (reg & (1 << 9)) return -5;
+  pacerStart(&watch.pacer, watch.rate);
+  watch.start_us = watch.pacer.next_us;
+  watch.last_send = millis();
+  return 0;
+}
+
+// New records go out in messages of whole records
+void watchSend() {
+  uint8_t buf[WATCH_MESSAGE_SIZE];
+  if (watch.head - watch.sent > watch.capacity) watch.sent = watch.head - watch.capacity;
+  while (watch.sent < watch.head) {
+    size_t len = 0;
+    while (watch.sent < watch.head && len + watch.record_size <= sizeof(buf)) {
+      memcpy(buf + len, watch.buf + (watch.sent % watch.capacity) * watch.record_size, watch.record_size);
+      len += watch.record_size;
+      watch.sent++;
+    }
+    watch_ws.binaryAll(buf, len);
+  }
+}
+
+void handleWatch() {
+  if (watch.stop) {
+    watch.stop = false;
+    if (watch.running) watchEnd(0);
+  }
+  if (watch.start) {
+    if (flasher.active || frameQueueCount() || !terminalPause()) return;
+    watch.start = false;
+    watch.running = true;
+    int r = gdb.attached ? -5 : watchBegin();
+    if (r) watchEnd(r);
+    else Serial.printf("Watching %u variables in %u ranges at %" PRIu32 " Hz\n\r", watch.count, watch.range_count, watch.rate);
+  }
+  if (!watch.running) return;
+  // The debugger holds the hart halted, sampling would let it run
+  if (gdb.attached) {
+    watchEnd(-5);
+    return;
+  }
+  if (millis() - watch.last_send >= WATCH_SEND_INTERVAL) {
+    watch.last_send = millis();
+    if (watch_ws.count()) watchSend();
+    else watch.sent = watch.head;
+  }
+  // Flasher jobs have the link, their time shows up as missed samples
+  if (flasher.active || frameQueueCount()) return;
+  if (!pacerWait(&watch.pacer, 0)) return;
+  uint32_t now = micros();
+  uint32_t data[WATCH_MAX_WORDS];
+  if (ReadRunning(&link_state, watch.ranges, watch.range_count, data)) {
+    watch.errors++;
+  } else {
+    uint8_t* record = watch.buf + (watch.head % watch.capacity) * watch.record_size;
+    uint32_t us = now - watch.start_us;
+    memcpy(record, &us, 4);
+    uint16_t offset = 4;
+    for (uint8_t i = 0; i < watch.count; i++) {
+      memcpy(record + offset, (const uint8_t*)data + watch.vars[i].offset, watch.vars[i].size);
+      offset += watch.vars[i].size;
+    }
+    watch.head++;
+    watch.samples++;
   }
+  watch.sysbus = link_state.statetag == STTAG( "SBUS" );
+  watch.missed += pacerNext(&watch.pacer);
 }
 
 void parseMessage(char* message) {
@@ -1133,9 +4448,39 @@ void uartSetup() {
 void terminalDisconnect() {
   terminal.connected = false;
   terminal_ws.closeAll();
+  tcpTerminalCloseAll();
   Serial.println("Debug terminal disconnected");
 }
 
+// Stops SWIO polling without dropping terminal clients, so the link can be
+// used by the flasher. Returns once the polling task is done with the link,
+// false if it didn't let go of it within 100ms and polling goes on.
+bool terminalPause() {
+  if (terminal.paused) return true;
+  terminal.paused = true;
+  // Once the lock is ours the polling task has seen the flag
+  if (xSemaphoreTake(terminal.lock, pdMS_TO_TICKS(100)) != pdTRUE) {
+    terminal.paused = false;
+    Serial.println("Terminal polling didn't stop");
+    return false;
+  }
+  xSemaphoreGive(terminal.lock);
+  // initLink() starts a fresh buffer, send out whatever was collected so far
+  uint32_t buf_len = strlen(terminal.buf);
+  if (terminal.connected && buf_len > 1) {
+    terminal_ws.binaryAll((const uint8_t *)terminal.buf, buf_len);
+    strcpy(terminal.buf, "#");
+    terminal.last_send_time = millis();
+  }
+  return true;
+}
+
+void terminalResume() {
+  // Polling would get in the way of the debugger and the watch list
+  if (gdb.attached || watch.running) return;
+  terminal.paused = false;
+}
+
 ////////////////////////////////
 ///   General setups         ///
 ////////////////////////////////
@@ -1150,6 +4495,7 @@ void mdnsSetup() {
   MDNS.end();
   if (MDNS.begin(MDNS_NAME)) {
     MDNS.addService("http", "tcp", 80);
+    MDNS.addService("telnet", "tcp", TERMINAL_TCP_PORT);
     Serial.println("mDNS responder started: http://weblink.local");
   } else {
     Serial.println("Error setting up MDNS responder!");
@@ -1190,6 +4536,7 @@ void wifiSetup() {
 void setup()
 {
   Serial.begin(115200);
+  terminal.lock = xSemaphoreCreateMutex();
   delay(3000);
   Serial.printf("WCH WebLink version %.2f", (float)config.sw_version/100);
   startFS();
@@ -1214,7 +4561,11 @@ void setup()
   startOTA();
   #endif
   webServerSetup();
+  tcpServerSetup();
+  link_state.progress = onLinkProgress;
+  link_state.histograms = link_histograms;
   
+  LoopTask = xTaskGetCurrentTaskHandle();
   xTaskCreatePinnedToCore(&pollTerminal, "Polling task", 10000, NULL, 0, &PollTask, xPortGetCoreID());
 }
 
@@ -1234,6 +4585,7 @@ void loop()
   if (millis() - lastCleanup >= 1000) {
     terminal_ws.cleanupClients(2);
     flash_ws.cleanupClients(2);
+    watch_ws.cleanupClients(2);
     lastCleanup = millis();
     delay(1);
   }
@@ -1246,11 +4598,29 @@ void loop()
     }
   }
   if (millis() - flasher.watchdog > FLASHER_OP_TIMEOUT) {
+    if (flasher.active) {
+      progressUpdate(WLP_FAILED, progress.done, progress.total);
+      metrics.flasher_timeouts++;
+    }
     flasher.status = WLF_FAILED;
     flasher.error = WLF_TIMEOUT;
     resetFlasher();
   }
+  // Pages are only freed here, resetFlasher() can run while loop() still uses them
+  if (!flasher.active && image.size()) image.clear();
   delay(1);
+  handleTrace();
+  handleHistograms();
   handleFlasher();
+  handleMemoryLoop();
+  handleFrameQueue();
+  handleBench();
+  handleProfile();
+  handleSnapshot();
+  handlePersonalize();
+  handleWatch();
+  handleDump();
+  handleGdb();
+  progressPublish();
   delay(1);
 }
\ No newline at end of file
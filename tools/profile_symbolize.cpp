@@ -0,0 +1,157 @@
+// Turns the PC histogram from WebLink's /profile?format=folded into folded
+// stacks for flamegraph.pl, with every PC resolved to the function of the
+// firmware ELF it falls into. Samples are single PCs, there is no call
+// stack, so every line is one function, or function;address with -a.
+//
+//   profile_symbolize [-a] firmware.elf [profile.txt]
+//
+//   curl -s 'http://weblink.local/profile?format=folded' | profile_symbolize fw.elf | flamegraph.pl > fw.svg
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+// Code runs from the 0 alias of flash, images may be linked at either address
+#define FLASH_BASE 0x08000000
+
+struct Symbol {
+  uint32_t address;
+  uint32_t size;
+  std::string name;
+};
+
+static uint32_t get32(const std::vector<uint8_t>& elf, size_t offset) {
+  if (offset + 4 > elf.size()) return 0;
+  return elf[offset] | elf[offset + 1] << 8 | elf[offset + 2] << 16 | (uint32_t)elf[offset + 3] << 24;
+}
+
+static uint16_t get16(const std::vector<uint8_t>& elf, size_t offset) {
+  if (offset + 2 > elf.size()) return 0;
+  return elf[offset] | elf[offset + 1] << 8;
+}
+
+// Functions and untyped code labels from .symtab, sorted by address
+static bool loadSymbols(const char* path, std::vector<Symbol>& symbols) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  std::vector<uint8_t> elf;
+  uint8_t buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) elf.insert(elf.end(), buf, buf + n);
+  fclose(f);
+  // 32 bit little endian only, that's every WCH RISC-V part
+  if (elf.size() < 52 || memcmp(elf.data(), "\x7f" "ELF", 4) || elf[4] != 1 || elf[5] != 1) {
+    fprintf(stderr, "%s: not a 32 bit little endian ELF\n", path);
+    return false;
+  }
+  uint32_t shoff = get32(elf, 0x20);
+  uint16_t shentsize = get16(elf, 0x2e);
+  uint16_t shnum = get16(elf, 0x30);
+  for (uint16_t i = 0; i < shnum; i++) {
+    size_t sh = shoff + (size_t)i * shentsize;
+    if (get32(elf, sh + 4) != 2) continue; // SHT_SYMTAB
+    uint32_t offset = get32(elf, sh + 16);
+    uint32_t size = get32(elf, sh + 20);
+    uint32_t entsize = get32(elf, sh + 36);
+    size_t strtab = get32(elf, shoff + (size_t)get32(elf, sh + 24) * shentsize + 16);
+    if (entsize < 16 || (size_t)offset + size > elf.size() || strtab >= elf.size()) break;
+    for (uint32_t s = offset; s + entsize <= offset + size; s += entsize) {
+      uint8_t type = elf[s + 12] & 0xf;
+      uint16_t shndx = get16(elf, s + 14);
+      uint32_t name = get32(elf, s);
+      // STT_FUNC, or STT_NOTYPE for labels in assembly startup code
+      if ((type != 2 && type != 0) || shndx == 0 || shndx >= 0xff00 || !name) continue;
+      if (strtab + name >= elf.size()) continue;
+      const char* str = (const char*)elf.data() + strtab + name;
+      const char* end = (const char*)memchr(str, 0, elf.size() - strtab - name);
+      if (end == NULL || str[0] == '.' || str[0] == '$') continue;
+      if (type == 0 && get32(elf, s + 8) == 0) continue; // Data labels and section markers
+      symbols.push_back({get32(elf, s + 4) & ~1u, get32(elf, s + 8), std::string(str, end)});
+    }
+  }
+  if (symbols.empty()) {
+    fprintf(stderr, "%s: no symbols, was it stripped?\n", path);
+    return false;
+  }
+  std::sort(symbols.begin(), symbols.end(), [](const Symbol& a, const Symbol& b) {
+    return a.address < b.address || (a.address == b.address && a.size > b.size);
+  });
+  return true;
+}
+
+// A symbol without a size covers everything up to the next one
+static const Symbol* lookup(const std::vector<Symbol>& symbols, uint32_t pc) {
+  auto it = std::upper_bound(symbols.begin(), symbols.end(), pc, [](uint32_t pc, const Symbol& s) { return pc < s.address; });
+  if (it == symbols.begin()) return NULL;
+  const Symbol* s = &*(it - 1);
+  if (s->size && pc >= s->address + s->size) return NULL;
+  return s;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: profile_symbolize [-a] firmware.elf [profile.txt]\n");
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  bool addresses = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "a")) != -1) {
+    switch (opt) {
+    case 'a': addresses = true; break;
+    default: usage();
+    }
+  }
+  if (optind != argc - 1 && optind != argc - 2) usage();
+
+  std::vector<Symbol> symbols;
+  if (!loadSymbols(argv[optind], symbols)) return 2;
+  FILE* in = stdin;
+  if (optind == argc - 2 && strcmp(argv[optind + 1], "-")) {
+    in = fopen(argv[optind + 1], "r");
+    if (!in) {
+      perror(argv[optind + 1]);
+      return 2;
+    }
+  }
+
+  std::map<std::string, uint64_t> stacks;
+  uint64_t total = 0, unknown = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), in)) {
+    char* end;
+    uint32_t pc = strtoul(line, &end, 0);
+    if (end == line) continue;
+    uint64_t count = strtoull(end, NULL, 10);
+    if (!count) continue;
+    uint32_t at = pc;
+    const Symbol* s = lookup(symbols, at);
+    if (s == NULL && pc < FLASH_BASE) s = lookup(symbols, at = pc + FLASH_BASE);
+    else if (s == NULL && pc >= FLASH_BASE && pc < FLASH_BASE * 2) s = lookup(symbols, at = pc - FLASH_BASE);
+    char frame[300];
+    if (s == NULL) {
+      snprintf(frame, sizeof(frame), "[unknown];0x%08" PRIx32, pc);
+      unknown += count;
+    } else if (addresses) {
+      snprintf(frame, sizeof(frame), "%s;%s+0x%" PRIx32, s->name.c_str(), s->name.c_str(), at - s->address);
+    } else {
+      snprintf(frame, sizeof(frame), "%s", s->name.c_str());
+    }
+    stacks[frame] += count;
+    total += count;
+  }
+  if (in != stdin) fclose(in);
+
+  for (const auto& s : stacks) printf("%s %" PRIu64 "\n", s.first.c_str(), s.second);
+  if (unknown) fprintf(stderr, "%" PRIu64 " of %" PRIu64 " samples outside any symbol\n", unknown, total);
+  return 0;
+}
@@ -0,0 +1,438 @@
+// Protocol level benchmarks of src/ch32v003_swio.h against the simulated
+// target. Reported time is simulated bus time, not host time, and every
+// case also counts SWIO frames, so results are deterministic and can be
+// compared between changes without hardware.
+//
+//   swio_bench [--baseline=file.json] [google benchmark flags]
+//
+// --benchmark_out=file.json --benchmark_out_format=json records a baseline,
+// --baseline compares this run with one and fails if any case got slower.
+
+#include <benchmark/benchmark.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "swio_host.h"
+
+#define FLASH_BASE 0x08000000
+#define RAM_BASE 0x20000000
+
+struct Target {
+  SWIOSim sim;
+  struct SWIOState state;
+  uint64_t frames_written, frames_read;
+  double start_ns, busy_ns;
+
+  Target() {
+    swioHostAttach(&sim, &state);
+    HaltMode(&state, 0);
+  }
+
+  // Same simulated target identifying as a CH32V203 with 256 byte pages and 4K sectors
+  void v20x() {
+    uint32_t id = 0x20300500;
+    sim.chip_id = 0;
+    sim.poke(0x1FFFF704, (const uint8_t*)&id, sizeof(id));
+    sim.page_size = 256;
+    sim.sector_size = 4096;
+  }
+
+  // Everything before this is setup and isn't counted
+  void begin() {
+    frames_written = sim.frames_written;
+    frames_read = sim.frames_read;
+    start_ns = sim.now_ns;
+    busy_ns = sim.flash_busy_ns;
+  }
+
+  void end(benchmark::State& st, uint32_t bytes) {
+    double seconds = (sim.now_ns - start_ns) / 1e9;
+    st.SetIterationTime(seconds);
+    st.counters["frames"] = sim.frames_written - frames_written + sim.frames_read - frames_read;
+    st.counters["writes"] = sim.frames_written - frames_written;
+    st.counters["reads"] = sim.frames_read - frames_read;
+    st.counters["flash_busy_us"] = (sim.flash_busy_ns - busy_ns) / 1e3;
+    if (bytes) st.counters["bytes_s"] = bytes / seconds;
+    if (!sim.anomalies.empty()) st.SkipWithError(("simulator: " + sim.anomalies[0].what).c_str());
+  }
+};
+
+static std::vector<uint8_t> image(uint32_t size) {
+  std::vector<uint8_t> data(size);
+  std::mt19937 rng(size);
+  for (uint8_t& b : data) b = rng();
+  return data;
+}
+
+static bool matches(SWIOSim& sim, uint32_t address, const std::vector<uint8_t>& data) {
+  std::vector<uint8_t> actual(data.size());
+  return sim.peek(address, actual.data(), actual.size()) && actual == data;
+}
+
+// Args: offset into flash, size
+static void BM_WriteBinaryBlobFlash(benchmark::State& st) {
+  uint32_t address = FLASH_BASE + st.range(0);
+  std::vector<uint8_t> data = image(st.range(1));
+  for (auto _ : st) {
+    Target t;
+    t.begin();
+    int r = WriteBinaryBlob(&t.state, address, data.size(), data.data());
+    t.end(st, data.size());
+    if (r || !matches(t.sim, address, data)) st.SkipWithError("flash content mismatch");
+  }
+}
+BENCHMARK(BM_WriteBinaryBlobFlash)->ArgNames({"offset", "size"})
+  ->Args({0, 1024})->Args({0, 4096})->Args({0, 16384}) // Aligned, one 64 byte block at a time
+  ->Args({0, 4300})->Args({0x20, 1000})                // Unaligned head and/or tail
+  ->UseManualTime()->Iterations(1);
+
+static void BM_WriteBinaryBlobFlashV20x(benchmark::State& st) {
+  uint32_t address = FLASH_BASE + st.range(0);
+  std::vector<uint8_t> data = image(st.range(1));
+  for (auto _ : st) {
+    Target t;
+    t.v20x();
+    t.begin();
+    int r = WriteBinaryBlob(&t.state, address, data.size(), data.data());
+    t.end(st, data.size());
+    if (r || !matches(t.sim, address, data)) st.SkipWithError("flash content mismatch");
+    else if (strcmp(t.state.chip->name, "CH32V20x")) st.SkipWithError("chip not detected as CH32V20x");
+  }
+}
+BENCHMARK(BM_WriteBinaryBlobFlashV20x)->ArgNames({"offset", "size"})
+  ->Args({0, 4096})->Args({0x20, 1000})
+  ->UseManualTime()->Iterations(1);
+
+// Args: size. Flash was mass erased first and the pages skip their own erase.
+static void BM_WriteBinaryBlobErased(benchmark::State& st) {
+  std::vector<uint8_t> data = image(st.range(0));
+  for (auto _ : st) {
+    Target t;
+    t.begin();
+    int r = EraseFlash(&t.state, 0, 0, 1);
+    t.state.erased_start = FLASH_BASE;
+    t.state.erased_end = FLASH_BASE + SWIOSim::kFlashSize;
+    if (!r) r = WriteBinaryBlob(&t.state, FLASH_BASE, data.size(), data.data());
+    t.end(st, data.size());
+    if (r || !matches(t.sim, FLASH_BASE, data)) st.SkipWithError("flash content mismatch");
+  }
+}
+BENCHMARK(BM_WriteBinaryBlobErased)->ArgName("size")->Arg(4096)->Arg(4300)->UseManualTime()->Iterations(1);
+
+// Args: offset into the option bytes, size. The rest of the block has to survive.
+static void BM_WriteOptionBytes(benchmark::State& st) {
+  const uint8_t initial[16] = {0xa5, 0x5a, 0xef, 0x10, 0x12, 0xed, 0x34, 0xcb, 0xff, 0x00, 0xff, 0x00, 0xff, 0x00, 0xff, 0x00};
+  const uint8_t update[4] = {0x56, 0xa9, 0x78, 0x87};
+  for (auto _ : st) {
+    Target t;
+    t.sim.poke(SWIOSim::kOptionBase, initial, sizeof(initial));
+    t.begin();
+    int r = WriteOptionBytes(&t.state, SWIOSim::kOptionBase + st.range(0), st.range(1), update);
+    t.end(st, 0);
+    std::vector<uint8_t> expected(initial, initial + sizeof(initial));
+    memcpy(&expected[st.range(0)], update, st.range(1));
+    if (r || !matches(t.sim, SWIOSim::kOptionBase, expected)) st.SkipWithError("option bytes mismatch");
+  }
+}
+BENCHMARK(BM_WriteOptionBytes)->ArgNames({"offset", "size"})->Args({4, 4})->Args({0, 2})->UseManualTime()->Iterations(1);
+
+static void BM_WriteBinaryBlobRam(benchmark::State& st) {
+  uint32_t address = RAM_BASE + st.range(0);
+  std::vector<uint8_t> data = image(st.range(1));
+  for (auto _ : st) {
+    Target t;
+    t.begin();
+    int r = WriteBinaryBlob(&t.state, address, data.size(), data.data());
+    t.end(st, data.size());
+    if (r || !matches(t.sim, address, data)) st.SkipWithError("RAM content mismatch");
+  }
+}
+BENCHMARK(BM_WriteBinaryBlobRam)->ArgNames({"offset", "size"})
+  ->Args({0, 1024})->Args({0, 1022})->Args({1, 1000})
+  ->UseManualTime()->Iterations(1);
+
+static void BM_ReadBinaryBlob(benchmark::State& st) {
+  uint32_t address = FLASH_BASE + st.range(0);
+  std::vector<uint8_t> data = image(st.range(1));
+  std::vector<uint8_t> out(data.size());
+  for (auto _ : st) {
+    Target t;
+    t.sim.poke(address, data.data(), data.size());
+    t.begin();
+    int r = ReadBinaryBlob(&t.state, address, out.size(), out.data());
+    t.end(st, out.size());
+    if (r || out != data) st.SkipWithError("read back mismatch");
+    else if (t.sim.unmapped_loads) st.SkipWithError("loads past the end of flash");
+  }
+}
+BENCHMARK(BM_ReadBinaryBlob)->ArgNames({"offset", "size"})
+  ->Args({0, 4096})->Args({0, 16384})
+  ->Args({SWIOSim::kFlashSize - 4096, 4096})
+  ->Args({0, 4099})->Args({1, 4096}) // Byte tails
+  ->UseManualTime()->Iterations(1);
+
+// Args: EraseFlash() type, length (ignored for mass erase)
+static void BM_EraseFlash(benchmark::State& st) {
+  uint32_t length = st.range(1);
+  std::vector<uint8_t> data = image(SWIOSim::kFlashSize);
+  std::vector<uint8_t> erased(SWIOSim::kFlashSize);
+  for (uint32_t i = 0; i < erased.size(); i += 4) memcpy(&erased[i], &SWIOSim::kErasedWord, 4);
+  for (auto _ : st) {
+    Target t;
+    t.sim.poke(FLASH_BASE, data.data(), data.size());
+    t.begin();
+    int r = EraseFlash(&t.state, FLASH_BASE, length, st.range(0));
+    t.end(st, 0);
+    if (st.range(0) == 0) erased.resize(length);
+    if (r || !matches(t.sim, FLASH_BASE, erased)) st.SkipWithError("flash not erased");
+  }
+}
+BENCHMARK(BM_EraseFlash)->ArgNames({"type", "length"})
+  ->Args({0, 1024})->Args({0, 16384})->Args({1, 0})
+  ->UseManualTime()->Iterations(1);
+
+static void BM_HaltMode(benchmark::State& st) {
+  for (auto _ : st) {
+    Target t;
+    t.begin();
+    HaltMode(&t.state, st.range(0));
+    t.end(st, 0);
+  }
+}
+BENCHMARK(BM_HaltMode)->ArgName("mode")->Arg(0)->Arg(1)->Arg(2)->Arg(5)->UseManualTime()->Iterations(1);
+
+// Args: samples. halt_us is how long the running hart is stopped per sample.
+static void BM_SamplePC(benchmark::State& st) {
+  for (auto _ : st) {
+    Target t;
+    HaltMode(&t.state, 2);
+    // The firmware's printf mailbox
+    t.sim.data0 = 0x80000041;
+    t.begin();
+    double halted_ns = t.sim.halted_ns;
+    uint32_t pc;
+    int r = 0;
+    for (int i = 0; i < st.range(0) && !r; i++) r = SamplePC(&t.state, &pc);
+    t.end(st, 0);
+    st.counters["halt_us"] = (t.sim.halted_ns - halted_ns) / 1e3 / st.range(0);
+    if (r) st.SkipWithError("sample failed");
+    else if (t.sim.halted) st.SkipWithError("hart left halted");
+    else if (t.sim.data0 != 0x80000041) st.SkipWithError("DATA0 clobbered");
+  }
+}
+BENCHMARK(BM_SamplePC)->ArgName("samples")->Arg(100)->UseManualTime()->Iterations(1);
+
+// Args: system bus access in the DM, samples. Three ranges, one of them at
+// the end of RAM, read from a running hart as the watch list does.
+static void BM_ReadRunning(benchmark::State& st) {
+  const SWIORange ranges[] = {{RAM_BASE + 0x10, 3}, {RAM_BASE + 0x100, 1}, {RAM_BASE + SWIOSim::kRamSize - 8, 2}};
+  const int words = 6;
+  std::vector<uint8_t> data = image(SWIOSim::kRamSize);
+  for (auto _ : st) {
+    Target t;
+    t.sim.sysbus = st.range(0);
+    t.sim.poke(RAM_BASE, data.data(), data.size());
+    t.sim.x[8] = 0x12345678;
+    t.sim.x[9] = 0x9abcdef0;
+    t.sim.data0 = 0x80000041;
+    HaltMode(&t.state, 2);
+    t.begin();
+    double halted_ns = t.sim.halted_ns;
+    uint64_t loads = t.sim.loads;
+    uint32_t out[words];
+    int r = 0;
+    bool match = true;
+    for (int i = 0; i < st.range(1) && !r; i++) {
+      r = ReadRunning(&t.state, ranges, 3, out);
+      uint32_t* word = out;
+      for (const SWIORange& range : ranges) {
+        match &= !memcmp(word, &data[range.address - RAM_BASE], range.words * 4);
+        word += range.words;
+      }
+    }
+    t.end(st, words * 4 * st.range(1));
+    st.counters["halt_us"] = (t.sim.halted_ns - halted_ns) / 1e3 / st.range(1);
+    if (r || !match) st.SkipWithError("read back mismatch");
+    else if (t.sim.loads - loads != (uint64_t)words * st.range(1)) st.SkipWithError("loads outside the ranges");
+    else if (t.sim.x[8] != 0x12345678 || t.sim.x[9] != 0x9abcdef0) st.SkipWithError("x8/x9 not restored");
+    else if (t.sim.data0 != 0x80000041) st.SkipWithError("DATA0 clobbered");
+    else if (t.sim.halted) st.SkipWithError("hart left halted");
+    else {
+      // A hart halted by someone else has to stay halted
+      HaltMode(&t.state, 5);
+      if (ReadRunning(&t.state, ranges, 3, out) || !t.sim.halted) st.SkipWithError("halted hart resumed");
+    }
+  }
+}
+BENCHMARK(BM_ReadRunning)->ArgNames({"sysbus", "samples"})->Args({0, 100})->Args({1, 100})->UseManualTime()->Iterations(1);
+
+static uint32_t crc32(const uint8_t* data, size_t len) {
+  uint32_t crc = 0xffffffff;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= data[i];
+    for (int b = 0; b < 8; b++) crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+  }
+  return ~crc;
+}
+
+enum { LOOP_FILL, LOOP_VERIFY, LOOP_VERIFY_BAD, LOOP_COPY, LOOP_COMPARE, LOOP_CRC };
+
+// Args: loop, bytes. Program buffer loops on the target, the wire only
+// carries setup and a status word. Compare with BM_WriteBinaryBlobRam.
+static void BM_MemoryLoop(benchmark::State& st) {
+  uint32_t bytes = st.range(1), words = bytes / 4;
+  std::vector<uint8_t> data = image(bytes);
+  std::vector<uint8_t> pattern(bytes);
+  for (uint32_t i = 0; i < words; i++) {
+    uint32_t v = RAM_BASE + i * 4;
+    memcpy(&pattern[i * 4], &v, 4);
+  }
+  for (auto _ : st) {
+    Target t;
+    uint32_t result = 0, expected = 0;
+    int r = 0, want = 0;
+    bool match = true;
+    switch (st.range(0)) {
+    case LOOP_FILL:
+      t.begin();
+      r = FillMemory(&t.state, RAM_BASE, words, RAM_BASE, 4);
+      t.end(st, bytes);
+      match = matches(t.sim, RAM_BASE, pattern);
+      break;
+    case LOOP_VERIFY:
+    case LOOP_VERIFY_BAD:
+      if (st.range(0) == LOOP_VERIFY_BAD) pattern[bytes - 3] ^= 0x10;
+      t.sim.poke(RAM_BASE, pattern.data(), bytes);
+      t.begin();
+      r = VerifyMemory(&t.state, RAM_BASE, words, RAM_BASE, 4, &result);
+      t.end(st, bytes);
+      if (st.range(0) == LOOP_VERIFY_BAD) want = 1, expected = RAM_BASE + bytes - 4;
+      break;
+    case LOOP_COPY:
+      t.sim.poke(RAM_BASE, data.data(), bytes);
+      t.begin();
+      r = CopyMemory(&t.state, RAM_BASE + bytes, RAM_BASE, words);
+      t.end(st, bytes);
+      match = matches(t.sim, RAM_BASE + bytes, data);
+      break;
+    case LOOP_COMPARE:
+      t.sim.poke(RAM_BASE, data.data(), bytes);
+      data[bytes / 2] ^= 1;
+      t.sim.poke(RAM_BASE + bytes, data.data(), bytes);
+      data[bytes / 2] ^= 1;
+      t.begin();
+      r = CompareMemory(&t.state, RAM_BASE, RAM_BASE + bytes, words, &result);
+      t.end(st, bytes);
+      want = 1, expected = RAM_BASE + bytes / 2;
+      break;
+    case LOOP_CRC:
+      t.sim.poke(RAM_BASE, data.data(), bytes);
+      t.begin();
+      r = ChecksumMemory(&t.state, RAM_BASE, words, &result);
+      t.end(st, bytes);
+      expected = crc32(data.data(), bytes);
+      break;
+    }
+    if (r != want || !match || result != expected) st.SkipWithError("wrong result");
+  }
+}
+BENCHMARK(BM_MemoryLoop)->ArgNames({"loop", "bytes"})
+  ->Args({LOOP_FILL, 1024})->Args({LOOP_VERIFY, 1024})->Args({LOOP_VERIFY_BAD, 1024})
+  ->Args({LOOP_COPY, 1024})->Args({LOOP_COMPARE, 1024})->Args({LOOP_CRC, 2048})
+  ->UseManualTime()->Iterations(1);
+
+struct CaseResult {
+  double frames = 0;
+  double time = 0;
+};
+
+// Keeps the numbers of this run around for the baseline comparison
+class CaptureReporter : public benchmark::ConsoleReporter {
+public:
+  std::map<std::string, CaseResult> results;
+  bool failed = false;
+
+  CaptureReporter() : ConsoleReporter(isatty(fileno(stdout)) ? OO_ColorTabular : OO_Tabular) {}
+
+  void ReportRuns(const std::vector<Run>& reports) override {
+    for (const Run& run : reports) {
+      if (run.error_occurred) failed = true;
+      auto frames = run.counters.find("frames");
+      CaseResult& result = results[run.benchmark_name()];
+      result.frames = frames == run.counters.end() ? 0 : frames->second.value;
+      result.time = run.GetAdjustedRealTime();
+    }
+    ConsoleReporter::ReportRuns(reports);
+  }
+};
+
+// Just enough of google benchmark's JSON output: "name" and the values we compare
+static std::map<std::string, CaseResult> loadBaseline(const char* path) {
+  std::map<std::string, CaseResult> results;
+  std::ifstream in(path);
+  std::string line, name;
+  while (std::getline(in, line)) {
+    size_t colon = line.find("\": ");
+    if (colon == std::string::npos) continue;
+    std::string key = line.substr(line.find('"') + 1, colon - line.find('"') - 1);
+    const char* value = line.c_str() + colon + 3;
+    if (key == "name") {
+      name = std::string(value + 1, strchr(value + 1, '"'));
+    } else if (key == "frames") {
+      results[name].frames = strtod(value, NULL);
+    } else if (key == "real_time") {
+      results[name].time = strtod(value, NULL);
+    }
+  }
+  return results;
+}
+
+static int compare(const char* path, const std::map<std::string, CaseResult>& current) {
+  std::map<std::string, CaseResult> baseline = loadBaseline(path);
+  if (baseline.empty()) {
+    fprintf(stderr, "%s: no benchmarks found\n", path);
+    return 2;
+  }
+  int regressions = 0;
+  printf("\n%-70s %12s %12s %8s %12s %12s %8s\n", "case", "frames", "baseline", "", "time", "baseline", "");
+  for (const auto& c : current) {
+    auto base = baseline.find(c.first);
+    if (base == baseline.end()) {
+      printf("%-70s %12.0f %12s\n", c.first.c_str(), c.second.frames, "new");
+      continue;
+    }
+    double df = base->second.frames ? (c.second.frames / base->second.frames - 1) * 100 : 0;
+    double dt = base->second.time ? (c.second.time / base->second.time - 1) * 100 : 0;
+    bool worse = df > 1 || dt > 1;
+    regressions += worse;
+    printf("%-70s %12.0f %12.0f %+7.1f%% %12.0f %12.0f %+7.1f%%%s\n", c.first.c_str(), c.second.frames, base->second.frames,
+           df, c.second.time, base->second.time, dt, worse ? "  <-" : "");
+  }
+  printf("%d case(s) slower than the baseline\n", regressions);
+  return regressions ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+  const char* baseline = NULL;
+  int out = 1;
+  for (int i = 1; i < argc; i++) {
+    if (!strncmp(argv[i], "--baseline=", 11)) baseline = argv[i] + 11;
+    else argv[out++] = argv[i];
+  }
+  argc = out;
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 2;
+  CaptureReporter reporter;
+  benchmark::RunSpecifiedBenchmarks(&reporter);
+  benchmark::Shutdown();
+  if (reporter.failed) return 1;
+  return baseline ? compare(baseline, reporter.results) : 0;
+}
@@ -0,0 +1,52 @@
+// Host build of src/ch32v003_swio.h with SWIOSim standing in for the wire.
+// Include once per program, then point swio_sim at a simulator before
+// calling any of the link functions.
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "swio_sim.h"
+
+#define SWIO_HOST
+#define IRAM_ATTR
+#define portDISABLE_INTERRUPTS()
+#define portENABLE_INTERRUPTS()
+
+#define SWIO_HOST_CPU_MHZ 160
+
+static SWIOSim* swio_sim = nullptr;
+
+static inline uint32_t cpu_hal_get_cycle_count() {
+  return (uint32_t)(swio_sim->now_ns * SWIO_HOST_CPU_MHZ / 1000);
+}
+
+static inline void esp_rom_delay_us(uint32_t us) {
+  swio_sim->now_ns += us * 1000.0;
+}
+
+// WriteBinaryBlob() prints the failing offset
+static struct {
+  template <typename T>
+  void println(T) {}
+} Serial;
+
+#include "../src/ch32v003_swio.h"
+
+static void SWIOHostWriteReg32(struct SWIOState* state, uint8_t command, uint32_t value) {
+  swio_sim->write(command, value);
+}
+
+static int SWIOHostReadReg32(struct SWIOState* state, uint8_t command, uint32_t* value) {
+  return swio_sim->read(command, value) ? 0 : -1;
+}
+
+// The link code waits with esp_rom_delay_us(8) after every frame itself
+static inline void swioHostAttach(SWIOSim* sim, struct SWIOState* state, int t1coeff = 10) {
+  swio_sim = sim;
+  sim->timing.frame_gap_ns = 0;
+  memset(state, 0, sizeof(*state));
+  state->t1coeff = t1coeff;
+  state->pinmask = 1;
+}
@@ -0,0 +1,885 @@
+// Host-side model of a CH32V003 as seen through SWIO: debug module registers,
+// an RV32EC core that runs the program buffer, SRAM, flash with its
+// controller and the bus timing of the ESP32 bit-banged link.
+//
+// Good enough to run the sequences in src/ch32v003_swio.h and to replay
+// traces recorded by WebLink, not a cycle accurate emulator. Anything the
+// model doesn't expect is reported as an anomaly instead of being ignored.
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+class SWIOSim {
+public:
+  // Durations in nanoseconds. Bit times follow Send1Bit/Send0Bit/ReadBit
+  // in ch32v003_swio.h, in units of one t1coeff delay.
+  struct Timing {
+    double t1_ns = 125;            // One PrecDelay(t1coeff), ~t1coeff 10 on a 160MHz ESP32-C3
+    double frame_gap_ns = 8000;    // esp_rom_delay_us(8) after every frame
+    double page_erase_ns = 2000000;
+    double page_program_ns = 2000000;
+    double sector_erase_ns = 4000000;
+    double mass_erase_ns = 10000000; // Has to fit in the 500 polls of WaitForFlash(), which works on real parts
+    double buf_reset_ns = 10000;
+    double half_word_program_ns = 60000; // Standard programming, what the option bytes use
+    double instruction_ns = 84;    // Two cycles at 24MHz per program buffer instruction
+  };
+
+  struct Anomaly {
+    uint64_t frame;
+    std::string what;
+  };
+
+  static const uint32_t kFlashBase = 0x08000000;
+  static const uint32_t kFlashSize = 16 * 1024;
+  static const uint32_t kBootBase = 0x1FFFF000;
+  static const uint32_t kBootSize = 1920;
+  static const uint32_t kOptionBase = 0x1FFFF800;
+  static const uint32_t kOptionSize = 64;
+  static const uint32_t kRamBase = 0x20000000;
+  static const uint32_t kRamSize = 2 * 1024;
+  static const uint32_t kData0Addr = 0xe00000f4;
+  static const uint32_t kData1Addr = 0xe00000f8;
+  static const uint32_t kProgbufAddr = 0xe0000100;
+  static const uint32_t kErasedWord = 0xe339e339; // What erased flash reads as on the CH32V003
+
+  Timing timing;
+  std::vector<Anomaly> anomalies;
+  size_t max_anomalies = 1000;
+
+  // Statistics
+  uint64_t frames_written = 0;
+  uint64_t frames_read = 0;
+  uint64_t commands = 0;
+  uint64_t instructions = 0;
+  uint64_t flash_busy_reads = 0;
+  uint64_t unmapped_loads = 0;
+  uint64_t loads = 0;
+  double now_ns = 0;
+  double flash_busy_ns = 0;
+  // Time the hart spent halted, what a sampler costs the firmware it samples
+  double halted_ns = 0;
+  double halt_start_ns = 0;
+
+  // Target state, public so tests and tools can poke at it
+  uint8_t flash[kFlashSize];
+  uint8_t boot[kBootSize];
+  uint8_t option[kOptionSize];
+  uint8_t ram[kRamSize];
+  uint32_t x[16] = {0};
+  uint32_t dpc = 0;
+  uint32_t dcsr = 0x40000003;
+  // DM data registers, the firmware's printf/input mailbox with ch32v003fun
+  uint32_t data0, data1;
+  bool halted = false;
+  uint32_t chip_id = 0x00300500;
+  // Flash geometry, a CH32V003 by default. Other families are modelled with
+  // the same controller and a bigger fast page or sector.
+  uint32_t page_size = 64;
+  uint32_t sector_size = 1024;
+  // System bus access in the DM, the CH32V003 doesn't have it
+  bool sysbus = false;
+  uint8_t uid[12] = {0xcd, 0xab, 0x34, 0x12, 0x78, 0x56, 0xef, 0xcd, 0x01, 0x23, 0x45, 0x67};
+
+  SWIOSim() { reset(true); }
+
+  void reset(bool power_on) {
+    if (power_on) {
+      for (uint32_t i = 0; i < kFlashSize; i += 4) memcpy(flash + i, &kErasedWord, 4);
+      for (uint32_t i = 0; i < kBootSize; i += 4) memcpy(boot + i, &kErasedWord, 4);
+      memset(option, 0xff, sizeof(option));
+      memset(ram, 0, sizeof(ram));
+      memset(known_ram, 0, sizeof(known_ram));
+      memset(known_flash, 1, sizeof(known_flash));
+      data0 = data1 = 0;
+      data0_known = data1_known = true;
+      dmcontrol = 0;
+      abstractauto = 0;
+      memset(progbuf, 0, sizeof(progbuf));
+      cpbr = cfgr = shdwcfgr = 0;
+    }
+    memset(x, 0, sizeof(x));
+    known_x = 1;
+    flash_ctlr = 0x8080;
+    flash_statr = 0;
+    flash_addr = 0;
+    key_step = mode_key_step = ob_key_step = 0;
+    busy_until_ns = 0;
+    resumeack = false;
+    last_command = 0;
+    cmderr = 0;
+  }
+
+  // One MCFWriteReg32() frame
+  void write(uint8_t reg, uint32_t value) {
+    frames_written++;
+    advance(frameTime(reg, value, false));
+    switch (reg) {
+    case 0x04: data0 = value; data0_known = true; autoexec(0); break;
+    case 0x05: data1 = value; data1_known = true; autoexec(1); break;
+    case 0x10: writeDmcontrol(value); break;
+    case 0x16:
+      // cmderr is write 1 to clear
+      cmderr &= ~((value >> 8) & 7);
+      break;
+    case 0x17: runCommand(value); break;
+    case 0x18: abstractauto = value; break;
+    case 0x20: case 0x21: case 0x22: case 0x23:
+    case 0x24: case 0x25: case 0x26: case 0x27:
+      progbuf[reg - 0x20] = value;
+      break;
+    case 0x38:
+      if (!sysbus) {
+        anomaly("write to sbcs without system bus access");
+        break;
+      }
+      sbcs = value & 0x001f8000;
+      if (value & (7 << 12)) sberror = 0;
+      break;
+    case 0x39:
+      sbaddress = value;
+      if (sysbus && (sbcs & (1 << 20))) systemBusRead();
+      break;
+    case 0x7c: cpbr = value; break;
+    case 0x7d: cfgr = value; break;
+    case 0x7e: shdwcfgr = value; break;
+    default: anomaly("write to unknown DM register 0x%02x", reg); break;
+    }
+  }
+
+  // One MCFReadReg32() frame. known is false when the value depends on
+  // target memory the simulation never saw written.
+  bool read(uint8_t reg, uint32_t* value, bool* known = nullptr) {
+    frames_read++;
+    uint32_t v = 0;
+    bool k = true;
+    switch (reg) {
+    case 0x04: v = data0; k = data0_known; break;
+    case 0x05: v = data1; k = data1_known; break;
+    case 0x10: v = dmcontrol; break;
+    case 0x11: v = dmstatus(); break;
+    case 0x12: v = 0x002120f4; break; // hartinfo: data registers at 0xe00000f4
+    case 0x16: v = (8u << 24) | (abstractBusy() << 12) | (cmderr << 8) | 2; break;
+    case 0x17: v = 0; break;
+    case 0x18: v = abstractauto; break;
+    case 0x20: case 0x21: case 0x22: case 0x23:
+    case 0x24: case 0x25: case 0x26: case 0x27:
+      v = progbuf[reg - 0x20];
+      break;
+    case 0x38: v = sysbus ? (1u << 29) | sbcs | (sberror << 12) | 4 : 0; break;
+    case 0x3c:
+      v = sbdata;
+      if (!sysbus) anomaly("sbdata0 read without system bus access");
+      else if (sbcs & (1 << 15)) systemBusRead();
+      break;
+    case 0x7c: v = cpbr; break;
+    case 0x7d: v = cfgr; break;
+    case 0x7e: v = shdwcfgr; break;
+    default: anomaly("read of unknown DM register 0x%02x", reg); break;
+    }
+    advance(frameTime(reg, v, true));
+    *value = v;
+    if (known) *known = k;
+    if (reg == 0x04) autoexec(0);
+    if (reg == 0x05) autoexec(1);
+    return true;
+  }
+
+  // Contents of a real target are unknown until the trace writes them
+  void forget() {
+    memset(known_ram, 0, sizeof(known_ram));
+    memset(known_flash, 0, sizeof(known_flash));
+    known_x = 1;
+    data0_known = data1_known = false;
+  }
+
+  uint32_t flashBusy() const { return now_ns < busy_until_ns; }
+
+  // Direct memory access for tests, bypassing the debug module
+  bool peek(uint32_t addr, uint8_t* out, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+      uint8_t* p = byteAt(addr + i, nullptr);
+      if (!p) return false;
+      out[i] = *p;
+    }
+    return true;
+  }
+
+  bool poke(uint32_t addr, const uint8_t* in, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+      bool* k = nullptr;
+      uint8_t* p = byteAt(addr + i, &k);
+      if (!p) return false;
+      *p = in[i];
+      if (k) *k = true;
+    }
+    return true;
+  }
+
+private:
+  bool data0_known, data1_known;
+  uint32_t dmcontrol, abstractauto, cpbr, cfgr, shdwcfgr;
+  uint32_t sbcs = 0, sbaddress = 0, sbdata = 0, sberror = 0;
+  double abstract_busy_until_ns = 0;
+  uint32_t progbuf[8];
+  uint32_t last_command;
+  uint32_t cmderr;
+  bool resumeack;
+  uint32_t known_x; // Bit per GPR
+  bool known_ram[kRamSize];
+  bool known_flash[kFlashSize];
+
+  uint32_t flash_ctlr, flash_statr, flash_addr;
+  int key_step, mode_key_step, ob_key_step;
+  double busy_until_ns;
+  uint8_t page_buf[256];
+  uint32_t pending_addr = 0;
+  uint32_t pending_value = 0;
+  bool pending = false;
+
+  template <typename... Args>
+  void anomaly(const char* format, Args... args) {
+    if (anomalies.size() >= max_anomalies) return;
+    char buf[160];
+    snprintf(buf, sizeof(buf), format, args...);
+    anomalies.push_back({frames_written + frames_read, buf});
+  }
+
+  void advance(double ns) {
+    now_ns += ns;
+  }
+
+  double frameTime(uint8_t reg, uint32_t value, bool read) const {
+    // Start bit, 7 address bits, R/W bit, 32 data bits
+    double t = 2 * timing.t1_ns;
+    for (int i = 6; i >= 0; i--) t += ((reg >> i) & 1) ? 2 * timing.t1_ns : 5 * timing.t1_ns;
+    t += read ? 5 * timing.t1_ns : 2 * timing.t1_ns;
+    if (read) {
+      t += 32 * 3.5 * timing.t1_ns;
+    } else {
+      for (int i = 31; i >= 0; i--) t += ((value >> i) & 1) ? 2 * timing.t1_ns : 5 * timing.t1_ns;
+    }
+    return t + timing.frame_gap_ns;
+  }
+
+  uint32_t dmstatus() const {
+    uint32_t v = 0x82; // authenticated, version 0.13
+    v |= halted ? 0x300 : 0xc00;
+    if (resumeack) v |= 0x30000;
+    return v;
+  }
+
+  void writeDmcontrol(uint32_t value) {
+    if (!(value & 1)) {
+      // Debug module off
+      dmcontrol = value;
+      return;
+    }
+    if (value & 2) {
+      reset(false);
+      if (!(value & 0x80000000)) halted = false;
+    }
+    if (value & 0x80000000) {
+      if (!halted) {
+        dpc = 0x00000000;
+        halt_start_ns = now_ns;
+      }
+      halted = true;
+      resumeack = false;
+    } else if (value & 0x40000000) {
+      if (halted) halted_ns += now_ns - halt_start_ns;
+      halted = false;
+      resumeack = true;
+    }
+    dmcontrol = value & ~0x40000000u;
+  }
+
+  // 32 bit only, the hart keeps running
+  void systemBusRead() {
+    bool known;
+    if (((sbcs >> 17) & 7) != 2) {
+      sberror = 4;
+      anomaly("system bus read with sbaccess %u", (sbcs >> 17) & 7);
+      return;
+    }
+    if (!load(sbaddress, 4, &sbdata, &known)) sberror = 2;
+    if (sbcs & (1 << 16)) sbaddress += 4;
+  }
+
+  void autoexec(int data_reg) {
+    if (abstractauto & (1u << data_reg)) runCommand(last_command);
+  }
+
+  bool abstractBusy() const { return now_ns < abstract_busy_until_ns; }
+
+  void runCommand(uint32_t command) {
+    last_command = command;
+    commands++;
+    if (cmderr) return; // Commands are ignored until cmderr is cleared
+    if (abstractBusy()) {
+      cmderr = 1;
+      anomaly("abstract command 0x%08x while the previous one is still running", command);
+      return;
+    }
+    if ((command >> 24) != 0) {
+      cmderr = 2;
+      anomaly("unsupported abstract command type 0x%08x", command);
+      return;
+    }
+    if (!halted) {
+      cmderr = 4;
+      anomaly("abstract command 0x%08x while the hart is running", command);
+      return;
+    }
+    uint32_t size = (command >> 20) & 7;
+    bool postexec = command & (1 << 18);
+    bool transfer = command & (1 << 17);
+    bool is_write = command & (1 << 16);
+    uint32_t regno = command & 0xffff;
+    if (transfer) {
+      if (size != 2) {
+        cmderr = 2;
+        anomaly("abstract access with aarsize %u", size);
+        return;
+      }
+      if (!accessRegister(regno, is_write)) return;
+    }
+    if (postexec) execute();
+  }
+
+  bool accessRegister(uint32_t regno, bool is_write) {
+    if (regno >= 0x1000 && regno < 0x1010) {
+      int r = regno - 0x1000;
+      if (is_write) {
+        if (r) x[r] = data0;
+        setKnown(r, data0_known);
+      } else {
+        data0 = x[r];
+        data0_known = isKnown(r);
+      }
+      return true;
+    }
+    if (regno >= 0x1010 && regno < 0x1020) {
+      cmderr = 3;
+      anomaly("access to x%u, the CH32V003 is RV32E", regno - 0x1000);
+      return false;
+    }
+    uint32_t* csr = regno == 0x7b1 ? &dpc : regno == 0x7b0 ? &dcsr : nullptr;
+    if (!csr) {
+      if (is_write) return true;
+      data0 = 0;
+      data0_known = false;
+      return true;
+    }
+    if (is_write) *csr = data0;
+    else data0 = *csr, data0_known = true;
+    return true;
+  }
+
+  bool isKnown(int r) const { return (known_x >> r) & 1; }
+  void setKnown(int r, bool k) {
+    if (!r) return;
+    if (k) known_x |= 1u << r;
+    else known_x &= ~(1u << r);
+  }
+
+  // Memory
+
+  uint8_t* byteAt(uint32_t addr, bool** known) {
+    if (known) *known = nullptr;
+    if (addr < kFlashSize) addr += kFlashBase;
+    if (addr >= kFlashBase && addr < kFlashBase + kFlashSize) {
+      if (known) *known = &known_flash[addr - kFlashBase];
+      return &flash[addr - kFlashBase];
+    }
+    if (addr >= kBootBase && addr < kBootBase + kBootSize) return &boot[addr - kBootBase];
+    if (addr >= kOptionBase && addr < kOptionBase + kOptionSize) return &option[addr - kOptionBase];
+    if (addr >= kRamBase && addr < kRamBase + kRamSize) {
+      if (known) *known = &known_ram[addr - kRamBase];
+      return &ram[addr - kRamBase];
+    }
+    return nullptr;
+  }
+
+  bool isFlash(uint32_t addr) const {
+    if (addr < kFlashSize) return true;
+    return (addr >= kFlashBase && addr < kFlashBase + kFlashSize) || (addr >= kBootBase && addr < kBootBase + kBootSize) ||
+           (addr >= kOptionBase && addr < kOptionBase + kOptionSize);
+  }
+
+  bool load(uint32_t addr, int size, uint32_t* value, bool* known) {
+    *known = true;
+    loads++;
+    if (addr & (size - 1)) {
+      anomaly("misaligned %d byte load from 0x%08x", size, addr);
+      return false;
+    }
+    if (addr == kData0Addr) { *value = data0; *known = data0_known; return true; }
+    if (addr == kData1Addr) { *value = data1; *known = data1_known; return true; }
+    if (addr >= 0x40022000 && addr < 0x40022030) { *value = flashRegRead(addr); return true; }
+    if (addr >= 0x1FFFF7C0 && addr < 0x1FFFF800) {
+      uint8_t esig[64];
+      memset(esig, 0xff, sizeof(esig));
+      memcpy(esig + 0x04, &chip_id, 4);         // 0x1FFFF7C4
+      uint16_t flash_kb = kFlashSize / 1024;
+      memcpy(esig + 0x20, &flash_kb, 2);        // 0x1FFFF7E0
+      memcpy(esig + 0x28, uid, sizeof(uid));    // 0x1FFFF7E8
+      *value = 0;
+      memcpy(value, esig + (addr - 0x1FFFF7C0), size);
+      return true;
+    }
+    if ((addr >= 0x40000000 && addr < 0x50000000) || addr >= 0xe0000000) {
+      // Other peripherals and core registers, not modelled
+      *value = 0;
+      *known = false;
+      return true;
+    }
+    *value = 0;
+    for (int i = 0; i < size; i++) {
+      bool* k;
+      uint8_t* p = byteAt(addr + i, &k);
+      if (!p) {
+        // Autoincrement reads fetch one word past the end of a block, real
+        // parts return garbage there instead of faulting
+        unmapped_loads++;
+        *value = 0;
+        *known = false;
+        return true;
+      }
+      *value |= (uint32_t)*p << (i * 8);
+      if (k && !*k) *known = false;
+    }
+    if (isFlash(addr) && flashBusy()) anomaly("flash read at 0x%08x while busy", addr);
+    return true;
+  }
+
+  bool store(uint32_t addr, int size, uint32_t value, bool known) {
+    if (addr & (size - 1)) {
+      anomaly("misaligned %d byte store to 0x%08x", size, addr);
+      return false;
+    }
+    if (addr == kData0Addr) { data0 = value; data0_known = known; return true; }
+    if (addr == kData1Addr) { data1 = value; data1_known = known; return true; }
+    if (addr >= 0x40022000 && addr < 0x40022030) { flashRegWrite(addr, value); return true; }
+    if (isFlash(addr)) return flashStore(addr, size, value);
+    if ((addr >= 0x40000000 && addr < 0x50000000) || addr >= 0xe0000000) return true;
+    for (int i = 0; i < size; i++) {
+      bool* k;
+      uint8_t* p = byteAt(addr + i, &k);
+      if (!p) {
+        anomaly("store to unmapped address 0x%08x", addr);
+        return false;
+      }
+      *p = value >> (i * 8);
+      if (k) *k = known;
+    }
+    return true;
+  }
+
+  // Flash controller
+
+  uint32_t flashRegRead(uint32_t addr) {
+    switch (addr - 0x40022000) {
+    case 0x0C:
+      if (flashBusy()) flash_busy_reads++;
+      return flash_statr | (flashBusy() ? 1 : 0);
+    case 0x10: return flash_ctlr;
+    case 0x14: return flash_addr;
+    case 0x1C: return 0x03fffff2;
+    case 0x20: return 0xffffffff;
+    default: return 0;
+    }
+  }
+
+  void flashRegWrite(uint32_t addr, uint32_t value) {
+    const uint32_t KEY1 = 0x45670123, KEY2 = 0xCDEF89AB;
+    switch (addr - 0x40022000) {
+    case 0x04:
+      key_step = (key_step == 0 && value == KEY1) ? 1 : (key_step == 1 && value == KEY2) ? 2 : 0;
+      if (key_step == 2) flash_ctlr &= ~0x80u;
+      break;
+    case 0x08:
+      // OBWRE, only once FLASH_KEYR is unlocked
+      ob_key_step = (ob_key_step == 0 && value == KEY1) ? 1 : (ob_key_step == 1 && value == KEY2) ? 2 : 0;
+      if (ob_key_step == 2 && !(flash_ctlr & 0x80)) flash_ctlr |= 0x200;
+      break;
+    case 0x24:
+      mode_key_step = (mode_key_step == 0 && value == KEY1) ? 1 : (mode_key_step == 1 && value == KEY2) ? 2 : 0;
+      if (mode_key_step == 2) flash_ctlr &= ~0x8000u;
+      break;
+    case 0x0C:
+      // EOP and WRPRTERR are write 1 to clear, BOOT_MODE is kept
+      flash_statr = (flash_statr & ~(value & 0x30)) | (value & 0x4000);
+      break;
+    case 0x10: flashControl(value); break;
+    case 0x14: flash_addr = value; break;
+    default: break;
+    }
+  }
+
+  void flashControl(uint32_t value) {
+    if (flash_ctlr & 0x80) {
+      if (value & 0x80) return;
+      anomaly("FLASH_CTLR write 0x%08x while locked", value);
+      return;
+    }
+    if ((value & ~0x80u & 0xf0000) && (flash_ctlr & 0x8000)) {
+      anomaly("fast programming mode used without MODEKEYR unlock (CTLR 0x%08x)", value);
+      return;
+    }
+    if (flashBusy() && (value & ~0x80u)) anomaly("FLASH_CTLR write 0x%08x while busy", value);
+    uint32_t addr = flash_addr | kFlashBase;
+    if (flash_addr >= kBootBase) addr = flash_addr;
+    if ((value & 0x10000) && (value & 0x80000)) {
+      // BUF_RST
+      for (uint32_t i = 0; i < page_size; i += 4) memcpy(page_buf + i, &kErasedWord, 4);
+      busy_until_ns = now_ns + timing.buf_reset_ns;
+      flash_busy_ns += timing.buf_reset_ns;
+    }
+    if ((value & 0x10000) && (value & 0x40000)) {
+      // BUF_LOAD latches the word stored to the flash address
+      if (!pending) anomaly("BUF_LOAD without a preceding store");
+      else memcpy(page_buf + (pending_addr & (page_size - 4)), &pending_value, 4);
+      pending = false;
+    }
+    if (value & 0x40) {
+      // STRT
+      if (value & 0x04) {
+        for (uint32_t i = 0; i < kFlashSize; i += 4) memcpy(flash + i, &kErasedWord, 4);
+        memset(known_flash, 1, sizeof(known_flash));
+        busy(timing.mass_erase_ns);
+      } else if (value & 0x20000) {
+        erase(addr & ~(page_size - 1), page_size);
+        busy(timing.page_erase_ns);
+      } else if (value & 0x02) {
+        erase(addr & ~(sector_size - 1), sector_size);
+        busy(timing.sector_erase_ns);
+      } else if (value & 0x20) {
+        // OBER, the whole option byte block
+        if (!(flash_ctlr & 0x200)) anomaly("option byte erase without OBKEYR unlock");
+        else memset(option, 0xff, sizeof(option));
+        busy(timing.page_erase_ns);
+      } else if (value & 0x10000) {
+        uint8_t* p = flashPage(addr & ~(page_size - 1));
+        if (p) {
+          memcpy(p, page_buf, page_size);
+          if (p >= flash && p < flash + kFlashSize) memset(known_flash + (p - flash), 1, page_size);
+        } else {
+          anomaly("page program at unmapped address 0x%08x", addr);
+        }
+        busy(timing.page_program_ns);
+        flash_statr |= 0x20;
+      } else {
+        anomaly("FLASH_CTLR STRT without an operation (0x%08x)", value);
+      }
+    }
+    // OBWRE can't be set by a write, a write without it clears it
+    flash_ctlr = (flash_ctlr & (0x8080 | (value & 0x200))) | (value & ~0x40u & ~0x40000u & ~0x80000u & ~0x200u);
+    if (value & 0x80) flash_ctlr = (flash_ctlr | 0x80) & ~0x200u;
+  }
+
+  uint8_t* flashPage(uint32_t addr) {
+    bool* k;
+    return byteAt(addr, &k);
+  }
+
+  void erase(uint32_t addr, uint32_t len) {
+    for (uint32_t i = 0; i < len; i += 4) {
+      uint8_t* p = flashPage(addr + i);
+      if (!p) {
+        anomaly("erase of unmapped address 0x%08x", addr + i);
+        return;
+      }
+      memcpy(p, &kErasedWord, 4);
+      if (p >= flash && p < flash + kFlashSize) memset(known_flash + (p - flash), 1, 4);
+    }
+  }
+
+  void busy(double ns) {
+    busy_until_ns = now_ns + ns;
+    flash_busy_ns += ns;
+  }
+
+  bool flashStore(uint32_t addr, int size, uint32_t value) {
+    if (addr >= kOptionBase && addr < kOptionBase + kOptionSize && (flash_ctlr & 0x10)) {
+      // OBPG, the data byte of a pair, the complement is generated
+      if (!(flash_ctlr & 0x200) || size != 2) {
+        anomaly("%d byte option byte store to 0x%08x (CTLR 0x%08x)", size, addr, flash_ctlr);
+        return false;
+      }
+      if (flashBusy()) anomaly("option byte store to 0x%08x while busy", addr);
+      option[addr - kOptionBase] &= value;
+      option[addr - kOptionBase + 1] &= ~value;
+      busy(timing.half_word_program_ns);
+      return true;
+    }
+    if (!(flash_ctlr & 0x10000)) {
+      anomaly("store to flash 0x%08x outside of page programming", addr);
+      return false;
+    }
+    if (size != 4) {
+      anomaly("%d byte store to flash 0x%08x", size, addr);
+      return false;
+    }
+    if (pending) anomaly("flash store to 0x%08x without BUF_LOAD of the previous one", addr);
+    pending = true;
+    pending_addr = addr;
+    pending_value = value;
+    return true;
+  }
+
+  // RV32EC core, runs the program buffer until ebreak
+
+  uint32_t fetch16(uint32_t pc, bool* ok) {
+    uint32_t off = pc - kProgbufAddr;
+    if (pc < kProgbufAddr || off >= sizeof(progbuf)) {
+      *ok = false;
+      return 0;
+    }
+    uint16_t h;
+    memcpy(&h, (const uint8_t*)progbuf + off, 2);
+    return h;
+  }
+
+  uint32_t reg(int r) const { return x[r]; }
+  bool setReg(int r, uint32_t v, bool known = true) {
+    if (r > 15) {
+      anomaly("instruction uses x%d, the CH32V003 is RV32E", r);
+      return false;
+    }
+    if (r) x[r] = v;
+    setKnown(r, known);
+    return true;
+  }
+  bool regKnown(int a, int b = 0) const { return isKnown(a) && isKnown(b); }
+
+  void execute() {
+    uint64_t first = instructions;
+    executeProgbuf();
+    abstract_busy_until_ns = now_ns + (instructions - first) * timing.instruction_ns;
+  }
+
+  void executeProgbuf() {
+    uint32_t pc = kProgbufAddr;
+    for (int steps = 0; steps < 10000; steps++) {
+      bool ok = true;
+      uint32_t ins = fetch16(pc, &ok);
+      if (!ok) {
+        // Running off the end of the program buffer is an implicit ebreak
+        if (pc == kProgbufAddr + sizeof(progbuf)) return;
+        cmderr = 3;
+        anomaly("program buffer jumped to 0x%08x", pc);
+        return;
+      }
+      instructions++;
+      uint32_t next;
+      int r;
+      if ((ins & 3) != 3) {
+        r = step16(ins, pc, &next);
+      } else {
+        uint32_t hi = fetch16(pc + 2, &ok);
+        if (!ok) {
+          cmderr = 3;
+          anomaly("32 bit instruction crosses the end of the program buffer");
+          return;
+        }
+        r = step32(ins | (hi << 16), pc, &next);
+      }
+      if (r == 1) return;      // ebreak
+      if (r < 0) {
+        cmderr = 3;
+        return;
+      }
+      pc = next;
+    }
+    cmderr = 3;
+    anomaly("program buffer did not reach ebreak");
+  }
+
+  static int32_t sext(uint32_t v, int bits) { return (int32_t)(v << (32 - bits)) >> (32 - bits); }
+  static uint32_t bit(uint32_t v, int n) { return (v >> n) & 1; }
+  static uint32_t bits(uint32_t v, int hi, int lo) { return (v >> lo) & ((1u << (hi - lo + 1)) - 1); }
+
+  int memOp(bool is_load, int size, bool is_signed, int rd_or_rs2, uint32_t addr, bool addr_known) {
+    if (!addr_known) anomaly("memory access through a register with unknown contents");
+    if (is_load) {
+      uint32_t v;
+      bool k;
+      if (!load(addr, size, &v, &k)) return -1;
+      if (is_signed && size < 4) v = sext(v, size * 8);
+      return setReg(rd_or_rs2, v, k && addr_known) ? 0 : -1;
+    }
+    return store(addr, size, reg(rd_or_rs2), isKnown(rd_or_rs2)) ? 0 : -1;
+  }
+
+  int step16(uint32_t ins, uint32_t pc, uint32_t* next) {
+    *next = pc + 2;
+    uint32_t q = ins & 3, f3 = bits(ins, 15, 13);
+    int rd = bits(ins, 11, 7), rs2 = bits(ins, 6, 2);
+    int rdp = 8 + bits(ins, 4, 2), rs1p = 8 + bits(ins, 9, 7);
+    int32_t imm6 = sext(bit(ins, 12) << 5 | bits(ins, 6, 2), 6);
+    uint32_t cj = bit(ins, 12) << 11 | bit(ins, 11) << 4 | bits(ins, 10, 9) << 8 | bit(ins, 8) << 10 |
+                  bit(ins, 7) << 6 | bit(ins, 6) << 7 | bits(ins, 5, 3) << 1 | bit(ins, 2) << 5;
+    uint32_t cb = bit(ins, 12) << 8 | bits(ins, 6, 5) << 6 | bit(ins, 2) << 5 | bits(ins, 11, 10) << 3 | bits(ins, 4, 3) << 1;
+    uint32_t lw_off = bits(ins, 12, 10) << 3 | bit(ins, 6) << 2 | bit(ins, 5) << 6;
+    if (q == 0) {
+      switch (f3) {
+      case 0: {
+        uint32_t nz = bits(ins, 12, 11) << 4 | bits(ins, 10, 7) << 6 | bit(ins, 6) << 2 | bit(ins, 5) << 3;
+        if (!nz) break;
+        return setReg(rdp, reg(2) + nz, isKnown(2)) ? 0 : -1; // c.addi4spn
+      }
+      case 2: return memOp(true, 4, false, rdp, reg(rs1p) + lw_off, isKnown(rs1p));   // c.lw
+      case 6: return memOp(false, 4, false, rdp, reg(rs1p) + lw_off, isKnown(rs1p));  // c.sw
+      }
+    } else if (q == 1) {
+      switch (f3) {
+      case 0: return setReg(rd, reg(rd) + imm6, isKnown(rd)) ? 0 : -1;                 // c.addi / c.nop
+      case 1: setReg(1, pc + 2); *next = pc + sext(cj, 12); return 0;                  // c.jal
+      case 2: return setReg(rd, imm6) ? 0 : -1;                                         // c.li
+      case 3:
+        if (rd == 2) {
+          int32_t imm = sext(bit(ins, 12) << 9 | bits(ins, 4, 3) << 7 | bit(ins, 5) << 6 | bit(ins, 2) << 5 | bit(ins, 6) << 4, 10);
+          return setReg(2, reg(2) + imm, isKnown(2)) ? 0 : -1;                          // c.addi16sp
+        }
+        return setReg(rd, (uint32_t)imm6 << 12) ? 0 : -1;                               // c.lui
+      case 4: {
+        uint32_t a = reg(rs1p);
+        uint32_t shamt = bit(ins, 12) << 5 | bits(ins, 6, 2);
+        switch (bits(ins, 11, 10)) {
+        case 0: return setReg(rs1p, a >> shamt, isKnown(rs1p)) ? 0 : -1;               // c.srli
+        case 1: return setReg(rs1p, (int32_t)a >> shamt, isKnown(rs1p)) ? 0 : -1;      // c.srai
+        case 2: return setReg(rs1p, a & imm6, isKnown(rs1p)) ? 0 : -1;                 // c.andi
+        case 3: {
+          if (bit(ins, 12)) break;
+          uint32_t b = reg(rdp), v;
+          switch (bits(ins, 6, 5)) {
+          case 0: v = a - b; break;
+          case 1: v = a ^ b; break;
+          case 2: v = a | b; break;
+          default: v = a & b; break;
+          }
+          return setReg(rs1p, v, regKnown(rs1p, rdp)) ? 0 : -1;
+        }
+        }
+        break;
+      }
+      case 5: *next = pc + sext(cj, 12); return 0;                                      // c.j
+      case 6: if (reg(rs1p) == 0) *next = pc + sext(cb, 9); return 0;                  // c.beqz
+      case 7: if (reg(rs1p) != 0) *next = pc + sext(cb, 9); return 0;                  // c.bnez
+      }
+    } else {
+      switch (f3) {
+      case 0: return setReg(rd, reg(rd) << (bit(ins, 12) << 5 | rs2), isKnown(rd)) ? 0 : -1; // c.slli
+      case 2: {
+        uint32_t off = bit(ins, 12) << 5 | bits(ins, 6, 4) << 2 | bits(ins, 3, 2) << 6;
+        return memOp(true, 4, false, rd, reg(2) + off, isKnown(2));                    // c.lwsp
+      }
+      case 4:
+        if (!bit(ins, 12)) {
+          if (!rs2) { *next = reg(rd) & ~1u; return 0; }                                // c.jr
+          return setReg(rd, reg(rs2), isKnown(rs2)) ? 0 : -1;                            // c.mv
+        }
+        if (!rd && !rs2) return 1;                                                      // c.ebreak
+        if (!rs2) { uint32_t t = reg(rd); setReg(1, pc + 2); *next = t & ~1u; return 0; } // c.jalr
+        return setReg(rd, reg(rd) + reg(rs2), regKnown(rd, rs2)) ? 0 : -1;               // c.add
+      case 6: {
+        uint32_t off = bits(ins, 12, 9) << 2 | bits(ins, 8, 7) << 6;
+        return memOp(false, 4, false, rs2, reg(2) + off, isKnown(2));                   // c.swsp
+      }
+      }
+    }
+    anomaly("unsupported compressed instruction 0x%04x", ins);
+    return -1;
+  }
+
+  int step32(uint32_t ins, uint32_t pc, uint32_t* next) {
+    *next = pc + 4;
+    uint32_t op = bits(ins, 6, 0), f3 = bits(ins, 14, 12), f7 = bits(ins, 31, 25);
+    int rd = bits(ins, 11, 7), rs1 = bits(ins, 19, 15), rs2 = bits(ins, 24, 20);
+    if (rs1 > 15 || rs2 > 15 || rd > 15) {
+      anomaly("instruction 0x%08x uses registers above x15", ins);
+      return -1;
+    }
+    int32_t imm_i = sext(bits(ins, 31, 20), 12);
+    int32_t imm_s = sext(bits(ins, 31, 25) << 5 | bits(ins, 11, 7), 12);
+    int32_t imm_b = sext(bit(ins, 31) << 12 | bit(ins, 7) << 11 | bits(ins, 30, 25) << 5 | bits(ins, 11, 8) << 1, 13);
+    int32_t imm_j = sext(bit(ins, 31) << 20 | bits(ins, 19, 12) << 12 | bit(ins, 20) << 11 | bits(ins, 30, 21) << 1, 21);
+    uint32_t a = reg(rs1), b = reg(rs2);
+    switch (op) {
+    case 0x37: return setReg(rd, ins & 0xfffff000) ? 0 : -1;                  // lui
+    case 0x17: return setReg(rd, pc + (ins & 0xfffff000)) ? 0 : -1;           // auipc
+    case 0x6f: setReg(rd, pc + 4); *next = pc + imm_j; return 0;             // jal
+    case 0x67: setReg(rd, pc + 4); *next = (a + imm_i) & ~1u; return 0;      // jalr
+    case 0x63: {
+      bool take;
+      switch (f3) {
+      case 0: take = a == b; break;
+      case 1: take = a != b; break;
+      case 4: take = (int32_t)a < (int32_t)b; break;
+      case 5: take = (int32_t)a >= (int32_t)b; break;
+      case 6: take = a < b; break;
+      case 7: take = a >= b; break;
+      default: anomaly("bad branch 0x%08x", ins); return -1;
+      }
+      if (take) *next = pc + imm_b;
+      return 0;
+    }
+    case 0x03:
+      switch (f3) {
+      case 0: return memOp(true, 1, true, rd, a + imm_i, isKnown(rs1));
+      case 1: return memOp(true, 2, true, rd, a + imm_i, isKnown(rs1));
+      case 2: return memOp(true, 4, false, rd, a + imm_i, isKnown(rs1));
+      case 4: return memOp(true, 1, false, rd, a + imm_i, isKnown(rs1));
+      case 5: return memOp(true, 2, false, rd, a + imm_i, isKnown(rs1));
+      }
+      break;
+    case 0x23:
+      switch (f3) {
+      case 0: return memOp(false, 1, false, rs2, a + imm_s, isKnown(rs1));
+      case 1: return memOp(false, 2, false, rs2, a + imm_s, isKnown(rs1));
+      case 2: return memOp(false, 4, false, rs2, a + imm_s, isKnown(rs1));
+      }
+      break;
+    case 0x13: {
+      uint32_t v;
+      uint32_t sh = rs2;
+      switch (f3) {
+      case 0: v = a + imm_i; break;
+      case 1: v = a << sh; break;
+      case 2: v = (int32_t)a < imm_i; break;
+      case 3: v = a < (uint32_t)imm_i; break;
+      case 4: v = a ^ imm_i; break;
+      case 5: v = f7 & 0x20 ? (uint32_t)((int32_t)a >> sh) : a >> sh; break;
+      case 6: v = a | imm_i; break;
+      default: v = a & imm_i; break;
+      }
+      return setReg(rd, v, isKnown(rs1)) ? 0 : -1;
+    }
+    case 0x33: {
+      uint32_t v;
+      switch (f3) {
+      case 0: v = f7 & 0x20 ? a - b : a + b; break;
+      case 1: v = a << (b & 31); break;
+      case 2: v = (int32_t)a < (int32_t)b; break;
+      case 3: v = a < b; break;
+      case 4: v = a ^ b; break;
+      case 5: v = f7 & 0x20 ? (uint32_t)((int32_t)a >> (b & 31)) : a >> (b & 31); break;
+      case 6: v = a | b; break;
+      default: v = a & b; break;
+      }
+      return setReg(rd, v, regKnown(rs1, rs2)) ? 0 : -1;
+    }
+    case 0x73:
+      if (ins == 0x00100073) return 1;                                        // ebreak
+      break;
+    }
+    anomaly("unsupported instruction 0x%08x", ins);
+    return -1;
+  }
+};
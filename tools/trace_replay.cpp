@@ -0,0 +1,219 @@
+// Replays a DM transaction trace downloaded from WebLink's /trace.bin
+// against the simulated target in swio_sim.h and reports where the time
+// went and everything that doesn't look like a healthy session.
+//
+//   trace_replay [-t t1_ns] [-n max_reports] [-v] trace.bin
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "swio_sim.h"
+
+#pragma pack(push, 1)
+struct TraceHeader {
+  char magic[4];       // "WLTR"
+  uint8_t version;     // 1
+  uint8_t entry_size;  // sizeof(TraceEntry)
+  uint16_t t1coeff;
+  uint32_t cpu_mhz;
+  uint32_t count;
+  uint32_t dropped;    // Entries overwritten before the dump
+};
+
+struct TraceEntry {
+  uint32_t cycles;
+  uint32_t value;
+  uint8_t reg;
+  uint8_t flags;
+  uint16_t reserved;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(TraceHeader) == 20, "trace header layout");
+static_assert(sizeof(TraceEntry) == 12, "trace entry layout");
+
+#define TRACE_READ  0x01
+#define TRACE_ERROR 0x02
+
+static const char* regName(uint8_t reg) {
+  static char buf[12];
+  switch (reg) {
+  case 0x04: return "DATA0";
+  case 0x05: return "DATA1";
+  case 0x10: return "DMCONTROL";
+  case 0x11: return "DMSTATUS";
+  case 0x12: return "HARTINFO";
+  case 0x16: return "ABSTRACTCS";
+  case 0x17: return "COMMAND";
+  case 0x18: return "ABSTRACTAUTO";
+  case 0x7c: return "CPBR";
+  case 0x7d: return "CFGR";
+  case 0x7e: return "SHDWCFGR";
+  }
+  if (reg >= 0x20 && reg < 0x28) {
+    snprintf(buf, sizeof(buf), "PROGBUF%d", reg - 0x20);
+    return buf;
+  }
+  snprintf(buf, sizeof(buf), "0x%02x", reg);
+  return buf;
+}
+
+// Bits of a read that the simulation can predict without knowing target memory
+static uint32_t compareMask(uint8_t reg) {
+  switch (reg) {
+  case 0x11: return 0x00000f00; // halted/running
+  case 0x16: return 0x00001700; // busy, cmderr
+  case 0x04:
+  case 0x05: return 0xffffffff;
+  default: return 0;
+  }
+}
+
+struct RegStats {
+  uint32_t writes = 0;
+  uint32_t reads = 0;
+  double seconds = 0;
+};
+
+static void usage() {
+  fprintf(stderr, "usage: trace_replay [-t t1_ns] [-n max_reports] [-v] trace.bin\n");
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  SWIOSim sim;
+  uint32_t max_reports = 20;
+  bool verbose = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:n:v")) != -1) {
+    switch (opt) {
+    case 't': sim.timing.t1_ns = atof(optarg); break;
+    case 'n': max_reports = strtoul(optarg, NULL, 0); break;
+    case 'v': verbose = true; break;
+    default: usage();
+    }
+  }
+  if (optind != argc - 1) usage();
+
+  FILE* f = fopen(argv[optind], "rb");
+  if (!f) {
+    perror(argv[optind]);
+    return 2;
+  }
+  TraceHeader header;
+  if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, "WLTR", 4) || header.version != 1 ||
+      header.entry_size != sizeof(TraceEntry)) {
+    fprintf(stderr, "%s: not a WebLink trace\n", argv[optind]);
+    return 2;
+  }
+  std::vector<TraceEntry> entries(header.count);
+  size_t got = fread(entries.data(), sizeof(TraceEntry), header.count, f);
+  fclose(f);
+  if (got != header.count) {
+    fprintf(stderr, "warning: trace truncated, %zu of %" PRIu32 " entries\n", got, header.count);
+    entries.resize(got);
+  }
+  if (entries.empty()) {
+    printf("Empty trace\n");
+    return 0;
+  }
+  double cycle_s = 1.0 / (header.cpu_mhz * 1e6);
+
+  // The trace usually starts in the middle of a session, state before it is unknown
+  sim.forget();
+  sim.halted = true;
+
+  std::map<uint8_t, RegStats> regs;
+  const double gap_limits[] = {50e-6, 100e-6, 1e-3, 10e-3, 100e-3, INFINITY};
+  const char* gap_names[] = {"<50us", "<100us", "<1ms", "<10ms", "<100ms", ">=100ms"};
+  uint32_t gaps[6] = {0};
+  std::vector<std::pair<double, size_t>> long_gaps;
+  uint32_t errors = 0, mismatches = 0, reports = 0;
+  double total_s = 0;
+
+  for (size_t i = 0; i < entries.size(); i++) {
+    const TraceEntry& e = entries[i];
+    double dt = i ? (uint32_t)(e.cycles - entries[i - 1].cycles) * cycle_s : 0;
+    total_s += dt;
+    RegStats& rs = regs[e.reg];
+    rs.seconds += dt;
+    if (i) {
+      int b = 0;
+      while (dt >= gap_limits[b]) b++;
+      gaps[b]++;
+      if (dt >= 1e-3) long_gaps.push_back({dt, i});
+    }
+    if (verbose) {
+      printf("%7zu %10.1fus %-12s %s 0x%08" PRIx32 "%s\n", i, dt * 1e6, regName(e.reg), e.flags & TRACE_READ ? "->" : "<-",
+             e.value, e.flags & TRACE_ERROR ? " TIMEOUT" : "");
+    }
+
+    if (!(e.flags & TRACE_READ)) {
+      rs.writes++;
+      sim.write(e.reg, e.value);
+      continue;
+    }
+    rs.reads++;
+    uint32_t expected;
+    bool known;
+    sim.read(e.reg, &expected, &known);
+    if (e.flags & TRACE_ERROR) {
+      errors++;
+      if (reports++ < max_reports) {
+        printf("#%zu: read of %s timed out, previous transactions:\n", i, regName(e.reg));
+        for (size_t j = i > 5 ? i - 5 : 0; j < i; j++) {
+          printf("    %-12s %s 0x%08" PRIx32 "\n", regName(entries[j].reg), entries[j].flags & TRACE_READ ? "->" : "<-",
+                 entries[j].value);
+        }
+      }
+      continue;
+    }
+    uint32_t mask = compareMask(e.reg);
+    if (known && ((expected ^ e.value) & mask)) {
+      mismatches++;
+      if (reports++ < max_reports) {
+        printf("#%zu: %s read 0x%08" PRIx32 ", simulation expected 0x%08" PRIx32 "\n", i, regName(e.reg), e.value, expected);
+      }
+    }
+  }
+
+  for (const SWIOSim::Anomaly& a : sim.anomalies) {
+    if (reports++ >= max_reports) break;
+    printf("#%" PRIu64 ": %s\n", a.frame - 1, a.what.c_str());
+  }
+
+  printf("\nTrace: %zu transactions, %" PRIu32 " dropped before the dump, t1coeff %u, %" PRIu32 "MHz\n", entries.size(),
+         header.dropped, header.t1coeff, header.cpu_mhz);
+  printf("Recorded time %.3fs, simulated bus time %.3fs (t1 %.0fns), flash busy %.3fs\n", total_s, sim.now_ns / 1e9,
+         sim.timing.t1_ns, sim.flash_busy_ns / 1e9);
+  printf("\n%-12s %8s %8s %10s %9s\n", "register", "writes", "reads", "time", "avg");
+  for (const auto& r : regs) {
+    uint32_t n = r.second.writes + r.second.reads;
+    printf("%-12s %8" PRIu32 " %8" PRIu32 " %9.3fs %7.1fus\n", regName(r.first), r.second.writes, r.second.reads,
+           r.second.seconds, n ? r.second.seconds / n * 1e6 : 0);
+  }
+  printf("\nGaps between transactions:");
+  for (int b = 0; b < 6; b++) printf(" %s %" PRIu32 "%s", gap_names[b], gaps[b], b < 5 ? "," : "\n");
+  if (!long_gaps.empty()) {
+    std::sort(long_gaps.begin(), long_gaps.end(), [](const std::pair<double, size_t>& a, const std::pair<double, size_t>& b) {
+      return a.first > b.first;
+    });
+    printf("Longest stalls:");
+    for (size_t k = 0; k < long_gaps.size() && k < 5; k++) {
+      printf(" %.1fms before #%zu (%s)%s", long_gaps[k].first * 1e3, long_gaps[k].second,
+             regName(entries[long_gaps[k].second].reg), k + 1 < long_gaps.size() && k < 4 ? "," : "\n");
+    }
+  }
+  printf("\nRead timeouts: %" PRIu32 ", unexpected reads: %" PRIu32 ", protocol anomalies: %zu\n", errors, mismatches,
+         sim.anomalies.size());
+  if (reports > max_reports) printf("(only the first %" PRIu32 " reports shown, use -n)\n", max_reports);
+  return errors || mismatches || !sim.anomalies.empty() ? 1 : 0;
+}
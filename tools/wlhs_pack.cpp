@@ -0,0 +1,182 @@
+// Compresses an image for upload, see src/WLCompress.h. The input can be
+// anything WebLink takes (raw binary, HEX, ELF, UF2 or WLMF), it's
+// decompressed on the way in and handled like the plain file.
+//
+//   wlhs_pack [-w window_bits] [-l lookahead_bits] in out
+//
+//   wlhs_pack app.bin app.wlhs
+//   curl -X PUT --data-binary @app.wlhs weblink.local/flash/0x08000000
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <vector>
+
+#include "../src/WLCompress.h"
+
+#define HASH_BITS 14
+#define MAX_CHAIN 256
+
+struct BitWriter {
+  std::vector<uint8_t>& out;
+  uint32_t bits = 0;
+  int count = 0;
+
+  BitWriter(std::vector<uint8_t>& out) : out(out) {}
+
+  void put(uint32_t value, int n) {
+    for (int i = n - 1; i >= 0; i--) {
+      bits = bits << 1 | (value >> i & 1);
+      if (++count == 8) {
+        out.push_back(bits);
+        bits = 0;
+        count = 0;
+      }
+    }
+  }
+
+  void flush() {
+    if (count) out.push_back(bits << (8 - count));
+    count = 0;
+  }
+};
+
+static bool readFile(const char* path, std::vector<uint8_t>& data) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  uint8_t buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) data.insert(data.end(), buf, buf + n);
+  fclose(f);
+  return true;
+}
+
+static uint32_t hash(const uint8_t* p) {
+  return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Greedy, longest match in the window, hash chains over 3 byte prefixes
+static void compress(const std::vector<uint8_t>& in, int w, int l, std::vector<uint8_t>& out) {
+  BitWriter writer(out);
+  size_t window = (size_t)1 << w, lookahead = (size_t)1 << l;
+  // A back reference has to be shorter than the literals it replaces
+  size_t min_len = (1 + w + l) / 9 + 1;
+  std::vector<int32_t> head(1 << HASH_BITS, -1), prev(in.size(), -1);
+  auto insert = [&](size_t pos) {
+    if (pos + 3 > in.size()) return;
+    uint32_t h = hash(&in[pos]);
+    prev[pos] = head[h];
+    head[h] = pos;
+  };
+  size_t pos = 0;
+  while (pos < in.size()) {
+    size_t best_len = 0, best_offset = 0;
+    if (pos + 3 <= in.size()) {
+      size_t max_len = std::min(lookahead, in.size() - pos);
+      int chain = MAX_CHAIN;
+      for (int32_t candidate = head[hash(&in[pos])]; candidate >= 0 && pos - candidate <= window && chain--; candidate = prev[candidate]) {
+        size_t len = 0;
+        while (len < max_len && in[candidate + len] == in[pos + len]) len++;
+        if (len > best_len) {
+          best_len = len;
+          best_offset = pos - candidate;
+          if (len == max_len) break;
+        }
+      }
+    }
+    if (best_len >= min_len) {
+      writer.put(0, 1);
+      writer.put(best_offset - 1, w);
+      writer.put(best_len - 1, l);
+    } else {
+      best_len = 1;
+      writer.put(1, 1);
+      writer.put(in[pos], 8);
+    }
+    for (size_t i = 0; i < best_len; i++) insert(pos + i);
+    pos += best_len;
+  }
+  writer.flush();
+}
+
+// Same as the firmware, to catch encoder bugs before they reach a target
+static bool decompress(const uint8_t* data, size_t len, int w, int l, size_t size, std::vector<uint8_t>& out) {
+  size_t bit = 0;
+  auto get = [&](int n, uint32_t& value) {
+    if (bit + n > len * 8) return false;
+    value = 0;
+    for (int i = 0; i < n; i++, bit++) value = value << 1 | (data[bit / 8] >> (7 - bit % 8) & 1);
+    return true;
+  };
+  while (out.size() < size) {
+    uint32_t tag, value, count;
+    if (!get(1, tag)) return false;
+    if (tag) {
+      if (!get(8, value)) return false;
+      out.push_back(value);
+    } else {
+      if (!get(w, value) || !get(l, count)) return false;
+      if (value + 1 > out.size()) return false;
+      for (uint32_t i = 0; i <= count; i++) out.push_back(out[out.size() - value - 1]);
+    }
+  }
+  return out.size() == size;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: wlhs_pack [-w window_bits] [-l lookahead_bits] in out\n"
+                  "  -w  %d to %d, 10 by default, the target allocates 2^w bytes\n"
+                  "  -l  %d to w - 1, 5 by default\n",
+                  WLHS_WINDOW_MIN_BITS, WLHS_WINDOW_MAX_BITS, WLHS_LOOKAHEAD_MIN_BITS);
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  int w = 10, l = 5;
+  int opt;
+  while ((opt = getopt(argc, argv, "w:l:")) != -1) {
+    switch (opt) {
+    case 'w': w = atoi(optarg); break;
+    case 'l': l = atoi(optarg); break;
+    default: usage();
+    }
+  }
+  if (argc - optind != 2) usage();
+  if (w < WLHS_WINDOW_MIN_BITS || w > WLHS_WINDOW_MAX_BITS || l < WLHS_LOOKAHEAD_MIN_BITS || l >= w) usage();
+  const char* in_path = argv[optind];
+  const char* out_path = argv[optind + 1];
+
+  std::vector<uint8_t> in;
+  if (!readFile(in_path, in)) return 2;
+  WLHSHeader_t header = {};
+  memcpy(header.magic, WLHS_MAGIC, 4);
+  header.window_bits = w;
+  header.lookahead_bits = l;
+  header.size = in.size();
+  std::vector<uint8_t> out((const uint8_t*)&header, (const uint8_t*)(&header + 1));
+  compress(in, w, l, out);
+
+  std::vector<uint8_t> check;
+  if (!decompress(out.data() + sizeof(header), out.size() - sizeof(header), w, l, in.size(), check) || check != in) {
+    fprintf(stderr, "%s: round trip failed\n", in_path);
+    return 1;
+  }
+
+  FILE* f = fopen(out_path, "wb");
+  if (!f) {
+    perror(out_path);
+    return 2;
+  }
+  bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+  ok = fclose(f) == 0 && ok;
+  if (!ok) {
+    perror(out_path);
+    return 2;
+  }
+  printf("%s: %zu -> %zu bytes, %.1f%%\n", out_path, in.size(), out.size(), in.empty() ? 100.0 : 100.0 * out.size() / in.size());
+  return 0;
+}
@@ -0,0 +1,128 @@
+// Packs binaries into a WLMF multi-region container that WebLink flashes
+// in one job, see src/WLManifest.h. Erase and verify options apply to the
+// regions after them on the command line.
+//
+//   wlmf_pack -o out.wlmf [-e pages|range|chip] [-c | -C] file@address ...
+//
+//   wlmf_pack -o board.wlmf -c app.bin@0x08000000 -C ob.bin@0x1FFFF800
+//   curl -X PUT --data-binary @board.wlmf weblink.local/flash/0x08000000
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../src/WLManifest.h"
+
+struct Input {
+  WLManifestRegion_t region;
+  std::vector<uint8_t> data;
+};
+
+static bool readFile(const char* path, std::vector<uint8_t>& data) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  uint8_t buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) data.insert(data.end(), buf, buf + n);
+  fclose(f);
+  return true;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: wlmf_pack -o out.wlmf [-e pages|range|chip] [-c | -C] file@address ...\n"
+                  "  -e  erase policy for the following regions, pages by default\n"
+                  "  -c  CRC check of the following regions after programming\n"
+                  "  -C  no CRC check, the default\n");
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  const char* out = NULL;
+  uint8_t erase = WLMF_ERASE_PAGES;
+  uint8_t verify = WLMF_VERIFY_DEFAULT;
+  std::vector<Input> inputs;
+  // Options and inputs mix, so no getopt()
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (!strcmp(arg, "-o") && i + 1 < argc) {
+      out = argv[++i];
+    } else if (!strcmp(arg, "-e") && i + 1 < argc) {
+      const char* policy = argv[++i];
+      if (!strcmp(policy, "pages")) erase = WLMF_ERASE_PAGES;
+      else if (!strcmp(policy, "range")) erase = WLMF_ERASE_RANGE;
+      else if (!strcmp(policy, "chip")) erase = WLMF_ERASE_CHIP;
+      else usage();
+    } else if (!strcmp(arg, "-c")) {
+      verify = WLMF_VERIFY_CRC;
+    } else if (!strcmp(arg, "-C")) {
+      verify = WLMF_VERIFY_DEFAULT;
+    } else if (arg[0] == '-') {
+      usage();
+    } else {
+      const char* at = strrchr(arg, '@');
+      if (at == NULL || at[1] == 0) usage();
+      char* end;
+      Input input = {};
+      input.region.address = strtoul(at + 1, &end, 0);
+      if (*end) usage();
+      input.region.erase = erase;
+      input.region.verify = verify;
+      if (!readFile(std::string(arg, at).c_str(), input.data)) return 2;
+      if (input.data.empty()) {
+        fprintf(stderr, "%s: empty\n", arg);
+        return 2;
+      }
+      input.region.length = input.data.size();
+      inputs.push_back(input);
+    }
+  }
+  if (out == NULL || inputs.empty()) usage();
+  if (inputs.size() > WLMF_MAX_REGIONS) {
+    fprintf(stderr, "At most %d regions\n", WLMF_MAX_REGIONS);
+    return 2;
+  }
+
+  WLManifestHeader_t header = {};
+  memcpy(header.magic, WLMF_MAGIC, 4);
+  header.version = WLMF_VERSION;
+  header.region_count = inputs.size();
+  // Data starts word aligned after the table
+  uint32_t offset = sizeof(header) + inputs.size() * sizeof(WLManifestRegion_t);
+  for (Input& input : inputs) {
+    input.region.data_offset = offset;
+    offset += (input.region.length + 3) & ~3u;
+  }
+  std::vector<uint8_t> container((const uint8_t*)&header, (const uint8_t*)(&header + 1));
+  for (const Input& input : inputs) {
+    const uint8_t* r = (const uint8_t*)&input.region;
+    container.insert(container.end(), r, r + sizeof(WLManifestRegion_t));
+  }
+  for (const Input& input : inputs) {
+    container.insert(container.end(), input.data.begin(), input.data.end());
+    container.resize((container.size() + 3) & ~(size_t)3, 0xff);
+  }
+
+  FILE* f = fopen(out, "wb");
+  if (!f) {
+    perror(out);
+    return 2;
+  }
+  bool ok = fwrite(container.data(), 1, container.size(), f) == container.size();
+  ok = fclose(f) == 0 && ok;
+  if (!ok) {
+    perror(out);
+    return 2;
+  }
+  for (const Input& input : inputs) {
+    printf("0x%08x %6u bytes  erase %s%s\n", input.region.address, input.region.length,
+           input.region.erase == WLMF_ERASE_CHIP ? "chip" : input.region.erase == WLMF_ERASE_RANGE ? "range" : "pages",
+           input.region.verify == WLMF_VERIFY_CRC ? ", crc" : "");
+  }
+  printf("%s: %zu bytes\n", out, container.size());
+  return 0;
+}